@@ -0,0 +1,35 @@
+/** @file
+  GUID and layout of the HOB that caches the QEMU fw_cfg E820 map
+
+  PlatformPei reads the "etc/e820" fw_cfg file once, and publishes it in this
+  HOB. PlatformPei answers all of its own memory map queries from the HOB, and
+  later phases can consult it instead of going back to fw_cfg.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef QEMU_E820_MAP_GUID_H__
+#define QEMU_E820_MAP_GUID_H__
+
+#include <IndustryStandard/E820.h>
+
+#define QEMU_E820_MAP_GUID \
+  {0x3c1f5a92, 0x7d04, 0x4b6e, {0xa5, 0x1b, 0x62, 0xe8, 0x0f, 0x93, 0xc4, 0x27}}
+
+//
+// The E820 map. Count entries follow the header, in the order that QEMU
+// provides them.
+//
+typedef struct {
+  UINT32    Count;
+  UINT32    Reserved;
+} QEMU_E820_MAP;
+
+#define QEMU_E820_MAP_ENTRIES(Map) \
+  ((CONST EFI_E820_ENTRY64 *)((CONST QEMU_E820_MAP *)(Map) + 1))
+
+extern EFI_GUID  gQemuE820MapGuid;
+
+#endif
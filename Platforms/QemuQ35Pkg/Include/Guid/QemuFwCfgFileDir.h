@@ -0,0 +1,49 @@
+/** @file
+  GUID and layout of the HOB that caches the QEMU fw_cfg file directory
+
+  The PEI instance of QemuFwCfgLib reads the file directory (fw_cfg item
+  QemuFwCfgItemFileDir) once, sorts it by file name, and publishes it in this
+  HOB. The DXE instance takes a private copy of the HOB, so that file lookups
+  before ExitBootServices() need no fw_cfg accesses at all.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef QEMU_FW_CFG_FILE_DIR_GUID_H__
+#define QEMU_FW_CFG_FILE_DIR_GUID_H__
+
+#include <IndustryStandard/QemuFwCfg.h>
+
+#define QEMU_FW_CFG_FILE_DIR_GUID \
+  {0x6b0f7d4e, 0x2a31, 0x4c59, {0x9d, 0x84, 0x1f, 0x37, 0xc2, 0x5e, 0xa0, 0x6b}}
+
+//
+// One entry of the file directory, in the format that QEMU provides it. Size
+// and Select are encoded in big endian.
+//
+#pragma pack (1)
+typedef struct {
+  UINT32    Size;
+  UINT16    Select;
+  UINT16    Reserved;
+  CHAR8     Name[QEMU_FW_CFG_FNAME_SIZE];
+} QEMU_FW_CFG_FILE;
+#pragma pack ()
+
+//
+// The file directory. Count entries follow the header, sorted by Name in
+// AsciiStrCmp() order. Count is encoded in native byte order.
+//
+typedef struct {
+  UINT32    Count;
+  UINT32    Reserved;
+} QEMU_FW_CFG_FILE_DIR;
+
+#define QEMU_FW_CFG_FILE_DIR_ENTRIES(Dir) \
+  ((CONST QEMU_FW_CFG_FILE *)((CONST QEMU_FW_CFG_FILE_DIR *)(Dir) + 1))
+
+extern EFI_GUID  gQemuFwCfgFileDirGuid;
+
+#endif
@@ -0,0 +1,35 @@
+/** @file
+  GUID of the HOB that caches the TSC frequency
+
+  The PEI instance of TscTimerLib determines the time base once: the frequency
+  of the time stamp counter, and the I/O port of the ACPI PM timer. It
+  publishes both in this HOB, as a QEMU_TSC_FREQUENCY_DATA. The DXE instance
+  picks it up, so that neither needs to calibrate the counter, or to look up
+  the PM timer in PCI config space, again.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef QEMU_TSC_FREQUENCY_GUID_H__
+#define QEMU_TSC_FREQUENCY_GUID_H__
+
+#define QEMU_TSC_FREQUENCY_GUID \
+  {0xaaf721fc, 0x431f, 0x4c0e, {0xaf, 0x22, 0x8a, 0x09, 0xb8, 0xea, 0x3a, 0x91}}
+
+typedef struct {
+  ///
+  /// TSC frequency in Hz. 0 if the TSC is not invariant, and the ACPI PM
+  /// timer serves as time base instead.
+  ///
+  UINT64    TscFrequency;
+  ///
+  /// I/O port of the ACPI PM timer, 0 on an unknown platform.
+  ///
+  UINT32    AcpiTimerPort;
+} QEMU_TSC_FREQUENCY_DATA;
+
+extern EFI_GUID  gQemuTscFrequencyGuid;
+
+#endif
@@ -29,6 +29,29 @@
 //
 VA_LIST  mVaListNull;
 
+/**
+  Send a string to the debug I/O port.
+
+  The string is written with a single string I/O instruction, rather than one
+  I/O instruction per character, so that a hypervisor can handle the whole
+  string in one VM exit.
+
+  @param  Buffer  The characters to send.
+  @param  Length  The number of characters in Buffer.
+
+**/
+STATIC
+VOID
+PlatformDebugLibIoPortWrite (
+  IN CHAR8  *Buffer,
+  IN UINTN  Length
+  )
+{
+  if (Length > 0) {
+    IoWriteFifo8 (PcdGet16 (PcdDebugIoPort), Length, Buffer);
+  }
+}
+
 /**
   Prints a debug message to the debug output device if the specified error level is enabled.
 
@@ -86,7 +109,6 @@ DebugPrintMarker (
 {
   CHAR8  Buffer[MAX_DEBUG_MESSAGE_LENGTH];
   UINTN  Length;
-  UINT8  *Buffer8;
 
   //
   // If Format is NULL, then ASSERT().
@@ -114,10 +136,7 @@ DebugPrintMarker (
   //
   // Send the print string to the debug I/O port
   //
-  Buffer8 = (UINT8 *)Buffer;
-  while (Length-- > 0) {
-    IoWrite8 (PcdGet16 (PcdDebugIoPort), *Buffer8++);
-  }
+  PlatformDebugLibIoPortWrite (Buffer, Length);
 }
 
 /**
@@ -205,7 +224,6 @@ DebugAssert (
 {
   CHAR8  Buffer[MAX_DEBUG_MESSAGE_LENGTH];
   UINTN  Length;
-  UINT8  *Buffer8;
 
   //
   // Generate the ASSERT() message in Ascii format
@@ -223,10 +241,7 @@ DebugAssert (
   // Send the print string to the debug I/O port, if present
   //
   if (PlatformDebugLibIoPortFound ()) {
-    Buffer8 = (UINT8 *)Buffer;
-    while (Length-- > 0) {
-      IoWrite8 (PcdGet16 (PcdDebugIoPort), *Buffer8++);
-    }
+    PlatformDebugLibIoPortWrite (Buffer, Length);
   }
 
   //
@@ -17,6 +17,8 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/IoLib.h>
 #include <Library/DebugLib.h>
+#include <Library/HobLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Library/QemuFwCfgLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/MemEncryptSevLib.h>
@@ -28,6 +30,34 @@ STATIC BOOLEAN  mQemuFwCfgDmaSupported;
 
 STATIC EDKII_IOMMU_PROTOCOL  *mIoMmuProtocol;
 
+//
+// Sorted file directory, set up on the first lookup. It lives in boot services
+// memory, so it is abandoned at ExitBootServices(); from then on, and if the
+// event could not be created, lookups scan the directory through fw_cfg.
+//
+STATIC QEMU_FW_CFG_FILE_DIR  *mQemuFwCfgFileDir;
+STATIC BOOLEAN               mQemuFwCfgFileDirDisabled;
+STATIC EFI_EVENT             mQemuFwCfgExitBootServicesEvent;
+
+/**
+  Notification function of mQemuFwCfgExitBootServicesEvent. Stops using the
+  cached file directory, whose memory now belongs to the OS.
+
+  @param[in] Event    The event being signaled.
+  @param[in] Context  Unused.
+**/
+STATIC
+VOID
+EFIAPI
+QemuFwCfgExitBootServices (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  mQemuFwCfgFileDir         = NULL;
+  mQemuFwCfgFileDirDisabled = TRUE;
+}
+
 /**
   Returns a boolean indicating if the firmware configuration interface
   is available or not.
@@ -53,8 +83,9 @@ QemuFwCfgInitialize (
   VOID
   )
 {
-  UINT32  Signature;
-  UINT32  Revision;
+  UINT32      Signature;
+  UINT32      Revision;
+  EFI_STATUS  Status;
 
   //
   // Enable the access routines while probing to see if it is supported.
@@ -86,8 +117,6 @@ QemuFwCfgInitialize (
   }
 
   if (mQemuFwCfgDmaSupported && MemEncryptSevIsEnabled ()) {
-    EFI_STATUS  Status;
-
     //
     // IoMmuDxe driver must have installed the IOMMU protocol. If we are not
     // able to locate the protocol then something must have gone wrong.
@@ -109,6 +138,41 @@ QemuFwCfgInitialize (
     }
   }
 
+  Status = gBS->CreateEvent (
+                  EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                  TPL_CALLBACK,
+                  QemuFwCfgExitBootServices,
+                  NULL,
+                  &mQemuFwCfgExitBootServicesEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    mQemuFwCfgFileDirDisabled = TRUE;
+  }
+
+  return RETURN_SUCCESS;
+}
+
+/**
+  Release the cached file directory, and close the ExitBootServices() event,
+  when a driver that links this library is unloaded.
+
+  @retval RETURN_SUCCESS  Always.
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgDestructor (
+  VOID
+  )
+{
+  if (mQemuFwCfgExitBootServicesEvent != NULL) {
+    gBS->CloseEvent (mQemuFwCfgExitBootServicesEvent);
+  }
+
+  if (mQemuFwCfgFileDir != NULL) {
+    FreePool (mQemuFwCfgFileDir);
+    mQemuFwCfgFileDir = NULL;
+  }
+
   return RETURN_SUCCESS;
 }
 
@@ -491,3 +555,49 @@ InternalQemuFwCfgDmaBytes (
     UnmapFwCfgDmaDataBuffer (DataMapping);
   }
 }
+
+/**
+  Returns the sorted firmware configuration file directory that this library
+  instance keeps, reading it on the first call if necessary.
+
+  The directory is taken over from the HOB that the PEI instance published, if
+  any. It is kept in boot services pool memory, and only until
+  ExitBootServices(); runtime drivers scan the directory through fw_cfg after
+  that, as they always did.
+
+  @return    The cached directory, or NULL if this library instance keeps no
+             directory (or failed to set it up, or boot services have ended);
+             QemuFwCfgFindFile() then scans the directory through fw_cfg.
+**/
+CONST QEMU_FW_CFG_FILE_DIR *
+InternalQemuFwCfgGetFileDir (
+  VOID
+  )
+{
+  EFI_HOB_GUID_TYPE     *GuidHob;
+  QEMU_FW_CFG_FILE_DIR  *Dir;
+  UINT32                Count;
+
+  if ((mQemuFwCfgFileDir != NULL) || mQemuFwCfgFileDirDisabled) {
+    return mQemuFwCfgFileDir;
+  }
+
+  GuidHob = GetFirstGuidHob (&gQemuFwCfgFileDirGuid);
+  if (GuidHob != NULL) {
+    mQemuFwCfgFileDir = AllocateCopyPool (
+                          GET_GUID_HOB_DATA_SIZE (GuidHob),
+                          GET_GUID_HOB_DATA (GuidHob)
+                          );
+    return mQemuFwCfgFileDir;
+  }
+
+  Count = InternalQemuFwCfgReadFileDir (NULL, 0);
+  Dir   = AllocatePool (sizeof *Dir + (UINTN)Count * sizeof (QEMU_FW_CFG_FILE));
+  if (Dir == NULL) {
+    return NULL;
+  }
+
+  InternalQemuFwCfgReadFileDir (Dir, Count);
+  mQemuFwCfgFileDir = Dir;
+  return mQemuFwCfgFileDir;
+}
@@ -232,6 +232,64 @@ QemuFwCfgRead64 (
   return Result;
 }
 
+/**
+  Read the firmware configuration file directory, and sort it by file name.
+
+  @param[out] Dir       Buffer with room for the header and MaxCount entries;
+                        Dir->Count is set to the number of entries stored. May
+                        be NULL if MaxCount is zero.
+  @param[in]  MaxCount  The number of entries that Dir has room for.
+
+  @return    The number of entries in the directory.
+
+**/
+UINT32
+InternalQemuFwCfgReadFileDir (
+  OUT QEMU_FW_CFG_FILE_DIR  *Dir       OPTIONAL,
+  IN  UINT32                MaxCount
+  )
+{
+  UINT32            Count;
+  QEMU_FW_CFG_FILE  *Files;
+  QEMU_FW_CFG_FILE  File;
+  UINT32            Idx;
+  UINT32            Pos;
+
+  QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
+  Count = SwapBytes32 (QemuFwCfgRead32 ());
+  if (Dir == NULL) {
+    return Count;
+  }
+
+  Dir->Count    = MIN (Count, MaxCount);
+  Dir->Reserved = 0;
+  Files         = (QEMU_FW_CFG_FILE *)(Dir + 1);
+
+  //
+  // Read all entries in one go; with the DMA interface, this is a single
+  // transfer rather than 64 IO Port accesses per entry.
+  //
+  InternalQemuFwCfgReadBytes (Dir->Count * sizeof *Files, Files);
+
+  //
+  // QEMU keeps the directory sorted for recent machine types only; sort it
+  // ourselves. The directory is small, and is sorted once per boot.
+  //
+  for (Idx = 1; Idx < Dir->Count; ++Idx) {
+    CopyMem (&File, &Files[Idx], sizeof File);
+    for (Pos = Idx;
+         Pos > 0 && AsciiStrCmp (Files[Pos - 1].Name, File.Name) > 0;
+         --Pos)
+    {
+      CopyMem (&Files[Pos], &Files[Pos - 1], sizeof File);
+    }
+
+    CopyMem (&Files[Pos], &File, sizeof File);
+  }
+
+  return Count;
+}
+
 /**
   Find the configuration item corresponding to the firmware configuration file.
 
@@ -253,13 +311,45 @@ QemuFwCfgFindFile (
   OUT  UINTN                 *Size
   )
 {
-  UINT32  Count;
-  UINT32  Idx;
+  CONST QEMU_FW_CFG_FILE_DIR  *Dir;
+  CONST QEMU_FW_CFG_FILE      *Files;
+  UINT32                      Count;
+  UINT32                      Idx;
+  UINT32                      Low;
+  UINT32                      High;
+  INTN                        Order;
 
   if (!InternalQemuFwCfgIsAvailable ()) {
     return RETURN_UNSUPPORTED;
   }
 
+  //
+  // Binary search the cached directory, if this phase keeps one.
+  //
+  Dir = InternalQemuFwCfgGetFileDir ();
+  if (Dir != NULL) {
+    Files = QEMU_FW_CFG_FILE_DIR_ENTRIES (Dir);
+    Low   = 0;
+    High  = Dir->Count;
+    while (Low < High) {
+      Idx   = Low + (High - Low) / 2;
+      Order = AsciiStrnCmp (Name, Files[Idx].Name, QEMU_FW_CFG_FNAME_SIZE);
+      if (Order == 0) {
+        *Item = SwapBytes16 (Files[Idx].Select);
+        *Size = SwapBytes32 (Files[Idx].Size);
+        return RETURN_SUCCESS;
+      }
+
+      if (Order < 0) {
+        High = Idx;
+      } else {
+        Low = Idx + 1;
+      }
+    }
+
+    return RETURN_NOT_FOUND;
+  }
+
   QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
   Count = SwapBytes32 (QemuFwCfgRead32 ());
 
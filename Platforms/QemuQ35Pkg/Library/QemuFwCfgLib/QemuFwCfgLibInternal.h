@@ -11,6 +11,8 @@
 #ifndef __QEMU_FW_CFG_LIB_INTERNAL_H__
 #define __QEMU_FW_CFG_LIB_INTERNAL_H__
 
+#include <Guid/QemuFwCfgFileDir.h>
+
 /**
   Returns a boolean indicating if the firmware configuration interface is
   available for library-internal purposes.
@@ -59,4 +61,33 @@ InternalQemuFwCfgDmaBytes (
   IN     UINT32  Control
   );
 
+/**
+  Read the firmware configuration file directory, and sort it by file name.
+
+  @param[out] Dir       Buffer with room for the header and MaxCount entries;
+                        Dir->Count is set to the number of entries stored. May
+                        be NULL if MaxCount is zero.
+  @param[in]  MaxCount  The number of entries that Dir has room for.
+
+  @return    The number of entries in the directory.
+**/
+UINT32
+InternalQemuFwCfgReadFileDir (
+  OUT QEMU_FW_CFG_FILE_DIR  *Dir       OPTIONAL,
+  IN  UINT32                MaxCount
+  );
+
+/**
+  Returns the sorted firmware configuration file directory that this library
+  instance keeps, reading it on the first call if necessary.
+
+  @return    The cached directory, or NULL if this library instance keeps no
+             directory (or failed to set it up); QemuFwCfgFindFile() then
+             scans the directory through fw_cfg.
+**/
+CONST QEMU_FW_CFG_FILE_DIR *
+InternalQemuFwCfgGetFileDir (
+  VOID
+  );
+
 #endif
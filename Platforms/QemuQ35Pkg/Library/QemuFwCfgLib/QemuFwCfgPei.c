@@ -12,6 +12,7 @@
 #include <Library/BaseLib.h>
 #include <Library/IoLib.h>
 #include <Library/DebugLib.h>
+#include <Library/HobLib.h>
 #include <Library/QemuFwCfgLib.h>
 #include <Library/MemEncryptSevLib.h>
 
@@ -199,3 +200,49 @@ InternalQemuFwCfgDmaBytes (
   //
   MemoryFence ();
 }
+
+/**
+  Returns the sorted firmware configuration file directory that this library
+  instance keeps, reading it on the first call if necessary.
+
+  The directory is kept in a GUID HOB, so that it is read only once for all
+  PEIMs, and DXE can take it over.
+
+  @return    The cached directory, or NULL if this library instance keeps no
+             directory (or failed to set it up); QemuFwCfgFindFile() then
+             scans the directory through fw_cfg.
+**/
+CONST QEMU_FW_CFG_FILE_DIR *
+InternalQemuFwCfgGetFileDir (
+  VOID
+  )
+{
+  EFI_HOB_GUID_TYPE     *GuidHob;
+  QEMU_FW_CFG_FILE_DIR  *Dir;
+  UINT32                Count;
+  UINTN                 Size;
+
+  GuidHob = GetFirstGuidHob (&gQemuFwCfgFileDirGuid);
+  if (GuidHob != NULL) {
+    return GET_GUID_HOB_DATA (GuidHob);
+  }
+
+  Count = InternalQemuFwCfgReadFileDir (NULL, 0);
+  Size  = sizeof *Dir + (UINTN)Count * sizeof (QEMU_FW_CFG_FILE);
+
+  //
+  // The length of a HOB is a UINT16.
+  //
+  if (Size > MAX_UINT16 - sizeof *GuidHob) {
+    return NULL;
+  }
+
+  Dir = BuildGuidHob (&gQemuFwCfgFileDirGuid, Size);
+  if (Dir == NULL) {
+    return NULL;
+  }
+
+  InternalQemuFwCfgReadFileDir (Dir, Count);
+  DEBUG ((DEBUG_INFO, "QemuFwCfg file directory cached (%u files).\n", Count));
+  return Dir;
+}
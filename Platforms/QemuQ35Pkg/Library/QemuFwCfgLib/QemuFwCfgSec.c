@@ -119,3 +119,22 @@ InternalQemuFwCfgDmaBytes (
   ASSERT (FALSE);
   CpuDeadLoop ();
 }
+
+/**
+  Returns the sorted firmware configuration file directory that this library
+  instance keeps, reading it on the first call if necessary.
+
+  @return    The cached directory, or NULL if this library instance keeps no
+             directory (or failed to set it up); QemuFwCfgFindFile() then
+             scans the directory through fw_cfg.
+**/
+CONST QEMU_FW_CFG_FILE_DIR *
+InternalQemuFwCfgGetFileDir (
+  VOID
+  )
+{
+  //
+  // The stateless SEC instance has nowhere to keep the directory.
+  //
+  return NULL;
+}
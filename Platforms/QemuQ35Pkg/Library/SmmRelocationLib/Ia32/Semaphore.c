@@ -26,7 +26,8 @@ AcquireSmmRelocationSemaphore (
 }
 
 /**
-  Release the SMM Relocation Semaphore.
+  Release the SMM Relocation Semaphore, and relay a chained relocation to the
+  next CPU.
 **/
 VOID
 EFIAPI
@@ -35,6 +36,7 @@ ReleaseSmmRelocationSemaphore (
   )
 {
   ReleaseSpinLock (&mSmmRelocationSemaphore);
+  SmmRelocationRelay ();
 }
 
 /**
@@ -79,6 +79,20 @@ SmmRelocationSemaphoreComplete (
   VOID
   );
 
+/**
+  Relay the chained SMBASE relocation to the next CPU, after the currently
+  executing CPU has left its first SMI. Does nothing unless the chained
+  relocation is in progress.
+
+  This function is called from the code that the return from the first SMI is
+  hooked to, after the SMM relocation semaphore has been released.
+**/
+VOID
+EFIAPI
+SmmRelocationRelay (
+  VOID
+  );
+
 /**
   Hook the code executed immediately after an RSM instruction on the currently
   executing CPU.  The mode of code executed immediately after RSM must be
@@ -31,6 +31,23 @@ UINT64  mSmBase;
 //
 volatile BOOLEAN  mRebased;
 
+//
+// APIC ID and new SmBase of each CPU, for the chained relocation
+//
+typedef struct {
+  UINT32    ApicId;
+  UINT64    SmBase;
+} SMM_RELOCATION_CPU;
+
+//
+// The CPUs in the order of the chained relocation: the APs first, the BSP
+// last. mRelocatedCpuCount counts the CPUs that have left their first SMI.
+//
+BOOLEAN             mRelocationChained;
+SMM_RELOCATION_CPU  *mRelocationCpus;
+UINTN               mRelocationCpuCount;
+volatile UINT32     mRelocatedCpuCount;
+
 /**
   This function will get the SmBase for CpuIndex.
 
@@ -125,6 +142,37 @@ CreateSmmBaseHob (
   return EFI_SUCCESS;
 }
 
+/**
+  Look up the new SmBase of the currently executing CPU, for the chained
+  relocation.
+
+  @retval The value of SmBase for the currently executing CPU.
+
+**/
+UINT64
+GetChainedSmBase (
+  VOID
+  )
+{
+  UINT32  ApicId;
+  UINTN   Index;
+
+  ApicId = GetApicId ();
+  for (Index = 0; Index < mRelocationCpuCount; Index++) {
+    if (mRelocationCpus[Index].ApicId == ApicId) {
+      return mRelocationCpus[Index].SmBase;
+    }
+  }
+
+  //
+  // An unknown CPU must not leave SMM with the default SmBase; the next CPU
+  // would overwrite its save state.
+  //
+  ASSERT (FALSE);
+  CpuDeadLoop ();
+  return 0;
+}
+
 /**
   C function for SMI handler. To change all processor's SMMBase Register.
 
@@ -143,7 +191,7 @@ SmmInitHandler (
   //
   // Configure SmBase.
   //
-  ConfigureSmBase (mSmBase);
+  ConfigureSmBase (mRelocationChained ? GetChainedSmBase () : mSmBase);
 
   //
   // Hook return after RSM to set SMM re-based flag
@@ -154,64 +202,149 @@ SmmInitHandler (
 }
 
 /**
-  Relocate SmmBases for each processor.
+  Relay the chained SMBASE relocation to the next CPU, after the currently
+  executing CPU has left its first SMI. Does nothing unless the chained
+  relocation is in progress.
+
+  This function is called from the code that the return from the first SMI is
+  hooked to, after the SMM relocation semaphore has been released.
+**/
+VOID
+EFIAPI
+SmmRelocationRelay (
+  VOID
+  )
+{
+  UINT32  RelocatedCpuCount;
+
+  if (!mRelocationChained) {
+    return;
+  }
+
+  RelocatedCpuCount = InterlockedIncrement (&mRelocatedCpuCount);
+
+  //
+  // The BSP, last in the table, sends the SMI to itself once all APs are
+  // done.
+  //
+  if (RelocatedCpuCount + 1 < mRelocationCpuCount) {
+    SendSmiIpi (mRelocationCpus[RelocatedCpuCount].ApicId);
+  }
+}
+
+/**
+  Relocate SmmBases for all processors in a chain. The BSP sends the SMI to
+  the first AP only; each AP sends the SMI to the next AP when it has left its
+  first SMI, so the first SMIs still never overlap, but the BSP does not sit
+  in the critical path of each relocation.
 
   @param[in]   MpServices2         Pointer to this instance of the MpServices.
   @param[in]   SmmRelocationStart  The start address of Smm relocated memory in SMRAM.
   @param[in]   TileSize            The total size required for a CPU save state, any
                                    additional CPU-specific context and the size of code
                                    for the SMI entry point.
+  @param[in]   BspApicId           The local APIC ID of the BSP.
+
+  @retval TRUE   All processors have been relocated.
+  @retval FALSE  Out of resources; no processor has been relocated.
 
 **/
-VOID
-SmmRelocateBases (
+BOOLEAN
+SmmRelocateBasesChained (
   IN EDKII_PEI_MP_SERVICES2_PPI  *MpServices2,
   IN EFI_PHYSICAL_ADDRESS        SmmRelocationStart,
-  IN UINTN                       TileSize
+  IN UINTN                       TileSize,
+  IN UINT32                      BspApicId
   )
 {
   EFI_STATUS                 Status;
-  UINT8                      BakBuf[BACK_BUF_SIZE];
-  SMRAM_SAVE_STATE_MAP       BakBuf2;
-  SMRAM_SAVE_STATE_MAP       *CpuStatePtr;
-  UINT8                      *U8Ptr;
   UINTN                      Index;
   UINTN                      BspIndex;
-  UINT32                     BspApicId;
+  UINTN                      ApCount;
   EFI_PROCESSOR_INFORMATION  ProcessorInfo;
 
-  //
-  // Make sure the reserved size is large enough for procedure SmmInitTemplate.
-  //
-  ASSERT (sizeof (BakBuf) >= gcSmmInitSize);
+  mRelocationCpus = AllocatePool (mNumberOfCpus * sizeof (SMM_RELOCATION_CPU));
+  if (mRelocationCpus == NULL) {
+    return FALSE;
+  }
 
   //
-  // Patch ASM code template with current CR0, CR3, and CR4 values
+  // Build the table of APIC IDs and SmBases, APs first
   //
-  PatchInstructionX86 (gPatchSmmInitCr0, AsmReadCr0 (), 4);
-  PatchInstructionX86 (gPatchSmmInitCr3, AsmReadCr3 (), 4);
-  PatchInstructionX86 (gPatchSmmInitCr4, AsmReadCr4 () & (~CR4_CET_ENABLE), 4);
+  ApCount  = 0;
+  BspIndex = (UINTN)-1;
+  for (Index = 0; Index < mNumberOfCpus; Index++) {
+    Status = MpServices2->GetProcessorInfo (MpServices2, Index | CPU_V2_EXTENDED_TOPOLOGY, &ProcessorInfo);
+    ASSERT_EFI_ERROR (Status);
 
-  U8Ptr       = (UINT8 *)(UINTN)(SMM_DEFAULT_SMBASE + SMM_HANDLER_OFFSET);
-  CpuStatePtr = (SMRAM_SAVE_STATE_MAP *)(UINTN)(SMM_DEFAULT_SMBASE + SMRAM_SAVE_STATE_MAP_OFFSET);
+    if (BspApicId == (UINT32)ProcessorInfo.ProcessorId) {
+      BspIndex = Index;
+      continue;
+    }
+
+    mRelocationCpus[ApCount].ApicId = (UINT32)ProcessorInfo.ProcessorId;
+    mRelocationCpus[ApCount].SmBase = GetSmBase (Index, SmmRelocationStart, TileSize);
+    ApCount++;
+  }
+
+  ASSERT (BspIndex != (UINTN)-1);
+  mRelocationCpus[ApCount].ApicId = BspApicId;
+  mRelocationCpus[ApCount].SmBase = GetSmBase (BspIndex, SmmRelocationStart, TileSize);
+
+  mRelocationCpuCount = ApCount + 1;
+  mRelocatedCpuCount  = 0;
+  mRelocationChained  = TRUE;
 
   //
-  // Backup original contents at address 0x38000
+  // Start the chain of APs' 1st SMIs, and wait for its end
   //
-  CopyMem (BakBuf, U8Ptr, sizeof (BakBuf));
-  CopyMem (&BakBuf2, CpuStatePtr, sizeof (BakBuf2));
+  if (ApCount > 0) {
+    SendSmiIpi (mRelocationCpus[0].ApicId);
+    while (mRelocatedCpuCount < ApCount) {
+      CpuPause ();
+    }
+  }
 
   //
-  // Load image for relocation
+  // Relocate BSP's SMM base
   //
-  CopyMem (U8Ptr, gcSmmInitTemplate, gcSmmInitSize);
+  SendSmiIpi (BspApicId);
+  while (mRelocatedCpuCount < mRelocationCpuCount) {
+    CpuPause ();
+  }
 
-  // RemoveNxProtection ((EFI_PHYSICAL_ADDRESS)((UINTN)SmmStartup & ~(EFI_PAGE_SIZE - 1)), EFI_PAGE_SIZE * 2);
+  mRelocationChained = FALSE;
+  FreePool (mRelocationCpus);
+  mRelocationCpus     = NULL;
+  mRelocationCpuCount = 0;
 
-  //
-  // Retrieve the local APIC ID of current processor
-  //
-  BspApicId = GetApicId ();
+  DEBUG ((DEBUG_INFO, "SmmRelocateBasesChained - relocated %d CPUs\n", mRelocatedCpuCount));
+  return TRUE;
+}
+
+/**
+  Relocate SmmBases for each processor, one at a time.
+
+  @param[in]   MpServices2         Pointer to this instance of the MpServices.
+  @param[in]   SmmRelocationStart  The start address of Smm relocated memory in SMRAM.
+  @param[in]   TileSize            The total size required for a CPU save state, any
+                                   additional CPU-specific context and the size of code
+                                   for the SMI entry point.
+  @param[in]   BspApicId           The local APIC ID of the BSP.
+
+**/
+VOID
+SmmRelocateBasesSerially (
+  IN EDKII_PEI_MP_SERVICES2_PPI  *MpServices2,
+  IN EFI_PHYSICAL_ADDRESS        SmmRelocationStart,
+  IN UINTN                       TileSize,
+  IN UINT32                      BspApicId
+  )
+{
+  EFI_STATUS                 Status;
+  UINTN                      Index;
+  UINTN                      BspIndex;
+  EFI_PROCESSOR_INFORMATION  ProcessorInfo;
 
   //
   // Relocate SM bases for all APs
@@ -252,6 +385,73 @@ SmmRelocateBases (
   //
   while (!mRebased) {
   }
+}
+
+/**
+  Relocate SmmBases for each processor.
+
+  @param[in]   MpServices2         Pointer to this instance of the MpServices.
+  @param[in]   SmmRelocationStart  The start address of Smm relocated memory in SMRAM.
+  @param[in]   TileSize            The total size required for a CPU save state, any
+                                   additional CPU-specific context and the size of code
+                                   for the SMI entry point.
+
+**/
+VOID
+SmmRelocateBases (
+  IN EDKII_PEI_MP_SERVICES2_PPI  *MpServices2,
+  IN EFI_PHYSICAL_ADDRESS        SmmRelocationStart,
+  IN UINTN                       TileSize
+  )
+{
+  UINT8                 BakBuf[BACK_BUF_SIZE];
+  SMRAM_SAVE_STATE_MAP  BakBuf2;
+  SMRAM_SAVE_STATE_MAP  *CpuStatePtr;
+  UINT8                 *U8Ptr;
+  UINT32                BspApicId;
+
+  //
+  // Make sure the reserved size is large enough for procedure SmmInitTemplate.
+  //
+  ASSERT (sizeof (BakBuf) >= gcSmmInitSize);
+
+  //
+  // Patch ASM code template with current CR0, CR3, and CR4 values
+  //
+  PatchInstructionX86 (gPatchSmmInitCr0, AsmReadCr0 (), 4);
+  PatchInstructionX86 (gPatchSmmInitCr3, AsmReadCr3 (), 4);
+  PatchInstructionX86 (gPatchSmmInitCr4, AsmReadCr4 () & (~CR4_CET_ENABLE), 4);
+
+  U8Ptr       = (UINT8 *)(UINTN)(SMM_DEFAULT_SMBASE + SMM_HANDLER_OFFSET);
+  CpuStatePtr = (SMRAM_SAVE_STATE_MAP *)(UINTN)(SMM_DEFAULT_SMBASE + SMRAM_SAVE_STATE_MAP_OFFSET);
+
+  //
+  // Backup original contents at address 0x38000
+  //
+  CopyMem (BakBuf, U8Ptr, sizeof (BakBuf));
+  CopyMem (&BakBuf2, CpuStatePtr, sizeof (BakBuf2));
+
+  //
+  // Load image for relocation
+  //
+  CopyMem (U8Ptr, gcSmmInitTemplate, gcSmmInitSize);
+
+  // RemoveNxProtection ((EFI_PHYSICAL_ADDRESS)((UINTN)SmmStartup & ~(EFI_PAGE_SIZE - 1)), EFI_PAGE_SIZE * 2);
+
+  //
+  // Retrieve the local APIC ID of current processor
+  //
+  BspApicId = GetApicId ();
+
+  //
+  // This is each CPU's 1st SMI - rebase will be done here, and the default SMI
+  // handler will be overridden by gcSmmInitTemplate
+  //
+  if (!FeaturePcdGet (PcdSmmRelocationChained) ||
+      !SmmRelocateBasesChained (MpServices2, SmmRelocationStart, TileSize, BspApicId))
+  {
+    SmmRelocateBasesSerially (MpServices2, SmmRelocationStart, TileSize, BspApicId);
+  }
 
   //
   // Restore contents at address 0x38000
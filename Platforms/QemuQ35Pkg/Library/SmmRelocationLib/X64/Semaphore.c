@@ -37,7 +37,8 @@ AcquireSmmRelocationSemaphore (
 }
 
 /**
-  Release the SMM Relocation Semaphore.
+  Release the SMM Relocation Semaphore, and relay a chained relocation to the
+  next CPU.
 **/
 VOID
 EFIAPI
@@ -46,6 +47,7 @@ ReleaseSmmRelocationSemaphore (
   )
 {
   ReleaseSpinLock (&mSmmRelocationSemaphore);
+  SmmRelocationRelay ();
 }
 
 /**
@@ -0,0 +1,80 @@
+/** @file
+  Provide constructor and the time base for the DXE instance of the TSC Timer
+  Library
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/HobLib.h>
+#include <Guid/QemuTscFrequency.h>
+
+#include "TscTimerLibInternal.h"
+
+//
+// Cached time base, valid once mTimeBaseKnown is TRUE
+//
+STATIC QEMU_TSC_FREQUENCY_DATA  mTimeBase;
+STATIC BOOLEAN                  mTimeBaseKnown;
+
+/**
+  Retrieve the time base.
+
+  Normally, the PEI instance of this library has published the time base in a
+  GUIDed HOB, which is cached here at the first call. The time base is only
+  determined from scratch if the HOB is missing.
+
+  @param[out] TimeBase  The time base.
+
+**/
+VOID
+InternalGetTimeBase (
+  OUT QEMU_TSC_FREQUENCY_DATA  *TimeBase
+  )
+{
+  EFI_HOB_GUID_TYPE  *GuidHob;
+
+  if (!mTimeBaseKnown) {
+    GuidHob = GetFirstGuidHob (&gQemuTscFrequencyGuid);
+    if (GuidHob != NULL) {
+      mTimeBase = *(QEMU_TSC_FREQUENCY_DATA *)GET_GUID_HOB_DATA (GuidHob);
+    } else {
+      InternalCalculateTimeBase (&mTimeBase);
+    }
+
+    mTimeBaseKnown = TRUE;
+  }
+
+  *TimeBase = mTimeBase;
+}
+
+/**
+  The constructor function caches the time base.
+
+  The DXE Core may query the Timer Library (through DebugLib, for example)
+  before it calls the constructors of its libraries, hence
+  InternalGetTimeBase() does not rely on this constructor. Runtime drivers
+  however must neither look at the HOB list nor access PCI config space after
+  ExitBootServices(), so the time base is cached here at the latest.
+
+  @retval RETURN_SUCCESS      The time base is cached.
+  @retval RETURN_UNSUPPORTED  The platform has neither a usable TSC nor a known
+                              ACPI PM timer.
+
+**/
+RETURN_STATUS
+EFIAPI
+DxeTscTimerLibConstructor (
+  VOID
+  )
+{
+  QEMU_TSC_FREQUENCY_DATA  TimeBase;
+
+  InternalGetTimeBase (&TimeBase);
+  if ((TimeBase.TscFrequency == 0) && (TimeBase.AcpiTimerPort == 0)) {
+    return RETURN_UNSUPPORTED;
+  }
+
+  return RETURN_SUCCESS;
+}
@@ -0,0 +1,39 @@
+/** @file
+  Provide the time base for the PEI instance of the TSC Timer Library
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/HobLib.h>
+#include <Guid/QemuTscFrequency.h>
+
+#include "TscTimerLibInternal.h"
+
+/**
+  Retrieve the time base.
+
+  PEI modules cannot rely on writable global variables, so the time base is
+  kept in a GUIDed HOB. The first call determines the time base and builds the
+  HOB; the HOB is later consumed by the DXE instance as well.
+
+  @param[out] TimeBase  The time base.
+
+**/
+VOID
+InternalGetTimeBase (
+  OUT QEMU_TSC_FREQUENCY_DATA  *TimeBase
+  )
+{
+  EFI_HOB_GUID_TYPE  *GuidHob;
+
+  GuidHob = GetFirstGuidHob (&gQemuTscFrequencyGuid);
+  if (GuidHob != NULL) {
+    *TimeBase = *(QEMU_TSC_FREQUENCY_DATA *)GET_GUID_HOB_DATA (GuidHob);
+    return;
+  }
+
+  InternalCalculateTimeBase (TimeBase);
+  BuildGuidDataHob (&gQemuTscFrequencyGuid, TimeBase, sizeof *TimeBase);
+}
@@ -0,0 +1,47 @@
+/** @file
+  Internal definitions for the TSC Timer Library
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef _TSC_TIMER_LIB_INTERNAL_H_
+#define _TSC_TIMER_LIB_INTERNAL_H_
+
+#include <Base.h>
+#include <Guid/QemuTscFrequency.h>
+
+/**
+  Determine the time base: the frequency of the time stamp counter, and the
+  I/O port of the ACPI PM timer.
+
+  The frequency is taken from CPUID leaf 0x40000010 (hypervisor timing
+  information) or CPUID leaf 0x15 (core crystal clock) if either is
+  available. Otherwise, the counter is calibrated against the ACPI PM timer,
+  which costs a few milliseconds.
+
+  If CPUID does not report an invariant TSC, the ACPI PM timer is used as the
+  time base instead, and the frequency is 0.
+
+  @param[out] TimeBase  The time base.
+
+**/
+VOID
+InternalCalculateTimeBase (
+  OUT QEMU_TSC_FREQUENCY_DATA  *TimeBase
+  );
+
+/**
+  Retrieve the time base, as determined by InternalCalculateTimeBase(),
+  possibly earlier in the boot.
+
+  @param[out] TimeBase  The time base.
+
+**/
+VOID
+InternalGetTimeBase (
+  OUT QEMU_TSC_FREQUENCY_DATA  *TimeBase
+  );
+
+#endif // _TSC_TIMER_LIB_INTERNAL_H_
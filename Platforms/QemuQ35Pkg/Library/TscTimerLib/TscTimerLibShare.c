@@ -0,0 +1,490 @@
+/** @file
+  TSC based implementation of the Timer Library, shared by the PEI and DXE
+  instances.
+
+  Reading the ACPI PM timer is an I/O port access, which a hypervisor has to
+  intercept, while RDTSC is normally executed without a VM exit. This library
+  therefore uses the ACPI PM timer at most once, to learn the frequency of the
+  time stamp counter, and serves all delays and performance counter queries
+  from the latter.
+
+  The TSC only ticks at a constant rate if the processor reports it as
+  invariant. Otherwise, the library falls back to serving all queries from the
+  ACPI PM timer, like AcpiTimerLib does. The I/O port of the PM timer is
+  resolved once, together with the TSC frequency, so that neither delays nor
+  counter reads access PCI config space.
+
+  Copyright (c) 2008 - 2012, Intel Corporation. All rights reserved.<BR>
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/PciLib.h>
+#include <Library/TimerLib.h>
+#include <IndustryStandard/Acpi.h>
+#include <Register/Intel/Cpuid.h>
+#include <OvmfPlatforms.h>
+
+#include "TscTimerLibInternal.h"
+
+//
+// The ACPI Time is a 24-bit counter
+//
+#define ACPI_TIMER_COUNT_SIZE  BIT24
+
+//
+// Calibrate the TSC over 2ms worth of ACPI PM timer ticks
+//
+#define TSC_CALIBRATION_TICKS  (ACPI_TIMER_FREQUENCY / 500)
+
+//
+// CPUID leaves of the hypervisor range. The timing information leaf reports
+// the TSC frequency in kHz in EAX.
+//
+#define CPUID_HYPERVISOR_BASE    0x40000000
+#define CPUID_HYPERVISOR_TIMING  0x40000010
+
+/**
+  Return the I/O port of the ACPI PM timer, enabling ACPI I/O space first if
+  necessary.
+
+  @return The I/O port of the ACPI PM timer, or 0 on an unknown platform.
+
+**/
+STATIC
+UINT32
+InternalAcpiTimerPort (
+  VOID
+  )
+{
+  UINT16  HostBridgeDevId;
+  UINTN   Pmba;
+  UINT32  PmbaAndVal;
+  UINT32  PmbaOrVal;
+  UINTN   AcpiCtlReg;
+  UINT8   AcpiEnBit;
+
+  //
+  // Query Host Bridge DID to determine platform type
+  //
+  HostBridgeDevId = PciRead16 (OVMF_HOSTBRIDGE_DID);
+  switch (HostBridgeDevId) {
+    case INTEL_82441_DEVICE_ID:
+      Pmba       = POWER_MGMT_REGISTER_PIIX4 (PIIX4_PMBA);
+      PmbaAndVal = ~(UINT32)PIIX4_PMBA_MASK;
+      PmbaOrVal  = PIIX4_PMBA_VALUE;
+      AcpiCtlReg = POWER_MGMT_REGISTER_PIIX4 (PIIX4_PMREGMISC);
+      AcpiEnBit  = PIIX4_PMREGMISC_PMIOSE;
+      break;
+    case INTEL_Q35_MCH_DEVICE_ID:
+      Pmba       = POWER_MGMT_REGISTER_Q35 (ICH9_PMBASE);
+      PmbaAndVal = ~(UINT32)ICH9_PMBASE_MASK;
+      PmbaOrVal  = ICH9_PMBASE_VALUE;
+      AcpiCtlReg = POWER_MGMT_REGISTER_Q35 (ICH9_ACPI_CNTL);
+      AcpiEnBit  = ICH9_ACPI_CNTL_ACPI_EN;
+      break;
+    case CLOUDHV_DEVICE_ID:
+      return CLOUDHV_ACPI_TIMER_IO_ADDRESS;
+    default:
+      return 0;
+  }
+
+  //
+  // Check to see if the Power Management Base Address is already enabled
+  //
+  if ((PciRead8 (AcpiCtlReg) & AcpiEnBit) == 0) {
+    //
+    // If the Power Management Base Address is not programmed,
+    // then program it now.
+    //
+    PciAndThenOr32 (Pmba, PmbaAndVal, PmbaOrVal);
+
+    //
+    // Enable PMBA I/O port decodes
+    //
+    PciOr8 (AcpiCtlReg, AcpiEnBit);
+  }
+
+  return (PciRead32 (Pmba) & ~PMBA_RTE) + ACPI_TIMER_OFFSET;
+}
+
+/**
+  Check whether the time stamp counter runs at a constant rate, independently
+  of P-, C- and T-states.
+
+  @retval TRUE   CPUID reports an invariant TSC.
+  @retval FALSE  The TSC may change its rate, or CPUID cannot tell.
+
+**/
+STATIC
+BOOLEAN
+InternalIsTscInvariant (
+  VOID
+  )
+{
+  UINT32                               RegEax;
+  CPUID_ADVANCED_POWER_MANAGEMENT_EDX  PowerManagementEdx;
+
+  AsmCpuid (CPUID_EXTENDED_FUNCTION, &RegEax, NULL, NULL, NULL);
+  if (RegEax < CPUID_ADVANCED_POWER_MANAGEMENT) {
+    return FALSE;
+  }
+
+  AsmCpuid (CPUID_ADVANCED_POWER_MANAGEMENT, NULL, NULL, NULL, &PowerManagementEdx.Uint32);
+  return (BOOLEAN)(PowerManagementEdx.Bits.InvariantTsc != 0);
+}
+
+/**
+  Determine the time base: the frequency of the time stamp counter, and the
+  I/O port of the ACPI PM timer.
+
+  Note that this function must not print DEBUG messages: DebugLib instances
+  may query the TimerLib for time stamps, and would recurse into here.
+
+  @param[out] TimeBase  The time base. TscFrequency is 0 if the ACPI PM timer
+                        serves as time base instead of the TSC. AcpiTimerPort
+                        is 0 on an unknown platform.
+
+**/
+VOID
+InternalCalculateTimeBase (
+  OUT QEMU_TSC_FREQUENCY_DATA  *TimeBase
+  )
+{
+  UINT32  RegEax;
+  UINT32  RegEbx;
+  UINT32  RegEcx;
+  UINT32  TimerPort;
+  UINT32  TimerStart;
+  UINT32  TimerTicks;
+  UINT64  TscStart;
+  UINT64  TscEnd;
+
+  TimerPort               = InternalAcpiTimerPort ();
+  TimeBase->AcpiTimerPort = TimerPort;
+  TimeBase->TscFrequency  = 0;
+
+  //
+  // A TSC that changes its rate is useless as time base; use the ACPI PM
+  // timer directly then, if there is one.
+  //
+  if (!InternalIsTscInvariant () && (TimerPort != 0)) {
+    return;
+  }
+
+  //
+  // If we run under a hypervisor that exposes the timing information leaf,
+  // take the TSC frequency from there.
+  //
+  AsmCpuid (CPUID_VERSION_INFO, NULL, NULL, &RegEcx, NULL);
+  if ((RegEcx & BIT31) != 0) {
+    AsmCpuid (CPUID_HYPERVISOR_BASE, &RegEax, NULL, NULL, NULL);
+    if (RegEax >= CPUID_HYPERVISOR_TIMING) {
+      AsmCpuid (CPUID_HYPERVISOR_TIMING, &RegEax, NULL, NULL, NULL);
+      if (RegEax != 0) {
+        TimeBase->TscFrequency = MultU64x32 (RegEax, 1000);
+        return;
+      }
+    }
+  }
+
+  //
+  // Otherwise, try the ratio of the TSC to the core crystal clock.
+  //
+  AsmCpuid (CPUID_SIGNATURE, &RegEax, NULL, NULL, NULL);
+  if (RegEax >= CPUID_TIME_STAMP_COUNTER) {
+    AsmCpuid (CPUID_TIME_STAMP_COUNTER, &RegEax, &RegEbx, &RegEcx, NULL);
+    if ((RegEax != 0) && (RegEbx != 0) && (RegEcx != 0)) {
+      TimeBase->TscFrequency = DivU64x32 (MultU64x32 (RegEcx, RegEbx), RegEax);
+      return;
+    }
+  }
+
+  //
+  // Fall back to measuring the TSC against the ACPI PM timer. Without one,
+  // there is no time base at all; the DXE constructor rejects that.
+  //
+  if (TimerPort == 0) {
+    return;
+  }
+
+  //
+  // Start at the edge of a PM timer tick, for accuracy.
+  //
+  TimerStart = IoRead32 (TimerPort);
+  while (IoRead32 (TimerPort) == TimerStart) {
+    CpuPause ();
+  }
+
+  TimerStart = IoRead32 (TimerPort);
+  TscStart   = AsmReadTsc ();
+  do {
+    TimerTicks = (IoRead32 (TimerPort) - TimerStart) &
+                 (ACPI_TIMER_COUNT_SIZE - 1);
+  } while (TimerTicks < TSC_CALIBRATION_TICKS);
+
+  TscEnd = AsmReadTsc ();
+
+  TimeBase->TscFrequency = DivU64x32 (
+                             MultU64x32 (TscEnd - TscStart, ACPI_TIMER_FREQUENCY),
+                             TimerTicks
+                             );
+}
+
+/**
+  Stalls the CPU for at least the given number of ACPI PM timer ticks.
+
+  @param  TimerPort The I/O port of the ACPI PM timer.
+  @param  Delay     A period of time to delay in ticks.
+
+**/
+STATIC
+VOID
+InternalAcpiDelay (
+  IN      UINT32  TimerPort,
+  IN      UINT32  Delay
+  )
+{
+  UINT32  Ticks;
+  UINT32  Times;
+
+  //
+  // Without any time base, do not poll port 0 forever.
+  //
+  if (TimerPort == 0) {
+    return;
+  }
+
+  Times  = Delay >> 22;
+  Delay &= BIT22 - 1;
+  do {
+    //
+    // The target timer count is calculated here
+    //
+    Ticks = IoRead32 (TimerPort) + Delay;
+    Delay = BIT22;
+    //
+    // Wait until time out
+    // Delay >= 2^23 could not be handled by this function
+    // Timer wrap-arounds are handled correctly by this function
+    //
+    while (((Ticks - IoRead32 (TimerPort)) & BIT23) == 0) {
+      CpuPause ();
+    }
+  } while (Times-- > 0);
+}
+
+/**
+  Stalls the CPU for at least the given number of TSC ticks.
+
+  @param  Delay     A period of time to delay in ticks.
+
+**/
+STATIC
+VOID
+InternalTscDelay (
+  IN      UINT64  Delay
+  )
+{
+  UINT64  Start;
+
+  Start = AsmReadTsc ();
+  while (AsmReadTsc () - Start < Delay) {
+    CpuPause ();
+  }
+}
+
+/**
+  Stalls the CPU for at least the given number of microseconds.
+
+  Stalls the CPU for the number of microseconds specified by MicroSeconds.
+
+  @param  MicroSeconds  The minimum number of microseconds to delay.
+
+  @return MicroSeconds
+
+**/
+UINTN
+EFIAPI
+MicroSecondDelay (
+  IN      UINTN  MicroSeconds
+  )
+{
+  QEMU_TSC_FREQUENCY_DATA  TimeBase;
+
+  InternalGetTimeBase (&TimeBase);
+  if (TimeBase.TscFrequency == 0) {
+    InternalAcpiDelay (
+      TimeBase.AcpiTimerPort,
+      (UINT32)DivU64x32 (
+                MultU64x32 (MicroSeconds, ACPI_TIMER_FREQUENCY),
+                1000000u
+                )
+      );
+    return MicroSeconds;
+  }
+
+  InternalTscDelay (
+    DivU64x32 (
+      MultU64x64 (MicroSeconds, TimeBase.TscFrequency),
+      1000000u
+      )
+    );
+  return MicroSeconds;
+}
+
+/**
+  Stalls the CPU for at least the given number of nanoseconds.
+
+  Stalls the CPU for the number of nanoseconds specified by NanoSeconds.
+
+  @param  NanoSeconds The minimum number of nanoseconds to delay.
+
+  @return NanoSeconds
+
+**/
+UINTN
+EFIAPI
+NanoSecondDelay (
+  IN      UINTN  NanoSeconds
+  )
+{
+  QEMU_TSC_FREQUENCY_DATA  TimeBase;
+
+  InternalGetTimeBase (&TimeBase);
+  if (TimeBase.TscFrequency == 0) {
+    InternalAcpiDelay (
+      TimeBase.AcpiTimerPort,
+      (UINT32)DivU64x32 (
+                MultU64x32 (NanoSeconds, ACPI_TIMER_FREQUENCY),
+                1000000000u
+                )
+      );
+    return NanoSeconds;
+  }
+
+  InternalTscDelay (
+    DivU64x32 (
+      MultU64x64 (NanoSeconds, TimeBase.TscFrequency),
+      1000000000u
+      )
+    );
+  return NanoSeconds;
+}
+
+/**
+  Retrieves the current value of a 64-bit free running performance counter.
+
+  Retrieves the current value of a 64-bit free running performance counter. The
+  counter can either count up by 1 or count down by 1. If the physical
+  performance counter counts by a larger increment, then the counter values
+  must be translated. The properties of the counter can be retrieved from
+  GetPerformanceCounterProperties().
+
+  @return The current value of the free running performance counter.
+
+**/
+UINT64
+EFIAPI
+GetPerformanceCounter (
+  VOID
+  )
+{
+  QEMU_TSC_FREQUENCY_DATA  TimeBase;
+
+  InternalGetTimeBase (&TimeBase);
+  if (TimeBase.TscFrequency == 0) {
+    return IoRead32 (TimeBase.AcpiTimerPort);
+  }
+
+  return AsmReadTsc ();
+}
+
+/**
+  Retrieves the 64-bit frequency in Hz and the range of performance counter
+  values.
+
+  If StartValue is not NULL, then the value that the performance counter starts
+  with immediately after is it rolls over is returned in StartValue. If
+  EndValue is not NULL, then the value that the performance counter end with
+  immediately before it rolls over is returned in EndValue. The 64-bit
+  frequency of the performance counter in Hz is always returned. If StartValue
+  is less than EndValue, then the performance counter counts up. If StartValue
+  is greater than EndValue, then the performance counter counts down. For
+  example, a 64-bit free running counter that counts up would have a StartValue
+  of 0 and an EndValue of 0xFFFFFFFFFFFFFFFF. A 24-bit free running counter
+  that counts down would have a StartValue of 0xFFFFFF and an EndValue of 0.
+
+  @param  StartValue  The value the performance counter starts with when it
+                      rolls over.
+  @param  EndValue    The value that the performance counter ends with before
+                      it rolls over.
+
+  @return The frequency in Hz.
+
+**/
+UINT64
+EFIAPI
+GetPerformanceCounterProperties (
+  OUT      UINT64  *StartValue   OPTIONAL,
+  OUT      UINT64  *EndValue     OPTIONAL
+  )
+{
+  QEMU_TSC_FREQUENCY_DATA  TimeBase;
+
+  InternalGetTimeBase (&TimeBase);
+
+  if (StartValue != NULL) {
+    *StartValue = 0;
+  }
+
+  if (EndValue != NULL) {
+    *EndValue = (TimeBase.TscFrequency == 0) ? ACPI_TIMER_COUNT_SIZE - 1 : MAX_UINT64;
+  }
+
+  return (TimeBase.TscFrequency == 0) ? ACPI_TIMER_FREQUENCY : TimeBase.TscFrequency;
+}
+
+/**
+  Converts elapsed ticks of performance counter to time in nanoseconds.
+
+  This function converts the elapsed ticks of running performance counter to
+  time value in unit of nanoseconds.
+
+  @param  Ticks     The number of elapsed ticks of running performance counter.
+
+  @return The elapsed time in nanoseconds.
+
+**/
+UINT64
+EFIAPI
+GetTimeInNanoSecond (
+  IN      UINT64  Ticks
+  )
+{
+  UINT64  Frequency;
+  UINT64  NanoSeconds;
+  UINT64  Remainder;
+
+  Frequency = GetPerformanceCounterProperties (NULL, NULL);
+
+  //
+  //          Ticks
+  // Time = --------- x 1,000,000,000
+  //        Frequency
+  //
+  NanoSeconds = MultU64x32 (DivU64x64Remainder (Ticks, Frequency, &Remainder), 1000000000u);
+
+  //
+  // Frequency < 0x400000000 (about 17 GHz), so Remainder < 0x400000000, then
+  // (Remainder * 1,000,000,000) will not overflow 64-bit.
+  //
+  NanoSeconds += DivU64x64Remainder (MultU64x32 (Remainder, 1000000000u), Frequency, NULL);
+
+  return NanoSeconds;
+}
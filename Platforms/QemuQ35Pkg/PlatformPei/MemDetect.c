@@ -18,6 +18,7 @@
 #include <PiPei.h>
 #include <Register/Intel/SmramSaveStateMap.h>
 #include <Guid/SmramMemoryReserve.h>
+#include <Guid/QemuE820Map.h>
 
 //
 // The Library classes this module consumes
@@ -47,6 +48,13 @@ BOOLEAN  mQ35SmramAtDefaultSmbase;
 
 UINT32  mQemuUc32Base;
 
+//
+// The outcome of the first GetE820Map() call. The map itself is not cached by
+// address, because the HOB list moves to permanent memory in
+// PublishPeiMemory().
+//
+STATIC EFI_STATUS  mE820MapStatus = EFI_NOT_STARTED;
+
 VOID
 Q35TsegMbytesInitialization (
   VOID
@@ -190,6 +198,81 @@ QemuUc32BaseInitialization (
   }
 }
 
+/**
+  Fetch QEMU's fw_cfg E820 map.
+
+  The first call reads the "etc/e820" fw_cfg file in a single transfer (which
+  QemuFwCfgReadBytes() performs with DMA, if the host supports it), and caches
+  it in a gQemuE820MapGuid HOB. Later calls, and later phases, are served from
+  the HOB.
+
+  @param[out] Map  On success, the cached E820 map.
+
+  @retval EFI_SUCCESS           The map is available in Map.
+
+  @retval EFI_PROTOCOL_ERROR    The map was found, but its size wasn't a whole
+                                multiple of sizeof(EFI_E820_ENTRY64).
+
+  @retval EFI_OUT_OF_RESOURCES  The map does not fit in a HOB.
+
+  @return                       Error codes from QemuFwCfgFindFile().
+**/
+STATIC
+EFI_STATUS
+GetE820Map (
+  OUT CONST QEMU_E820_MAP  **Map
+  )
+{
+  EFI_HOB_GUID_TYPE     *GuidHob;
+  FIRMWARE_CONFIG_ITEM  FwCfgItem;
+  UINTN                 FwCfgSize;
+  UINTN                 HobSize;
+  QEMU_E820_MAP         *NewMap;
+
+  if (mE820MapStatus != EFI_NOT_STARTED) {
+    if (EFI_ERROR (mE820MapStatus)) {
+      return mE820MapStatus;
+    }
+
+    GuidHob = GetFirstGuidHob (&gQemuE820MapGuid);
+    ASSERT (GuidHob != NULL);
+    *Map = GET_GUID_HOB_DATA (GuidHob);
+    return EFI_SUCCESS;
+  }
+
+  mE820MapStatus = QemuFwCfgFindFile ("etc/e820", &FwCfgItem, &FwCfgSize);
+  if (EFI_ERROR (mE820MapStatus)) {
+    return mE820MapStatus;
+  }
+
+  if (FwCfgSize % sizeof (EFI_E820_ENTRY64) != 0) {
+    mE820MapStatus = EFI_PROTOCOL_ERROR;
+    return mE820MapStatus;
+  }
+
+  HobSize = sizeof (QEMU_E820_MAP) + FwCfgSize;
+  if (HobSize > 0xFFF8 - sizeof (EFI_HOB_GUID_TYPE)) {
+    mE820MapStatus = EFI_OUT_OF_RESOURCES;
+    return mE820MapStatus;
+  }
+
+  NewMap = BuildGuidHob (&gQemuE820MapGuid, HobSize);
+  if (NewMap == NULL) {
+    mE820MapStatus = EFI_OUT_OF_RESOURCES;
+    return mE820MapStatus;
+  }
+
+  NewMap->Count    = (UINT32)(FwCfgSize / sizeof (EFI_E820_ENTRY64));
+  NewMap->Reserved = 0;
+  QemuFwCfgSelectItem (FwCfgItem);
+  QemuFwCfgReadBytes (FwCfgSize, NewMap + 1);
+
+  DEBUG ((DEBUG_INFO, "%a: %u entries\n", __FUNCTION__, NewMap->Count));
+
+  *Map = NewMap;
+  return mE820MapStatus;
+}
+
 /**
   Iterate over the RAM entries in QEMU's fw_cfg E820 RAM map that start outside
   of the 32-bit address range.
@@ -213,8 +296,8 @@ QemuUc32BaseInitialization (
                               whole multiple of sizeof(EFI_E820_ENTRY64). No
                               RAM entry was processed.
 
-  @return                     Error codes from QemuFwCfgFindFile(). No RAM
-                              entry was processed.
+  @return                     Error codes from GetE820Map(). No RAM entry
+                              was processed.
 **/
 STATIC
 EFI_STATUS
@@ -224,21 +307,16 @@ ScanOrAdd64BitE820Ram (
   OUT UINT64  *MaxAddress OPTIONAL
   )
 {
-  EFI_STATUS            Status;
-  FIRMWARE_CONFIG_ITEM  FwCfgItem;
-  UINTN                 FwCfgSize;
-  EFI_E820_ENTRY64      E820Entry;
-  UINTN                 Processed;
+  EFI_STATUS              Status;
+  CONST QEMU_E820_MAP     *Map;
+  CONST EFI_E820_ENTRY64  *E820Entry;
+  UINT32                  Processed;
 
-  Status = QemuFwCfgFindFile ("etc/e820", &FwCfgItem, &FwCfgSize);
+  Status = GetE820Map (&Map);
   if (EFI_ERROR (Status)) {
     return Status;
   }
 
-  if (FwCfgSize % sizeof E820Entry != 0) {
-    return EFI_PROTOCOL_ERROR;
-  }
-
   if (LowMemory != NULL) {
     *LowMemory = 0;
   }
@@ -247,27 +325,26 @@ ScanOrAdd64BitE820Ram (
     *MaxAddress = BASE_4GB;
   }
 
-  QemuFwCfgSelectItem (FwCfgItem);
-  for (Processed = 0; Processed < FwCfgSize; Processed += sizeof E820Entry) {
-    QemuFwCfgReadBytes (sizeof E820Entry, &E820Entry);
+  E820Entry = QEMU_E820_MAP_ENTRIES (Map);
+  for (Processed = 0; Processed < Map->Count; Processed++, E820Entry++) {
     DEBUG ((
       DEBUG_VERBOSE,
       "%a: Base=0x%Lx Length=0x%Lx Type=%u\n",
       __FUNCTION__,
-      E820Entry.BaseAddr,
-      E820Entry.Length,
-      E820Entry.Type
+      E820Entry->BaseAddr,
+      E820Entry->Length,
+      E820Entry->Type
       ));
-    if (E820Entry.Type == EfiAcpiAddressRangeMemory) {
-      if (AddHighHob && (E820Entry.BaseAddr >= BASE_4GB)) {
+    if (E820Entry->Type == EfiAcpiAddressRangeMemory) {
+      if (AddHighHob && (E820Entry->BaseAddr >= BASE_4GB)) {
         UINT64  Base;
         UINT64  End;
 
         //
         // Round up the start address, and round down the end address.
         //
-        Base = ALIGN_VALUE (E820Entry.BaseAddr, (UINT64)EFI_PAGE_SIZE);
-        End  = (E820Entry.BaseAddr + E820Entry.Length) &
+        Base = ALIGN_VALUE (E820Entry->BaseAddr, (UINT64)EFI_PAGE_SIZE);
+        End  = (E820Entry->BaseAddr + E820Entry->Length) &
                ~(UINT64)EFI_PAGE_MASK;
         if (Base < End) {
           AddMemoryRangeHob (Base, End);
@@ -284,7 +361,7 @@ ScanOrAdd64BitE820Ram (
       if (MaxAddress || LowMemory) {
         UINT64  Candidate;
 
-        Candidate = E820Entry.BaseAddr + E820Entry.Length;
+        Candidate = E820Entry->BaseAddr + E820Entry->Length;
         if (MaxAddress && (Candidate > *MaxAddress)) {
           *MaxAddress = Candidate;
           DEBUG ((
@@ -635,6 +712,14 @@ GetPeiMemoryCap (
                (PdpEntries + 1) * Pml4Entries + 1;
   ASSERT (TotalPages <= 0x40201);
 
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: Page1GSupport=%d PageTablePages=0x%Lx\n",
+    __func__,
+    Page1GSupport,
+    (UINT64)TotalPages
+    ));
+
   //
   // Add 64 MB for miscellaneous allocations. Note that for
   // mPhysMemAddressWidth values close to 36, the cap will actually be
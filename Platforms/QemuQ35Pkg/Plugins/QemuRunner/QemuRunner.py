@@ -12,6 +12,9 @@ import datetime
 import re
 import io
 import shutil
+import subprocess
+import tempfile
+import time
 from pathlib import Path
 from edk2toolext.environment.plugintypes import uefi_helper_plugin
 from edk2toollib import utility_functions
@@ -46,6 +49,43 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
         return ver_str.split('.')
 
 
+    @staticmethod
+    def StartVirtiofsd(env, shared_dir, socket_path):
+        ''' Starts virtiofsd to share a host directory with a vhost-user-fs device '''
+        virtiofsd = env.GetValue("VIRTIOFSD_PATH", "virtiofsd")
+        if os.path.exists(socket_path):
+            os.remove(socket_path)
+
+        cmd = [virtiofsd, f"--socket-path={socket_path}", f"--shared-dir={shared_dir}",
+               "--cache=auto", "--sandbox=none"]
+        try:
+            process = subprocess.Popen(cmd)
+        except OSError as e:
+            logging.warning(f"Failed to start {virtiofsd}: {e}")
+            return None
+
+        # QEMU fails to start if the socket is not there yet
+        for _ in range(50):
+            if os.path.exists(socket_path):
+                return process
+            if process.poll() is not None:
+                break
+            time.sleep(0.1)
+
+        logging.warning(f"{virtiofsd} did not create {socket_path}")
+        process.kill()
+        process.wait()
+        return None
+
+    @staticmethod
+    def StopVirtiofsd(process, socket_path):
+        ''' Stops virtiofsd and removes its socket '''
+        process.terminate()
+        process.wait()
+        if os.path.exists(socket_path):
+            os.remove(socket_path)
+
+
     @staticmethod
     def Runner(env):
         ''' Runs QEMU '''
@@ -92,7 +132,7 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
         path_to_os = env.GetValue("PATH_TO_OS")
         if path_to_os is not None:
             # Potentially dealing with big daddy, give it more juice...
-            args += " -m 8192"
+            memory_size = 8192
 
             file_extension = Path(path_to_os).suffix.lower().replace('"', '')
 
@@ -111,7 +151,8 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
                 args += f" -drive file=\"{path_to_os}\",format={storage_format},if=none,id=os_nvme"
                 args += " -device nvme,serial=nvme-1,drive=os_nvme"
         else:
-            args += " -m 2048"
+            memory_size = 2048
+        args += f" -m {memory_size}"
 
         cpu_model = env.GetValue("CPU_MODEL")
         if cpu_model is None:
@@ -170,12 +211,25 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
 
         # If DFCI_VAR_STORE is enabled, don't enable the Virtual Drive
         dfci_var_store = env.GetValue("DFCI_VAR_STORE")
+        virtiofsd = None
+        socket_path = None
         if dfci_var_store is None:
             # Mount disk with startup.nsh
             if os.path.isfile(VirtualDrive):
                 args += f" -drive file={VirtualDrive},if=virtio"
             elif os.path.isdir(VirtualDrive):
-                args += f" -drive file=fat:rw:{VirtualDrive},format=raw,media=disk"
+                if (env.GetValue("VIRTIO_FS", "FALSE").upper() == "TRUE") and os.name != 'nt':
+                    socket_path = os.path.join(tempfile.gettempdir(), f"virtiofsd-{os.getpid()}.sock")
+                    virtiofsd = QemuRunner.StartVirtiofsd(env, VirtualDrive, socket_path)
+
+                if virtiofsd is not None:
+                    # vhost-user devices need guest RAM that virtiofsd can map
+                    args += f" -object memory-backend-memfd,id=mem,size={memory_size}M,share=on"
+                    args += " -numa node,memdev=mem"
+                    args += f" -chardev socket,id=virtiofs0,path={socket_path}"
+                    args += " -device vhost-user-fs-pci,chardev=virtiofs0,tag=VirtualDrive"
+                else:
+                    args += f" -drive file=fat:rw:{VirtualDrive},format=raw,media=disk"
             else:
                 logging.critical("Virtual Drive Path Invalid")
 
@@ -240,28 +294,33 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
             except Exception:
                 std_handle = None
 
-        # Run QEMU
+        # Stop virtiofsd and remove its socket, even if the run fails or is interrupted
         try:
-            ret = utility_functions.RunCmd(executable, args)
-        except KeyboardInterrupt:
-            logging.critical("QEMU run interrupted by user (ctrl+c).")
-            ret = -1
-
-        ## TODO: restore the customized RunCmd once unit tests with asserts are figured out
-        if ret == 0xc0000005:
-            ret = 0
-
-        ## TODO: remove this once we upgrade to newer QEMU
-        if ret == 0x8B and qemu_version[0] == '4':
-            # QEMU v4 will return segmentation fault when shutting down.
-            # Tested same FDs on QEMU 6 and 7, not observing the same.
-            ret = 0
-
-        if os.name == 'nt' and qemu_version[0] >= '8' and std_handle is not None:
-            # Restore the console mode for Windows on QEMU v8+.
-            std_handle.SetConsoleMode(console_mode)
-        elif os.name != 'nt':
-            # Linux version of QEMU will mess with the print if its run failed, let's just restore it anyway
-            utility_functions.RunCmd('stty', 'sane', capture=False)
+            # Run QEMU
+            try:
+                ret = utility_functions.RunCmd(executable, args)
+            except KeyboardInterrupt:
+                logging.critical("QEMU run interrupted by user (ctrl+c).")
+                ret = -1
+
+            ## TODO: restore the customized RunCmd once unit tests with asserts are figured out
+            if ret == 0xc0000005:
+                ret = 0
+
+            ## TODO: remove this once we upgrade to newer QEMU
+            if ret == 0x8B and qemu_version[0] == '4':
+                # QEMU v4 will return segmentation fault when shutting down.
+                # Tested same FDs on QEMU 6 and 7, not observing the same.
+                ret = 0
+
+            if os.name == 'nt' and qemu_version[0] >= '8' and std_handle is not None:
+                # Restore the console mode for Windows on QEMU v8+.
+                std_handle.SetConsoleMode(console_mode)
+            elif os.name != 'nt':
+                # Linux version of QEMU will mess with the print if its run failed, let's just restore it anyway
+                utility_functions.RunCmd('stty', 'sane', capture=False)
+        finally:
+            if virtiofsd is not None:
+                QemuRunner.StopVirtiofsd(virtiofsd, socket_path)
 
         return ret
@@ -46,9 +46,14 @@ typedef struct {
     UINT32                        Size;
   }                             FwCfgItem[2];
   UINT32          Size;
-  UINT8           *Data;
+  UINT8           *Data;    // NULL until the first read, see FetchBlob()
 } KERNEL_BLOB;
 
+//
+// Blobs are transferred from fw_cfg in chunks of this size.
+//
+#define KERNEL_BLOB_CHUNK_SIZE  SIZE_32MB
+
 STATIC KERNEL_BLOB  mKernelBlob[KernelBlobTypeMax] = {
   {
     L"kernel",
@@ -71,6 +76,156 @@ STATIC KERNEL_BLOB  mKernelBlob[KernelBlobTypeMax] = {
 
 STATIC UINT64  mTotalBlobBytes;
 
+//
+// Utility functions.
+//
+
+/**
+  Read the size of a blob in mKernelBlob from fw_cfg.
+
+  param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob whose
+                      Size fields are to be filled from fw_cfg.
+**/
+STATIC
+VOID
+FetchBlobSize (
+  IN OUT KERNEL_BLOB  *Blob
+  )
+{
+  UINTN  Idx;
+
+  Blob->Size = 0;
+  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
+    if (Blob->FwCfgItem[Idx].SizeKey == 0) {
+      break;
+    }
+
+    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].SizeKey);
+    Blob->FwCfgItem[Idx].Size = QemuFwCfgRead32 ();
+    Blob->Size               += Blob->FwCfgItem[Idx].Size;
+  }
+}
+
+/**
+  Read the contents of a blob in mKernelBlob from fw_cfg, and verify them.
+
+  The fw_cfg items of the blob are transferred in chunks of
+  KERNEL_BLOB_CHUNK_SIZE bytes, directly into Buffer. With the DMA interface,
+  each chunk is a single transfer; the chunk size only bounds the bounce
+  buffer that the IOMMU needs under SEV.
+
+  param[in] Blob     Pointer to the KERNEL_BLOB element in mKernelBlob, with
+                     the Size fields populated by FetchBlobSize().
+
+  param[out] Buffer  The buffer to read the blob into; at least Blob->Size
+                     bytes in size.
+
+  @return  Status codes from VerifyBlob().
+**/
+STATIC
+EFI_STATUS
+ReadBlob (
+  IN  CONST KERNEL_BLOB  *Blob,
+  OUT UINT8              *Buffer
+  )
+{
+  UINT32  Left;
+  UINTN   Idx;
+  UINT8   *ChunkData;
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: loading %Ld bytes for \"%s\"\n",
+    __FUNCTION__,
+    (INT64)Blob->Size,
+    Blob->Name
+    ));
+
+  ChunkData = Buffer;
+  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
+    if (Blob->FwCfgItem[Idx].DataKey == 0) {
+      break;
+    }
+
+    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].DataKey);
+
+    Left = Blob->FwCfgItem[Idx].Size;
+    while (Left > 0) {
+      UINT32  Chunk;
+
+      Chunk = MIN (Left, KERNEL_BLOB_CHUNK_SIZE);
+      QemuFwCfgReadBytes (Chunk, ChunkData + Blob->FwCfgItem[Idx].Size - Left);
+      Left -= Chunk;
+      DEBUG ((
+        DEBUG_VERBOSE,
+        "%a: %Ld bytes remaining for \"%s\" (%d)\n",
+        __FUNCTION__,
+        (INT64)Left,
+        Blob->Name,
+        (INT32)Idx
+        ));
+    }
+
+    ChunkData += Blob->FwCfgItem[Idx].Size;
+  }
+
+  return VerifyBlob (Blob->Name, Buffer, Blob->Size);
+}
+
+/**
+  Populate the contents of a blob in mKernelBlob, unless they have been
+  populated already.
+
+  The contents are fetched on the first read from the blob, rather than when
+  the driver starts, so that blobs that are never read (or are read only
+  through InitrdLoadFile2()) don't cost a copy.
+
+  param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob that is
+                      to be filled from fw_cfg.
+
+  @retval EFI_SUCCESS           Blob has been populated. If fw_cfg reported a
+                                size of zero for the blob, then Blob->Data has
+                                been left unchanged.
+
+  @retval EFI_OUT_OF_RESOURCES  Failed to allocate memory for Blob->Data.
+
+  @return                       Status codes from VerifyBlob().
+**/
+STATIC
+EFI_STATUS
+FetchBlob (
+  IN OUT KERNEL_BLOB  *Blob
+  )
+{
+  UINT8       *Data;
+  EFI_STATUS  Status;
+
+  if ((Blob->Data != NULL) || (Blob->Size == 0)) {
+    return EFI_SUCCESS;
+  }
+
+  Data = AllocatePages (EFI_SIZE_TO_PAGES ((UINTN)Blob->Size));
+  if (Data == NULL) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: failed to allocate %Ld bytes for \"%s\"\n",
+      __FUNCTION__,
+      (INT64)Blob->Size,
+      Blob->Name
+      ));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = ReadBlob (Blob, Data);
+  if (EFI_ERROR (Status)) {
+    FreePages (Data, EFI_SIZE_TO_PAGES ((UINTN)Blob->Size));
+    return Status;
+  }
+
+  Blob->Data = Data;
+  return EFI_SUCCESS;
+}
+
 //
 // Device path for the handle that incorporates our "EFI stub filesystem".
 //
@@ -355,9 +510,10 @@ StubFileRead (
   OUT VOID              *Buffer
   )
 {
-  STUB_FILE          *StubFile;
-  CONST KERNEL_BLOB  *Blob;
-  UINT64             Left;
+  STUB_FILE    *StubFile;
+  KERNEL_BLOB  *Blob;
+  UINT64       Left;
+  EFI_STATUS   Status;
 
   StubFile = STUB_FILE_FROM_FILE (This);
 
@@ -365,8 +521,6 @@ StubFileRead (
   // Scanning the root directory?
   //
   if (StubFile->BlobType == KernelBlobTypeMax) {
-    EFI_STATUS  Status;
-
     if (StubFile->Position == KernelBlobTypeMax) {
       //
       // Scanning complete.
@@ -401,7 +555,12 @@ StubFileRead (
     *BufferSize = (UINTN)Left;
   }
 
-  if (Blob->Data != NULL) {
+  if (*BufferSize > 0) {
+    Status = FetchBlob (Blob);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
     CopyMem (Buffer, Blob->Data + StubFile->Position, *BufferSize);
   }
 
@@ -884,6 +1043,7 @@ InitrdLoadFile2 (
   )
 {
   CONST KERNEL_BLOB  *InitrdBlob = &mKernelBlob[KernelBlobTypeInitrd];
+  EFI_STATUS         Status;
 
   ASSERT (InitrdBlob->Size > 0);
 
@@ -906,7 +1066,18 @@ InitrdLoadFile2 (
     return EFI_BUFFER_TOO_SMALL;
   }
 
-  CopyMem (Buffer, InitrdBlob->Data, InitrdBlob->Size);
+  if (InitrdBlob->Data != NULL) {
+    CopyMem (Buffer, InitrdBlob->Data, InitrdBlob->Size);
+  } else {
+    //
+    // Stream the initrd from fw_cfg directly into the caller's buffer, rather
+    // than keeping a copy of our own.
+    //
+    Status = ReadBlob (InitrdBlob, Buffer);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
 
   *BufferSize = InitrdBlob->Size;
   return EFI_SUCCESS;
@@ -916,112 +1087,14 @@ STATIC CONST EFI_LOAD_FILE2_PROTOCOL  mInitrdLoadFile2 = {
   InitrdLoadFile2,
 };
 
-//
-// Utility functions.
-//
-
-/**
-  Populate a blob in mKernelBlob.
-
-  param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob that is
-                      to be filled from fw_cfg.
-
-  @retval EFI_SUCCESS           Blob has been populated. If fw_cfg reported a
-                                size of zero for the blob, then Blob->Data has
-                                been left unchanged.
-
-  @retval EFI_OUT_OF_RESOURCES  Failed to allocate memory for Blob->Data.
-**/
-STATIC
-EFI_STATUS
-FetchBlob (
-  IN OUT KERNEL_BLOB  *Blob
-  )
-{
-  UINT32  Left;
-  UINTN   Idx;
-  UINT8   *ChunkData;
-
-  //
-  // Read blob size.
-  //
-  Blob->Size = 0;
-  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
-    if (Blob->FwCfgItem[Idx].SizeKey == 0) {
-      break;
-    }
-
-    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].SizeKey);
-    Blob->FwCfgItem[Idx].Size = QemuFwCfgRead32 ();
-    Blob->Size               += Blob->FwCfgItem[Idx].Size;
-  }
-
-  if (Blob->Size == 0) {
-    return EFI_SUCCESS;
-  }
-
-  //
-  // Read blob.
-  //
-  Blob->Data = AllocatePool (Blob->Size);
-  if (Blob->Data == NULL) {
-    DEBUG ((
-      DEBUG_ERROR,
-      "%a: failed to allocate %Ld bytes for \"%s\"\n",
-      __FUNCTION__,
-      (INT64)Blob->Size,
-      Blob->Name
-      ));
-    return EFI_OUT_OF_RESOURCES;
-  }
-
-  DEBUG ((
-    DEBUG_INFO,
-    "%a: loading %Ld bytes for \"%s\"\n",
-    __FUNCTION__,
-    (INT64)Blob->Size,
-    Blob->Name
-    ));
-
-  ChunkData = Blob->Data;
-  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
-    if (Blob->FwCfgItem[Idx].DataKey == 0) {
-      break;
-    }
-
-    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].DataKey);
-
-    Left = Blob->FwCfgItem[Idx].Size;
-    while (Left > 0) {
-      UINT32  Chunk;
-
-      Chunk = (Left < SIZE_1MB) ? Left : SIZE_1MB;
-      QemuFwCfgReadBytes (Chunk, ChunkData + Blob->FwCfgItem[Idx].Size - Left);
-      Left -= Chunk;
-      DEBUG ((
-        DEBUG_VERBOSE,
-        "%a: %Ld bytes remaining for \"%s\" (%d)\n",
-        __FUNCTION__,
-        (INT64)Left,
-        Blob->Name,
-        (INT32)Idx
-        ));
-    }
-
-    ChunkData += Blob->FwCfgItem[Idx].Size;
-  }
-
-  return EFI_SUCCESS;
-}
-
 //
 // The entry point of the feature.
 //
 
 /**
-  Download the kernel, the initial ramdisk, and the kernel command line from
+  Look up the kernel, the initial ramdisk, and the kernel command line in
   QEMU's fw_cfg. Construct a minimal SimpleFileSystem that contains the two
-  image files.
+  image files. The contents of the files are downloaded on first access.
 
   @retval EFI_NOT_FOUND         Kernel image was not found.
   @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
@@ -1056,22 +1129,18 @@ QemuKernelLoaderFsDxeEntrypoint (
   }
 
   //
-  // Fetch all blobs.
+  // Fetch the sizes of all blobs; the contents are fetched by FetchBlob() or
+  // InitrdLoadFile2(). Empty blobs have no contents to fetch, so verify them
+  // right away.
   //
   for (BlobType = 0; BlobType < KernelBlobTypeMax; ++BlobType) {
     CurrentBlob = &mKernelBlob[BlobType];
-    Status      = FetchBlob (CurrentBlob);
-    if (EFI_ERROR (Status)) {
-      goto FreeBlobs;
-    }
-
-    Status = VerifyBlob (
-               CurrentBlob->Name,
-               CurrentBlob->Data,
-               CurrentBlob->Size
-               );
-    if (EFI_ERROR (Status)) {
-      goto FreeBlobs;
+    FetchBlobSize (CurrentBlob);
+    if (CurrentBlob->Size == 0) {
+      Status = VerifyBlob (CurrentBlob->Name, NULL, 0);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
     }
 
     mTotalBlobBytes += CurrentBlob->Size;
@@ -1079,9 +1148,8 @@ QemuKernelLoaderFsDxeEntrypoint (
 
   KernelBlob = &mKernelBlob[KernelBlobTypeKernel];
 
-  if (KernelBlob->Data == NULL) {
-    Status = EFI_NOT_FOUND;
-    goto FreeBlobs;
+  if (KernelBlob->Size == 0) {
+    return EFI_NOT_FOUND;
   }
 
   //
@@ -1104,7 +1172,7 @@ QemuKernelLoaderFsDxeEntrypoint (
       __FUNCTION__,
       Status
       ));
-    goto FreeBlobs;
+    return Status;
   }
 
   if (KernelBlob[KernelBlobTypeInitrd].Size > 0) {
@@ -1141,15 +1209,5 @@ UninstallFileSystemHandle:
                   );
   ASSERT_EFI_ERROR (Status);
 
-FreeBlobs:
-  while (BlobType > 0) {
-    CurrentBlob = &mKernelBlob[--BlobType];
-    if (CurrentBlob->Data != NULL) {
-      FreePool (CurrentBlob->Data);
-      CurrentBlob->Size = 0;
-      CurrentBlob->Data = NULL;
-    }
-  }
-
   return Status;
 }
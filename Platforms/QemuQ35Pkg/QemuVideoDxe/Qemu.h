@@ -75,6 +75,13 @@ typedef struct {
 
 #define GRAPHICS_OUTPUT_INVALID_MODE_NUMBER  0xffff
 
+//
+// Delay between the first Blt() that modifies the shadow frame buffer, and
+// the copying of the modified region to the frame buffer. Blt() calls within
+// this period are coalesced into a single copy.
+//
+#define QEMU_VIDEO_SHADOW_FLUSH_DELAY  EFI_TIMER_PERIOD_MILLISECONDS (20)
+
 //
 // QEMU Video Private Data Structure
 //
@@ -113,6 +120,26 @@ typedef struct {
   UINTN                           FrameBufferBltConfigureSize;
   UINT8                           FrameBufferVramBarIndex;
 
+  //
+  // System memory copy of the frame buffer, in the same pixel format, used if
+  // PcdVideoShadowFrameBuffer is TRUE. Blt() operates on the shadow, and
+  // extends the dirty rectangle [DirtyLeft, DirtyRight) x [DirtyTop,
+  // DirtyBottom) to cover what it modified. The dirty rectangle is copied to
+  // the frame buffer when ShadowFlushTimer expires, and at SetMode(). At
+  // ExitBootServices(), the shadow is flushed and then abandoned.
+  //
+  UINT8                           *Shadow;
+  UINTN                           ShadowPages;
+  FRAME_BUFFER_CONFIGURE          *ShadowBltConfigure;
+  UINTN                           ShadowBltConfigureSize;
+  EFI_EVENT                       ShadowFlushTimer;
+  EFI_EVENT                       ShadowExitBootServices;
+  BOOLEAN                         ShadowDirty;
+  UINTN                           DirtyLeft;
+  UINTN                           DirtyTop;
+  UINTN                           DirtyRight;
+  UINTN                           DirtyBottom;
+
   UINT8                           Edid[128];
 } QEMU_VIDEO_PRIVATE_DATA;
 
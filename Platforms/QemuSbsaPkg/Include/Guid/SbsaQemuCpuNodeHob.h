@@ -0,0 +1,50 @@
+/** @file
+  Cpu node HOB passed by PEI into DXE.
+
+  Describes every cpu node found in the device tree, including its location in
+  the processor hierarchy, so that the DXE users of FdtHelperLib can look cpus
+  up by index without walking the device tree.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef SBSA_QEMU_CPU_NODE_HOB_H_
+#define SBSA_QEMU_CPU_NODE_HOB_H_
+
+#define QEMU_SBSA_PKG_CPU_NODE_HOB_GUID \
+  { 0xd49b33fb, 0x1bab, 0x49a8, { 0xb1, 0x62, 0x84, 0x77, 0xd3, 0xbd, 0x2f, 0x5c } }
+
+//
+// The HOB data is an array of SBSAQEMU_CPU_NODE, one entry per /cpus subnode
+// with device_type "cpu", in device tree order. The number of entries follows
+// from the HOB data size.
+//
+// The location comes from the /cpus/cpu-map node, where every socket, cluster,
+// core and thread node gets an identifier that is unique across the whole map;
+// nested clusters are flattened to the innermost one. If cpu-map does not
+// place every cpu, all cpus take their location from the MPIDR affinity
+// fields instead.
+//
+typedef struct {
+  ///
+  /// Value of the reg property.
+  ///
+  UINT64    Mpidr;
+  ///
+  /// Value of the numa-node-id property, 0 when the node has none.
+  ///
+  UINT32    NumaNodeId;
+  ///
+  /// Location of the cpu in the processor hierarchy.
+  ///
+  UINT32    SocketId;
+  UINT32    ClusterId;
+  UINT32    CoreId;
+  UINT32    ThreadId;
+} SBSAQEMU_CPU_NODE;
+
+extern EFI_GUID  gQemuSbsaPkgCpuNodeHobGuid;
+
+#endif
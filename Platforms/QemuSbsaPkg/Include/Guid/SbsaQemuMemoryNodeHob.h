@@ -0,0 +1,35 @@
+/** @file
+  Memory node HOB passed by PEI into DXE.
+
+  Describes every system memory range found in the device tree together with
+  the NUMA node it belongs to, so that DXE can describe memory affinity to the
+  OS without parsing the device tree again.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef SBSA_QEMU_MEMORY_NODE_HOB_H_
+#define SBSA_QEMU_MEMORY_NODE_HOB_H_
+
+#define QEMU_SBSA_PKG_MEMORY_NODE_HOB_GUID \
+  { 0x1457a416, 0xa329, 0x4f6b, { 0x93, 0xf2, 0xec, 0xdf, 0xff, 0x8f, 0xdf, 0xb1 } }
+
+//
+// The HOB data is an array of SBSAQEMU_MEMORY_NODE, one entry per range of
+// the device tree memory nodes, sorted by ascending base address. The number
+// of entries follows from the HOB data size.
+//
+typedef struct {
+  UINT64    Base;
+  UINT64    Size;
+  ///
+  /// Value of the numa-node-id property, 0 when the node has none.
+  ///
+  UINT32    NumaNodeId;
+} SBSAQEMU_MEMORY_NODE;
+
+extern EFI_GUID  gQemuSbsaPkgMemoryNodeHobGuid;
+
+#endif
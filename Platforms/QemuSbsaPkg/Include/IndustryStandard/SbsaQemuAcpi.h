@@ -75,11 +75,6 @@ typedef struct {
 #define SBSAQEMU_L2_CACHE_SETS  1024
 #define SBSAQEMU_L2_CACHE_ASSC  8
 
-#define CLUSTER_INDEX     (sizeof (EFI_ACPI_DESCRIPTION_HEADER))
-#define L1_D_CACHE_INDEX  (CLUSTER_INDEX + sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR))
-#define L1_I_CACHE_INDEX  (L1_D_CACHE_INDEX + sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE))
-#define L2_CACHE_INDEX    (L1_I_CACHE_INDEX + sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE))
-
 #define SBSAQEMU_ACPI_PPTT_L1_D_CACHE_STRUCT  {                                \
     EFI_ACPI_6_3_PPTT_TYPE_CACHE,                                              \
     sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE),                                \
@@ -155,7 +150,9 @@ typedef struct {
     64            /* LineSize */                                               \
   }
 
-#define SBSAQEMU_ACPI_PPTT_CLUSTER_STRUCT  {                                   \
+// Templates for the PPTT processor hierarchy nodes. Lengths, parents, processor
+// IDs and private resources are filled in while the hierarchy is generated.
+#define SBSAQEMU_ACPI_PPTT_PACKAGE_STRUCT  {                                   \
     EFI_ACPI_6_3_PPTT_TYPE_PROCESSOR,                                          \
     sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR),                            \
     { EFI_ACPI_RESERVED_BYTE, EFI_ACPI_RESERVED_BYTE },                        \
@@ -171,9 +168,25 @@ typedef struct {
     0,                                        /* NumberOfPrivateResources */   \
   }
 
+#define SBSAQEMU_ACPI_PPTT_CLUSTER_STRUCT  {                                   \
+    EFI_ACPI_6_3_PPTT_TYPE_PROCESSOR,                                          \
+    sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR),                            \
+    { EFI_ACPI_RESERVED_BYTE, EFI_ACPI_RESERVED_BYTE },                        \
+    {                                                                          \
+      EFI_ACPI_6_3_PPTT_PACKAGE_NOT_PHYSICAL,     /* PhysicalPackage */        \
+      EFI_ACPI_6_3_PPTT_PROCESSOR_ID_INVALID,     /* AcpiProcessorIdValid */   \
+      EFI_ACPI_6_3_PPTT_PROCESSOR_IS_NOT_THREAD,  /* Is not a Thread */        \
+      EFI_ACPI_6_3_PPTT_NODE_IS_NOT_LEAF,         /* Not Leaf */               \
+      EFI_ACPI_6_3_PPTT_IMPLEMENTATION_IDENTICAL, /* Identical Cores */        \
+    },                                                                         \
+    0,                                        /* Parent */                     \
+    0,                                        /* AcpiProcessorId */            \
+    0,                                        /* NumberOfPrivateResources */   \
+  }
+
 #define SBSAQEMU_ACPI_PPTT_CORE_STRUCT  {                                      \
     EFI_ACPI_6_3_PPTT_TYPE_PROCESSOR,                                          \
-    (sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) + (2 * sizeof (UINT32))),  \
+    sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR),                            \
     { EFI_ACPI_RESERVED_BYTE, EFI_ACPI_RESERVED_BYTE },                        \
     {                                                                          \
       EFI_ACPI_6_3_PPTT_PACKAGE_NOT_PHYSICAL,     /* PhysicalPackage */        \
@@ -184,7 +197,23 @@ typedef struct {
     },                                                                         \
     0,                                        /* Parent */                     \
     0,                                        /* AcpiProcessorId */            \
-    2,                                        /* NumberOfPrivateResources */   \
+    0,                                        /* NumberOfPrivateResources */   \
+  }
+
+#define SBSAQEMU_ACPI_PPTT_THREAD_STRUCT  {                                    \
+    EFI_ACPI_6_3_PPTT_TYPE_PROCESSOR,                                          \
+    sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR),                            \
+    { EFI_ACPI_RESERVED_BYTE, EFI_ACPI_RESERVED_BYTE },                        \
+    {                                                                          \
+      EFI_ACPI_6_3_PPTT_PACKAGE_NOT_PHYSICAL,     /* PhysicalPackage */        \
+      EFI_ACPI_6_3_PPTT_PROCESSOR_ID_VALID,       /* AcpiProcessorValid */     \
+      EFI_ACPI_6_3_PPTT_PROCESSOR_IS_THREAD,      /* Is a Thread */            \
+      EFI_ACPI_6_3_PPTT_NODE_IS_LEAF,             /* Leaf */                   \
+      EFI_ACPI_6_3_PPTT_IMPLEMENTATION_IDENTICAL, /* Identical Cores */        \
+    },                                                                         \
+    0,                                        /* Parent */                     \
+    0,                                        /* AcpiProcessorId */            \
+    0,                                        /* NumberOfPrivateResources */   \
   }
 
 #endif
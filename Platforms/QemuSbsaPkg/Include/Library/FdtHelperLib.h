@@ -10,6 +10,8 @@
 #ifndef FDT_HELPER_LIB_
 #define FDT_HELPER_LIB_
 
+#include <Guid/SbsaQemuCpuNodeHob.h>
+
 /**
   Get MPIDR for a given cpu from device tree passed by Qemu.
 
@@ -33,4 +35,29 @@ FdtHelperCountCpus (
   VOID
   );
 
+/**
+  Get the cpu table entry for a given cpu.
+
+  @param [in]   CpuId    Index of the cpu, in device tree order.
+
+  @retval NULL           CpuId is out of range.
+  @retval Other          Pointer to the MPIDR, NUMA node and cluster of the cpu.
+**/
+CONST SBSAQEMU_CPU_NODE *
+EFIAPI
+FdtHelperGetCpuNode (
+  IN UINTN  CpuId
+  );
+
+/**
+  Parse the cpu nodes of the device tree passed by Qemu and publish them as
+  a GUID HOB, so that later phases look cpus up without parsing the device
+  tree again. Meant to be called once, from PEI.
+**/
+VOID
+EFIAPI
+FdtHelperPublishCpuNodes (
+  VOID
+  );
+
 #endif /* FDT_HELPER_LIB_ */
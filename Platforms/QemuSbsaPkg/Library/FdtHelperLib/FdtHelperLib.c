@@ -9,13 +9,360 @@
 **/
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/FdtHelperLib.h>
+#include <Library/HobLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Library/PcdLib.h>
 #include <libfdt.h>
 
-STATIC INT32  mFdtFirstCpuOffset;
-STATIC INT32  mFdtCpuNodeSize;
+#define FDT_HELPER_MPIDR_MT  BIT24
+#define FDT_HELPER_MPIDR_AFF(Mpidr, Lvl) \
+  ((UINT32)RShiftU64 ((Mpidr), ((Lvl) == 3) ? 32 : ((Lvl) * 8)) & 0xFF)
+
+//
+// SocketId of a cpu that the cpu-map walk has not placed yet
+//
+#define FDT_HELPER_UNPLACED  MAX_UINT32
+
+//
+// Levels of the processor hierarchy, indexing the identifier counters of the
+// cpu-map walk
+//
+typedef enum {
+  FdtHelperLevelSocket,
+  FdtHelperLevelCluster,
+  FdtHelperLevelCore,
+  FdtHelperLevelThread,
+  FdtHelperLevelMax
+} FDT_HELPER_TOPOLOGY_LEVEL;
+
+//
+// Cpu table, taken from the cpu node HOB or parsed on first use.
+//
+STATIC CONST SBSAQEMU_CPU_NODE  *mCpuNodes;
+STATIC UINT32                   mCpuNodeCount;
+
+/**
+  Read the MPIDR of a device tree cpu node.
+
+  @param [in]  Fdt      Pointer to the device tree blob.
+  @param [in]  CpuNode  Offset of the cpu node.
+
+  @retval UINT64  Value of the reg property, 0 when the node has none.
+**/
+STATIC
+UINT64
+ReadCpuNodeMpidr (
+  IN CONST VOID  *Fdt,
+  IN INT32       CpuNode
+  )
+{
+  CONST VOID  *Reg;
+  INT32       Len;
+
+  Reg = fdt_getprop (Fdt, CpuNode, "reg", &Len);
+  if (Reg == NULL) {
+    DEBUG ((DEBUG_ERROR, "Couldn't find reg property for cpu node %a\n", fdt_get_name (Fdt, CpuNode, NULL)));
+    return 0;
+  }
+
+  if (Len >= (INT32)sizeof (UINT64)) {
+    return fdt64_to_cpu (ReadUnaligned64 (Reg));
+  }
+
+  return fdt32_to_cpu (ReadUnaligned32 (Reg));
+}
+
+/**
+  Assign the location of the cpu referenced by a cpu-map leaf node.
+
+  @param [in]      Fdt       Pointer to the device tree blob.
+  @param [in]      Phandle   Value of the cpu property of the leaf.
+  @param [in]      Location  Socket, cluster, core and thread of the leaf.
+  @param [in, out] CpuNodes  Cpu table to update.
+  @param [in]      CpuCount  Number of entries in CpuNodes.
+
+  @retval TRUE   The referenced cpu was found, and had not been placed yet.
+  @retval FALSE  Otherwise.
+**/
+STATIC
+BOOLEAN
+PlaceCpuMapLeaf (
+  IN     CONST VOID               *Fdt,
+  IN     UINT32                   Phandle,
+  IN     CONST SBSAQEMU_CPU_NODE  *Location,
+  IN OUT SBSAQEMU_CPU_NODE        *CpuNodes,
+  IN     UINT32                   CpuCount
+  )
+{
+  INT32   CpuNode;
+  UINT64  Mpidr;
+  UINT32  Index;
+
+  CpuNode = fdt_node_offset_by_phandle (Fdt, Phandle);
+  if (CpuNode < 0) {
+    return FALSE;
+  }
+
+  Mpidr = ReadCpuNodeMpidr (Fdt, CpuNode);
+  for (Index = 0; Index < CpuCount; Index++) {
+    if (CpuNodes[Index].Mpidr == Mpidr) {
+      break;
+    }
+  }
+
+  if ((Index == CpuCount) || (CpuNodes[Index].SocketId != FDT_HELPER_UNPLACED)) {
+    return FALSE;
+  }
+
+  CpuNodes[Index].SocketId  = Location->SocketId;
+  CpuNodes[Index].ClusterId = Location->ClusterId;
+  CpuNodes[Index].CoreId    = Location->CoreId;
+  CpuNodes[Index].ThreadId  = Location->ThreadId;
+  return TRUE;
+}
+
+/**
+  Walk a level of the cpu-map node and assign the location of every cpu it
+  references.
+
+  Each socket, cluster, core and thread node gets an identifier that is unique
+  across the whole map, so nested clusters are flattened to the innermost one.
+
+  @param [in]      Fdt       Pointer to the device tree blob.
+  @param [in]      Node      Offset of the cpu-map node to walk.
+  @param [in]      Parent    Location of Node in the hierarchy.
+  @param [in, out] NextId    Next free identifier for each hierarchy level.
+  @param [in, out] CpuNodes  Cpu table to update.
+  @param [in]      CpuCount  Number of entries in CpuNodes.
+
+  @retval UINT32  Number of cpus placed below Node.
+**/
+STATIC
+UINT32
+ParseCpuMap (
+  IN     CONST VOID               *Fdt,
+  IN     INT32                    Node,
+  IN     CONST SBSAQEMU_CPU_NODE  *Parent,
+  IN OUT UINT32                   *NextId,
+  IN OUT SBSAQEMU_CPU_NODE        *CpuNodes,
+  IN     UINT32                   CpuCount
+  )
+{
+  INT32              Child;
+  CONST CHAR8        *Name;
+  CONST UINT32       *Phandle;
+  INT32              Len;
+  SBSAQEMU_CPU_NODE  Location;
+  UINT32             Placed;
+
+  Placed = 0;
+
+  for (Child = fdt_first_subnode (Fdt, Node);
+       Child >= 0;
+       Child = fdt_next_subnode (Fdt, Child))
+  {
+    Name = fdt_get_name (Fdt, Child, NULL);
+    if (Name == NULL) {
+      continue;
+    }
+
+    CopyMem (&Location, Parent, sizeof (Location));
+    if (AsciiStrnCmp (Name, "socket", 6) == 0) {
+      Location.SocketId = NextId[FdtHelperLevelSocket]++;
+    } else if (AsciiStrnCmp (Name, "cluster", 7) == 0) {
+      Location.ClusterId = NextId[FdtHelperLevelCluster]++;
+    } else if (AsciiStrnCmp (Name, "core", 4) == 0) {
+      Location.CoreId = NextId[FdtHelperLevelCore]++;
+    } else if (AsciiStrnCmp (Name, "thread", 6) == 0) {
+      Location.ThreadId = NextId[FdtHelperLevelThread]++;
+    }
+
+    Phandle = fdt_getprop (Fdt, Child, "cpu", &Len);
+    if (Phandle != NULL) {
+      if ((Len == sizeof (UINT32)) &&
+          PlaceCpuMapLeaf (Fdt, fdt32_to_cpu (ReadUnaligned32 (Phandle)), &Location, CpuNodes, CpuCount))
+      {
+        Placed++;
+      }
+    } else {
+      Placed += ParseCpuMap (Fdt, Child, &Location, NextId, CpuNodes, CpuCount);
+    }
+  }
+
+  return Placed;
+}
+
+/**
+  Derive the location of a cpu from its MPIDR affinity fields.
+
+  With the MT bit set, Aff0 numbers the threads of a core; otherwise Aff0
+  numbers the cores of a cluster.
+
+  @param [in, out] CpuNode  Cpu table entry, with Mpidr set.
+**/
+STATIC
+VOID
+SetLocationFromMpidr (
+  IN OUT SBSAQEMU_CPU_NODE  *CpuNode
+  )
+{
+  if ((CpuNode->Mpidr & FDT_HELPER_MPIDR_MT) != 0) {
+    CpuNode->ThreadId  = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 0);
+    CpuNode->CoreId    = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 1);
+    CpuNode->ClusterId = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 2);
+    CpuNode->SocketId  = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 3);
+  } else {
+    CpuNode->ThreadId  = 0;
+    CpuNode->CoreId    = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 0);
+    CpuNode->ClusterId = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 1);
+    CpuNode->SocketId  = FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 2) |
+                         (FDT_HELPER_MPIDR_AFF (CpuNode->Mpidr, 3) << 8);
+  }
+}
+
+/**
+  Parse the cpu nodes of the device tree.
+
+  Only the /cpus subnodes with device_type "cpu" are considered, so the
+  cpu-map node and any other helper node do not count as cpus. The location
+  of the cpus is taken from the cpu-map node if it places every cpu, and from
+  the MPIDR affinity fields otherwise.
+
+  @param [in]  Fdt       Pointer to the device tree blob.
+  @param [out] CpuNodes  Array receiving one entry per cpu, in device tree
+                         order. NULL to only count the cpus.
+
+  @retval UINT32  Number of cpu nodes in the device tree.
+**/
+STATIC
+UINT32
+ParseCpuNodes (
+  IN  CONST VOID         *Fdt,
+  OUT SBSAQEMU_CPU_NODE  *CpuNodes OPTIONAL
+  )
+{
+  INT32         CpusNode;
+  INT32         Node;
+  CONST CHAR8   *Type;
+  CONST UINT32       *NumaNodeId;
+  INT32              Len;
+  UINT32             CpuCount;
+  UINT32             Index;
+  UINT32             Placed;
+  UINT32             NextId[FdtHelperLevelMax];
+  SBSAQEMU_CPU_NODE  Root;
+
+  ASSERT (Fdt != NULL);
+
+  // Make sure we have a valid device tree blob
+  if (fdt_check_header (Fdt) != 0) {
+    DEBUG ((DEBUG_ERROR, "Invalid device tree blob\n"));
+    return 0;
+  }
+
+  CpusNode = fdt_path_offset (Fdt, "/cpus");
+  if (CpusNode <= 0) {
+    DEBUG ((DEBUG_ERROR, "Unable to locate /cpus in device tree\n"));
+    return 0;
+  }
+
+  CpuCount = 0;
+  for (Node = fdt_first_subnode (Fdt, CpusNode);
+       Node >= 0;
+       Node = fdt_next_subnode (Fdt, Node))
+  {
+    Type = fdt_getprop (Fdt, Node, "device_type", NULL);
+    if ((Type == NULL) || (AsciiStrCmp (Type, "cpu") != 0)) {
+      continue;
+    }
+
+    if (CpuNodes != NULL) {
+      CpuNodes[CpuCount].Mpidr = ReadCpuNodeMpidr (Fdt, Node);
+
+      NumaNodeId                    = fdt_getprop (Fdt, Node, "numa-node-id", &Len);
+      CpuNodes[CpuCount].NumaNodeId = ((NumaNodeId != NULL) && (Len == sizeof (UINT32))) ?
+                                      fdt32_to_cpu (ReadUnaligned32 (NumaNodeId)) : 0;
+      CpuNodes[CpuCount].SocketId = FDT_HELPER_UNPLACED;
+    }
+
+    CpuCount++;
+  }
+
+  if (CpuNodes == NULL) {
+    return CpuCount;
+  }
+
+  Placed = 0;
+  Node   = fdt_subnode_offset (Fdt, CpusNode, "cpu-map");
+  if (Node >= 0) {
+    ZeroMem (&Root, sizeof (Root));
+    ZeroMem (NextId, sizeof (NextId));
+    Placed = ParseCpuMap (Fdt, Node, &Root, NextId, CpuNodes, CpuCount);
+  }
+
+  if (Placed != CpuCount) {
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: cpu-map places %d of %d cpus, deriving topology from MPIDR\n",
+      __func__,
+      Placed,
+      CpuCount
+      ));
+    for (Index = 0; Index < CpuCount; Index++) {
+      SetLocationFromMpidr (&CpuNodes[Index]);
+    }
+  }
+
+  return CpuCount;
+}
+
+/**
+  Get the cpu table, taking it from the cpu node HOB when PEI published one
+  and parsing the device tree otherwise. The table is cached after the
+  first call.
+
+  @param [out] CpuNodes  Pointer to the cpu table.
+
+  @retval UINT32  Number of entries in the cpu table.
+**/
+STATIC
+UINT32
+GetCpuNodes (
+  OUT CONST SBSAQEMU_CPU_NODE  **CpuNodes
+  )
+{
+  VOID               *Hob;
+  VOID               *DeviceTreeBase;
+  SBSAQEMU_CPU_NODE  *Nodes;
+  UINT32             CpuCount;
+
+  if (mCpuNodes == NULL) {
+    Hob = GetFirstGuidHob (&gQemuSbsaPkgCpuNodeHobGuid);
+    if (Hob != NULL) {
+      mCpuNodes     = GET_GUID_HOB_DATA (Hob);
+      mCpuNodeCount = GET_GUID_HOB_DATA_SIZE (Hob) / sizeof (SBSAQEMU_CPU_NODE);
+    } else {
+      DeviceTreeBase = (VOID *)(UINTN)PcdGet64 (PcdDeviceTreeInitialBaseAddress);
+      CpuCount       = ParseCpuNodes (DeviceTreeBase, NULL);
+      Nodes          = AllocatePool (CpuCount * sizeof (SBSAQEMU_CPU_NODE));
+      if (Nodes == NULL) {
+        DEBUG ((DEBUG_ERROR, "Unable to allocate the table of %d cpus\n", CpuCount));
+        *CpuNodes = NULL;
+        return 0;
+      }
+
+      mCpuNodeCount = ParseCpuNodes (DeviceTreeBase, Nodes);
+      mCpuNodes     = Nodes;
+    }
+  }
+
+  *CpuNodes = mCpuNodes;
+  return mCpuNodeCount;
+}
 
 /**
   Get MPIDR for a given cpu from device tree passed by Qemu.
@@ -29,25 +376,15 @@ FdtHelperGetMpidr (
   IN UINTN  CpuId
   )
 {
-  VOID          *DeviceTreeBase;
-  CONST UINT64  *RegVal;
-  INT32         Len;
+  CONST SBSAQEMU_CPU_NODE  *CpuNode;
 
-  DeviceTreeBase = (VOID *)(UINTN)PcdGet64 (PcdDeviceTreeInitialBaseAddress);
-  ASSERT (DeviceTreeBase != NULL);
-
-  RegVal = fdt_getprop (
-             DeviceTreeBase,
-             mFdtFirstCpuOffset + (CpuId * mFdtCpuNodeSize),
-             "reg",
-             &Len
-             );
-  if (!RegVal) {
+  CpuNode = FdtHelperGetCpuNode (CpuId);
+  if (CpuNode == NULL) {
     DEBUG ((DEBUG_ERROR, "Couldn't find reg property for CPU:%d\n", CpuId));
     return 0;
   }
 
-  return (fdt64_to_cpu (ReadUnaligned64 (RegVal)));
+  return CpuNode->Mpidr;
 }
 
 /** Walks through the Device Tree created by Qemu and counts the number
@@ -61,41 +398,63 @@ FdtHelperCountCpus (
   VOID
   )
 {
-  VOID    *DeviceTreeBase;
-  INT32   Node;
-  INT32   Prev;
-  INT32   CpuNode;
-  UINT32  CpuCount;
+  CONST SBSAQEMU_CPU_NODE  *CpuNodes;
 
-  DeviceTreeBase = (VOID *)(UINTN)PcdGet64 (PcdDeviceTreeInitialBaseAddress);
-  ASSERT (DeviceTreeBase != NULL);
+  return GetCpuNodes (&CpuNodes);
+}
 
-  // Make sure we have a valid device tree blob
-  ASSERT (fdt_check_header (DeviceTreeBase) == 0);
+/**
+  Get the cpu table entry for a given cpu.
 
-  CpuNode = fdt_path_offset (DeviceTreeBase, "/cpus");
-  if (CpuNode <= 0) {
-    DEBUG ((DEBUG_ERROR, "Unable to locate /cpus in device tree\n"));
-    return 0;
+  @param [in]   CpuId    Index of the cpu, in device tree order.
+
+  @retval NULL           CpuId is out of range.
+  @retval Other          Pointer to the MPIDR, NUMA node and cluster of the cpu.
+**/
+CONST SBSAQEMU_CPU_NODE *
+EFIAPI
+FdtHelperGetCpuNode (
+  IN UINTN  CpuId
+  )
+{
+  CONST SBSAQEMU_CPU_NODE  *CpuNodes;
+  UINT32                   CpuCount;
+
+  CpuCount = GetCpuNodes (&CpuNodes);
+  if (CpuId >= CpuCount) {
+    return NULL;
   }
 
-  CpuCount = 0;
+  return &CpuNodes[CpuId];
+}
 
-  // Walk through /cpus node and count the number of subnodes.
-  // The count of these subnodes corresponds to the number of
-  // CPUs created by Qemu.
-  Prev               = fdt_first_subnode (DeviceTreeBase, CpuNode);
-  mFdtFirstCpuOffset = Prev;
-  while (1) {
-    CpuCount++;
-    Node = fdt_next_subnode (DeviceTreeBase, Prev);
-    if (Node < 0) {
-      break;
-    }
+/**
+  Parse the cpu nodes of the device tree passed by Qemu and publish them as
+  a GUID HOB, so that later phases look cpus up without parsing the device
+  tree again. Meant to be called once, from PEI.
+**/
+VOID
+EFIAPI
+FdtHelperPublishCpuNodes (
+  VOID
+  )
+{
+  VOID               *DeviceTreeBase;
+  SBSAQEMU_CPU_NODE  *CpuNodes;
+  UINT32             CpuCount;
 
-    mFdtCpuNodeSize = Node - Prev;
-    Prev            = Node;
+  DeviceTreeBase = (VOID *)(UINTN)PcdGet64 (PcdDeviceTreeInitialBaseAddress);
+
+  CpuCount = ParseCpuNodes (DeviceTreeBase, NULL);
+  if (CpuCount == 0) {
+    return;
   }
 
-  return CpuCount;
+  CpuNodes = BuildGuidHob (&gQemuSbsaPkgCpuNodeHobGuid, CpuCount * sizeof (SBSAQEMU_CPU_NODE));
+  if (CpuNodes == NULL) {
+    DEBUG ((DEBUG_ERROR, "Unable to publish the table of %d cpus\n", CpuCount));
+    return;
+  }
+
+  ParseCpuNodes (DeviceTreeBase, CpuNodes);
 }
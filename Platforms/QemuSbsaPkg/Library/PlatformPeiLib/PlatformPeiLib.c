@@ -13,12 +13,14 @@
 #include <Library/HobLib.h>
 #include <Library/PcdLib.h>
 #include <Library/DebugLib.h>
+#include <Library/FdtHelperLib.h>
 #include <Library/PeiServicesLib.h>
 #include <Library/PanicLib.h>
 #include <libfdt.h>
 #include <Library/HobLib.h>
 #include <Guid/DxeMemoryProtectionSettings.h>
 #include <Guid/MmMemoryProtectionSettings.h>
+#include <Guid/SbsaQemuMemoryNodeHob.h>
 
 #include <libfdt.h>
 
@@ -34,6 +36,103 @@ STATIC CONST EFI_PEI_PPI_DESCRIPTOR  mTpm2InitializationDonePpi = {
   NULL
 };
 
+//
+// Attributes of the system memory ranges beyond the boot memory, matching the
+// ones MemoryInitPei uses for the boot memory.
+//
+#define SBSAQEMU_MEMORY_RESOURCE_ATTRIBUTES         \
+  (EFI_RESOURCE_ATTRIBUTE_PRESENT |                 \
+   EFI_RESOURCE_ATTRIBUTE_INITIALIZED |             \
+   EFI_RESOURCE_ATTRIBUTE_WRITE_COMBINEABLE |       \
+   EFI_RESOURCE_ATTRIBUTE_WRITE_THROUGH_CACHEABLE | \
+   EFI_RESOURCE_ATTRIBUTE_WRITE_BACK_CACHEABLE |    \
+   EFI_RESOURCE_ATTRIBUTE_TESTED)
+
+/**
+  Walk the memory nodes of the device tree blob.
+
+  Every (base, size) pair of the 'reg' property of a memory node is one range.
+  For now, we will assume two 8 byte quantities for base and size.
+
+  @param[in]  DeviceTreeBase  Pointer to the device tree blob.
+  @param[out] MemoryNodes     Array receiving the ranges sorted by ascending
+                              base address, or NULL to only count them.
+
+  @return  The number of memory ranges found.
+**/
+STATIC
+UINTN
+ParseMemoryNodes (
+  IN  CONST VOID            *DeviceTreeBase,
+  OUT SBSAQEMU_MEMORY_NODE  *MemoryNodes OPTIONAL
+  )
+{
+  INT32                 Node, Prev;
+  CONST CHAR8           *Type;
+  INT32                 Len;
+  CONST UINT64          *RegProp;
+  CONST UINT32          *NumaProp;
+  SBSAQEMU_MEMORY_NODE  Range;
+  UINTN                 Count;
+  UINTN                 Pair;
+  UINTN                 Pos;
+
+  Count = 0;
+
+  for (Prev = 0; ; Prev = Node) {
+    Node = fdt_next_node (DeviceTreeBase, Prev, NULL);
+    if (Node < 0) {
+      break;
+    }
+
+    // Check for memory node
+    Type = fdt_getprop (DeviceTreeBase, Node, "device_type", &Len);
+    if (!Type || (AsciiStrnCmp (Type, "memory", Len) != 0)) {
+      continue;
+    }
+
+    RegProp = fdt_getprop (DeviceTreeBase, Node, "reg", &Len);
+    if ((RegProp == 0) || (Len <= 0) || ((Len % (2 * sizeof (UINT64))) != 0)) {
+      DEBUG ((
+        DEBUG_ERROR,
+        "%a: Failed to parse FDT memory node\n",
+        __FUNCTION__
+        ));
+      continue;
+    }
+
+    NumaProp         = fdt_getprop (DeviceTreeBase, Node, "numa-node-id", NULL);
+    Range.NumaNodeId = (NumaProp != NULL) ? fdt32_to_cpu (ReadUnaligned32 (NumaProp)) : 0;
+
+    for (Pair = 0; Pair < Len / (2 * sizeof (UINT64)); Pair++) {
+      if (MemoryNodes != NULL) {
+        Range.Base = fdt64_to_cpu (ReadUnaligned64 (RegProp + (2 * Pair)));
+        Range.Size = fdt64_to_cpu (ReadUnaligned64 (RegProp + (2 * Pair) + 1));
+
+        DEBUG ((
+          DEBUG_INFO,
+          "%a: System RAM @ 0x%lx - 0x%lx, NUMA node %d\n",
+          __FUNCTION__,
+          Range.Base,
+          Range.Base + Range.Size - 1,
+          Range.NumaNodeId
+          ));
+
+        // Keep the array sorted, so that the boot memory comes first
+        for (Pos = Count; (Pos > 0) && (MemoryNodes[Pos - 1].Base > Range.Base); Pos--) {
+          MemoryNodes[Pos] = MemoryNodes[Pos - 1];
+        }
+
+        MemoryNodes[Pos] = Range;
+      }
+
+      Count++;
+    }
+  }
+
+  return Count;
+}
+
 /**
   Initialize the memory configuration for the platform based on the device tree blob.
 
@@ -48,12 +147,11 @@ InitializeMemoryConfiguration (
   )
 {
   VOID                            *DeviceTreeBase;
-  INT32                           Node, Prev;
-  UINT64                          NewBase, CurBase;
-  UINT64                          NewSize, CurSize;
-  CONST CHAR8                     *Type;
-  INT32                           Len;
-  CONST UINT64                    *RegProp;
+  UINT64                          NewBase;
+  UINT64                          NewSize;
+  SBSAQEMU_MEMORY_NODE            *MemoryNodes;
+  UINTN                           NodeCount;
+  UINTN                           Index;
   RETURN_STATUS                   PcdStatus;
   DXE_MEMORY_PROTECTION_SETTINGS  DxeSettings;
   MM_MEMORY_PROTECTION_SETTINGS   MmSettings;
@@ -94,9 +192,6 @@ InitializeMemoryConfiguration (
       );
   }
 
-  NewBase = 0;
-  NewSize = 0;
-
   DeviceTreeBase = (VOID *)(UINTN)PcdGet64 (PcdDeviceTreeInitialBaseAddress);
   if (DeviceTreeBase == NULL) {
     PANIC ("Device Tree Base Address is not set. Cannot continue without a valid Device Tree Blob.\n");
@@ -107,43 +202,34 @@ InitializeMemoryConfiguration (
     PANIC ("Device Tree Blob header is not valid. Cannot continue without a valid Device Tree Blob.\n");
   }
 
-  // Look for the lowest memory node
-  for (Prev = 0; ; Prev = Node) {
-    Node = fdt_next_node (DeviceTreeBase, Prev, NULL);
-    if (Node < 0) {
-      break;
-    }
+  // Collect every memory range and its NUMA node for DXE
+  NodeCount = ParseMemoryNodes (DeviceTreeBase, NULL);
+  if (NodeCount == 0) {
+    PANIC ("No memory node found in the Device Tree Blob.\n");
+  }
 
-    // Check for memory node
-    Type = fdt_getprop (DeviceTreeBase, Node, "device_type", &Len);
-    if (Type && (AsciiStrnCmp (Type, "memory", Len) == 0)) {
-      // Get the 'reg' property of this node. For now, we will assume
-      // two 8 byte quantities for base and size, respectively.
-      RegProp = fdt_getprop (DeviceTreeBase, Node, "reg", &Len);
-      if ((RegProp != 0) && (Len == (2 * sizeof (UINT64)))) {
-        CurBase = fdt64_to_cpu (ReadUnaligned64 (RegProp));
-        CurSize = fdt64_to_cpu (ReadUnaligned64 (RegProp + 1));
+  MemoryNodes = BuildGuidHob (
+                  &gQemuSbsaPkgMemoryNodeHobGuid,
+                  NodeCount * sizeof (SBSAQEMU_MEMORY_NODE)
+                  );
+  if (MemoryNodes == NULL) {
+    PANIC ("Failed to build the memory node HOB.\n");
+  }
 
-        DEBUG ((
-          DEBUG_INFO,
-          "%a: System RAM @ 0x%lx - 0x%lx\n",
-          __FUNCTION__,
-          CurBase,
-          CurBase + CurSize - 1
-          ));
+  ParseMemoryNodes (DeviceTreeBase, MemoryNodes);
 
-        if ((NewBase > CurBase) || (NewBase == 0)) {
-          NewBase = CurBase;
-          NewSize = CurSize;
-        }
-      } else {
-        DEBUG ((
-          DEBUG_ERROR,
-          "%a: Failed to parse FDT memory node\n",
-          __FUNCTION__
-          ));
-      }
-    }
+  // The lowest range is the boot memory that MemoryInitPei installs, the
+  // remaining ones are published as additional system memory.
+  NewBase = MemoryNodes[0].Base;
+  NewSize = MemoryNodes[0].Size;
+
+  for (Index = 1; Index < NodeCount; Index++) {
+    BuildResourceDescriptorHob (
+      EFI_RESOURCE_SYSTEM_MEMORY,
+      SBSAQEMU_MEMORY_RESOURCE_ATTRIBUTES,
+      MemoryNodes[Index].Base,
+      MemoryNodes[Index].Size
+      );
   }
 
   FdtSize = fdt_totalsize (DeviceTreeBase) + PcdGet32 (PcdDeviceTreeAllocationPadding);
@@ -204,5 +290,7 @@ PlatformPeim (
 
   InitializeMemoryConfiguration ();
 
+  FdtHelperPublishCpuNodes ();
+
   return EFI_SUCCESS;
 }
@@ -12,8 +12,10 @@
 #include <Library/ArmLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/HobLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/PcdLib.h>
+#include <Guid/SbsaQemuMemoryNodeHob.h>
 
 // Number of Virtual Memory Map Descriptors
 #define MAX_VIRTUAL_MEMORY_MAP_DESCRIPTORS  5
@@ -69,12 +71,26 @@ ArmPlatformGetVirtualMemoryMap (
   )
 {
   ARM_MEMORY_REGION_DESCRIPTOR  *VirtualMemoryTable;
+  EFI_HOB_GUID_TYPE             *MemoryNodeHob;
+  SBSAQEMU_MEMORY_NODE          *MemoryNodes;
+  UINTN                         NodeCount;
+  UINTN                         Index;
+  UINTN                         Descriptor;
 
   ASSERT (VirtualMemoryMap != NULL);
 
+  // Memory ranges beyond the boot memory, published by PlatformPeiLib
+  MemoryNodes   = NULL;
+  NodeCount     = 0;
+  MemoryNodeHob = GetFirstGuidHob (&gQemuSbsaPkgMemoryNodeHobGuid);
+  if (MemoryNodeHob != NULL) {
+    MemoryNodes = GET_GUID_HOB_DATA (MemoryNodeHob);
+    NodeCount   = GET_GUID_HOB_DATA_SIZE (MemoryNodeHob) / sizeof (SBSAQEMU_MEMORY_NODE);
+  }
+
   VirtualMemoryTable = AllocatePool (
                          sizeof (ARM_MEMORY_REGION_DESCRIPTOR) *
-                         MAX_VIRTUAL_MEMORY_MAP_DESCRIPTORS
+                         (MAX_VIRTUAL_MEMORY_MAP_DESCRIPTORS + NodeCount)
                          );
 
   if (VirtualMemoryTable == NULL) {
@@ -118,8 +134,22 @@ ArmPlatformGetVirtualMemoryMap (
   VirtualMemoryTable[3].Length       = PcdGet64 (PcdMmBufferSize);
   VirtualMemoryTable[3].Attributes   = ARM_MEMORY_REGION_ATTRIBUTE_UNCACHED_UNBUFFERED;
 
+  // Additional System DRAM, e.g. the memory of other NUMA nodes
+  Descriptor = 4;
+  for (Index = 0; Index < NodeCount; Index++) {
+    if (MemoryNodes[Index].Base == VirtualMemoryTable[0].PhysicalBase) {
+      continue;
+    }
+
+    VirtualMemoryTable[Descriptor].PhysicalBase = MemoryNodes[Index].Base;
+    VirtualMemoryTable[Descriptor].VirtualBase  = MemoryNodes[Index].Base;
+    VirtualMemoryTable[Descriptor].Length       = MemoryNodes[Index].Size;
+    VirtualMemoryTable[Descriptor].Attributes   = ARM_MEMORY_REGION_ATTRIBUTE_WRITE_BACK;
+    Descriptor++;
+  }
+
   // End of Table
-  ZeroMem (&VirtualMemoryTable[4], sizeof (ARM_MEMORY_REGION_DESCRIPTOR));
+  ZeroMem (&VirtualMemoryTable[Descriptor], sizeof (ARM_MEMORY_REGION_DESCRIPTOR));
 
   *VirtualMemoryMap = VirtualMemoryTable;
 }
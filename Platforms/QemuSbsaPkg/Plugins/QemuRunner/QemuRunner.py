@@ -11,7 +11,10 @@ import io
 import os
 import re
 import datetime
+import subprocess
+import tempfile
 import threading
+import time
 from pathlib import Path
 from edk2toolext.environment.plugintypes import uefi_helper_plugin
 from edk2toollib import utility_functions
@@ -44,6 +47,43 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
         return ver_str.split('.')
 
 
+    @staticmethod
+    def StartVirtiofsd(env, shared_dir, socket_path):
+        ''' Starts virtiofsd to share a host directory with a vhost-user-fs device '''
+        virtiofsd = env.GetValue("VIRTIOFSD_PATH", "virtiofsd")
+        if os.path.exists(socket_path):
+            os.remove(socket_path)
+
+        cmd = [virtiofsd, f"--socket-path={socket_path}", f"--shared-dir={shared_dir}",
+               "--cache=auto", "--sandbox=none"]
+        try:
+            process = subprocess.Popen(cmd)
+        except OSError as e:
+            logging.warning(f"Failed to start {virtiofsd}: {e}")
+            return None
+
+        # QEMU fails to start if the socket is not there yet
+        for _ in range(50):
+            if os.path.exists(socket_path):
+                return process
+            if process.poll() is not None:
+                break
+            time.sleep(0.1)
+
+        logging.warning(f"{virtiofsd} did not create {socket_path}")
+        process.kill()
+        process.wait()
+        return None
+
+    @staticmethod
+    def StopVirtiofsd(process, socket_path):
+        ''' Stops virtiofsd and removes its socket '''
+        process.terminate()
+        process.wait()
+        if os.path.exists(socket_path):
+            os.remove(socket_path)
+
+
     @staticmethod
     def RunThread(env):
         ''' Runs TPM in a separate thread '''
@@ -86,6 +126,8 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
 
         # Mount disk with either startup.nsh or OS image
         path_to_os = env.GetValue("PATH_TO_OS")
+        virtiofsd = None
+        socket_path = None
         if path_to_os is not None:
             args += " -m 8192"
 
@@ -111,7 +153,18 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
             if os.path.isfile(VirtualDrive):
                 args += f" -drive file={VirtualDrive},if=virtio"
             elif os.path.isdir(VirtualDrive):
-                args += f" -drive file=fat:rw:{VirtualDrive},format=raw,media=disk"
+                if (env.GetValue("VIRTIO_FS", "FALSE").upper() == "TRUE") and os.name != 'nt':
+                    socket_path = os.path.join(tempfile.gettempdir(), f"virtiofsd-{os.getpid()}.sock")
+                    virtiofsd = QemuRunner.StartVirtiofsd(env, VirtualDrive, socket_path)
+
+                if virtiofsd is not None:
+                    # vhost-user devices need guest RAM that virtiofsd can map
+                    args += " -object memory-backend-memfd,id=mem,size=2048M,share=on"
+                    args += " -numa node,memdev=mem"
+                    args += f" -chardev socket,id=virtiofs0,path={socket_path}"
+                    args += " -device vhost-user-fs-pci,chardev=virtiofs0,tag=VirtualDrive"
+                else:
+                    args += f" -drive file=fat:rw:{VirtualDrive},format=raw,media=disk"
             else:
                 logging.critical("Virtual Drive Path Invalid")
 
@@ -184,25 +237,30 @@ class QemuRunner(uefi_helper_plugin.IUefiHelperPlugin):
             except Exception:
                 std_handle = None
 
-        # Run QEMU
-        ret = utility_functions.RunCmd(executable, args)
-
-        ## TODO: restore the customized RunCmd once unit tests with asserts are figured out
-        if ret == 0xc0000005:
-            ret = 0
-
-        ## TODO: remove this once we upgrade to newer QEMU
-        if ret == 0x8B and qemu_version[0] == '4':
-            # QEMU v4 will return segmentation fault when shutting down.
-            # Tested same FDs on QEMU 6 and 7, not observing the same.
-            ret = 0
-
-        if os.name == 'nt' and qemu_version[0] >= '8' and std_handle is not None:
-            # Restore the console mode for Windows on QEMU v8+.
-            std_handle.SetConsoleMode(console_mode)
-        elif os.name != 'nt':
-            # Linux version of QEMU will mess with the print if its run failed, let's just restore it anyway
-            utility_functions.RunCmd('stty', 'sane', capture=False)
+        # Stop virtiofsd and remove its socket, even if the run fails or is interrupted
+        try:
+            # Run QEMU
+            ret = utility_functions.RunCmd(executable, args)
+
+            ## TODO: restore the customized RunCmd once unit tests with asserts are figured out
+            if ret == 0xc0000005:
+                ret = 0
+
+            ## TODO: remove this once we upgrade to newer QEMU
+            if ret == 0x8B and qemu_version[0] == '4':
+                # QEMU v4 will return segmentation fault when shutting down.
+                # Tested same FDs on QEMU 6 and 7, not observing the same.
+                ret = 0
+
+            if os.name == 'nt' and qemu_version[0] >= '8' and std_handle is not None:
+                # Restore the console mode for Windows on QEMU v8+.
+                std_handle.SetConsoleMode(console_mode)
+            elif os.name != 'nt':
+                # Linux version of QEMU will mess with the print if its run failed, let's just restore it anyway
+                utility_functions.RunCmd('stty', 'sane', capture=False)
+        finally:
+            if virtiofsd is not None:
+                QemuRunner.StopVirtiofsd(virtiofsd, socket_path)
 
         if thread is not None:
             logging.critical("Terminate TPM emulator by using Crtl + C now!")
@@ -83,6 +83,266 @@ QemuVideoCompleteModeData (
   return EFI_SUCCESS;
 }
 
+/**
+  Create or update a FrameBufferBltLib configuration for a buffer.
+
+  @param[in] FrameBuffer    The frame buffer, or its shadow.
+  @param[in] Info           The current mode.
+  @param[in,out] Configure  The configuration; reallocated if it is too small
+                            for the current mode.
+  @param[in,out] Size       The size of Configure.
+
+  @return  Status codes from FrameBufferBltConfigure(), or
+           EFI_OUT_OF_RESOURCES.
+**/
+STATIC
+EFI_STATUS
+QemuVideoBltConfigure (
+  IN     VOID                                  *FrameBuffer,
+  IN     EFI_GRAPHICS_OUTPUT_MODE_INFORMATION  *Info,
+  IN OUT FRAME_BUFFER_CONFIGURE                **Configure,
+  IN OUT UINTN                                 *Size
+  )
+{
+  RETURN_STATUS  Status;
+
+  Status = FrameBufferBltConfigure (FrameBuffer, Info, *Configure, Size);
+  if (Status == RETURN_BUFFER_TOO_SMALL) {
+    //
+    // Frame buffer configure may be larger in new mode.
+    //
+    if (*Configure != NULL) {
+      FreePool (*Configure);
+    }
+
+    *Configure = AllocatePool (*Size);
+    if (*Configure == NULL) {
+      *Size = 0;
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    //
+    // Create the configuration for FrameBufferBltLib
+    //
+    Status = FrameBufferBltConfigure (FrameBuffer, Info, *Configure, Size);
+  }
+
+  return Status;
+}
+
+/**
+  Copy the dirty rectangle of the shadow frame buffer to the frame buffer.
+
+  Must be called at TPL_NOTIFY, or after ExitBootServices().
+
+  @param[in,out] Private  The device whose shadow to flush.
+**/
+STATIC
+VOID
+QemuVideoShadowFlush (
+  IN OUT QEMU_VIDEO_PRIVATE_DATA  *Private
+  )
+{
+  EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE  *Mode;
+  UINTN                              BytesPerPixel;
+  UINTN                              Stride;
+  UINTN                              Offset;
+  UINTN                              RowSize;
+  UINTN                              Row;
+
+  if (!Private->ShadowDirty) {
+    return;
+  }
+
+  Private->ShadowDirty = FALSE;
+
+  Mode          = Private->GraphicsOutput.Mode;
+  BytesPerPixel = (Private->ModeData[Mode->Mode].ColorDepth + 7) / 8;
+  Stride        = Mode->Info->PixelsPerScanLine * BytesPerPixel;
+  Offset        = Private->DirtyTop * Stride + Private->DirtyLeft * BytesPerPixel;
+  RowSize       = (Private->DirtyRight - Private->DirtyLeft) * BytesPerPixel;
+
+  if (RowSize == Stride) {
+    //
+    // Full scan lines are contiguous; copy them at once.
+    //
+    CopyMem (
+      (UINT8 *)(UINTN)Mode->FrameBufferBase + Offset,
+      Private->Shadow + Offset,
+      RowSize * (Private->DirtyBottom - Private->DirtyTop)
+      );
+    return;
+  }
+
+  for (Row = Private->DirtyTop; Row < Private->DirtyBottom; Row++) {
+    CopyMem (
+      (UINT8 *)(UINTN)Mode->FrameBufferBase + Offset,
+      Private->Shadow + Offset,
+      RowSize
+      );
+    Offset += Stride;
+  }
+}
+
+/**
+  Extend the dirty rectangle of the shadow frame buffer, and arm the flush
+  timer if the shadow was clean.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Private  The device whose shadow has been modified.
+  @param[in] X            The leftmost modified column.
+  @param[in] Y            The topmost modified row.
+  @param[in] Width        The width of the modified rectangle.
+  @param[in] Height       The height of the modified rectangle.
+**/
+STATIC
+VOID
+QemuVideoShadowMarkDirty (
+  IN OUT QEMU_VIDEO_PRIVATE_DATA  *Private,
+  IN     UINTN                    X,
+  IN     UINTN                    Y,
+  IN     UINTN                    Width,
+  IN     UINTN                    Height
+  )
+{
+  if ((Width == 0) || (Height == 0)) {
+    return;
+  }
+
+  if (!Private->ShadowDirty) {
+    Private->ShadowDirty = TRUE;
+    Private->DirtyLeft   = X;
+    Private->DirtyTop    = Y;
+    Private->DirtyRight  = X + Width;
+    Private->DirtyBottom = Y + Height;
+    gBS->SetTimer (
+           Private->ShadowFlushTimer,
+           TimerRelative,
+           QEMU_VIDEO_SHADOW_FLUSH_DELAY
+           );
+    return;
+  }
+
+  Private->DirtyLeft   = MIN (Private->DirtyLeft, X);
+  Private->DirtyTop    = MIN (Private->DirtyTop, Y);
+  Private->DirtyRight  = MAX (Private->DirtyRight, X + Width);
+  Private->DirtyBottom = MAX (Private->DirtyBottom, Y + Height);
+}
+
+/**
+  Notification function of ShadowFlushTimer.
+
+  @param[in] Event    The event being signaled.
+  @param[in] Context  The QEMU_VIDEO_PRIVATE_DATA of the device.
+**/
+STATIC
+VOID
+EFIAPI
+QemuVideoShadowFlushNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  QemuVideoShadowFlush (Context);
+}
+
+/**
+  Notification function of ShadowExitBootServices.
+
+  Cancels the flush timer, copies the pending updates to the frame buffer, and
+  stops using the shadow. The OS loader may access the frame buffer directly
+  from now on, and must neither race with the timer nor have Blt() results
+  withheld from it. The shadow itself is boot services memory, which the OS
+  reclaims.
+
+  @param[in] Event    The event being signaled.
+  @param[in] Context  The QEMU_VIDEO_PRIVATE_DATA of the device.
+**/
+STATIC
+VOID
+EFIAPI
+QemuVideoShadowExitBootServicesNotify (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  QEMU_VIDEO_PRIVATE_DATA  *Private;
+  EFI_TPL                  OriginalTPL;
+
+  Private = Context;
+
+  OriginalTPL = gBS->RaiseTPL (TPL_NOTIFY);
+  gBS->SetTimer (Private->ShadowFlushTimer, TimerCancel, 0);
+  if (Private->Shadow != NULL) {
+    QemuVideoShadowFlush (Private);
+    Private->Shadow = NULL;
+  }
+
+  gBS->RestoreTPL (OriginalTPL);
+}
+
+/**
+  Size the shadow frame buffer for the current mode, and clear it.
+
+  If the shadow cannot be set up, Blt() falls back to accessing the frame
+  buffer directly.
+
+  @param[in,out] Private  The device whose mode has been set.
+**/
+STATIC
+VOID
+QemuVideoShadowSetMode (
+  IN OUT QEMU_VIDEO_PRIVATE_DATA  *Private
+  )
+{
+  EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE  *Mode;
+  UINTN                              Pages;
+  EFI_STATUS                         Status;
+
+  Private->ShadowDirty = FALSE;
+  Mode                 = Private->GraphicsOutput.Mode;
+  Pages                = EFI_SIZE_TO_PAGES (Mode->FrameBufferSize);
+
+  if ((Private->Shadow != NULL) && (Private->ShadowPages < Pages)) {
+    FreePages (Private->Shadow, Private->ShadowPages);
+    Private->Shadow = NULL;
+  }
+
+  if (Private->Shadow == NULL) {
+    Private->Shadow = AllocatePages (Pages);
+    if (Private->Shadow == NULL) {
+      DEBUG ((
+        DEBUG_WARN,
+        "%a: no shadow frame buffer (%Lu pages)\n",
+        __FUNCTION__,
+        (UINT64)Pages
+        ));
+      return;
+    }
+
+    Private->ShadowPages = Pages;
+  }
+
+  Status = QemuVideoBltConfigure (
+             Private->Shadow,
+             Mode->Info,
+             &Private->ShadowBltConfigure,
+             &Private->ShadowBltConfigureSize
+             );
+  if (EFI_ERROR (Status)) {
+    FreePages (Private->Shadow, Private->ShadowPages);
+    Private->Shadow = NULL;
+    return;
+  }
+
+  //
+  // Matches the frame buffer, which SetMode() clears to black (all-bits-zero
+  // in every pixel format).
+  //
+  ZeroMem (Private->Shadow, (UINTN)Mode->FrameBufferSize);
+}
+
 //
 // Graphics Output Protocol Member Functions
 //
@@ -168,6 +428,7 @@ Routine Description:
   QEMU_VIDEO_MODE_DATA           *ModeData;
   RETURN_STATUS                  Status;
   EFI_GRAPHICS_OUTPUT_BLT_PIXEL  Black;
+  EFI_TPL                        OriginalTPL;
 
   Private = QEMU_VIDEO_PRIVATE_DATA_FROM_GRAPHICS_OUTPUT_THIS (This);
 
@@ -177,6 +438,15 @@ Routine Description:
 
   ModeData = &Private->ModeData[ModeNumber];
 
+  //
+  // Complete the pending updates of the old mode, and keep the flush timer
+  // from running while the mode changes.
+  //
+  OriginalTPL = gBS->RaiseTPL (TPL_NOTIFY);
+  if (Private->Shadow != NULL) {
+    QemuVideoShadowFlush (Private);
+  }
+
   switch (Private->Variant) {
     case QEMU_VIDEO_BOCHS_MMIO:
     case QEMU_VIDEO_BOCHS:
@@ -184,6 +454,7 @@ Routine Description:
       break;
     default:
       ASSERT (FALSE);
+      gBS->RestoreTPL (OriginalTPL);
       return EFI_DEVICE_ERROR;
   }
 
@@ -197,35 +468,12 @@ Routine Description:
   //
   // Re-initialize the frame buffer configure when mode changes.
   //
-  Status = FrameBufferBltConfigure (
+  Status = QemuVideoBltConfigure (
              (VOID *)(UINTN)This->Mode->FrameBufferBase,
              This->Mode->Info,
-             Private->FrameBufferBltConfigure,
+             &Private->FrameBufferBltConfigure,
              &Private->FrameBufferBltConfigureSize
              );
-  if (Status == RETURN_BUFFER_TOO_SMALL) {
-    //
-    // Frame buffer configure may be larger in new mode.
-    //
-    if (Private->FrameBufferBltConfigure != NULL) {
-      FreePool (Private->FrameBufferBltConfigure);
-    }
-
-    Private->FrameBufferBltConfigure =
-      AllocatePool (Private->FrameBufferBltConfigureSize);
-    ASSERT (Private->FrameBufferBltConfigure != NULL);
-
-    //
-    // Create the configuration for FrameBufferBltLib
-    //
-    Status = FrameBufferBltConfigure (
-               (VOID *)(UINTN)This->Mode->FrameBufferBase,
-               This->Mode->Info,
-               Private->FrameBufferBltConfigure,
-               &Private->FrameBufferBltConfigureSize
-               );
-  }
-
   ASSERT (Status == RETURN_SUCCESS);
 
   //
@@ -246,6 +494,12 @@ Routine Description:
              );
   ASSERT_RETURN_ERROR (Status);
 
+  if (Private->ShadowFlushTimer != NULL) {
+    QemuVideoShadowSetMode (Private);
+  }
+
+  gBS->RestoreTPL (OriginalTPL);
+
   return EFI_SUCCESS;
 }
 
@@ -296,6 +550,7 @@ Returns:
   EFI_STATUS               Status;
   EFI_TPL                  OriginalTPL;
   QEMU_VIDEO_PRIVATE_DATA  *Private;
+  FRAME_BUFFER_CONFIGURE   *Configure;
 
   Private = QEMU_VIDEO_PRIVATE_DATA_FROM_GRAPHICS_OUTPUT_THIS (This);
   //
@@ -305,13 +560,23 @@ Returns:
   //
   OriginalTPL = gBS->RaiseTPL (TPL_NOTIFY);
 
+  //
+  // With a shadow frame buffer, reads are served from system memory, and
+  // writes reach the frame buffer later, in coalesced rectangles.
+  //
+  if (Private->Shadow != NULL) {
+    Configure = Private->ShadowBltConfigure;
+  } else {
+    Configure = Private->FrameBufferBltConfigure;
+  }
+
   switch (BltOperation) {
     case EfiBltVideoToBltBuffer:
     case EfiBltBufferToVideo:
     case EfiBltVideoFill:
     case EfiBltVideoToVideo:
       Status = FrameBufferBlt (
-                 Private->FrameBufferBltConfigure,
+                 Configure,
                  BltBuffer,
                  BltOperation,
                  SourceX,
@@ -322,6 +587,18 @@ Returns:
                  Height,
                  Delta
                  );
+      if (!EFI_ERROR (Status) && (Private->Shadow != NULL) &&
+          (BltOperation != EfiBltVideoToBltBuffer))
+      {
+        QemuVideoShadowMarkDirty (
+          Private,
+          DestinationX,
+          DestinationY,
+          Width,
+          Height
+          );
+      }
+
       break;
 
     default:
@@ -433,13 +710,44 @@ QemuVideoGraphicsOutputConstructor (
   Private->GraphicsOutput.Mode->Mode    = GRAPHICS_OUTPUT_INVALID_MODE_NUMBER;
   Private->FrameBufferBltConfigure      = NULL;
   Private->FrameBufferBltConfigureSize  = 0;
+  Private->Shadow                       = NULL;
+  Private->ShadowPages                  = 0;
+  Private->ShadowBltConfigure           = NULL;
+  Private->ShadowBltConfigureSize       = 0;
+  Private->ShadowFlushTimer             = NULL;
+  Private->ShadowExitBootServices       = NULL;
+  Private->ShadowDirty                  = FALSE;
+
+  if (PcdGetBool (PcdVideoShadowFrameBuffer)) {
+    Status = gBS->CreateEvent (
+                    EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                    TPL_NOTIFY,
+                    QemuVideoShadowFlushNotify,
+                    Private,
+                    &Private->ShadowFlushTimer
+                    );
+    if (EFI_ERROR (Status)) {
+      goto FreeInfo;
+    }
+
+    Status = gBS->CreateEvent (
+                    EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                    TPL_CALLBACK,
+                    QemuVideoShadowExitBootServicesNotify,
+                    Private,
+                    &Private->ShadowExitBootServices
+                    );
+    if (EFI_ERROR (Status)) {
+      goto CloseFlushTimer;
+    }
+  }
 
   //
   // Initialize the hardware
   //
   Status = GraphicsOutput->SetMode (GraphicsOutput, QueryNativeResMode (GraphicsOutput)); // MU_CHANGE - query for the native resolution
   if (EFI_ERROR (Status)) {
-    goto FreeInfo;
+    goto CloseExitBootServices;
   }
 
   DrawLogo (
@@ -450,6 +758,18 @@ QemuVideoGraphicsOutputConstructor (
 
   return EFI_SUCCESS;
 
+CloseExitBootServices:
+  if (Private->ShadowExitBootServices != NULL) {
+    gBS->CloseEvent (Private->ShadowExitBootServices);
+    Private->ShadowExitBootServices = NULL;
+  }
+
+CloseFlushTimer:
+  if (Private->ShadowFlushTimer != NULL) {
+    gBS->CloseEvent (Private->ShadowFlushTimer);
+    Private->ShadowFlushTimer = NULL;
+  }
+
 FreeInfo:
   FreePool (Private->GraphicsOutput.Mode->Info);
 
@@ -477,6 +797,20 @@ Returns:
 
 --*/
 {
+  if (Private->ShadowFlushTimer != NULL) {
+    gBS->CloseEvent (Private->ShadowFlushTimer);
+    gBS->CloseEvent (Private->ShadowExitBootServices);
+  }
+
+  if (Private->Shadow != NULL) {
+    QemuVideoShadowFlush (Private);
+    FreePages (Private->Shadow, Private->ShadowPages);
+  }
+
+  if (Private->ShadowBltConfigure != NULL) {
+    FreePool (Private->ShadowBltConfigure);
+  }
+
   if (Private->FrameBufferBltConfigure != NULL) {
     FreePool (Private->FrameBufferBltConfigure);
   }
@@ -15,6 +15,7 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/FdtHelperLib.h>
+#include <Library/HobLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/PcdLib.h>
 #include <Library/PrintLib.h>
@@ -23,11 +24,45 @@
 #include <Library/UefiDriverEntryPoint.h>
 #include <Library/UefiLib.h>
 #include <Protocol/AcpiTable.h>
+#include <Guid/SbsaQemuMemoryNodeHob.h>
+#include <libfdt.h>
 
 #define SIP_SVC_GET_CPU_COUNT  SMC_SIP_FUNCTION_ID(200)
 #define SIP_SVC_GET_CPU_NODE   SMC_SIP_FUNCTION_ID(201)
 #define SMC_SIP_CALL_SUCCESS   SMC_ARCH_CALL_SUCCESS
 
+#define SBSAQEMU_MPIDR_AFFINITY_MASK  0xFF00FFFFFFULL
+#define SBSAQEMU_MPIDR_MT             BIT24
+#define SBSAQEMU_MPIDR_AFF(Mpidr, Level) \
+  ((UINT32)RShiftU64 ((Mpidr), ((Level) == 3) ? 32 : ((Level) * 8)) & 0xFF)
+
+typedef enum {
+  SbsaQemuTopologySocket,
+  SbsaQemuTopologyCluster,
+  SbsaQemuTopologyCore,
+  SbsaQemuTopologyThread,
+  SbsaQemuTopologyMax
+} SBSAQEMU_TOPOLOGY_LEVEL;
+
+// Location of a cpu in the processor hierarchy, indexed by ACPI processor UID
+typedef struct {
+  UINT64     Mpidr;
+  UINT32     SocketId;
+  UINT32     ClusterId;
+  UINT32     CoreId;
+  UINT32     ThreadId;
+  UINT32     NumaNodeId;
+} SBSAQEMU_CPU_TOPOLOGY;
+
+STATIC SBSAQEMU_CPU_TOPOLOGY  *mCpuTopology;
+STATIC UINT32                 mCpuCount;
+
+STATIC EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  mL1DCache   = SBSAQEMU_ACPI_PPTT_L1_D_CACHE_STRUCT;
+STATIC EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  mL1ICache   = SBSAQEMU_ACPI_PPTT_L1_I_CACHE_STRUCT;
+STATIC EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  mL2Cache    = SBSAQEMU_ACPI_PPTT_L2_CACHE_STRUCT;
+STATIC EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  mL3Cache    = SBSAQEMU_ACPI_PPTT_L2_CACHE_STRUCT;
+STATIC BOOLEAN                            mHasL3Cache = FALSE;
+
 /**
   Get CPU count from information passed by TF-A.
 
@@ -86,6 +121,352 @@ GetMpidr (
   return SmcArgs.Arg2;
 }
 
+/**
+  Read a 32-bit cell property from a device tree node.
+
+  @param [in]  Fdt      Pointer to the device tree blob.
+  @param [in]  Node     Offset of the node holding the property.
+  @param [in]  Name     Name of the property.
+  @param [in]  Default  Value returned when the property is absent.
+
+  @retval UINT32  Value of the property, or <Default>.
+**/
+STATIC
+UINT32
+FdtGetUint32 (
+  IN CONST VOID   *Fdt,
+  IN INT32        Node,
+  IN CONST CHAR8  *Name,
+  IN UINT32       Default
+  )
+{
+  CONST UINT32  *Prop;
+  INT32         Len;
+
+  Prop = fdt_getprop (Fdt, Node, Name, &Len);
+  if ((Prop == NULL) || (Len < (INT32)sizeof (UINT32))) {
+    return Default;
+  }
+
+  return fdt32_to_cpu (ReadUnaligned32 (Prop));
+}
+
+/**
+  Update a PPTT cache template from the geometry described by a device tree
+  node. Properties missing from the node keep the values of the template.
+
+  @param [in]      Fdt     Pointer to the device tree blob.
+  @param [in]      Node    Offset of the cpu or cache node.
+  @param [in]      Prefix  Property prefix, e.g. "d-cache-" or "cache-".
+  @param [in, out] Cache   Cache template to update.
+**/
+STATIC
+VOID
+FdtReadCacheGeometry (
+  IN     CONST VOID                         *Fdt,
+  IN     INT32                              Node,
+  IN     CONST CHAR8                        *Prefix,
+  IN OUT EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  *Cache
+  )
+{
+  CHAR8   Name[32];
+  UINT32  LineSize;
+  UINT32  Ways;
+
+  AsciiSPrint (Name, sizeof (Name), "%asize", Prefix);
+  Cache->Size = FdtGetUint32 (Fdt, Node, Name, Cache->Size);
+
+  AsciiSPrint (Name, sizeof (Name), "%asets", Prefix);
+  Cache->NumberOfSets = FdtGetUint32 (Fdt, Node, Name, Cache->NumberOfSets);
+
+  AsciiSPrint (Name, sizeof (Name), "%ablock-size", Prefix);
+  LineSize = FdtGetUint32 (Fdt, Node, Name, Cache->LineSize);
+  AsciiSPrint (Name, sizeof (Name), "%aline-size", Prefix);
+  LineSize        = FdtGetUint32 (Fdt, Node, Name, LineSize);
+  Cache->LineSize = (UINT16)LineSize;
+
+  if ((Cache->NumberOfSets != 0) && (Cache->LineSize != 0)) {
+    Ways = Cache->Size / (Cache->NumberOfSets * Cache->LineSize);
+    if ((Ways != 0) && (Ways <= MAX_UINT8)) {
+      Cache->Associativity = (UINT8)Ways;
+    }
+  }
+}
+
+/**
+  Fill in the cache templates used for the PPTT from the device tree.
+
+  Every core is assumed to implement the cache hierarchy of the first cpu
+  node: private L1 caches described by its d-cache-* and i-cache-* properties,
+  a cluster level L2 cache reached through next-level-cache and, when the L2
+  cache node has a next-level-cache of its own, a package level L3 cache.
+
+  @param [in]  Fdt  Pointer to the device tree blob.
+**/
+STATIC
+VOID
+InitCacheTemplates (
+  IN CONST VOID  *Fdt
+  )
+{
+  INT32        CpusNode;
+  INT32        Node;
+  CONST CHAR8  *Type;
+  UINT32       Phandle;
+
+  CpusNode = fdt_path_offset (Fdt, "/cpus");
+  if (CpusNode < 0) {
+    return;
+  }
+
+  for (Node = fdt_first_subnode (Fdt, CpusNode);
+       Node >= 0;
+       Node = fdt_next_subnode (Fdt, Node))
+  {
+    Type = fdt_getprop (Fdt, Node, "device_type", NULL);
+    if ((Type != NULL) && (AsciiStrCmp (Type, "cpu") == 0)) {
+      break;
+    }
+  }
+
+  if (Node < 0) {
+    return;
+  }
+
+  FdtReadCacheGeometry (Fdt, Node, "d-cache-", &mL1DCache);
+  FdtReadCacheGeometry (Fdt, Node, "i-cache-", &mL1ICache);
+
+  Phandle = FdtGetUint32 (Fdt, Node, "next-level-cache", 0);
+  Node    = (Phandle != 0) ? fdt_node_offset_by_phandle (Fdt, Phandle) : -1;
+  if (Node < 0) {
+    return;
+  }
+
+  FdtReadCacheGeometry (Fdt, Node, "cache-", &mL2Cache);
+
+  Phandle = FdtGetUint32 (Fdt, Node, "next-level-cache", 0);
+  Node    = (Phandle != 0) ? fdt_node_offset_by_phandle (Fdt, Phandle) : -1;
+  if (Node < 0) {
+    return;
+  }
+
+  FdtReadCacheGeometry (Fdt, Node, "cache-", &mL3Cache);
+  mHasL3Cache = TRUE;
+}
+
+/**
+  Take the location and the NUMA node of every cpu from the cpu table of
+  FdtHelperLib, which parsed the cpu nodes and the cpu-map node of the device
+  tree.
+
+  The cpu table of FdtHelperLib is normally in the order of the TF-A cpu
+  indices, so the entry at the same index is tried before searching it.
+
+  @retval TRUE   Every cpu reported by TF-A was found in the cpu table.
+  @retval FALSE  Otherwise; the cpus that were not found keep location 0.
+**/
+STATIC
+BOOLEAN
+ReadCpuNodes (
+  VOID
+  )
+{
+  CONST SBSAQEMU_CPU_NODE  *CpuNode;
+  CONST SBSAQEMU_CPU_NODE  *Candidate;
+  UINT32                   CpuNodeCount;
+  UINT32                   Index;
+  UINT32                   NodeIndex;
+  BOOLEAN                  Found;
+
+  Found        = TRUE;
+  CpuNodeCount = FdtHelperCountCpus ();
+  for (Index = 0; Index < mCpuCount; Index++) {
+    CpuNode = FdtHelperGetCpuNode (Index);
+    if ((CpuNode == NULL) ||
+        ((CpuNode->Mpidr & SBSAQEMU_MPIDR_AFFINITY_MASK) !=
+         (mCpuTopology[Index].Mpidr & SBSAQEMU_MPIDR_AFFINITY_MASK)))
+    {
+      CpuNode = NULL;
+      for (NodeIndex = 0; NodeIndex < CpuNodeCount; NodeIndex++) {
+        Candidate = FdtHelperGetCpuNode (NodeIndex);
+        if ((Candidate->Mpidr & SBSAQEMU_MPIDR_AFFINITY_MASK) ==
+            (mCpuTopology[Index].Mpidr & SBSAQEMU_MPIDR_AFFINITY_MASK))
+        {
+          CpuNode = Candidate;
+          break;
+        }
+      }
+    }
+
+    if (CpuNode == NULL) {
+      Found = FALSE;
+      continue;
+    }
+
+    mCpuTopology[Index].NumaNodeId = CpuNode->NumaNodeId;
+    mCpuTopology[Index].SocketId   = CpuNode->SocketId;
+    mCpuTopology[Index].ClusterId  = CpuNode->ClusterId;
+    mCpuTopology[Index].CoreId     = CpuNode->CoreId;
+    mCpuTopology[Index].ThreadId   = CpuNode->ThreadId;
+  }
+
+  return Found;
+}
+
+/**
+  Derive the topology of every cpu from its MPIDR affinity fields.
+
+  Used when the device tree does not describe every cpu that TF-A reports.
+  With the MT bit set, Aff0 numbers the threads of a core; otherwise Aff0
+  numbers the cores of a cluster, as in FdtHelperLib.
+**/
+STATIC
+VOID
+SetTopologyFromMpidr (
+  VOID
+  )
+{
+  SBSAQEMU_CPU_TOPOLOGY  *Cpu;
+  UINT32                 Index;
+
+  for (Index = 0; Index < mCpuCount; Index++) {
+    Cpu = &mCpuTopology[Index];
+    if ((Cpu->Mpidr & SBSAQEMU_MPIDR_MT) != 0) {
+      Cpu->ThreadId  = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 0);
+      Cpu->CoreId    = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 1);
+      Cpu->ClusterId = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 2);
+      Cpu->SocketId  = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 3);
+    } else {
+      Cpu->ThreadId  = 0;
+      Cpu->CoreId    = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 0);
+      Cpu->ClusterId = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 1);
+      Cpu->SocketId  = SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 2) |
+                       (SBSAQEMU_MPIDR_AFF (Cpu->Mpidr, 3) << 8);
+    }
+  }
+}
+
+/**
+  Build the cpu table shared by the MADT, PPTT and SRAT generation.
+
+  The MPIDR of every cpu is queried from TF-A once. The topology and the NUMA
+  node come from the cpu table of FdtHelperLib, the cache geometry from the
+  cache nodes of the device tree. Missing device tree information falls back
+  to the MPIDR affinity fields and to the default cache geometry.
+
+  @param [in]  NumCores  Number of cpus reported by TF-A.
+
+  @retval EFI_SUCCESS           The cpu table was built.
+  @retval EFI_OUT_OF_RESOURCES  The cpu table could not be allocated.
+**/
+STATIC
+EFI_STATUS
+InitCpuTopology (
+  IN UINT32  NumCores
+  )
+{
+  VOID     *Fdt;
+  BOOLEAN  Found;
+  UINT32   Index;
+
+  mCpuTopology = AllocateZeroPool (NumCores * sizeof (SBSAQEMU_CPU_TOPOLOGY));
+  if (mCpuTopology == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  mCpuCount = NumCores;
+  for (Index = 0; Index < NumCores; Index++) {
+    mCpuTopology[Index].Mpidr = GetMpidr (Index);
+  }
+
+  Found = FALSE;
+  Fdt   = (VOID *)(UINTN)FixedPcdGet64 (PcdDeviceTreeInitialBaseAddress);
+  if ((Fdt != NULL) && (fdt_check_header (Fdt) == 0)) {
+    InitCacheTemplates (Fdt);
+    Found = ReadCpuNodes ();
+  } else {
+    DEBUG ((DEBUG_WARN, "%a: No valid device tree, using default topology\n", __func__));
+  }
+
+  if (!Found) {
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: device tree does not describe all %d cpus, deriving topology from MPIDR\n",
+      __func__,
+      NumCores
+      ));
+    SetTopologyFromMpidr ();
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Return the outermost topology level at which two cpus differ.
+
+  @param [in]  Cpu1  First cpu.
+  @param [in]  Cpu2  Second cpu.
+
+  @retval SBSAQEMU_TOPOLOGY_LEVEL  Outermost differing level, or
+                                   SbsaQemuTopologyMax for the same thread.
+**/
+STATIC
+SBSAQEMU_TOPOLOGY_LEVEL
+TopologyDifference (
+  IN CONST SBSAQEMU_CPU_TOPOLOGY  *Cpu1,
+  IN CONST SBSAQEMU_CPU_TOPOLOGY  *Cpu2
+  )
+{
+  if (Cpu1->SocketId != Cpu2->SocketId) {
+    return SbsaQemuTopologySocket;
+  }
+
+  if (Cpu1->ClusterId != Cpu2->ClusterId) {
+    return SbsaQemuTopologyCluster;
+  }
+
+  if (Cpu1->CoreId != Cpu2->CoreId) {
+    return SbsaQemuTopologyCore;
+  }
+
+  if (Cpu1->ThreadId != Cpu2->ThreadId) {
+    return SbsaQemuTopologyThread;
+  }
+
+  return SbsaQemuTopologyMax;
+}
+
+/**
+  Compare the topology of two cpus, socket first and thread last.
+
+  @param [in]  Cpu1  First cpu.
+  @param [in]  Cpu2  Second cpu.
+
+  @retval <0  <Cpu1> sorts before <Cpu2>.
+  @retval 0   Both cpus have the same location.
+  @retval >0  <Cpu1> sorts after <Cpu2>.
+**/
+STATIC
+INTN
+TopologyCompare (
+  IN CONST SBSAQEMU_CPU_TOPOLOGY  *Cpu1,
+  IN CONST SBSAQEMU_CPU_TOPOLOGY  *Cpu2
+  )
+{
+  switch (TopologyDifference (Cpu1, Cpu2)) {
+    case SbsaQemuTopologySocket:
+      return (Cpu1->SocketId < Cpu2->SocketId) ? -1 : 1;
+    case SbsaQemuTopologyCluster:
+      return (Cpu1->ClusterId < Cpu2->ClusterId) ? -1 : 1;
+    case SbsaQemuTopologyCore:
+      return (Cpu1->CoreId < Cpu2->CoreId) ? -1 : 1;
+    case SbsaQemuTopologyThread:
+      return (Cpu1->ThreadId < Cpu2->ThreadId) ? -1 : 1;
+    default:
+      return 0;
+  }
+}
+
 /*
  * A Function to Compute the ACPI Table Checksum
  */
@@ -159,8 +540,8 @@ AddMadtTable (
   // Initialize GIC Redistributor Structure
   EFI_ACPI_6_0_GICR_STRUCTURE  Gicr = SBSAQEMU_MADT_GICR_INIT ();
 
-  // Get CoreCount which was determined earlier after parsing device tree
-  NumCores = PcdGet32 (PcdCoreCount);
+  // Use the cpu table built from TF-A and the device tree
+  NumCores = mCpuCount;
 
   // Calculate the new table size based on the number of cores
   TableSize = sizeof (EFI_ACPI_6_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER) +
@@ -188,13 +569,13 @@ AddMadtTable (
   New                                         += sizeof (EFI_ACPI_6_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER);
 
   // Add new GICC structures for the Cores
-  for (CoreIndex = 0; CoreIndex < PcdGet32 (PcdCoreCount); CoreIndex++) {
+  for (CoreIndex = 0; CoreIndex < NumCores; CoreIndex++) {
     EFI_ACPI_6_0_GIC_STRUCTURE  *GiccPtr;
 
     CopyMem (New, &Gicc, sizeof (EFI_ACPI_6_0_GIC_STRUCTURE));
     GiccPtr                   = (EFI_ACPI_6_0_GIC_STRUCTURE *)New;
     GiccPtr->AcpiProcessorUid = CoreIndex;
-    GiccPtr->MPIDR            = GetMpidr (CoreIndex);
+    GiccPtr->MPIDR            = mCpuTopology[CoreIndex].Mpidr;
     New                      += sizeof (EFI_ACPI_6_0_GIC_STRUCTURE);
   }
 
@@ -378,28 +759,125 @@ AddSsdtTable (
   return Status;
 }
 
+/**
+  Append a processor hierarchy node to the PPTT.
+
+  @param [in]      Table                     Start of the PPTT.
+  @param [in, out] Offset                    Offset of the next free byte.
+  @param [in]      Template                  Node template to copy.
+  @param [in]      Parent                    Offset of the parent node.
+  @param [in]      AcpiProcessorId           ACPI processor UID of the node.
+  @param [in]      NumberOfPrivateResources  Number of private resources.
+
+  @retval UINT32  Offset of the new node.
+**/
+STATIC
+UINT32
+AddPpttProcessor (
+  IN     UINT8                                        *Table,
+  IN OUT UINT32                                       *Offset,
+  IN     CONST EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  *Template,
+  IN     UINT32                                       Parent,
+  IN     UINT32                                       AcpiProcessorId,
+  IN     UINT32                                       NumberOfPrivateResources
+  )
+{
+  EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  *Node;
+  UINT32                                 NodeOffset;
+
+  NodeOffset = *Offset;
+  Node       = (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR *)(Table + NodeOffset);
+
+  CopyMem (Node, Template, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR));
+  Node->Length = (UINT8)(sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) +
+                         (NumberOfPrivateResources * sizeof (UINT32)));
+  Node->Parent                   = Parent;
+  Node->AcpiProcessorId          = AcpiProcessorId;
+  Node->NumberOfPrivateResources = NumberOfPrivateResources;
+
+  *Offset += Node->Length;
+  return NodeOffset;
+}
+
+/**
+  Append a cache node to the PPTT and reference it from a private resource
+  slot of a processor hierarchy node.
+
+  @param [in]      Table             Start of the PPTT.
+  @param [in, out] Offset            Offset of the next free byte.
+  @param [in]      NodeOffset        Offset of the owning processor node.
+  @param [in]      Resource          Private resource slot to fill.
+  @param [in]      Template          Cache template to copy.
+  @param [in]      NextLevelOfCache  Offset of the next level cache, or 0.
+
+  @retval UINT32  Offset of the new cache node.
+**/
+STATIC
+UINT32
+AddPpttCache (
+  IN     UINT8                                    *Table,
+  IN OUT UINT32                                   *Offset,
+  IN     UINT32                                   NodeOffset,
+  IN     UINT32                                   Resource,
+  IN     CONST EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  *Template,
+  IN     UINT32                                   NextLevelOfCache
+  )
+{
+  EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  *Cache;
+  UINT32                             *PrivateResources;
+  UINT32                             CacheOffset;
+
+  CacheOffset = *Offset;
+  Cache       = (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE *)(Table + CacheOffset);
+
+  CopyMem (Cache, Template, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE));
+  Cache->NextLevelOfCache = NextLevelOfCache;
+
+  PrivateResources = (UINT32 *)(Table + NodeOffset +
+                                sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR));
+  PrivateResources[Resource] = CacheOffset;
+
+  *Offset += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE);
+  return CacheOffset;
+}
+
 /*
- * A function that adds the SSDT ACPI table.
+ * A function that adds the PPTT ACPI table.
+ *
+ * The hierarchy is emitted as packages, clusters, cores and, on cpus with
+ * more than one thread per core, threads. Every core owns its L1 caches,
+ * every cluster its L2 cache and every package the L3 cache if there is one.
  */
 EFI_STATUS
 AddPpttTable (
   IN EFI_ACPI_TABLE_PROTOCOL  *AcpiTable
   )
 {
-  EFI_STATUS            Status;
-  UINTN                 TableHandle;
-  UINT32                TableSize;
-  EFI_PHYSICAL_ADDRESS  PageAddress;
-  UINT8                 *New;
-  UINT32                CpuId;
-  UINT32                NumCores = PcdGet32 (PcdCoreCount);
-
-  EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  L1DCache = SBSAQEMU_ACPI_PPTT_L1_D_CACHE_STRUCT;
-  EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  L1ICache = SBSAQEMU_ACPI_PPTT_L1_I_CACHE_STRUCT;
-  EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE  L2Cache  = SBSAQEMU_ACPI_PPTT_L2_CACHE_STRUCT;
-
+  EFI_STATUS                             Status;
+  UINTN                                  TableHandle;
+  UINT32                                 TableSize;
+  EFI_PHYSICAL_ADDRESS                   PageAddress;
+  UINT8                                  *New;
+  UINT32                                 *Order;
+  UINT32                                 Index;
+  UINT32                                 Pos;
+  UINT32                                 Offset;
+  UINT32                                 NumPackages;
+  UINT32                                 NumClusters;
+  UINT32                                 NumCores;
+  BOOLEAN                                HasThreads;
+  SBSAQEMU_TOPOLOGY_LEVEL                Level;
+  UINT32                                 PackageOffset;
+  UINT32                                 ClusterOffset;
+  UINT32                                 CoreOffset;
+  UINT32                                 L2Offset;
+  UINT32                                 L3Offset;
+  EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  *CorePtr;
+
+  EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  Package = SBSAQEMU_ACPI_PPTT_PACKAGE_STRUCT;
   EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  Cluster = SBSAQEMU_ACPI_PPTT_CLUSTER_STRUCT;
   EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  Core    = SBSAQEMU_ACPI_PPTT_CORE_STRUCT;
+  EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  Thread  = SBSAQEMU_ACPI_PPTT_THREAD_STRUCT;
 
   EFI_ACPI_DESCRIPTION_HEADER  Header =
     SBSAQEMU_ACPI_HEADER (
@@ -408,11 +886,73 @@ AddPpttTable (
       EFI_ACPI_6_3_PROCESSOR_PROPERTIES_TOPOLOGY_TABLE_REVISION
       );
 
+  // Sort the cpus by location, so that every node precedes its children
+  Order = AllocatePool (mCpuCount * sizeof (UINT32));
+  if (Order == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Index = 0; Index < mCpuCount; Index++) {
+    for (Pos = Index;
+         (Pos > 0) &&
+         (TopologyCompare (&mCpuTopology[Order[Pos - 1]], &mCpuTopology[Index]) > 0);
+         Pos--)
+    {
+      Order[Pos] = Order[Pos - 1];
+    }
+
+    Order[Pos] = Index;
+  }
+
+  // Count the nodes of each level to size the table
+  NumPackages = 0;
+  NumClusters = 0;
+  NumCores    = 0;
+  HasThreads  = FALSE;
+  for (Index = 0; Index < mCpuCount; Index++) {
+    Level = (Index == 0) ? SbsaQemuTopologySocket :
+            TopologyDifference (
+              &mCpuTopology[Order[Index - 1]],
+              &mCpuTopology[Order[Index]]
+              );
+    if (Level <= SbsaQemuTopologySocket) {
+      NumPackages++;
+    }
+
+    if (Level <= SbsaQemuTopologyCluster) {
+      NumClusters++;
+    }
+
+    if (Level <= SbsaQemuTopologyCore) {
+      NumCores++;
+    } else {
+      HasThreads = TRUE;
+    }
+  }
+
   TableSize = sizeof (EFI_ACPI_DESCRIPTION_HEADER) +
-              sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) +
-              (sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE) * 3) +
-              (sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) * NumCores) +
-              (sizeof (UINT32) * 2 * NumCores);
+              (sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) * NumPackages) +
+              ((sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) + sizeof (UINT32) +
+                sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE)) * NumClusters) +
+              ((sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) + (2 * sizeof (UINT32)) +
+                (2 * sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE))) * NumCores);
+  if (mHasL3Cache) {
+    TableSize += (sizeof (UINT32) + sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE)) * NumPackages;
+  }
+
+  if (HasThreads) {
+    TableSize += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR) * mCpuCount;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: %d packages, %d clusters, %d cores, %d cpus\n",
+    __func__,
+    NumPackages,
+    NumClusters,
+    NumCores,
+    mCpuCount
+    ));
 
   Status = gBS->AllocatePages (
                   AllocateAnyPages,
@@ -422,6 +962,7 @@ AddPpttTable (
                   );
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "Failed to allocate pages for PPTT table\n"));
+    FreePool (Order);
     return EFI_OUT_OF_RESOURCES;
   }
 
@@ -431,41 +972,195 @@ AddPpttTable (
   // Add the ACPI Description table header
   CopyMem (New, &Header, sizeof (EFI_ACPI_DESCRIPTION_HEADER));
   ((EFI_ACPI_DESCRIPTION_HEADER *)New)->Length = TableSize;
-  New                                         += sizeof (EFI_ACPI_DESCRIPTION_HEADER);
+  Offset                                       = sizeof (EFI_ACPI_DESCRIPTION_HEADER);
+
+  PackageOffset = 0;
+  ClusterOffset = 0;
+  CoreOffset    = 0;
+  L2Offset      = 0;
+  L3Offset      = 0;
+
+  for (Index = 0; Index < mCpuCount; Index++) {
+    Level = (Index == 0) ? SbsaQemuTopologySocket :
+            TopologyDifference (
+              &mCpuTopology[Order[Index - 1]],
+              &mCpuTopology[Order[Index]]
+              );
+
+    if (Level <= SbsaQemuTopologySocket) {
+      PackageOffset = AddPpttProcessor (New, &Offset, &Package, 0, 0, mHasL3Cache ? 1 : 0);
+      if (mHasL3Cache) {
+        L3Offset = AddPpttCache (New, &Offset, PackageOffset, 0, &mL3Cache, 0);
+      }
+    }
+
+    if (Level <= SbsaQemuTopologyCluster) {
+      ClusterOffset = AddPpttProcessor (New, &Offset, &Cluster, PackageOffset, 0, 1);
+      L2Offset      = AddPpttCache (New, &Offset, ClusterOffset, 0, &mL2Cache, L3Offset);
+    }
+
+    if (Level <= SbsaQemuTopologyCore) {
+      CoreOffset = AddPpttProcessor (New, &Offset, &Core, ClusterOffset, Order[Index], 2);
+      AddPpttCache (New, &Offset, CoreOffset, 0, &mL1DCache, L2Offset);
+      AddPpttCache (New, &Offset, CoreOffset, 1, &mL1ICache, L2Offset);
+
+      if (HasThreads) {
+        // The threads are the leaves, the core only groups them
+        CorePtr                             = (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR *)(New + CoreOffset);
+        CorePtr->Flags.AcpiProcessorIdValid = EFI_ACPI_6_3_PPTT_PROCESSOR_ID_INVALID;
+        CorePtr->Flags.NodeIsALeaf          = EFI_ACPI_6_3_PPTT_NODE_IS_NOT_LEAF;
+        CorePtr->AcpiProcessorId            = 0;
+      }
+    }
+
+    if (HasThreads) {
+      AddPpttProcessor (New, &Offset, &Thread, CoreOffset, Order[Index], 0);
+    }
+  }
+
+  ASSERT (Offset == TableSize);
+  FreePool (Order);
+
+  // Perform Checksum
+  AcpiPlatformChecksum ((UINT8 *)PageAddress, TableSize);
+
+  Status = AcpiTable->InstallAcpiTable (
+                        AcpiTable,
+                        (EFI_ACPI_COMMON_HEADER *)PageAddress,
+                        TableSize,
+                        &TableHandle
+                        );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to install PPTT table\n"));
+  }
 
-  // Add the Cluster PPTT structure
-  CopyMem (New, &Cluster, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR));
-  New += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR);
+  return Status;
+}
 
-  // Add L1 D Cache structure
-  CopyMem (New, &L1DCache, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE));
-  ((EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE *)New)->NextLevelOfCache = L2_CACHE_INDEX;
-  New                                                         += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE);
+/**
+  Return the number of NUMA nodes described by the device tree, i.e. the
+  highest numa-node-id of any cpu or memory range plus one.
 
-  // Add L1 I Cache structure
-  CopyMem (New, &L1ICache, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE));
-  ((EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE *)New)->NextLevelOfCache = L2_CACHE_INDEX;
-  New                                                         += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE);
+  @retval UINT32  Number of NUMA nodes, 1 on non-NUMA configurations.
+**/
+STATIC
+UINT32
+GetNumaNodeCount (
+  VOID
+  )
+{
+  EFI_HOB_GUID_TYPE     *MemoryNodeHob;
+  SBSAQEMU_MEMORY_NODE  *MemoryNodes;
+  UINTN                 NodeCount;
+  UINTN                 Index;
+  UINT32                NumaNodeCount;
 
-  // Add L2 Cache structure
-  CopyMem (New, &L2Cache, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE));
-  ((EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE *)New)->NextLevelOfCache = 0; /* L2 is LLC */
-  New                                                         += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_CACHE);
+  NumaNodeCount = 1;
 
-  for (CpuId = 0; CpuId < NumCores; CpuId++) {
-    EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR  *CorePtr;
-    UINT32                                 *PrivateResourcePtr;
+  for (Index = 0; Index < mCpuCount; Index++) {
+    NumaNodeCount = MAX (NumaNodeCount, mCpuTopology[Index].NumaNodeId + 1);
+  }
 
-    CopyMem (New, &Core, sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR));
-    CorePtr                  = (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR *)New;
-    CorePtr->Parent          = CLUSTER_INDEX;
-    CorePtr->AcpiProcessorId = CpuId;
-    New                     += sizeof (EFI_ACPI_6_3_PPTT_STRUCTURE_PROCESSOR);
+  MemoryNodeHob = GetFirstGuidHob (&gQemuSbsaPkgMemoryNodeHobGuid);
+  if (MemoryNodeHob != NULL) {
+    MemoryNodes = GET_GUID_HOB_DATA (MemoryNodeHob);
+    NodeCount   = GET_GUID_HOB_DATA_SIZE (MemoryNodeHob) / sizeof (SBSAQEMU_MEMORY_NODE);
+    for (Index = 0; Index < NodeCount; Index++) {
+      NumaNodeCount = MAX (NumaNodeCount, MemoryNodes[Index].NumaNodeId + 1);
+    }
+  }
+
+  return NumaNodeCount;
+}
 
-    PrivateResourcePtr    = (UINT32 *)New;
-    PrivateResourcePtr[0] = L1_D_CACHE_INDEX;
-    PrivateResourcePtr[1] = L1_I_CACHE_INDEX;
-    New                  += (2 * sizeof (UINT32));
+/*
+ * A function that adds the SRAT ACPI table.
+ *
+ * Memory ranges come from the memory node HOB published by PlatformPeiLib,
+ * the proximity domain of every GICC from the cpu table.
+ */
+EFI_STATUS
+AddSratTable (
+  IN EFI_ACPI_TABLE_PROTOCOL  *AcpiTable
+  )
+{
+  EFI_STATUS                              Status;
+  UINTN                                   TableHandle;
+  UINT32                                  TableSize;
+  EFI_PHYSICAL_ADDRESS                    PageAddress;
+  UINT8                                   *New;
+  EFI_HOB_GUID_TYPE                       *MemoryNodeHob;
+  SBSAQEMU_MEMORY_NODE                    *MemoryNodes;
+  UINTN                                   NodeCount;
+  UINTN                                   Index;
+  EFI_ACPI_6_3_MEMORY_AFFINITY_STRUCTURE  *Memory;
+  EFI_ACPI_6_3_GICC_AFFINITY_STRUCTURE    *Gicc;
+
+  EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER  Header = {
+    SBSAQEMU_ACPI_HEADER (
+      EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_SIGNATURE,
+      EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER,
+      EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_REVISION
+      ),
+    1, /* Reserved1, must be 1 for backward compatibility */
+    EFI_ACPI_RESERVED_QWORD
+  };
+
+  MemoryNodeHob = GetFirstGuidHob (&gQemuSbsaPkgMemoryNodeHobGuid);
+  if (MemoryNodeHob == NULL) {
+    DEBUG ((DEBUG_ERROR, "Failed to find the memory node HOB\n"));
+    return EFI_NOT_FOUND;
+  }
+
+  MemoryNodes = GET_GUID_HOB_DATA (MemoryNodeHob);
+  NodeCount   = GET_GUID_HOB_DATA_SIZE (MemoryNodeHob) / sizeof (SBSAQEMU_MEMORY_NODE);
+
+  TableSize = sizeof (EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER) +
+              (sizeof (EFI_ACPI_6_3_MEMORY_AFFINITY_STRUCTURE) * NodeCount) +
+              (sizeof (EFI_ACPI_6_3_GICC_AFFINITY_STRUCTURE) * mCpuCount);
+
+  Status = gBS->AllocatePages (
+                  AllocateAnyPages,
+                  EfiACPIReclaimMemory,
+                  EFI_SIZE_TO_PAGES (TableSize),
+                  &PageAddress
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to allocate pages for SRAT table\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  New = (UINT8 *)(UINTN)PageAddress;
+  ZeroMem (New, TableSize);
+
+  // Add the ACPI Description table header
+  CopyMem (New, &Header, sizeof (EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER));
+  ((EFI_ACPI_DESCRIPTION_HEADER *)New)->Length = TableSize;
+  New                                         += sizeof (EFI_ACPI_6_3_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER);
+
+  // Add a Memory Affinity structure for every memory range
+  for (Index = 0; Index < NodeCount; Index++) {
+    Memory                  = (EFI_ACPI_6_3_MEMORY_AFFINITY_STRUCTURE *)New;
+    Memory->Type            = EFI_ACPI_6_3_MEMORY_AFFINITY;
+    Memory->Length          = sizeof (EFI_ACPI_6_3_MEMORY_AFFINITY_STRUCTURE);
+    Memory->ProximityDomain = MemoryNodes[Index].NumaNodeId;
+    Memory->AddressBaseLow  = (UINT32)MemoryNodes[Index].Base;
+    Memory->AddressBaseHigh = (UINT32)RShiftU64 (MemoryNodes[Index].Base, 32);
+    Memory->LengthLow       = (UINT32)MemoryNodes[Index].Size;
+    Memory->LengthHigh      = (UINT32)RShiftU64 (MemoryNodes[Index].Size, 32);
+    Memory->Flags           = EFI_ACPI_6_3_MEMORY_ENABLED;
+    New                    += sizeof (EFI_ACPI_6_3_MEMORY_AFFINITY_STRUCTURE);
+  }
+
+  // Add a GICC Affinity structure for every cpu
+  for (Index = 0; Index < mCpuCount; Index++) {
+    Gicc                   = (EFI_ACPI_6_3_GICC_AFFINITY_STRUCTURE *)New;
+    Gicc->Type             = EFI_ACPI_6_3_GICC_AFFINITY;
+    Gicc->Length           = sizeof (EFI_ACPI_6_3_GICC_AFFINITY_STRUCTURE);
+    Gicc->ProximityDomain  = mCpuTopology[Index].NumaNodeId;
+    Gicc->AcpiProcessorUid = (UINT32)Index;
+    Gicc->Flags            = EFI_ACPI_6_3_GICC_ENABLED;
+    New                   += sizeof (EFI_ACPI_6_3_GICC_AFFINITY_STRUCTURE);
   }
 
   // Perform Checksum
@@ -478,7 +1173,116 @@ AddPpttTable (
                         &TableHandle
                         );
   if (EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_ERROR, "Failed to install PPTT table\n"));
+    DEBUG ((DEBUG_ERROR, "Failed to install SRAT table\n"));
+  }
+
+  return Status;
+}
+
+/*
+ * A function that adds the SLIT ACPI table.
+ *
+ * Distances default to 10 within a node and 20 between nodes, and are
+ * overridden by the distance-matrix of the numa-distance-map-v1 node. A
+ * distance given in one direction only applies to both.
+ */
+EFI_STATUS
+AddSlitTable (
+  IN EFI_ACPI_TABLE_PROTOCOL  *AcpiTable,
+  IN UINT32                   NumaNodeCount
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 TableHandle;
+  UINT32                TableSize;
+  EFI_PHYSICAL_ADDRESS  PageAddress;
+  UINT8                 *Matrix;
+  VOID                  *Fdt;
+  INT32                 Node;
+  CONST UINT32          *Prop;
+  INT32                 Len;
+  UINT32                Entries;
+  UINT32                Pass;
+  UINT32                Index;
+  UINT32                From;
+  UINT32                To;
+  UINT32                Distance;
+
+  EFI_ACPI_6_3_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER  Header = {
+    SBSAQEMU_ACPI_HEADER (
+      EFI_ACPI_6_3_SYSTEM_LOCALITY_INFORMATION_TABLE_SIGNATURE,
+      EFI_ACPI_6_3_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER,
+      EFI_ACPI_6_3_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_REVISION
+      ),
+    0 /* NumberOfSystemLocalities */
+  };
+
+  TableSize = sizeof (EFI_ACPI_6_3_SYSTEM_LOCALITY_DISTANCE_INFORMATION_TABLE_HEADER) +
+              (NumaNodeCount * NumaNodeCount);
+
+  Status = gBS->AllocatePages (
+                  AllocateAnyPages,
+                  EfiACPIReclaimMemory,
+                  EFI_SIZE_TO_PAGES (TableSize),
+                  &PageAddress
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to allocate pages for SLIT table\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // Add the ACPI Description table header
+  Header.NumberOfSystemLocalities = NumaNodeCount;
+  CopyMem ((VOID *)(UINTN)PageAddress, &Header, sizeof (Header));
+  ((EFI_ACPI_DESCRIPTION_HEADER *)(UINTN)PageAddress)->Length = TableSize;
+  Matrix                                                      = (UINT8 *)(UINTN)PageAddress + sizeof (Header);
+
+  for (From = 0; From < NumaNodeCount; From++) {
+    for (To = 0; To < NumaNodeCount; To++) {
+      Matrix[(From * NumaNodeCount) + To] = (From == To) ? 10 : 20;
+    }
+  }
+
+  Fdt = (VOID *)(UINTN)FixedPcdGet64 (PcdDeviceTreeInitialBaseAddress);
+  if ((Fdt != NULL) && (fdt_check_header (Fdt) == 0)) {
+    Node = fdt_node_offset_by_compatible (Fdt, -1, "numa-distance-map-v1");
+    Prop = (Node >= 0) ? fdt_getprop (Fdt, Node, "distance-matrix", &Len) : NULL;
+    if (Prop != NULL) {
+      Entries = (UINT32)Len / (3 * sizeof (UINT32));
+
+      // The first pass fills both directions, the second one restores the
+      // distances that are given explicitly for the reverse direction.
+      for (Pass = 0; Pass < 2; Pass++) {
+        for (Index = 0; Index < Entries; Index++) {
+          From     = fdt32_to_cpu (ReadUnaligned32 (&Prop[(3 * Index)]));
+          To       = fdt32_to_cpu (ReadUnaligned32 (&Prop[(3 * Index) + 1]));
+          Distance = fdt32_to_cpu (ReadUnaligned32 (&Prop[(3 * Index) + 2]));
+          if ((From >= NumaNodeCount) || (To >= NumaNodeCount)) {
+            continue;
+          }
+
+          // 255 means unreachable in the SLIT
+          Distance                            = MIN (Distance, 254);
+          Matrix[(From * NumaNodeCount) + To] = (UINT8)Distance;
+          if (Pass == 0) {
+            Matrix[(To * NumaNodeCount) + From] = (UINT8)Distance;
+          }
+        }
+      }
+    }
+  }
+
+  // Perform Checksum
+  AcpiPlatformChecksum ((UINT8 *)PageAddress, TableSize);
+
+  Status = AcpiTable->InstallAcpiTable (
+                        AcpiTable,
+                        (EFI_ACPI_COMMON_HEADER *)PageAddress,
+                        TableSize,
+                        &TableHandle
+                        );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to install SLIT table\n"));
   }
 
   return Status;
@@ -494,11 +1298,19 @@ InitializeSbsaQemuAcpiDxe (
   EFI_STATUS               Status;
   EFI_ACPI_TABLE_PROTOCOL  *AcpiTable;
   UINT32                   NumCores;
+  UINT32                   NumaNodeCount;
 
   // Get the number of CPUs
   NumCores = GetCpuCount ();
   ASSERT (PcdGet32 (PcdCoreCount) == NumCores);
 
+  // Gather MPIDRs and topology once for the MADT and PPTT
+  Status = InitCpuTopology (NumCores);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed to build cpu topology\n"));
+    return Status;
+  }
+
   // Check if ACPI Table Protocol has been installed
   Status = gBS->LocateProtocol (
                   &gEfiAcpiTableProtocolGuid,
@@ -525,5 +1337,22 @@ InitializeSbsaQemuAcpiDxe (
     DEBUG ((DEBUG_ERROR, "Failed to add PPTT table\n"));
   }
 
+  // Only describe memory and cpu affinity on NUMA configurations
+  NumaNodeCount = GetNumaNodeCount ();
+  if (NumaNodeCount > 1) {
+    Status = AddSratTable (AcpiTable);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "Failed to add SRAT table\n"));
+    }
+
+    Status = AddSlitTable (AcpiTable, NumaNodeCount);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "Failed to add SLIT table\n"));
+    }
+  }
+
+  FreePool (mCpuTopology);
+  mCpuTopology = NULL;
+
   return EFI_SUCCESS;
 }
@@ -127,7 +127,7 @@ typedef struct {
 //
 #define VRING_DESC_F_NEXT      BIT0 // more descriptors in this request
 #define VRING_DESC_F_WRITE     BIT1 // buffer to be written *by the host*
-#define VRING_DESC_F_INDIRECT  BIT2 // unused
+#define VRING_DESC_F_INDIRECT  BIT2 // buffer is a table of descriptors
 
 #pragma pack(1)
 typedef struct {
@@ -138,13 +138,77 @@ typedef struct {
 } VRING_DESC;
 #pragma pack()
 
+//
+// virtio-1.1, 2.7 Packed Virtqueues
+//
+// The descriptor ring takes the role of all three areas of the split layout
+// above; the driver and the device take turns in owning each descriptor,
+// signalled by the AVAIL and USED flags, relative to wrap counters that flip
+// whenever the respective side wraps around the ring.
+//
+#define VRING_PACKED_DESC_F_AVAIL  BIT7
+#define VRING_PACKED_DESC_F_USED   BIT15
+
+#pragma pack(1)
+typedef struct {
+  UINT64    Addr;
+  UINT32    Len;
+  UINT16    Id;
+  UINT16    Flags; // VRING_DESC_F_* and VRING_PACKED_DESC_F_*
+} VRING_PACKED_DESC;
+#pragma pack()
+
+//
+// virtio-1.1, 2.7.14 Event Suppression Structure Layout
+//
+#define VRING_PACKED_EVENT_FLAG_ENABLE   0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE  0x1
+#define VRING_PACKED_EVENT_FLAG_DESC     0x2 // with VIRTIO_F_RING_EVENT_IDX
+
+#define VRING_PACKED_EVENT_F_WRAP_CTR  BIT15
+
+#pragma pack(1)
+typedef struct {
+  UINT16    OffWrap; // descriptor offset, and wrap counter in bit 15
+  UINT16    Flags;   // VRING_PACKED_EVENT_FLAG_*
+} VRING_PACKED_EVENT;
+#pragma pack()
+
 typedef struct {
-  UINTN                  NumPages;
-  VOID                   *Base;  // deallocate only this field
-  volatile VRING_DESC    *Desc;  // QueueSize elements
-  VRING_AVAIL            Avail;
-  VRING_USED             Used;
-  UINT16                 QueueSize;
+  UINTN                          NumPages;
+  VOID                           *Base;       // deallocate only this field
+  volatile VRING_DESC            *Desc;       // QueueSize elements
+  VRING_AVAIL                    Avail;
+  VRING_USED                     Used;
+  UINT16                         QueueSize;
+  //
+  // With VIRTIO_F_RING_PACKED, Desc, Avail and Used are NULL, and the ring
+  // consists of the following areas instead.
+  //
+  BOOLEAN                        Packed;
+  volatile VRING_PACKED_DESC     *PackedDesc; // QueueSize elements
+  volatile VRING_PACKED_EVENT    *DriverEvent;
+  volatile VRING_PACKED_EVENT    *DeviceEvent;
+  //
+  // Guest-private state, maintained by VirtioLib; the host never sees it.
+  //
+  BOOLEAN                        EventIdx;    // VIRTIO_F_RING_EVENT_IDX
+  UINT32                         SpinBudget;  // busy-polls before sleeping
+  UINT16                         UsedCount;   // used elements consumed, mod 2^16
+  //
+  // Packed ring bookkeeping. The flags of the head descriptor of the chain
+  // being built are stashed in HeadFlags, and written by VirtioSubmit() only,
+  // so that the host sees the chain complete or not at all. ChainLen is
+  // indexed by buffer ID (head descriptor index), and records the number of
+  // ring descriptors that the buffer occupies.
+  //
+  UINT16                         NextAvail;
+  BOOLEAN                        AvailWrap;
+  UINT16                         HeadAvail;
+  UINT16                         HeadFlags;
+  UINT16                         NextUsed;
+  BOOLEAN                        UsedWrap;
+  UINT16                         *ChainLen;   // QueueSize elements
 } VRING;
 
 //
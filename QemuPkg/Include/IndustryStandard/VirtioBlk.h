@@ -34,6 +34,19 @@ typedef struct {
   UINT8                  Sectors;
   UINT32                 BlkSize;
   VIRTIO_BLK_TOPOLOGY    Topology;
+  //
+  // virtio-1.1, 5.2.4 Device configuration layout
+  //
+  UINT8                  WriteBack;
+  UINT8                  Unused0;
+  UINT16                 NumQueues;
+  UINT32                 MaxDiscardSectors;
+  UINT32                 MaxDiscardSeg;
+  UINT32                 DiscardSectorAlignment;
+  UINT32                 MaxWriteZeroesSectors;
+  UINT32                 MaxWriteZeroesSeg;
+  UINT8                  WriteZeroesMayUnmap;
+  UINT8                  Unused1[3];
 } VIRTIO_BLK_CONFIG;
 #pragma pack()
 
@@ -54,6 +67,13 @@ typedef struct {
 #define VIRTIO_BLK_F_FLUSH     BIT9  // identical to "write cache enabled"
 #define VIRTIO_BLK_F_TOPOLOGY  BIT10 // information on optimal I/O alignment
 
+//
+// virtio-1.1, 5.2.3 Feature bits
+//
+#define VIRTIO_BLK_F_MQ            BIT12 // NumQueues request queues
+#define VIRTIO_BLK_F_DISCARD       BIT13
+#define VIRTIO_BLK_F_WRITE_ZEROES  BIT14
+
 //
 // We keep the status byte separate from the rest of the virtio-blk request
 // header. See description of historical scattering at the end of Appendix D:
@@ -73,8 +93,24 @@ typedef struct {
 #define VIRTIO_BLK_T_SCSI_CMD_OUT  0x00000003
 #define VIRTIO_BLK_T_FLUSH         0x00000004
 #define VIRTIO_BLK_T_FLUSH_OUT     0x00000005
+#define VIRTIO_BLK_T_DISCARD       0x0000000B
+#define VIRTIO_BLK_T_WRITE_ZEROES  0x0000000D
 #define VIRTIO_BLK_T_BARRIER       BIT31
 
+//
+// virtio-1.1, 5.2.6 Device Operation: the data buffer of VIRTIO_BLK_T_DISCARD
+// and VIRTIO_BLK_T_WRITE_ZEROES requests is an array of these segments.
+//
+#pragma pack(1)
+typedef struct {
+  UINT64    Sector;
+  UINT32    NumSectors;
+  UINT32    Flags;
+} VIRTIO_BLK_DISCARD_WRITE_ZEROES;
+#pragma pack()
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP  BIT0
+
 #define VIRTIO_BLK_S_OK      0x00
 #define VIRTIO_BLK_S_IOERR   0x01
 #define VIRTIO_BLK_S_UNSUPP  0x02
@@ -0,0 +1,396 @@
+/** @file
+
+  Virtio Filesystem Device specific type and macro definitions.
+
+  The device carries FUSE requests and responses over its request queues; the
+  FUSE wire format below follows the Linux kernel's <linux/fuse.h>, protocol
+  version 7.31. Only the messages that VirtioFsDxe uses are declared.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _VIRTIO_FS_H_
+#define _VIRTIO_FS_H_
+
+#include <IndustryStandard/Virtio.h>
+
+//
+// virtio-1.2, 5.11.4 Device configuration layout
+//
+#define VIRTIO_FS_TAG_BYTES  36
+
+#pragma pack (1)
+typedef struct {
+  UINT8     Tag[VIRTIO_FS_TAG_BYTES];
+  UINT32    NumReqQueues;
+} VIRTIO_FS_CONFIG;
+#pragma pack ()
+
+#define OFFSET_OF_VFS(Field)  OFFSET_OF (VIRTIO_FS_CONFIG, Field)
+#define SIZE_OF_VFS(Field)    (sizeof ((VIRTIO_FS_CONFIG *) 0)->Field)
+
+//
+// virtio-1.2, 5.11.2 Virtqueues: queue #0 is the high priority queue, the
+// request queues follow it.
+//
+#define VIRTIO_FS_HIPRIO_QUEUE   0
+#define VIRTIO_FS_REQUEST_QUEUE  1
+
+//
+// FUSE protocol version that VirtioFsDxe implements.
+//
+#define VIRTIO_FS_FUSE_MAJOR  7
+#define VIRTIO_FS_FUSE_MINOR  31
+
+//
+// The node ID of the root directory of the file system.
+//
+#define VIRTIO_FS_FUSE_ROOT_NODE_ID  1
+
+typedef enum {
+  VirtioFsFuseOpLookup      = 1,
+  VirtioFsFuseOpForget      = 2,
+  VirtioFsFuseOpGetAttr     = 3,
+  VirtioFsFuseOpSetAttr     = 4,
+  VirtioFsFuseOpMkDir       = 9,
+  VirtioFsFuseOpUnlink      = 10,
+  VirtioFsFuseOpRmDir       = 11,
+  VirtioFsFuseOpOpen        = 14,
+  VirtioFsFuseOpRead        = 15,
+  VirtioFsFuseOpWrite       = 16,
+  VirtioFsFuseOpStatFs      = 17,
+  VirtioFsFuseOpRelease     = 18,
+  VirtioFsFuseOpFsync       = 20,
+  VirtioFsFuseOpInit        = 26,
+  VirtioFsFuseOpOpenDir     = 27,
+  VirtioFsFuseOpReleaseDir  = 29,
+  VirtioFsFuseOpCreate      = 35,
+  VirtioFsFuseOpBatchForget = 42,
+  VirtioFsFuseOpReadDirPlus = 44,
+  VirtioFsFuseOpRename2     = 45,
+} VIRTIO_FS_FUSE_OPCODE;
+
+//
+// Flags of VIRTIO_FS_FUSE_INIT_IN and VIRTIO_FS_FUSE_INIT_OUT.
+//
+#define VIRTIO_FS_FUSE_INIT_MAX_PAGES  BIT22
+
+//
+// Flags of VIRTIO_FS_FUSE_SETATTR_IN.Valid.
+//
+#define VIRTIO_FS_FUSE_SETATTR_MODE   BIT0
+#define VIRTIO_FS_FUSE_SETATTR_SIZE   BIT3
+#define VIRTIO_FS_FUSE_SETATTR_ATIME  BIT4
+#define VIRTIO_FS_FUSE_SETATTR_MTIME  BIT5
+#define VIRTIO_FS_FUSE_SETATTR_FH     BIT6
+
+//
+// Flags of VIRTIO_FS_FUSE_RENAME2_IN.Flags.
+//
+#define VIRTIO_FS_FUSE_RENAME2_NOREPLACE  BIT0
+
+//
+// Linux open(2) flags, file mode bits and errno values that travel in FUSE
+// messages.
+//
+#define VIRTIO_FS_LINUX_O_RDONLY  0x0
+#define VIRTIO_FS_LINUX_O_RDWR    0x2
+
+#define VIRTIO_FS_LINUX_S_IFMT   0170000
+#define VIRTIO_FS_LINUX_S_IFDIR  0040000
+#define VIRTIO_FS_LINUX_S_IFREG  0100000
+#define VIRTIO_FS_LINUX_S_IWUSR  0000200
+#define VIRTIO_FS_LINUX_S_IWGRP  0000020
+#define VIRTIO_FS_LINUX_S_IWOTH  0000002
+
+#define VIRTIO_FS_LINUX_EPERM         1
+#define VIRTIO_FS_LINUX_ENOENT        2
+#define VIRTIO_FS_LINUX_EBADF         9
+#define VIRTIO_FS_LINUX_ENOMEM        12
+#define VIRTIO_FS_LINUX_EACCES        13
+#define VIRTIO_FS_LINUX_EFAULT        14
+#define VIRTIO_FS_LINUX_EBUSY         16
+#define VIRTIO_FS_LINUX_EEXIST        17
+#define VIRTIO_FS_LINUX_EXDEV         18
+#define VIRTIO_FS_LINUX_ENOTDIR       20
+#define VIRTIO_FS_LINUX_EISDIR        21
+#define VIRTIO_FS_LINUX_EINVAL        22
+#define VIRTIO_FS_LINUX_ENFILE        23
+#define VIRTIO_FS_LINUX_EMFILE        24
+#define VIRTIO_FS_LINUX_EFBIG         27
+#define VIRTIO_FS_LINUX_ENOSPC        28
+#define VIRTIO_FS_LINUX_EROFS         30
+#define VIRTIO_FS_LINUX_ENAMETOOLONG  36
+#define VIRTIO_FS_LINUX_ENOSYS        38
+#define VIRTIO_FS_LINUX_ENOTEMPTY     39
+#define VIRTIO_FS_LINUX_ELOOP         40
+#define VIRTIO_FS_LINUX_EDQUOT        122
+
+#pragma pack (1)
+//
+// Headers of every request and response.
+//
+typedef struct {
+  UINT32    Len;
+  UINT32    Opcode;
+  UINT64    Unique;
+  UINT64    NodeId;
+  UINT32    Uid;
+  UINT32    Gid;
+  UINT32    Pid;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_IN_HEADER;
+
+typedef struct {
+  UINT32    Len;
+  INT32     Error;
+  UINT64    Unique;
+} VIRTIO_FS_FUSE_OUT_HEADER;
+
+//
+// Attributes of a node, and the responses that carry them.
+//
+typedef struct {
+  UINT64    Ino;
+  UINT64    Size;
+  UINT64    Blocks;
+  UINT64    Atime;
+  UINT64    Mtime;
+  UINT64    Ctime;
+  UINT32    AtimeNsec;
+  UINT32    MtimeNsec;
+  UINT32    CtimeNsec;
+  UINT32    Mode;
+  UINT32    Nlink;
+  UINT32    Uid;
+  UINT32    Gid;
+  UINT32    Rdev;
+  UINT32    BlkSize;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_ATTR;
+
+typedef struct {
+  UINT64                 NodeId;
+  UINT64                 Generation;
+  UINT64                 EntryValid;
+  UINT64                 AttrValid;
+  UINT32                 EntryValidNsec;
+  UINT32                 AttrValidNsec;
+  VIRTIO_FS_FUSE_ATTR    Attr;
+} VIRTIO_FS_FUSE_ENTRY_OUT;
+
+typedef struct {
+  UINT64                 AttrValid;
+  UINT32                 AttrValidNsec;
+  UINT32                 Dummy;
+  VIRTIO_FS_FUSE_ATTR    Attr;
+} VIRTIO_FS_FUSE_ATTR_OUT;
+
+//
+// FUSE_INIT
+//
+typedef struct {
+  UINT32    Major;
+  UINT32    Minor;
+  UINT32    MaxReadahead;
+  UINT32    Flags;
+} VIRTIO_FS_FUSE_INIT_IN;
+
+typedef struct {
+  UINT32    Major;
+  UINT32    Minor;
+  UINT32    MaxReadahead;
+  UINT32    Flags;
+  UINT16    MaxBackground;
+  UINT16    CongestionThreshold;
+  UINT32    MaxWrite;
+  UINT32    TimeGran;
+  UINT16    MaxPages;
+  UINT16    MapAlignment;
+  UINT32    Unused[8];
+} VIRTIO_FS_FUSE_INIT_OUT;
+
+//
+// The size of VIRTIO_FS_FUSE_INIT_OUT up to and including MaxWrite; servers
+// that speak protocol versions older than 7.23 send only this much.
+//
+#define VIRTIO_FS_FUSE_INIT_OUT_COMPAT_SIZE  24
+
+//
+// FUSE_FORGET and FUSE_BATCH_FORGET
+//
+typedef struct {
+  UINT64    NumberOfLookups;
+} VIRTIO_FS_FUSE_FORGET_IN;
+
+typedef struct {
+  UINT32    Count;
+  UINT32    Dummy;
+} VIRTIO_FS_FUSE_BATCH_FORGET_IN;
+
+typedef struct {
+  UINT64    NodeId;
+  UINT64    NumberOfLookups;
+} VIRTIO_FS_FUSE_FORGET_ONE;
+
+//
+// FUSE_GETATTR
+//
+typedef struct {
+  UINT32    GetAttrFlags;
+  UINT32    Dummy;
+  UINT64    FileHandle;
+} VIRTIO_FS_FUSE_GETATTR_IN;
+
+//
+// FUSE_SETATTR
+//
+typedef struct {
+  UINT32    Valid;
+  UINT32    Padding;
+  UINT64    FileHandle;
+  UINT64    Size;
+  UINT64    LockOwner;
+  UINT64    Atime;
+  UINT64    Mtime;
+  UINT64    Ctime;
+  UINT32    AtimeNsec;
+  UINT32    MtimeNsec;
+  UINT32    CtimeNsec;
+  UINT32    Mode;
+  UINT32    Unused4;
+  UINT32    Uid;
+  UINT32    Gid;
+  UINT32    Unused5;
+} VIRTIO_FS_FUSE_SETATTR_IN;
+
+//
+// FUSE_MKDIR; followed by the NUL-terminated name of the new directory.
+//
+typedef struct {
+  UINT32    Mode;
+  UINT32    Umask;
+} VIRTIO_FS_FUSE_MKDIR_IN;
+
+//
+// FUSE_OPEN and FUSE_OPENDIR
+//
+typedef struct {
+  UINT32    Flags;
+  UINT32    Unused;
+} VIRTIO_FS_FUSE_OPEN_IN;
+
+typedef struct {
+  UINT64    FileHandle;
+  UINT32    OpenFlags;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_OPEN_OUT;
+
+//
+// FUSE_CREATE; followed by the NUL-terminated name of the new file. The
+// response is a VIRTIO_FS_FUSE_ENTRY_OUT, followed by a
+// VIRTIO_FS_FUSE_OPEN_OUT.
+//
+typedef struct {
+  UINT32    Flags;
+  UINT32    Mode;
+  UINT32    Umask;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_CREATE_IN;
+
+//
+// FUSE_READ and FUSE_READDIRPLUS; the response is the data read.
+//
+typedef struct {
+  UINT64    FileHandle;
+  UINT64    Offset;
+  UINT32    Size;
+  UINT32    ReadFlags;
+  UINT64    LockOwner;
+  UINT32    Flags;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_READ_IN;
+
+//
+// FUSE_WRITE; followed by the data to write.
+//
+typedef struct {
+  UINT64    FileHandle;
+  UINT64    Offset;
+  UINT32    Size;
+  UINT32    WriteFlags;
+  UINT64    LockOwner;
+  UINT32    Flags;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_WRITE_IN;
+
+typedef struct {
+  UINT32    Size;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_WRITE_OUT;
+
+//
+// FUSE_STATFS
+//
+typedef struct {
+  UINT64    Blocks;
+  UINT64    Bfree;
+  UINT64    Bavail;
+  UINT64    Files;
+  UINT64    Ffree;
+  UINT32    Bsize;
+  UINT32    NameLen;
+  UINT32    Frsize;
+  UINT32    Padding;
+  UINT32    Spare[6];
+} VIRTIO_FS_FUSE_STATFS_OUT;
+
+//
+// FUSE_RELEASE and FUSE_RELEASEDIR
+//
+typedef struct {
+  UINT64    FileHandle;
+  UINT32    Flags;
+  UINT32    ReleaseFlags;
+  UINT64    LockOwner;
+} VIRTIO_FS_FUSE_RELEASE_IN;
+
+//
+// FUSE_FSYNC
+//
+typedef struct {
+  UINT64    FileHandle;
+  UINT32    FsyncFlags;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_FSYNC_IN;
+
+//
+// FUSE_RENAME2; followed by the NUL-terminated old name, and the
+// NUL-terminated new name.
+//
+typedef struct {
+  UINT64    NewDir;
+  UINT32    Flags;
+  UINT32    Padding;
+} VIRTIO_FS_FUSE_RENAME2_IN;
+
+//
+// One entry in the response to FUSE_READDIRPLUS. The name (not NUL-terminated)
+// follows, and the entry is padded to a multiple of 8 bytes.
+//
+typedef struct {
+  VIRTIO_FS_FUSE_ENTRY_OUT    Entry;
+  UINT64                      Ino;
+  UINT64                      Offset;
+  UINT32                      NameLen;
+  UINT32                      Type;
+} VIRTIO_FS_FUSE_DIRENTPLUS;
+#pragma pack ()
+
+#define VIRTIO_FS_FUSE_DIRENTPLUS_SIZE(NameLen) \
+  ALIGN_VALUE (sizeof (VIRTIO_FS_FUSE_DIRENTPLUS) + (NameLen), 8)
+
+#endif // _VIRTIO_FS_H_
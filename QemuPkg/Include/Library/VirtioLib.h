@@ -51,6 +51,44 @@ VirtioRingInit (
   OUT VRING                   *Ring
   );
 
+/**
+
+  Configure a virtio ring, in the layout and with the behavior that the
+  negotiated features call for.
+
+  With VIRTIO_F_RING_PACKED, the ring is set up in the packed layout of
+  virtio-1.1; otherwise in the split layout, see VirtioRingInit(). With
+  VIRTIO_F_RING_EVENT_IDX, Ring->EventIdx is set. Other feature bits are
+  ignored. Drivers only use the functions of this library to drive the ring,
+  so they need not care about the layout.
+
+  @param[in]  VirtIo     The virtio device which will use the ring.
+
+  @param[in]  QueueSize  The number of descriptors to allocate for the virtio
+                         ring, as requested by the host.
+
+  @param[in]  Features   The feature bits that the device accepted.
+
+  @param[out] Ring       The virtio ring to set up.
+
+  @retval EFI_SUCCESS           Allocation and setup successful.
+                                VirtioRingUninit() releases the ring.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+  @return                       Status codes propagated from
+                                VirtIo->AllocateSharedPages().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRingInitForFeatures (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  QueueSize,
+  IN  UINT64                  Features,
+  OUT VRING                   *Ring
+  );
+
 /**
 
   Map the ring buffer so that it can be accessed equally by both guest
@@ -106,6 +144,27 @@ typedef struct {
   UINT16    NextDescIdx;
 } DESC_INDICES;
 
+//
+// Indirect descriptor tables (VIRTIO_F_RING_INDIRECT_DESC), allocated in one
+// shared, bus master common buffer. Table #N is a run of DescPerTable
+// descriptors that a single ring descriptor can refer to, so that a request
+// occupies one ring descriptor regardless of its number of buffers.
+//
+// With a packed ring, the tables hold packed descriptors, accessed through
+// PackedDesc; Desc and PackedDesc alias the same memory.
+//
+typedef struct {
+  UINTN                       NumPages;
+  VOID                        *Base;
+  volatile VRING_DESC         *Desc;
+  volatile VRING_PACKED_DESC  *PackedDesc;
+  BOOLEAN                     Packed;
+  EFI_PHYSICAL_ADDRESS        DeviceAddress;
+  VOID                        *Mapping;
+  UINT16                      NumTables;
+  UINT16                      DescPerTable;
+} VRING_INDIRECT;
+
 /**
 
   Turn off interrupt notifications from the host, and prepare for appending
@@ -132,10 +191,11 @@ VirtioPrepare (
   This function implements the following section from virtio-0.9.5:
   - 2.4.1.1 Placing Buffers into the Descriptor Table
 
-  Free space is taken as granted, since the individual drivers support only
-  synchronous requests and host side status is processed in lock-step with
-  request submission. It is the calling driver's responsibility to verify the
-  ring size in advance.
+  Free space is taken as granted. Drivers that support only synchronous
+  requests process host side status in lock-step with request submission;
+  drivers that keep several requests in flight must assign disjoint descriptor
+  ranges to them. It is the calling driver's responsibility to verify the ring
+  size in advance.
 
   The caller is responsible for initializing *Indices with VirtioPrepare()
   first.
@@ -151,17 +211,23 @@ VirtioPrepare (
   @param[in] Flags                  A bitmask of VRING_DESC_F_* flags. The
                                     caller computes this mask dependent on
                                     further buffers to append and transfer
-                                    direction. VRING_DESC_F_INDIRECT is
-                                    unsupported. The VRING_DESC.Next field is
-                                    always set, but the host only interprets
-                                    it dependent on VRING_DESC_F_NEXT.
+                                    direction. VRING_DESC_F_INDIRECT is set
+                                    by VirtioAppendIndirect() only. The
+                                    VRING_DESC.Next field is always set, but
+                                    the host only interprets it dependent on
+                                    VRING_DESC_F_NEXT.
 
-  @param[in,out] Indices            Indices->HeadDescIdx is not accessed.
-                                    On input, Indices->NextDescIdx identifies
+  @param[in,out] Indices            On input, Indices->NextDescIdx identifies
                                     the next descriptor to carry the buffer.
                                     On output, Indices->NextDescIdx is
                                     incremented by one, modulo 2^16.
 
+                                    With a packed ring, descriptors are
+                                    always placed at the ring's next free
+                                    position, and Indices->HeadDescIdx serves
+                                    as the buffer ID that VirtioGetNextUsed()
+                                    reports.
+
 **/
 VOID
 EFIAPI
@@ -173,6 +239,231 @@ VirtioAppendDesc (
   IN OUT DESC_INDICES  *Indices
   );
 
+/**
+
+  Allocate and map indirect descriptor tables.
+
+  The calling driver must have negotiated VIRTIO_F_RING_INDIRECT_DESC.
+
+  @param[in]  VirtIo        The virtio device which will use the tables.
+
+  @param[in]  Ring          A ring that the tables will be used with. The
+                            tables take the descriptor layout of the ring
+                            type: split (virtio-1.0, 2.4.5.3) or packed
+                            (virtio-1.1, 2.7.7).
+
+  @param[in]  NumTables     The number of indirect tables to allocate.
+                            Typically one per request that the driver keeps
+                            in flight.
+
+  @param[in]  DescPerTable  The number of descriptors in each table.
+
+  @param[out] Indirect      The VRING_INDIRECT structure to set up.
+
+  @retval EFI_SUCCESS            The tables are ready to use.
+
+  @retval EFI_INVALID_PARAMETER  NumTables or DescPerTable is zero, or the
+                                 tables would hold more descriptors than
+                                 DESC_INDICES can address.
+
+  @return                        Status codes propagated from
+                                 VirtIo->AllocateSharedPages() and
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioIndirectInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  CONST VRING             *Ring,
+  IN  UINT16                  NumTables,
+  IN  UINT16                  DescPerTable,
+  OUT VRING_INDIRECT          *Indirect
+  );
+
+/**
+
+  Unmap and release indirect descriptor tables.
+
+  The caller is responsible to stop the host from using the tables before
+  invoking this function.
+
+  @param[in]     VirtIo    The virtio device which was using the tables.
+
+  @param[in,out] Indirect  The indirect tables to clean up.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VRING_INDIRECT          *Indirect
+  );
+
+/**
+
+  Prepare for appending descriptors to an indirect table.
+
+  @param[in]  Indirect  The indirect tables.
+
+  @param[in]  TableIdx  The table to fill in; must be smaller than
+                        Indirect->NumTables. The caller is responsible for not
+                        reusing a table while the host may access it.
+
+  @param[out] Indices   The DESC_INDICES structure to initialize, for
+                        VirtioIndirectAppendDesc() and VirtioAppendIndirect().
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPrepare (
+  IN     VRING_INDIRECT  *Indirect,
+  IN     UINT16          TableIdx,
+  OUT    DESC_INDICES    *Indices
+  );
+
+/**
+
+  Append a contiguous buffer to an indirect table.
+
+  The parameters are the same as those of VirtioAppendDesc(), except that the
+  buffer is placed in the indirect table identified by Indices (see
+  VirtioIndirectPrepare()), rather than in the descriptor table of the ring.
+  VRING_DESC_F_INDIRECT must not be set in Flags. The caller must not append
+  more than Indirect->DescPerTable buffers to one table.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectAppendDesc (
+  IN     VRING_INDIRECT  *Indirect,
+  IN     UINT64          BufferDeviceAddress,
+  IN     UINT32          BufferSize,
+  IN     UINT16          Flags,
+  IN OUT DESC_INDICES    *Indices
+  );
+
+/**
+
+  Append a descriptor referring to a filled-in indirect table to the virtio
+  ring.
+
+  The descriptor terminates the chain in the ring; virtio-1.0, 2.4.5.3.1
+  forbids combining VRING_DESC_F_INDIRECT with VRING_DESC_F_NEXT.
+
+  @param[in,out] Ring         The virtio ring to append the descriptor to.
+
+  @param[in] Indirect         The indirect tables.
+
+  @param[in] IndirectIndices  The indices that VirtioIndirectPrepare() and
+                              VirtioIndirectAppendDesc() have used to fill in
+                              the table.
+
+  @param[in,out] Indices      The ring indices, as for VirtioAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioAppendIndirect (
+  IN OUT VRING           *Ring,
+  IN     VRING_INDIRECT  *Indirect,
+  IN     DESC_INDICES    *IndirectIndices,
+  IN OUT DESC_INDICES    *Indices
+  );
+
+/**
+
+  Make the descriptor chain just built available to the host, and notify the
+  host about it, without waiting for the host to process the chain.
+
+  If Ring->EventIdx is set (that is, VIRTIO_F_RING_EVENT_IDX has been
+  negotiated), the notification is suppressed when the host has not asked for
+  it.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Ring     The virtio ring with descriptors to submit.
+
+  @param[in] Indices      Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain. Indices->NextDescIdx is
+                          only accessed with a packed ring, to learn the
+                          length of the chain.
+
+  @return              Error code from VirtIo->SetQueueNotify() if it fails.
+
+  @retval EFI_SUCCESS  Otherwise, the descriptor chain has been made available
+                       to the host. Completion can be detected with
+                       VirtioGetNextUsed().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioSubmit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VRING                   *Ring,
+  IN     DESC_INDICES            *Indices
+  );
+
+/**
+
+  Consume the next element from the used ring, if the host has produced one.
+
+  @param[in,out] Ring         The virtio ring to check. A packed ring tracks
+                              the position of the next used element itself.
+
+  @param[in,out] LastUsedIdx  On input, the free-running index of the next used
+                              element that the driver has not consumed yet. On
+                              output, incremented by one (modulo 2^16) if an
+                              element was consumed.
+
+  @param[out] HeadDescIdx     On success, the head descriptor index of the
+                              descriptor chain that the host processed.
+
+  @param[out] UsedLen         On success, the total number of bytes that the
+                              host wrote to the buffers of the descriptor
+                              chain. May be NULL if the caller doesn't care.
+
+  @retval EFI_SUCCESS    A used element has been consumed.
+
+  @retval EFI_NOT_READY  The host has not produced a new used element.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioGetNextUsed (
+  IN OUT VRING   *Ring,
+  IN OUT UINT16  *LastUsedIdx,
+  OUT    UINT16  *HeadDescIdx,
+  OUT    UINT32  *UsedLen     OPTIONAL
+  );
+
+/**
+
+  Wait until the host produces a used element beyond LastUsedIdx.
+
+  The function busy-polls the used ring for a while, adapted to the latency of
+  the device and limited by PcdVirtioPollSpinLimit, then falls back to
+  gBS->Stall() with an exponentially growing period.
+
+  @param[in,out] Ring     The virtio ring to wait on.
+
+  @param[in] LastUsedIdx  The free-running index of the next used element that
+                          the caller had not consumed yet, when it decided to
+                          wait. Callers that may race with another consumer of
+                          the ring pass a snapshot of Ring->UsedCount; the wait
+                          ends as soon as an element is consumed after that.
+
+**/
+VOID
+EFIAPI
+VirtioWaitUsed (
+  IN OUT VRING   *Ring,
+  IN     UINT16  LastUsedIdx
+  );
+
 /**
 
   Notify the host about the descriptor chain just built, and wait until the
@@ -184,9 +475,10 @@ VirtioAppendDesc (
 
   @param[in,out] Ring     The virtio ring with descriptors to submit.
 
-  @param[in] Indices      Indices->NextDescIdx is not accessed.
-                          Indices->HeadDescIdx identifies the head descriptor
-                          of the descriptor chain.
+  @param[in] Indices      Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain. Indices->NextDescIdx is
+                          only accessed with a packed ring, to learn the
+                          length of the chain.
 
   @param[out] UsedLen     On success, the total number of bytes, consecutively
                           across the buffers linked by the descriptor chain,
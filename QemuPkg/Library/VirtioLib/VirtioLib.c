@@ -13,6 +13,9 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/SynchronizationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
 #include <Library/VirtioLib.h>
@@ -51,11 +54,135 @@ VirtioRingInit (
   IN  UINT16                  QueueSize,
   OUT VRING                   *Ring
   )
+{
+  return VirtioRingInitForFeatures (VirtIo, QueueSize, 0, Ring);
+}
+
+/**
+
+  Configure a packed virtio ring.
+
+  Relevant sections from the virtio-1.1 spec:
+  - 2.7 Packed Virtqueues,
+  - 2.7.10 Driver and Device Ring Wrap Counters,
+  - 2.7.14 Event Suppression Structure Layout.
+
+  See VirtioRingInitForFeatures() for the parameters.
+
+**/
+STATIC
+EFI_STATUS
+VirtioPackedRingInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  QueueSize,
+  OUT VRING                   *Ring
+  )
 {
   EFI_STATUS      Status;
   UINTN           RingSize;
   volatile UINT8  *RingPagesPtr;
 
+  //
+  // The descriptor ring needs 16-byte alignment, the event suppression
+  // structures 4-byte alignment; laying them out back to back satisfies both.
+  //
+  RingSize = ALIGN_VALUE (
+               sizeof *Ring->PackedDesc * QueueSize +
+               sizeof *Ring->DriverEvent            +
+               sizeof *Ring->DeviceEvent,
+               EFI_PAGE_SIZE
+               );
+
+  Ring->ChainLen = AllocateZeroPool (sizeof *Ring->ChainLen * QueueSize);
+  if (Ring->ChainLen == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Ring->NumPages = EFI_SIZE_TO_PAGES (RingSize);
+  Status         = VirtIo->AllocateSharedPages (
+                             VirtIo,
+                             Ring->NumPages,
+                             &Ring->Base
+                             );
+  if (EFI_ERROR (Status)) {
+    FreePool (Ring->ChainLen);
+    Ring->ChainLen = NULL;
+    return Status;
+  }
+
+  SetMem (Ring->Base, RingSize, 0x00);
+  RingPagesPtr = Ring->Base;
+
+  Ring->PackedDesc = (volatile VOID *)RingPagesPtr;
+  RingPagesPtr    += sizeof *Ring->PackedDesc * QueueSize;
+
+  Ring->DriverEvent = (volatile VOID *)RingPagesPtr;
+  RingPagesPtr     += sizeof *Ring->DriverEvent;
+
+  Ring->DeviceEvent = (volatile VOID *)RingPagesPtr;
+  RingPagesPtr     += sizeof *Ring->DeviceEvent;
+
+  Ring->Packed    = TRUE;
+  Ring->QueueSize = QueueSize;
+
+  //
+  // virtio-1.1, 2.7.10: both wrap counters start at 1.
+  //
+  Ring->AvailWrap = TRUE;
+  Ring->UsedWrap  = TRUE;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Configure a virtio ring, in the layout and with the behavior that the
+  negotiated features call for.
+
+  With VIRTIO_F_RING_PACKED, the ring is set up in the packed layout of
+  virtio-1.1; otherwise in the split layout, see VirtioRingInit(). With
+  VIRTIO_F_RING_EVENT_IDX, Ring->EventIdx is set. Other feature bits are
+  ignored. Drivers only use the functions of this library to drive the ring,
+  so they need not care about the layout.
+
+  @param[in]  VirtIo     The virtio device which will use the ring.
+
+  @param[in]  QueueSize  The number of descriptors to allocate for the virtio
+                         ring, as requested by the host.
+
+  @param[in]  Features   The feature bits that the device accepted.
+
+  @param[out] Ring       The virtio ring to set up.
+
+  @retval EFI_SUCCESS           Allocation and setup successful.
+                                VirtioRingUninit() releases the ring.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+  @return                       Status codes propagated from
+                                VirtIo->AllocateSharedPages().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRingInitForFeatures (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  QueueSize,
+  IN  UINT64                  Features,
+  OUT VRING                   *Ring
+  )
+{
+  EFI_STATUS      Status;
+  UINTN           RingSize;
+  volatile UINT8  *RingPagesPtr;
+
+  ZeroMem (Ring, sizeof *Ring);
+  Ring->EventIdx   = (BOOLEAN)((Features & VIRTIO_F_RING_EVENT_IDX) != 0);
+  Ring->SpinBudget = PcdGet32 (PcdVirtioPollSpinLimit);
+
+  if ((Features & VIRTIO_F_RING_PACKED) != 0) {
+    return VirtioPackedRingInit (VirtIo, QueueSize, Ring);
+  }
+
   RingSize = ALIGN_VALUE (
                sizeof *Ring->Desc            * QueueSize +
                sizeof *Ring->Avail.Flags                 +
@@ -147,6 +274,10 @@ VirtioRingUninit (
   )
 {
   VirtIo->FreeSharedPages (VirtIo, Ring->NumPages, Ring->Base);
+  if (Ring->ChainLen != NULL) {
+    FreePool (Ring->ChainLen);
+  }
+
   SetMem (Ring, sizeof *Ring, 0x00);
 }
 
@@ -169,11 +300,28 @@ VirtioPrepare (
   OUT    DESC_INDICES  *Indices
   )
 {
-  //
-  // Prepare for virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device.
-  // We're going to poll the answer, the host should not send an interrupt.
-  //
-  *Ring->Avail.Flags = (UINT16)VRING_AVAIL_F_NO_INTERRUPT;
+  if (Ring->Packed) {
+    //
+    // virtio-1.1, 2.7.14: the DISABLE flag takes precedence over event
+    // indices, too.
+    //
+    Ring->DriverEvent->Flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+  } else {
+    //
+    // Prepare for virtio-0.9.5, 2.4.2 Receiving Used Buffers From the
+    // Device. We're going to poll the answer, the host should not send an
+    // interrupt.
+    //
+    *Ring->Avail.Flags = (UINT16)VRING_AVAIL_F_NO_INTERRUPT;
+
+    //
+    // With VIRTIO_F_RING_EVENT_IDX, the host ignores the flag above; park the
+    // used event index as far behind the used ring as possible instead.
+    //
+    if (Ring->EventIdx) {
+      *Ring->Avail.UsedEvent = (UINT16)(*Ring->Used.Idx - 1);
+    }
+  }
 
   //
   // Prepare for virtio-0.9.5, 2.4.1 Supplying Buffers to the Device.
@@ -192,10 +340,11 @@ VirtioPrepare (
   This function implements the following section from virtio-0.9.5:
   - 2.4.1.1 Placing Buffers into the Descriptor Table
 
-  Free space is taken as granted, since the individual drivers support only
-  synchronous requests and host side status is processed in lock-step with
-  request submission. It is the calling driver's responsibility to verify the
-  ring size in advance.
+  Free space is taken as granted. Drivers that support only synchronous
+  requests process host side status in lock-step with request submission;
+  drivers that keep several requests in flight must assign disjoint descriptor
+  ranges to them. It is the calling driver's responsibility to verify the ring
+  size in advance.
 
   The caller is responsible for initializing *Indices with VirtioPrepare()
   first.
@@ -211,17 +360,23 @@ VirtioPrepare (
   @param[in] Flags                  A bitmask of VRING_DESC_F_* flags. The
                                     caller computes this mask dependent on
                                     further buffers to append and transfer
-                                    direction. VRING_DESC_F_INDIRECT is
-                                    unsupported. The VRING_DESC.Next field is
-                                    always set, but the host only interprets
-                                    it dependent on VRING_DESC_F_NEXT.
+                                    direction. VRING_DESC_F_INDIRECT is set
+                                    by VirtioAppendIndirect() only. The
+                                    VRING_DESC.Next field is always set, but
+                                    the host only interprets it dependent on
+                                    VRING_DESC_F_NEXT.
 
-  @param[in,out] Indices            Indices->HeadDescIdx is not accessed.
-                                    On input, Indices->NextDescIdx identifies
+  @param[in,out] Indices            On input, Indices->NextDescIdx identifies
                                     the next descriptor to carry the buffer.
                                     On output, Indices->NextDescIdx is
                                     incremented by one, modulo 2^16.
 
+                                    With a packed ring, descriptors are
+                                    always placed at the ring's next free
+                                    position, and Indices->HeadDescIdx serves
+                                    as the buffer ID that VirtioGetNextUsed()
+                                    reports.
+
 **/
 VOID
 EFIAPI
@@ -233,7 +388,37 @@ VirtioAppendDesc (
   IN OUT DESC_INDICES  *Indices
   )
 {
-  volatile VRING_DESC  *Desc;
+  volatile VRING_DESC         *Desc;
+  volatile VRING_PACKED_DESC  *PackedDesc;
+
+  if (Ring->Packed) {
+    //
+    // virtio-1.1, 2.7.13 Supplying Buffers to The Device. Chains occupy
+    // consecutive ring positions; VRING_DESC_F_NEXT keeps its meaning, but
+    // the Next field is gone.
+    //
+    Flags |= Ring->AvailWrap ? VRING_PACKED_DESC_F_AVAIL :
+             VRING_PACKED_DESC_F_USED;
+
+    PackedDesc       = &Ring->PackedDesc[Ring->NextAvail];
+    PackedDesc->Addr = BufferDeviceAddress;
+    PackedDesc->Len  = BufferSize;
+    PackedDesc->Id   = Indices->HeadDescIdx % Ring->QueueSize;
+    if (Indices->NextDescIdx == Indices->HeadDescIdx) {
+      Ring->HeadAvail = Ring->NextAvail;
+      Ring->HeadFlags = Flags;
+    } else {
+      PackedDesc->Flags = Flags;
+    }
+
+    if (++Ring->NextAvail == Ring->QueueSize) {
+      Ring->NextAvail = 0;
+      Ring->AvailWrap = (BOOLEAN)!Ring->AvailWrap;
+    }
+
+    Indices->NextDescIdx++;
+    return;
+  }
 
   Desc        = &Ring->Desc[Indices->NextDescIdx++ % Ring->QueueSize];
   Desc->Addr  = BufferDeviceAddress;
@@ -242,10 +427,380 @@ VirtioAppendDesc (
   Desc->Next  = Indices->NextDescIdx % Ring->QueueSize;
 }
 
+//
+// Indirect tables are laid out as split or packed descriptors, depending on
+// the ring they are used with. Both layouts share the entry size, but the
+// devices look for the flags at different offsets.
+//
+STATIC_ASSERT (
+  sizeof (VRING_PACKED_DESC) == sizeof (VRING_DESC),
+  "Split and packed descriptors must have the same size."
+  );
+STATIC_ASSERT (
+  OFFSET_OF (VRING_DESC, Flags) == 12,
+  "Split descriptors carry Flags at offset 12."
+  );
+STATIC_ASSERT (
+  OFFSET_OF (VRING_PACKED_DESC, Flags) == 14,
+  "Packed descriptors carry Flags at offset 14."
+  );
+
 /**
 
-  Notify the host about the descriptor chain just built, and wait until the
-  host processes it.
+  Allocate and map indirect descriptor tables.
+
+  This function implements the guest side of the following section from
+  virtio-1.0:
+  - 2.4.5.3 Indirect Descriptors
+
+  The calling driver must have negotiated VIRTIO_F_RING_INDIRECT_DESC.
+
+  @param[in]  VirtIo        The virtio device which will use the tables.
+
+  @param[in]  Ring          A ring that the tables will be used with. The
+                            tables take the descriptor layout of the ring
+                            type: split (virtio-1.0, 2.4.5.3) or packed
+                            (virtio-1.1, 2.7.7).
+
+  @param[in]  NumTables     The number of indirect tables to allocate.
+                            Typically one per request that the driver keeps
+                            in flight.
+
+  @param[in]  DescPerTable  The number of descriptors in each table.
+
+  @param[out] Indirect      The VRING_INDIRECT structure to set up.
+
+  @retval EFI_SUCCESS            The tables are ready to use.
+
+  @retval EFI_INVALID_PARAMETER  NumTables or DescPerTable is zero, or the
+                                 tables would hold more descriptors than
+                                 DESC_INDICES can address.
+
+  @return                        Status codes propagated from
+                                 VirtIo->AllocateSharedPages() and
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioIndirectInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  CONST VRING             *Ring,
+  IN  UINT16                  NumTables,
+  IN  UINT16                  DescPerTable,
+  OUT VRING_INDIRECT          *Indirect
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       TablesSize;
+
+  if ((NumTables == 0) || (DescPerTable == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // DESC_INDICES identifies descriptors by their UINT16 offset from the start
+  // of the concatenated tables.
+  //
+  if ((UINTN)NumTables * DescPerTable > (UINTN)MAX_UINT16 + 1) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  TablesSize = sizeof *Indirect->Desc * NumTables * DescPerTable;
+
+  Indirect->NumPages = EFI_SIZE_TO_PAGES (TablesSize);
+  Status             = VirtIo->AllocateSharedPages (
+                                 VirtIo,
+                                 Indirect->NumPages,
+                                 &Indirect->Base
+                                 );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  SetMem (Indirect->Base, EFI_PAGES_TO_SIZE (Indirect->NumPages), 0x00);
+
+  //
+  // The host reads the tables, but we rewrite them for every request, so map
+  // them as a common buffer once, rather than mapping each request's table.
+  //
+  Status = VirtioMapAllBytesInSharedBuffer (
+             VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             Indirect->Base,
+             EFI_PAGES_TO_SIZE (Indirect->NumPages),
+             &Indirect->DeviceAddress,
+             &Indirect->Mapping
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeTables;
+  }
+
+  Indirect->Desc         = Indirect->Base;
+  Indirect->PackedDesc   = Indirect->Base;
+  Indirect->Packed       = Ring->Packed;
+  Indirect->NumTables    = NumTables;
+  Indirect->DescPerTable = DescPerTable;
+  return EFI_SUCCESS;
+
+FreeTables:
+  VirtIo->FreeSharedPages (VirtIo, Indirect->NumPages, Indirect->Base);
+  return Status;
+}
+
+/**
+
+  Unmap and release indirect descriptor tables.
+
+  The caller is responsible to stop the host from using the tables before
+  invoking this function.
+
+  @param[in]     VirtIo    The virtio device which was using the tables.
+
+  @param[in,out] Indirect  The indirect tables to clean up.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VRING_INDIRECT          *Indirect
+  )
+{
+  VirtIo->UnmapSharedBuffer (VirtIo, Indirect->Mapping);
+  VirtIo->FreeSharedPages (VirtIo, Indirect->NumPages, Indirect->Base);
+  SetMem (Indirect, sizeof *Indirect, 0x00);
+}
+
+/**
+
+  Prepare for appending descriptors to an indirect table.
+
+  @param[in]  Indirect  The indirect tables.
+
+  @param[in]  TableIdx  The table to fill in; must be smaller than
+                        Indirect->NumTables. The caller is responsible for not
+                        reusing a table while the host may access it.
+
+  @param[out] Indices   The DESC_INDICES structure to initialize, for
+                        VirtioIndirectAppendDesc() and VirtioAppendIndirect().
+                        The indices are relative to the start of the
+                        concatenated tables.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPrepare (
+  IN     VRING_INDIRECT  *Indirect,
+  IN     UINT16          TableIdx,
+  OUT    DESC_INDICES    *Indices
+  )
+{
+  UINTN  Offset;
+
+  ASSERT (TableIdx < Indirect->NumTables);
+
+  Offset = (UINTN)TableIdx * Indirect->DescPerTable;
+  ASSERT (Offset <= MAX_UINT16);
+
+  Indices->HeadDescIdx = (UINT16)Offset;
+  Indices->NextDescIdx = Indices->HeadDescIdx;
+}
+
+/**
+
+  Append a contiguous buffer to an indirect table.
+
+  The parameters are the same as those of VirtioAppendDesc(), except that the
+  buffer is placed in the indirect table identified by Indices (see
+  VirtioIndirectPrepare()), rather than in the descriptor table of the ring.
+  VRING_DESC_F_INDIRECT must not be set in Flags. The caller must not append
+  more than Indirect->DescPerTable buffers to one table.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectAppendDesc (
+  IN     VRING_INDIRECT  *Indirect,
+  IN     UINT64          BufferDeviceAddress,
+  IN     UINT32          BufferSize,
+  IN     UINT16          Flags,
+  IN OUT DESC_INDICES    *Indices
+  )
+{
+  volatile VRING_DESC         *Desc;
+  volatile VRING_PACKED_DESC  *PackedDesc;
+
+  ASSERT ((Flags & VRING_DESC_F_INDIRECT) == 0);
+  ASSERT (
+    (UINT16)(Indices->NextDescIdx - Indices->HeadDescIdx) <
+    Indirect->DescPerTable
+    );
+
+  if (Indirect->Packed) {
+    //
+    // virtio-1.1, 2.7.7 Indirect Flag: Scatter-Gather Support. The table is
+    // an array of packed descriptors that the device walks in order; the
+    // buffer ID, VRING_DESC_F_NEXT and the avail / used flags are not used.
+    //
+    PackedDesc        = &Indirect->PackedDesc[Indices->NextDescIdx++];
+    PackedDesc->Addr  = BufferDeviceAddress;
+    PackedDesc->Len   = BufferSize;
+    PackedDesc->Id    = 0;
+    PackedDesc->Flags = (UINT16)(Flags & ~VRING_DESC_F_NEXT);
+    return;
+  }
+
+  Desc        = &Indirect->Desc[Indices->NextDescIdx++];
+  Desc->Addr  = BufferDeviceAddress;
+  Desc->Len   = BufferSize;
+  Desc->Flags = Flags;
+
+  //
+  // virtio-1.0, 2.4.5.3.1: in an indirect table, Next is relative to the
+  // start of the table.
+  //
+  Desc->Next = (UINT16)(Indices->NextDescIdx - Indices->HeadDescIdx);
+}
+
+/**
+
+  Append a descriptor referring to a filled-in indirect table to the virtio
+  ring.
+
+  The descriptor terminates the chain in the ring; virtio-1.0, 2.4.5.3.1
+  forbids combining VRING_DESC_F_INDIRECT with VRING_DESC_F_NEXT.
+
+  @param[in,out] Ring         The virtio ring to append the descriptor to.
+
+  @param[in] Indirect         The indirect tables.
+
+  @param[in] IndirectIndices  The indices that VirtioIndirectPrepare() and
+                              VirtioIndirectAppendDesc() have used to fill in
+                              the table.
+
+  @param[in,out] Indices      The ring indices, as for VirtioAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioAppendIndirect (
+  IN OUT VRING           *Ring,
+  IN     VRING_INDIRECT  *Indirect,
+  IN     DESC_INDICES    *IndirectIndices,
+  IN OUT DESC_INDICES    *Indices
+  )
+{
+  UINT16  NumDesc;
+
+  NumDesc = (UINT16)(IndirectIndices->NextDescIdx -
+                     IndirectIndices->HeadDescIdx);
+  ASSERT (NumDesc > 0 && NumDesc <= Indirect->DescPerTable);
+
+  //
+  // The device parses the table in the descriptor layout of the ring that
+  // refers to it.
+  //
+  ASSERT (Indirect->Packed == Ring->Packed);
+
+  VirtioAppendDesc (
+    Ring,
+    Indirect->DeviceAddress +
+    sizeof *Indirect->Desc * IndirectIndices->HeadDescIdx,
+    (UINT32)(sizeof *Indirect->Desc * NumDesc),
+    VRING_DESC_F_INDIRECT,
+    Indices
+    );
+}
+
+/**
+
+  Make the descriptor chain just built in a packed ring available to the host,
+  and notify the host about it if necessary.
+
+  This function implements the following sections from virtio-1.1:
+  - 2.7.13 Supplying Buffers to The Device
+  - 2.7.14 Event Suppression Structure Layout
+
+  See VirtioSubmit() for the parameters and return values.
+
+**/
+STATIC
+EFI_STATUS
+VirtioPackedSubmit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VRING                   *Ring,
+  IN     DESC_INDICES            *Indices
+  )
+{
+  UINT16  NumDesc;
+  UINT16  OldAvail;
+  UINT16  NextAvail;
+  UINT16  OffWrap;
+  UINT16  Event;
+
+  NumDesc = (UINT16)(Indices->NextDescIdx - Indices->HeadDescIdx);
+  ASSERT (NumDesc > 0 && NumDesc <= Ring->QueueSize);
+  Ring->ChainLen[Indices->HeadDescIdx % Ring->QueueSize] = NumDesc;
+
+  //
+  // The rest of the chain must be visible before the head descriptor changes
+  // hands. Publish the head with a full (store-load) barrier, so that the
+  // host doesn't miss it while we read its event suppression structure.
+  //
+  MemoryFence ();
+  InterlockedCompareExchange16 (
+    &Ring->PackedDesc[Ring->HeadAvail].Flags,
+    Ring->PackedDesc[Ring->HeadAvail].Flags,
+    Ring->HeadFlags
+    );
+
+  switch (Ring->DeviceEvent->Flags) {
+    case VRING_PACKED_EVENT_FLAG_DISABLE:
+      return EFI_SUCCESS;
+
+    case VRING_PACKED_EVENT_FLAG_DESC:
+      if (!Ring->EventIdx) {
+        break;
+      }
+
+      //
+      // Notify the host only if it has asked to be told about a descriptor
+      // in the range [OldAvail, NextAvail), accounting for the wrap counter
+      // the way virtio-1.0, 2.4.7.2 does for the split ring.
+      //
+      NextAvail = Ring->NextAvail;
+      OldAvail  = (UINT16)(NextAvail - NumDesc);
+      OffWrap   = Ring->DeviceEvent->OffWrap;
+      MemoryFence ();
+      Event = (UINT16)(OffWrap & ~VRING_PACKED_EVENT_F_WRAP_CTR);
+      if (((OffWrap & VRING_PACKED_EVENT_F_WRAP_CTR) != 0) != Ring->AvailWrap) {
+        Event = (UINT16)(Event - Ring->QueueSize);
+      }
+
+      if ((UINT16)(NextAvail - Event - 1) >= (UINT16)(NextAvail - OldAvail)) {
+        return EFI_SUCCESS;
+      }
+
+      break;
+
+    default:
+      break;
+  }
+
+  return VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
+}
+
+/**
+
+  Make the descriptor chain just built available to the host, and notify the
+  host about it, without waiting for the host to process the chain.
+
+  This function implements the following sections from virtio-0.9.5:
+  - 2.4.1.2 Updating the Available Ring
+  - 2.4.1.3 Updating the Index Field
+  - 2.4.1.4 Notifying the Device
 
   @param[in] VirtIo       The target virtio device to notify.
 
@@ -253,36 +808,34 @@ VirtioAppendDesc (
 
   @param[in,out] Ring     The virtio ring with descriptors to submit.
 
-  @param[in] Indices      Indices->NextDescIdx is not accessed.
-                          Indices->HeadDescIdx identifies the head descriptor
-                          of the descriptor chain.
-
-  @param[out] UsedLen     On success, the total number of bytes, consecutively
-                          across the buffers linked by the descriptor chain,
-                          that the host wrote. May be NULL if the caller
-                          doesn't care, or can compute the same information
-                          from device-specific request structures linked by the
-                          descriptor chain.
+  @param[in] Indices      Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain. Indices->NextDescIdx is
+                          only accessed with a packed ring, to learn the
+                          length of the chain.
 
   @return              Error code from VirtIo->SetQueueNotify() if it fails.
 
-  @retval EFI_SUCCESS  Otherwise, the host processed all descriptors.
+  @retval EFI_SUCCESS  Otherwise, the descriptor chain has been made available
+                       to the host. Completion can be detected with
+                       VirtioGetNextUsed().
 
 **/
 EFI_STATUS
 EFIAPI
-VirtioFlush (
+VirtioSubmit (
   IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
   IN     UINT16                  VirtQueueId,
   IN OUT VRING                   *Ring,
-  IN     DESC_INDICES            *Indices,
-  OUT    UINT32                  *UsedLen    OPTIONAL
+  IN     DESC_INDICES            *Indices
   )
 {
-  UINT16      NextAvailIdx;
-  UINT16      LastUsedIdx;
-  EFI_STATUS  Status;
-  UINTN       PollPeriodUsecs;
+  UINT16  OldAvailIdx;
+  UINT16  NextAvailIdx;
+  UINT16  AvailEvent;
+
+  if (Ring->Packed) {
+    return VirtioPackedSubmit (VirtIo, VirtQueueId, Ring, Indices);
+  }
 
   //
   // virtio-0.9.5, 2.4.1.2 Updating the Available Ring
@@ -291,42 +844,251 @@ VirtioFlush (
   // specification, but each entry in the Available Ring references only the
   // head descriptor of any given descriptor chain.
   //
-  NextAvailIdx = *Ring->Avail.Idx;
-  //
-  // (Due to our lock-step progress, this is where the host will produce the
-  // used element with the head descriptor's index in it.)
-  //
-  LastUsedIdx                                        = NextAvailIdx;
-  Ring->Avail.Ring[NextAvailIdx++ % Ring->QueueSize] =
+  OldAvailIdx                                    = *Ring->Avail.Idx;
+  NextAvailIdx                                   = OldAvailIdx + 1;
+  Ring->Avail.Ring[OldAvailIdx % Ring->QueueSize] =
     Indices->HeadDescIdx % Ring->QueueSize;
 
   //
   // virtio-0.9.5, 2.4.1.3 Updating the Index Field
   //
   MemoryFence ();
-  *Ring->Avail.Idx = NextAvailIdx;
+  if (!Ring->EventIdx) {
+    *Ring->Avail.Idx = NextAvailIdx;
+
+    //
+    // virtio-0.9.5, 2.4.1.4 Notifying the Device -- gratuitous notifications
+    // are OK.
+    //
+    MemoryFence ();
+    return VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
+  }
 
   //
-  // virtio-0.9.5, 2.4.1.4 Notifying the Device -- gratuitous notifications are
-  // OK.
+  // virtio-1.0, 2.4.7.2 Notification Suppression
+  //
+  // The host must not miss the new index while we read its avail event
+  // index, so publish the former with a full (store-load) barrier; on IA32
+  // and X64, MemoryFence() is only a compiler barrier.
   //
+  InterlockedCompareExchange16 (Ring->Avail.Idx, OldAvailIdx, NextAvailIdx);
+  AvailEvent = *Ring->Used.AvailEvent;
   MemoryFence ();
-  Status = VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
-  if (EFI_ERROR (Status)) {
-    return Status;
+
+  //
+  // Notify the host only if it has asked to be told about an available index
+  // in the range (OldAvailIdx, NextAvailIdx]. Otherwise the host is still
+  // processing the available ring and will find our descriptor chain without
+  // the (trapping) notification.
+  //
+  if ((UINT16)(NextAvailIdx - AvailEvent - 1) <
+      (UINT16)(NextAvailIdx - OldAvailIdx))
+  {
+    return VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Check if the host has produced a used element that the driver has not
+  consumed yet.
+
+  @param[in] Ring         The virtio ring to check.
+
+  @param[in] LastUsedIdx  The free-running index of the next used element that
+                          the driver had not consumed yet, when it decided to
+                          check. With a packed ring, this is a snapshot of
+                          Ring->UsedCount.
+
+  @retval TRUE   A used element is pending, or has been consumed since the
+                 snapshot was taken.
+
+  @retval FALSE  Otherwise.
+
+**/
+STATIC
+BOOLEAN
+VirtioUsedPending (
+  IN CONST VRING  *Ring,
+  IN UINT16       LastUsedIdx
+  )
+{
+  UINT16  Flags;
+
+  if (!Ring->Packed) {
+    return (BOOLEAN)(*Ring->Used.Idx != LastUsedIdx);
   }
 
   //
-  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
-  // Wait until the host processes and acknowledges our descriptor chain. The
-  // condition we use for polling is greatly simplified and relies on the
-  // synchronous, lock-step progress.
+  // A packed ring has no index that the host advances. If someone else (such
+  // as a timer callback) has consumed a used element since the snapshot, the
+  // element the caller waited for has arrived.
+  //
+  if (Ring->UsedCount != LastUsedIdx) {
+    return TRUE;
+  }
+
+  //
+  // virtio-1.1, 2.7.1: a descriptor is used if its AVAIL and USED flags are
+  // equal to each other, and to the used wrap counter.
+  //
+  Flags = Ring->PackedDesc[Ring->NextUsed].Flags;
+  return (BOOLEAN)(
+                   (((Flags & VRING_PACKED_DESC_F_AVAIL) != 0) ==
+                    Ring->UsedWrap) &&
+                   (((Flags & VRING_PACKED_DESC_F_USED) != 0) ==
+                    Ring->UsedWrap)
+                   );
+}
+
+/**
+
+  Consume the next element from the used ring, if the host has produced one.
+
+  This function implements the following section from virtio-0.9.5:
+  - 2.4.2 Receiving Used Buffers From the Device
+
+  It lets drivers that keep several descriptor chains in flight learn, one by
+  one, which chains the host has finished processing.
+
+  With a packed ring, the function also implements virtio-1.1, 2.7.9
+  Receiving Used Buffers From the Device, and the ring tracks the position of
+  the next used element itself.
+
+  Either way, Ring->UsedCount counts the consumed elements, so that waiters
+  can snapshot it for VirtioWaitUsed().
+
+  @param[in,out] Ring         The virtio ring to check.
+
+  @param[in,out] LastUsedIdx  On input, the free-running index of the next used
+                              element that the driver has not consumed yet. On
+                              output, incremented by one (modulo 2^16) if an
+                              element was consumed.
+
+  @param[out] HeadDescIdx     On success, the head descriptor index of the
+                              descriptor chain that the host processed.
+
+  @param[out] UsedLen         On success, the total number of bytes that the
+                              host wrote to the buffers of the descriptor
+                              chain. May be NULL if the caller doesn't care.
+
+  @retval EFI_SUCCESS    A used element has been consumed.
+
+  @retval EFI_NOT_READY  The host has not produced a new used element.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioGetNextUsed (
+  IN OUT VRING   *Ring,
+  IN OUT UINT16  *LastUsedIdx,
+  OUT    UINT16  *HeadDescIdx,
+  OUT    UINT32  *UsedLen     OPTIONAL
+  )
+{
+  volatile CONST VRING_USED_ELEM    *UsedElem;
+  volatile CONST VRING_PACKED_DESC  *PackedDesc;
+  UINT16                            Id;
+
+  ASSERT (!Ring->Packed || *LastUsedIdx == Ring->UsedCount);
+
+  MemoryFence ();
+  if (!VirtioUsedPending (Ring, *LastUsedIdx)) {
+    return EFI_NOT_READY;
+  }
+
+  Ring->UsedCount++;
+
+  MemoryFence ();
+
+  if (Ring->Packed) {
+    PackedDesc = &Ring->PackedDesc[Ring->NextUsed];
+    Id         = PackedDesc->Id;
+    if (UsedLen != NULL) {
+      *UsedLen = PackedDesc->Len;
+    }
+
+    //
+    // The host writes one used descriptor per chain, and skips the rest of
+    // the chain.
+    //
+    ASSERT (Id < Ring->QueueSize && Ring->ChainLen[Id] > 0);
+    Ring->NextUsed += Ring->ChainLen[Id % Ring->QueueSize];
+    if (Ring->NextUsed >= Ring->QueueSize) {
+      Ring->NextUsed -= Ring->QueueSize;
+      Ring->UsedWrap  = (BOOLEAN)!Ring->UsedWrap;
+    }
+
+    (*LastUsedIdx)++;
+    *HeadDescIdx = Id;
+    return EFI_SUCCESS;
+  }
+
+  UsedElem     = &Ring->Used.UsedElem[(*LastUsedIdx)++ % Ring->QueueSize];
+  *HeadDescIdx = (UINT16)UsedElem->Id;
+  if (UsedLen != NULL) {
+    *UsedLen = UsedElem->Len;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Wait until the host produces a used element beyond LastUsedIdx.
+
+  The function first busy-polls the used ring, for up to Ring->SpinBudget
+  iterations, in order to pick up completions that the host produces within
+  microseconds. Then it falls back to gBS->Stall(), with a period that grows
+  exponentially, until it slightly exceeds 1 ms.
+
+  Ring->SpinBudget is adapted to the latency of the device: it grows (up to
+  PcdVirtioPollSpinLimit) when the completion arrives early, and shrinks
+  (down to 1/16th of PcdVirtioPollSpinLimit) when busy-polling was in vain.
+
+  @param[in,out] Ring     The virtio ring to wait on.
+
+  @param[in] LastUsedIdx  The free-running index of the next used element that
+                          the caller had not consumed yet, when it decided to
+                          wait. Callers that may race with another consumer of
+                          the ring pass a snapshot of Ring->UsedCount; the wait
+                          ends as soon as an element is consumed after that.
+
+**/
+VOID
+EFIAPI
+VirtioWaitUsed (
+  IN OUT VRING   *Ring,
+  IN     UINT16  LastUsedIdx
+  )
+{
+  UINT32  SpinLimit;
+  UINT32  Spin;
+  UINTN   PollPeriodUsecs;
+
+  SpinLimit = PcdGet32 (PcdVirtioPollSpinLimit);
+
+  MemoryFence ();
+  for (Spin = 0; Spin < Ring->SpinBudget; Spin++) {
+    if (VirtioUsedPending (Ring, LastUsedIdx)) {
+      //
+      // Completed while spinning; spinning pays off on this device.
+      //
+      Ring->SpinBudget = MIN (MAX (Ring->SpinBudget * 2, 1), SpinLimit);
+      return;
+    }
+
+    CpuPause ();
+    MemoryFence ();
+  }
+
   //
   // Keep slowing down until we reach a poll period of slightly above 1 ms.
   //
   PollPeriodUsecs = 1;
-  MemoryFence ();
-  while (*Ring->Used.Idx != NextAvailIdx) {
+  while (!VirtioUsedPending (Ring, LastUsedIdx)) {
     gBS->Stall (PollPeriodUsecs); // calls AcpiTimerLib::MicroSecondDelay
 
     if (PollPeriodUsecs < 1024) {
@@ -336,16 +1098,85 @@ VirtioFlush (
     MemoryFence ();
   }
 
-  MemoryFence ();
+  if (PollPeriodUsecs <= 2) {
+    //
+    // Just missed the completion; spin a bit longer next time.
+    //
+    Ring->SpinBudget = MIN (MAX (Ring->SpinBudget * 2, 1), SpinLimit);
+  } else {
+    //
+    // A slow request; don't burn the CPU as long next time.
+    //
+    Ring->SpinBudget = MAX (Ring->SpinBudget / 2, SpinLimit / 16);
+  }
+}
 
-  if (UsedLen != NULL) {
-    volatile CONST VRING_USED_ELEM  *UsedElem;
+/**
 
-    UsedElem = &Ring->Used.UsedElem[LastUsedIdx % Ring->QueueSize];
-    ASSERT (UsedElem->Id == Indices->HeadDescIdx);
-    *UsedLen = UsedElem->Len;
+  Notify the host about the descriptor chain just built, and wait until the
+  host processes it.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Ring     The virtio ring with descriptors to submit.
+
+  @param[in] Indices      Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain. Indices->NextDescIdx is
+                          only accessed with a packed ring, to learn the
+                          length of the chain.
+
+  @param[out] UsedLen     On success, the total number of bytes, consecutively
+                          across the buffers linked by the descriptor chain,
+                          that the host wrote. May be NULL if the caller
+                          doesn't care, or can compute the same information
+                          from device-specific request structures linked by the
+                          descriptor chain.
+
+  @return              Error code from VirtIo->SetQueueNotify() if it fails.
+
+  @retval EFI_SUCCESS  Otherwise, the host processed all descriptors.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioFlush (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VRING                   *Ring,
+  IN     DESC_INDICES            *Indices,
+  OUT    UINT32                  *UsedLen    OPTIONAL
+  )
+{
+  UINT16      LastUsedIdx;
+  UINT16      HeadDescIdx;
+  EFI_STATUS  Status;
+
+  //
+  // Due to our lock-step progress, this is where the host will produce the
+  // used element with the head descriptor's index in it. (A packed ring keeps
+  // track of that position itself.)
+  //
+  LastUsedIdx = Ring->Packed ? Ring->UsedCount : *Ring->Avail.Idx;
+
+  Status = VirtioSubmit (VirtIo, VirtQueueId, Ring, Indices);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
+  //
+  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
+  // Wait until the host processes and acknowledges our descriptor chain. The
+  // condition we use for polling is greatly simplified and relies on the
+  // synchronous, lock-step progress.
+  //
+  VirtioWaitUsed (Ring, LastUsedIdx);
+
+  Status = VirtioGetNextUsed (Ring, &LastUsedIdx, &HeadDescIdx, UsedLen);
+  ASSERT_EFI_ERROR (Status);
+  ASSERT (HeadDescIdx == Indices->HeadDescIdx);
+
   return EFI_SUCCESS;
 }
 
@@ -477,6 +477,50 @@ Virtio10SetGuestFeatures (
   return EFI_SUCCESS;
 }
 
+/**
+  Read the QueueNotifyOff field of the currently selected queue, and store the
+  offset of the queue's notification register in Dev->NotifyOffsets.
+
+  @param[in,out] Dev  The VIRTIO_1_0_DEV whose currently selected queue has
+                      been set up.
+
+  @param[out] NotifyOffset  On output, the offset of the notification register
+                            of the queue, relative to Dev->NotifyConfig.
+
+  @retval EFI_SUCCESS  The offset has been read and captured.
+
+  @return              Error codes from Virtio10Transfer().
+**/
+STATIC
+EFI_STATUS
+Virtio10CaptureNotifyOffset (
+  IN OUT VIRTIO_1_0_DEV  *Dev,
+  OUT    UINT32          *NotifyOffset
+  )
+{
+  EFI_STATUS  Status;
+  UINT16      QueueNotifyOff;
+
+  Status = Virtio10Transfer (
+             Dev->PciIo,
+             &Dev->CommonConfig,
+             FALSE,
+             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueNotifyOff),
+             sizeof QueueNotifyOff,
+             &QueueNotifyOff
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *NotifyOffset = QueueNotifyOff * Dev->NotifyOffsetMultiplier;
+  if (Dev->QueueSelect < Dev->NumQueues) {
+    Dev->NotifyOffsets[Dev->QueueSelect] = *NotifyOffset;
+  }
+
+  return EFI_SUCCESS;
+}
+
 STATIC
 EFI_STATUS
 EFIAPI
@@ -490,10 +534,16 @@ Virtio10SetQueueAddress (
   EFI_STATUS      Status;
   UINT64          Address;
   UINT16          Enable;
+  UINT32          NotifyOffset;
 
   Dev = VIRTIO_1_0_FROM_VIRTIO_DEVICE (This);
 
-  Address  = (UINTN)Ring->Desc;
+  //
+  // With VIRTIO_F_RING_PACKED (virtio-1.1, 4.1.4.3), the same registers
+  // receive the addresses of the descriptor ring, the driver event
+  // suppression area and the device event suppression area.
+  //
+  Address  = Ring->Packed ? (UINTN)Ring->PackedDesc : (UINTN)Ring->Desc;
   Address += RingBaseShift;
   Status   = Virtio10Transfer (
                Dev->PciIo,
@@ -507,7 +557,8 @@ Virtio10SetQueueAddress (
     return Status;
   }
 
-  Address  = (UINTN)Ring->Avail.Flags;
+  Address  = Ring->Packed ? (UINTN)Ring->DriverEvent :
+             (UINTN)Ring->Avail.Flags;
   Address += RingBaseShift;
   Status   = Virtio10Transfer (
                Dev->PciIo,
@@ -521,7 +572,8 @@ Virtio10SetQueueAddress (
     return Status;
   }
 
-  Address  = (UINTN)Ring->Used.Flags;
+  Address  = Ring->Packed ? (UINTN)Ring->DeviceEvent :
+             (UINTN)Ring->Used.Flags;
   Address += RingBaseShift;
   Status   = Virtio10Transfer (
                Dev->PciIo,
@@ -544,7 +596,11 @@ Virtio10SetQueueAddress (
              sizeof Enable,
              &Enable
              );
-  return Status;
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return Virtio10CaptureNotifyOffset (Dev, &NotifyOffset);
 }
 
 STATIC
@@ -568,6 +624,10 @@ Virtio10SetQueueSel (
              sizeof Index,
              &Index
              );
+  if (!EFI_ERROR (Status)) {
+    Dev->QueueSelect = Index;
+  }
+
   return Status;
 }
 
@@ -582,54 +642,41 @@ Virtio10SetQueueNotify (
   VIRTIO_1_0_DEV  *Dev;
   EFI_STATUS      Status;
   UINT16          SavedQueueSelect;
-  UINT16          NotifyOffset;
+  UINT32          NotifyOffset;
 
   Dev = VIRTIO_1_0_FROM_VIRTIO_DEVICE (This);
 
   //
-  // Read NotifyOffset first. NotifyOffset is queue specific, so we have
-  // to stash & restore the current queue selector around it.
+  // The offset of the notification register is normally captured when the
+  // queue is set up; the kick is then a single write.
   //
-  // So, start with saving the current queue selector.
-  //
-  Status = Virtio10Transfer (
+  if ((Index < Dev->NumQueues) && (Dev->NotifyOffsets[Index] != MAX_UINT32)) {
+    return Virtio10Transfer (
              Dev->PciIo,
-             &Dev->CommonConfig,
-             FALSE,
-             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueSelect),
-             sizeof SavedQueueSelect,
-             &SavedQueueSelect
+             &Dev->NotifyConfig,
+             TRUE,
+             Dev->NotifyOffsets[Index],
+             sizeof Index,
+             &Index
              );
-  if (EFI_ERROR (Status)) {
-    return Status;
   }
 
   //
-  // Select the requested queue.
+  // Otherwise read NotifyOffset first. NotifyOffset is queue specific, so we
+  // have to stash & restore the current queue selector around it.
   //
-  Status = Virtio10Transfer (
-             Dev->PciIo,
-             &Dev->CommonConfig,
-             TRUE,
-             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueSelect),
-             sizeof Index,
-             &Index
-             );
+  SavedQueueSelect = Dev->QueueSelect;
+
+  //
+  // Select the requested queue, and read (and capture) its QueueNotifyOff
+  // field.
+  //
+  Status = Virtio10SetQueueSel (This, Index);
   if (EFI_ERROR (Status)) {
     return Status;
   }
 
-  //
-  // Read the QueueNotifyOff field.
-  //
-  Status = Virtio10Transfer (
-             Dev->PciIo,
-             &Dev->CommonConfig,
-             FALSE,
-             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueNotifyOff),
-             sizeof NotifyOffset,
-             &NotifyOffset
-             );
+  Status = Virtio10CaptureNotifyOffset (Dev, &NotifyOffset);
   if (EFI_ERROR (Status)) {
     return Status;
   }
@@ -637,14 +684,7 @@ Virtio10SetQueueNotify (
   //
   // Re-select the original queue.
   //
-  Status = Virtio10Transfer (
-             Dev->PciIo,
-             &Dev->CommonConfig,
-             TRUE,
-             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueSelect),
-             sizeof SavedQueueSelect,
-             &SavedQueueSelect
-             );
+  Status = Virtio10SetQueueSel (This, SavedQueueSelect);
   if (EFI_ERROR (Status)) {
     return Status;
   }
@@ -656,7 +696,7 @@ Virtio10SetQueueNotify (
              Dev->PciIo,
              &Dev->NotifyConfig,
              TRUE,
-             NotifyOffset * Dev->NotifyOffsetMultiplier,
+             NotifyOffset,
              sizeof Index,
              &Index
              );
@@ -779,6 +819,23 @@ Virtio10SetDeviceStatus (
              sizeof DeviceStatus,
              &DeviceStatus
              );
+
+  //
+  // Writing zero resets the device, including the queue selector
+  // (virtio-1.0, 4.1.4.3.1). Forget the cached selector and the captured
+  // notification offsets, so that nothing is derived from pre-reset state.
+  //
+  if (!EFI_ERROR (Status) && (DeviceStatus == 0)) {
+    Dev->QueueSelect = 0;
+    if (Dev->NumQueues > 0) {
+      SetMem32 (
+        Dev->NotifyOffsets,
+        Dev->NumQueues * sizeof *Dev->NotifyOffsets,
+        MAX_UINT32
+        );
+    }
+  }
+
   return Status;
 }
 
@@ -1104,6 +1161,34 @@ Virtio10BindingStart (
     goto ClosePciIo;
   }
 
+  Status = Virtio10Transfer (
+             Device->PciIo,
+             &Device->CommonConfig,
+             FALSE,
+             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, NumQueues),
+             sizeof Device->NumQueues,
+             &Device->NumQueues
+             );
+  if (EFI_ERROR (Status)) {
+    goto ClosePciIo;
+  }
+
+  if (Device->NumQueues > 0) {
+    Device->NotifyOffsets = AllocatePool (
+                              Device->NumQueues * sizeof *Device->NotifyOffsets
+                              );
+    if (Device->NotifyOffsets == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto ClosePciIo;
+    }
+
+    SetMem32 (
+      Device->NotifyOffsets,
+      Device->NumQueues * sizeof *Device->NotifyOffsets,
+      MAX_UINT32
+      );
+  }
+
   Status = Device->PciIo->Attributes (
                             Device->PciIo,
                             EfiPciIoAttributeOperationGet,
@@ -1111,7 +1196,7 @@ Virtio10BindingStart (
                             &Device->OriginalPciAttributes
                             );
   if (EFI_ERROR (Status)) {
-    goto ClosePciIo;
+    goto FreeNotifyOffsets;
   }
 
   SetAttributes = (EFI_PCI_IO_ATTRIBUTE_BUS_MASTER |
@@ -1126,7 +1211,7 @@ Virtio10BindingStart (
                             NULL
                             );
   if (EFI_ERROR (Status)) {
-    goto ClosePciIo;
+    goto FreeNotifyOffsets;
   }
 
   Status = gBS->InstallProtocolInterface (
@@ -1149,6 +1234,11 @@ RestorePciAttributes:
                    NULL
                    );
 
+FreeNotifyOffsets:
+  if (Device->NotifyOffsets != NULL) {
+    FreePool (Device->NotifyOffsets);
+  }
+
 ClosePciIo:
   gBS->CloseProtocol (
          DeviceHandle,
@@ -1212,6 +1302,10 @@ Virtio10BindingStop (
          This->DriverBindingHandle,
          DeviceHandle
          );
+  if (Device->NotifyOffsets != NULL) {
+    FreePool (Device->NotifyOffsets);
+  }
+
   FreePool (Device);
 
   return EFI_SUCCESS;
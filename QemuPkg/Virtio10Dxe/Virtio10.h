@@ -42,6 +42,14 @@ typedef struct {
   VIRTIO_1_0_CONFIG         NotifyConfig;        // Notifications
   UINT32                    NotifyOffsetMultiplier;
   VIRTIO_1_0_CONFIG         SpecificConfig;      // Device specific settings
+  UINT16                    QueueSelect;         // Last queue selected
+  UINT16                    NumQueues;
+  //
+  // Offset of the notification register of each queue, relative to
+  // NotifyConfig, or MAX_UINT32 if not captured yet. Captured when the queue
+  // is set up, so that a kick is a single register write.
+  //
+  UINT32                    *NotifyOffsets;
 } VIRTIO_1_0_DEV;
 
 #define VIRTIO_1_0_FROM_VIRTIO_DEVICE(Device) \
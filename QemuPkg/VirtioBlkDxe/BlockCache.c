@@ -0,0 +1,387 @@
+/** @file
+
+  Block cache of the virtio-blk driver.
+
+  FAT and partition drivers read the same FAT and directory sectors over and
+  over, in small requests; each one would cost a full round trip to the host
+  otherwise. See BlockCache.h for the properties of the cache.
+
+  All functions in this file must be called at TPL_NOTIFY, or with the cache
+  otherwise protected against reentry.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "BlockCache.h"
+
+/**
+
+  Find the cache entry of a block.
+
+  @param[in] Cache  The cache to search.
+
+  @param[in] Lba    The block to look up.
+
+  @return  The entry that holds the block, or NULL if the block is not cached.
+
+**/
+STATIC
+VBLK_CACHE_ENTRY *
+FindEntry (
+  IN CONST VBLK_CACHE  *Cache,
+  IN EFI_LBA           Lba
+  )
+{
+  CONST LIST_ENTRY  *Bucket;
+  LIST_ENTRY        *Link;
+  VBLK_CACHE_ENTRY  *Entry;
+
+  Bucket = &Cache->Buckets[(UINTN)Lba & (Cache->NumBuckets - 1)];
+  for (Link = GetFirstNode (Bucket);
+       !IsNull (Bucket, Link);
+       Link = GetNextNode (Bucket, Link))
+  {
+    Entry = BASE_CR (Link, VBLK_CACHE_ENTRY, HashLink);
+    if (Entry->Lba == Lba) {
+      return Entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+
+  Drop the cached copy of a block, and make its entry the first to reuse.
+
+  @param[in,out] Cache  The cache that holds Entry.
+
+  @param[in,out] Entry  The entry to drop.
+
+**/
+STATIC
+VOID
+DropEntry (
+  IN OUT VBLK_CACHE        *Cache,
+  IN OUT VBLK_CACHE_ENTRY  *Entry
+  )
+{
+  RemoveEntryList (&Entry->HashLink);
+  InitializeListHead (&Entry->HashLink);
+  Entry->Valid = FALSE;
+
+  RemoveEntryList (&Entry->LruLink);
+  InsertTailList (&Cache->Lru, &Entry->LruLink);
+}
+
+/**
+
+  Mark an entry as the most recently used one.
+
+  @param[in,out] Cache  The cache that holds Entry.
+
+  @param[in,out] Entry  The entry that has been used.
+
+**/
+STATIC
+VOID
+TouchEntry (
+  IN OUT VBLK_CACHE        *Cache,
+  IN OUT VBLK_CACHE_ENTRY  *Entry
+  )
+{
+  RemoveEntryList (&Entry->LruLink);
+  InsertHeadList (&Cache->Lru, &Entry->LruLink);
+}
+
+/**
+
+  Refresh or drop the cached copy of a block that is being written.
+
+  @param[in,out] Cache  The cache that holds Entry.
+
+  @param[in,out] Entry  The entry of the block.
+
+  @param[in] Buffer     The buffer of the write request, or NULL to drop the
+                        block.
+
+  @param[in] Index      The index of the block within Buffer.
+
+**/
+STATIC
+VOID
+UpdateEntry (
+  IN OUT VBLK_CACHE        *Cache,
+  IN OUT VBLK_CACHE_ENTRY  *Entry,
+  IN     CONST VOID        *Buffer  OPTIONAL,
+  IN     UINTN             Index
+  )
+{
+  if (Buffer == NULL) {
+    DropEntry (Cache, Entry);
+  } else {
+    CopyMem (
+      Entry->Data,
+      (CONST UINT8 *)Buffer + Index * Cache->BlockSize,
+      Cache->BlockSize
+      );
+  }
+}
+
+EFI_STATUS
+VirtioBlkCacheInit (
+  OUT VBLK_CACHE  *Cache,
+  IN  UINT32      BlockSize,
+  IN  UINT32      NumEntries,
+  IN  UINT32      ReadAheadBlocks
+  )
+{
+  UINT32  Index;
+  UINTN   BounceBlocks;
+
+  ZeroMem (Cache, sizeof *Cache);
+  InitializeListHead (&Cache->Lru);
+  if (NumEntries == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Cache->BlockSize        = BlockSize;
+  Cache->NumBuckets       = GetPowerOfTwo32 (NumEntries);
+  Cache->MaxRequestBlocks = MAX (1, NumEntries / 4);
+  Cache->ReadAheadBlocks  = MIN (ReadAheadBlocks, NumEntries / 2);
+  BounceBlocks            = (UINTN)Cache->MaxRequestBlocks +
+                            Cache->ReadAheadBlocks;
+
+  if ((NumEntries > MAX_UINTN / BlockSize) ||
+      (BounceBlocks > MAX_UINTN / BlockSize))
+  {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Cache->Entries = AllocateZeroPool (NumEntries * sizeof *Cache->Entries);
+  if (Cache->Entries == NULL) {
+    goto Failed;
+  }
+
+  Cache->Buckets = AllocatePool (Cache->NumBuckets * sizeof *Cache->Buckets);
+  if (Cache->Buckets == NULL) {
+    goto FreeEntries;
+  }
+
+  Cache->Data = AllocatePool ((UINTN)NumEntries * BlockSize);
+  if (Cache->Data == NULL) {
+    goto FreeBuckets;
+  }
+
+  Cache->Bounce = AllocatePool (BounceBlocks * BlockSize);
+  if (Cache->Bounce == NULL) {
+    goto FreeData;
+  }
+
+  for (Index = 0; Index < Cache->NumBuckets; Index++) {
+    InitializeListHead (&Cache->Buckets[Index]);
+  }
+
+  for (Index = 0; Index < NumEntries; Index++) {
+    Cache->Entries[Index].Data = Cache->Data + (UINTN)Index * BlockSize;
+    InitializeListHead (&Cache->Entries[Index].HashLink);
+    InsertTailList (&Cache->Lru, &Cache->Entries[Index].LruLink);
+  }
+
+  Cache->NumEntries = NumEntries;
+  Cache->NextLba    = MAX_UINT64;
+  return EFI_SUCCESS;
+
+FreeData:
+  FreePool (Cache->Data);
+
+FreeBuckets:
+  FreePool (Cache->Buckets);
+
+FreeEntries:
+  FreePool (Cache->Entries);
+
+Failed:
+  ZeroMem (Cache, sizeof *Cache);
+  InitializeListHead (&Cache->Lru);
+  return EFI_OUT_OF_RESOURCES;
+}
+
+VOID
+VirtioBlkCacheUninit (
+  IN OUT VBLK_CACHE  *Cache
+  )
+{
+  if (Cache->NumEntries == 0) {
+    return;
+  }
+
+  VirtioBlkCacheLogStats (Cache);
+
+  FreePool (Cache->Bounce);
+  FreePool (Cache->Data);
+  FreePool (Cache->Buckets);
+  FreePool (Cache->Entries);
+  Cache->NumEntries = 0;
+}
+
+VOID
+VirtioBlkCacheLogStats (
+  IN CONST VBLK_CACHE  *Cache
+  )
+{
+  if (Cache->NumEntries == 0) {
+    return;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: Blocks=%u Hits=%Lu Misses=%Lu ReadAhead=%Lu[Lba]\n",
+    __FUNCTION__,
+    Cache->NumEntries,
+    Cache->Hits,
+    Cache->Misses,
+    Cache->ReadAhead
+    ));
+}
+
+VOID
+VirtioBlkCacheInvalidate (
+  IN OUT VBLK_CACHE  *Cache
+  )
+{
+  UINT32  Index;
+
+  for (Index = 0; Index < Cache->NumEntries; Index++) {
+    if (Cache->Entries[Index].Valid) {
+      DropEntry (Cache, &Cache->Entries[Index]);
+    }
+  }
+
+  Cache->NextLba = MAX_UINT64;
+  Cache->Generation++;
+}
+
+BOOLEAN
+VirtioBlkCacheLookup (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  OUT    VOID        *Buffer
+  )
+{
+  UINTN             Index;
+  VBLK_CACHE_ENTRY  *Entry;
+
+  for (Index = 0; Index < NumBlocks; Index++) {
+    if (FindEntry (Cache, Lba + Index) == NULL) {
+      Cache->Misses++;
+      return FALSE;
+    }
+  }
+
+  for (Index = 0; Index < NumBlocks; Index++) {
+    Entry = FindEntry (Cache, Lba + Index);
+    CopyMem (
+      (UINT8 *)Buffer + Index * Cache->BlockSize,
+      Entry->Data,
+      Cache->BlockSize
+      );
+    TouchEntry (Cache, Entry);
+  }
+
+  Cache->Hits++;
+  return TRUE;
+}
+
+VOID
+VirtioBlkCacheInsert (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  IN     CONST VOID  *Buffer
+  )
+{
+  UINTN             Index;
+  VBLK_CACHE_ENTRY  *Entry;
+
+  for (Index = 0; Index < NumBlocks; Index++) {
+    Entry = FindEntry (Cache, Lba + Index);
+    if (Entry == NULL) {
+      //
+      // Recycle the least recently used entry.
+      //
+      Entry = BASE_CR (
+                GetPreviousNode (&Cache->Lru, &Cache->Lru),
+                VBLK_CACHE_ENTRY,
+                LruLink
+                );
+      if (Entry->Valid) {
+        DropEntry (Cache, Entry);
+      }
+
+      Entry->Lba   = Lba + Index;
+      Entry->Valid = TRUE;
+      InsertHeadList (
+        &Cache->Buckets[(UINTN)Entry->Lba & (Cache->NumBuckets - 1)],
+        &Entry->HashLink
+        );
+    }
+
+    CopyMem (
+      Entry->Data,
+      (CONST UINT8 *)Buffer + Index * Cache->BlockSize,
+      Cache->BlockSize
+      );
+    TouchEntry (Cache, Entry);
+  }
+}
+
+VOID
+VirtioBlkCacheUpdate (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  IN     CONST VOID  *Buffer  OPTIONAL
+  )
+{
+  UINTN             Index;
+  VBLK_CACHE_ENTRY  *Entry;
+
+  if (Cache->NumEntries == 0) {
+    return;
+  }
+
+  Cache->Generation++;
+
+  if (NumBlocks > Cache->NumEntries) {
+    //
+    // Scanning the cache is cheaper than looking up every block.
+    //
+    for (Index = 0; Index < Cache->NumEntries; Index++) {
+      Entry = &Cache->Entries[Index];
+      if (Entry->Valid && (Entry->Lba >= Lba) &&
+          (Entry->Lba - Lba < NumBlocks))
+      {
+        UpdateEntry (Cache, Entry, Buffer, (UINTN)(Entry->Lba - Lba));
+      }
+    }
+
+    return;
+  }
+
+  for (Index = 0; Index < NumBlocks; Index++) {
+    Entry = FindEntry (Cache, Lba + Index);
+    if (Entry != NULL) {
+      UpdateEntry (Cache, Entry, Buffer, Index);
+    }
+  }
+}
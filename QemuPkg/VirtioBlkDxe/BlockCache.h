@@ -0,0 +1,205 @@
+/** @file
+
+  Internal definitions for the block cache of the virtio-blk driver.
+
+  The cache keeps recently read blocks of a device in memory, and is managed
+  in least-recently-used order. It is write-through: the device always holds
+  the current contents of every block, and cached copies are refreshed or
+  dropped when the blocks are written or erased.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _VIRTIO_BLK_CACHE_H_
+#define _VIRTIO_BLK_CACHE_H_
+
+#include <Uefi/UefiBaseType.h>
+#include <Library/BaseLib.h>
+
+//
+// A single cached block.
+//
+typedef struct {
+  LIST_ENTRY    LruLink;  // in VBLK_CACHE.Lru, most recently used first
+  LIST_ENTRY    HashLink; // in VBLK_CACHE.Buckets, or empty if !Valid
+  EFI_LBA       Lba;
+  BOOLEAN       Valid;
+  UINT8         *Data;    // points into VBLK_CACHE.Data
+} VBLK_CACHE_ENTRY;
+
+typedef struct {
+  UINT32              NumEntries;      // zero if the cache is disabled
+  UINT32              NumBuckets;      // power of two
+  UINT32              BlockSize;
+  VBLK_CACHE_ENTRY    *Entries;
+  UINT8               *Data;           // NumEntries * BlockSize bytes
+  LIST_ENTRY          *Buckets;
+  LIST_ENTRY          Lru;
+  //
+  // Requests up to MaxRequestBlocks blocks are served through the cache.
+  // Larger ones (such as file loads) bypass it, so that they do not evict the
+  // file system metadata that the cache is for.
+  //
+  UINT32              MaxRequestBlocks;
+  //
+  // Read-ahead: a request that starts where the previous one ended is
+  // extended by ReadAheadBlocks blocks, using Bounce as the buffer.
+  //
+  UINT32              ReadAheadBlocks;
+  EFI_LBA             NextLba;
+  UINT8               *Bounce;         // (MaxRequestBlocks + ReadAheadBlocks)
+                                       //   * BlockSize bytes
+  BOOLEAN             BounceInUse;
+  //
+  // Incremented whenever blocks are written or dropped, so that a reader can
+  // tell if the blocks it has read from the device may have become stale
+  // before it could insert them.
+  //
+  UINT32              Generation;
+  //
+  // Statistics, in requests (Hits, Misses) and blocks (ReadAhead).
+  //
+  UINT64              Hits;
+  UINT64              Misses;
+  UINT64              ReadAhead;
+} VBLK_CACHE;
+
+/**
+
+  Set up the block cache of a device.
+
+  @param[out] Cache          The cache to initialize.
+
+  @param[in] BlockSize       The block size of the device, in bytes.
+
+  @param[in] NumEntries      The number of blocks to cache. Zero disables the
+                             cache.
+
+  @param[in] ReadAheadBlocks The number of blocks to read ahead of sequential
+                             requests.
+
+  @retval EFI_SUCCESS           The cache has been set up, or disabled.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed; the cache is
+                                disabled.
+
+**/
+EFI_STATUS
+VirtioBlkCacheInit (
+  OUT VBLK_CACHE  *Cache,
+  IN  UINT32      BlockSize,
+  IN  UINT32      NumEntries,
+  IN  UINT32      ReadAheadBlocks
+  );
+
+/**
+
+  Log the statistics of the cache, and release its resources.
+
+  @param[in,out] Cache  The cache set up with VirtioBlkCacheInit().
+
+**/
+VOID
+VirtioBlkCacheUninit (
+  IN OUT VBLK_CACHE  *Cache
+  );
+
+/**
+
+  Log the statistics of the cache at DEBUG_INFO level.
+
+  @param[in] Cache  The cache set up with VirtioBlkCacheInit().
+
+**/
+VOID
+VirtioBlkCacheLogStats (
+  IN CONST VBLK_CACHE  *Cache
+  );
+
+/**
+
+  Drop every cached block. Increments the Generation counter.
+
+  @param[in,out] Cache  The cache set up with VirtioBlkCacheInit().
+
+**/
+VOID
+VirtioBlkCacheInvalidate (
+  IN OUT VBLK_CACHE  *Cache
+  );
+
+/**
+
+  Serve a read request from the cache, if all blocks of the request are
+  cached. Updates the Hits and Misses counters.
+
+  @param[in,out] Cache  The cache set up with VirtioBlkCacheInit().
+
+  @param[in] Lba        The first block to read.
+
+  @param[in] NumBlocks  The number of blocks to read.
+
+  @param[out] Buffer    The buffer to copy the blocks to.
+
+  @retval TRUE   Buffer has been filled from the cache.
+
+  @retval FALSE  At least one block is not cached; Buffer is untouched.
+
+**/
+BOOLEAN
+VirtioBlkCacheLookup (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  OUT    VOID        *Buffer
+  );
+
+/**
+
+  Add blocks that have been read from the device to the cache, evicting the
+  least recently used blocks as necessary.
+
+  @param[in,out] Cache  The cache set up with VirtioBlkCacheInit().
+
+  @param[in] Lba        The first block in Buffer.
+
+  @param[in] NumBlocks  The number of blocks in Buffer.
+
+  @param[in] Buffer     The contents of the blocks.
+
+**/
+VOID
+VirtioBlkCacheInsert (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  IN     CONST VOID  *Buffer
+  );
+
+/**
+
+  Keep the cached copies of blocks consistent with a write or erase request.
+  Blocks that are not cached are not added. Increments the Generation counter.
+
+  @param[in,out] Cache  The cache set up with VirtioBlkCacheInit().
+
+  @param[in] Lba        The first block written.
+
+  @param[in] NumBlocks  The number of blocks written.
+
+  @param[in] Buffer     The new contents of the blocks. If NULL, the cached
+                        copies of the blocks are dropped instead of updated.
+
+**/
+VOID
+VirtioBlkCacheUpdate (
+  IN OUT VBLK_CACHE  *Cache,
+  IN     EFI_LBA     Lba,
+  IN     UINTN       NumBlocks,
+  IN     CONST VOID  *Buffer  OPTIONAL
+  );
+
+#endif // _VIRTIO_BLK_CACHE_H_
@@ -6,9 +6,13 @@
 
   - No attach/detach (ie. removable media).
 
-  - Although the non-blocking interfaces of EFI_BLOCK_IO2_PROTOCOL could be a
-    good match for multiple in-flight virtio-blk requests, we stick to
-    synchronous requests and EFI_BLOCK_IO_PROTOCOL for now.
+  - Several requests may be in flight at the same time; they are submitted
+    through the non-blocking interfaces of EFI_BLOCK_IO2_PROTOCOL. Each
+    request takes three ring descriptors, or a single one if the host supports
+    indirect descriptors.
+
+  - Small blocking reads may be served from a write-through block cache; see
+    BlockCache.c.
 
   Copyright (C) 2012, Red Hat, Inc.
   Copyright (c) 2012 - 2018, Intel Corporation. All rights reserved.<BR>
@@ -22,6 +26,7 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 #include <Library/VirtioLib.h>
@@ -83,10 +88,18 @@ VirtioBlkReset (
   IN BOOLEAN                ExtendedVerification
   )
 {
+  VBLK_DEV  *Dev;
+  EFI_TPL   OldTpl;
+
   //
   // If we managed to initialize and install the driver, then the device is
-  // working correctly.
+  // working correctly. Forget the cached blocks though; the caller may reset
+  // the device because it suspects the data to be stale.
   //
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO (This);
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioBlkCacheInvalidate (&Dev->Cache);
+  gBS->RestoreTPL (OldTpl);
   return EFI_SUCCESS;
 }
 
@@ -176,92 +189,142 @@ VerifyReadWriteRequest (
 
 /**
 
-  Format a read / write / flush request as three consecutive virtio
-  descriptors, push them to the host, and poll for the response.
+  Reap the requests that the host has completed since the last call.
+
+  Blocking requests are only marked as completed; the thread of execution that
+  waits for them is responsible for releasing their resources. Non-blocking
+  requests are torn down here, and their tokens are signaled.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-blk device whose request queue to process.
+
+**/
+STATIC
+VOID
+ProcessCompletions (
+  IN OUT VBLK_DEV  *Dev
+  );
+
+/**
+
+  Claim a free request slot.
+
+  If all slots are taken, completed requests are reaped until a slot becomes
+  free.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-blk device to claim a request slot on.
+
+  @return  The claimed request slot, or NULL if all slots are held by callers
+           that the current thread of execution has interrupted.
+
+**/
+STATIC
+VBLK_REQ *
+ClaimRequest (
+  IN OUT VBLK_DEV  *Dev
+  )
+{
+  UINT16  Slot;
+
+  for ( ; ;) {
+    for (Slot = 0; Slot < Dev->NumRequests; Slot++) {
+      if (!Dev->Requests[Slot].InUse) {
+        Dev->Requests[Slot].InUse    = TRUE;
+        Dev->Requests[Slot].InFlight = FALSE;
+        return &Dev->Requests[Slot];
+      }
+    }
+
+    if (Dev->NumInFlight == 0) {
+      //
+      // No slot can be freed at our TPL.
+      //
+      return NULL;
+    }
 
-  This is the main workhorse function. Two use cases are supported, read/write
-  and flush. The function may only be called after the request parameters have
-  been verified by
-  - specific checks in ReadBlocks() / WriteBlocks() / FlushBlocks(), and
-  - VerifyReadWriteRequest() (for read/write only).
+    gBS->Stall (1);
+    ProcessCompletions (Dev);
+  }
+}
+
+/**
+
+  Prepare a read / write / flush / erase request for submission: fill in the
+  request header and preset the host status in the request slot's part of the
+  request pool, and map the data buffer for bus master access.
+
+  The function may only be called after the request parameters have been
+  verified by
+  - specific checks in ReadBlocks() / WriteBlocks() / FlushBlocks() /
+    EraseBlocks(), and
+  - VerifyReadWriteRequest() (for read/write/erase only).
 
   Parameters handled commonly:
 
-    @param[in] Dev             The virtio-blk device the request is targeted
-                               at.
+    @param[in] Dev          The virtio-blk device the request is targeted at.
 
-  Flush request:
+    @param[in,out] Req      The claimed request slot to populate.
+
+    @param[in] RequestType  VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT,
+                            VIRTIO_BLK_T_FLUSH, VIRTIO_BLK_T_DISCARD or
+                            VIRTIO_BLK_T_WRITE_ZEROES.
 
-    @param[in] Lba             Must be zero.
+  Flush request:
 
-    @param[in] BufferSize      Must be zero.
+    @param[in] Lba          Must be zero.
 
-    @param[in out] Buffer      Ignored by the function.
+    @param[in] BufferSize   Must be zero.
 
-    @param[in] RequestIsWrite  Must be TRUE.
+    @param[in out] Buffer   Ignored by the function.
 
   Read/Write request:
 
-    @param[in] Lba             Logical Block Address: number of logical blocks
-                               to skip from the beginning of the device.
+    @param[in] Lba          Logical Block Address: number of logical blocks to
+                            skip from the beginning of the device.
 
-    @param[in] BufferSize      Size of buffer to transfer, in bytes. The caller
-                               is responsible to ensure this parameter is
-                               positive.
+    @param[in] BufferSize   Size of buffer to transfer, in bytes. The caller is
+                            responsible to ensure this parameter is positive.
 
-    @param[in out] Buffer      The guest side area to read data from the device
-                               into, or write data to the device from.
+    @param[in out] Buffer   The guest side area to read data from the device
+                            into, or write data to the device from.
 
-    @param[in] RequestIsWrite  TRUE iff data transfer goes from guest to
-                               device.
+  Discard/Write Zeroes request:
 
-  Return values are common to both use cases, and are appropriate to be
-  forwarded by the EFI_BLOCK_IO_PROTOCOL functions (ReadBlocks(),
-  WriteBlocks(), FlushBlocks()).
+    @param[in] Lba          Logical Block Address of the first block to erase.
 
+    @param[in] BufferSize   Number of bytes to erase; positive.
 
-  @retval EFI_SUCCESS          Transfer complete.
+    @param[in out] Buffer   Ignored by the function. The data buffer of the
+                            request is the segment descriptor in the request
+                            pool.
 
-  @retval EFI_DEVICE_ERROR     Failed to notify host side via VirtIo write, or
-                               unable to parse host response, or host response
-                               is not VIRTIO_BLK_S_OK or failed to map Buffer
-                               for a bus master operation.
+  @retval EFI_SUCCESS       The request is ready for SubmitRequest().
+
+  @retval EFI_DEVICE_ERROR  Failed to map the data buffer for a bus master
+                            operation. No resources remain associated with
+                            Req.
 
 **/
 STATIC
 EFI_STATUS
-EFIAPI
-SynchronousRequest (
+MapRequest (
   IN              VBLK_DEV  *Dev,
+  IN OUT          VBLK_REQ  *Req,
+  IN              UINT32    RequestType,
   IN              EFI_LBA   Lba,
   IN              UINTN     BufferSize,
-  IN OUT volatile VOID      *Buffer,
-  IN              BOOLEAN   RequestIsWrite
+  IN OUT volatile VOID      *Buffer
   )
 {
-  UINT32                   BlockSize;
-  volatile VIRTIO_BLK_REQ  Request;
-  volatile UINT8           *HostStatus;
-  VOID                     *HostStatusBuffer;
-  DESC_INDICES             Indices;
-  VOID                     *RequestMapping;
-  VOID                     *StatusMapping;
-  VOID                     *BufferMapping;
-  EFI_PHYSICAL_ADDRESS     BufferDeviceAddress;
-  EFI_PHYSICAL_ADDRESS     HostStatusDeviceAddress;
-  EFI_PHYSICAL_ADDRESS     RequestDeviceAddress;
-  EFI_STATUS               Status;
-  EFI_STATUS               UnmapStatus;
+  UINT32      BlockSize;
+  UINT64      Sector;
+  EFI_STATUS  Status;
 
   BlockSize = Dev->BlockIoMedia.BlockSize;
 
-  //
-  // Set BufferMapping and BufferDeviceAddress to suppress incorrect
-  // compiler/analyzer warnings.
-  //
-  BufferMapping       = NULL;
-  BufferDeviceAddress = 0;
-
   //
   // ensured by VirtioBlkInit()
   //
@@ -273,47 +336,48 @@ SynchronousRequest (
   //
   ASSERT (BufferSize % BlockSize == 0);
 
+  Req->RequestIsWrite   = (BOOLEAN)(RequestType != VIRTIO_BLK_T_IN);
+  Req->Lba              = Lba;
+  Req->NumBlocksWritten = (RequestType == VIRTIO_BLK_T_IN) ? 0 :
+                          BufferSize / BlockSize;
+  Req->BufferSize       = BufferSize;
+  Req->BufferInPool   = FALSE;
+  Req->BufferMapping  = NULL;
+
   //
   // Prepare virtio-blk request header, setting zero size for flush.
-  // IO Priority is homogeneously 0.
+  // IO Priority is homogeneously 0. The header lives in the request pool,
+  // which is mapped for the lifetime of the device.
   //
-  Request.Type = RequestIsWrite ?
-                 (BufferSize == 0 ? VIRTIO_BLK_T_FLUSH : VIRTIO_BLK_T_OUT) :
-                 VIRTIO_BLK_T_IN;
-  Request.IoPrio = 0;
-  Request.Sector = MultU64x32 (Lba, BlockSize / 512);
+  Sector                   = MultU64x32 (Lba, BlockSize / 512);
+  Req->Dma->Request.Type   = RequestType;
+  Req->Dma->Request.IoPrio = 0;
+  Req->Dma->Request.Sector = Sector;
 
   //
-  // Host status is bi-directional (we preset with a value and expect the
-  // device to update it). Allocate a host status buffer which can be mapped
-  // to access equally by both processor and the device.
+  // preset a host status for ourselves that we do not accept as success
   //
-  Status = Dev->VirtIo->AllocateSharedPages (
-                          Dev->VirtIo,
-                          EFI_SIZE_TO_PAGES (sizeof *HostStatus),
-                          &HostStatusBuffer
-                          );
-  if (EFI_ERROR (Status)) {
-    return EFI_DEVICE_ERROR;
-  }
+  Req->Dma->HostStatus = VIRTIO_BLK_S_IOERR;
 
-  HostStatus = HostStatusBuffer;
-
-  //
-  // Map virtio-blk request header (must be done after request header is
-  // populated)
-  //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterRead,
-             (VOID *)&Request,
-             sizeof Request,
-             &RequestDeviceAddress,
-             &RequestMapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto FreeHostStatusBuffer;
+  if ((RequestType == VIRTIO_BLK_T_DISCARD) ||
+      (RequestType == VIRTIO_BLK_T_WRITE_ZEROES))
+  {
+    //
+    // virtio-1.1, 5.2.6.2: the sector field of the header is unused, and the
+    // data buffer is a single segment. VirtioBlkInit() has limited
+    // Dev->MaxEraseSize so that the sector count fits in 32 bits.
+    //
+    Req->Dma->Request.Sector    = 0;
+    Req->Dma->Segment.Sector     = Sector;
+    Req->Dma->Segment.NumSectors = (UINT32)(BufferSize / 512);
+    Req->Dma->Segment.Flags      =
+      (RequestType == VIRTIO_BLK_T_WRITE_ZEROES) ?
+      VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+
+    Req->BufferSize          = sizeof Req->Dma->Segment;
+    Req->BufferInPool        = TRUE;
+    Req->BufferDeviceAddress = Req->SegmentDeviceAddress;
+    return EFI_SUCCESS;
   }
 
   //
@@ -322,65 +386,174 @@ SynchronousRequest (
   if (BufferSize > 0) {
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
-               (RequestIsWrite ?
+               (Req->RequestIsWrite ?
                 VirtioOperationBusMasterRead :
                 VirtioOperationBusMasterWrite),
                (VOID *)Buffer,
                BufferSize,
-               &BufferDeviceAddress,
-               &BufferMapping
+               &Req->BufferDeviceAddress,
+               &Req->BufferMapping
                );
     if (EFI_ERROR (Status)) {
+      return EFI_DEVICE_ERROR;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Unmap the data buffer that MapRequest() mapped for a request, unless the
+  data buffer is part of the request pool.
+
+  @param[in] Dev      The virtio-blk device the request was targeted at.
+
+  @param[in,out] Req  The request to unmap.
+
+  @param[in] Status   The outcome of the request so far.
+
+  @return  Status, or EFI_DEVICE_ERROR if data read by the bus master may not
+           have reached the caller.
+
+**/
+STATIC
+EFI_STATUS
+UnmapRequest (
+  IN     VBLK_DEV    *Dev,
+  IN OUT VBLK_REQ    *Req,
+  IN     EFI_STATUS  Status
+  )
+{
+  EFI_STATUS  UnmapStatus;
+
+  if ((Req->BufferSize > 0) && !Req->BufferInPool) {
+    UnmapStatus = Dev->VirtIo->UnmapSharedBuffer (
+                                 Dev->VirtIo,
+                                 Req->BufferMapping
+                                 );
+    if (EFI_ERROR (UnmapStatus) && !Req->RequestIsWrite && !EFI_ERROR (Status)) {
+      //
+      // Data from the bus master may not reach the caller; fail the request.
+      //
       Status = EFI_DEVICE_ERROR;
-      goto UnmapRequestBuffer;
     }
   }
 
-  //
-  // preset a host status for ourselves that we do not accept as success
-  //
-  *HostStatus = VIRTIO_BLK_S_IOERR;
+  return Status;
+}
 
-  //
-  // Map the Status Buffer with VirtioOperationBusMasterCommonBuffer so that
-  // both processor and device can access it.
-  //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterCommonBuffer,
-             HostStatusBuffer,
-             sizeof *HostStatus,
-             &HostStatusDeviceAddress,
-             &StatusMapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto UnmapDataBuffer;
+/**
+
+  Append a buffer of a request either to the virtio ring, or to the request
+  slot's indirect descriptor table.
+
+  @param[in,out] Dev  The virtio-blk device the request is targeted at.
+
+  See VirtioAppendDesc() for the rest of the parameters.
+
+**/
+STATIC
+VOID
+AppendRequestDesc (
+  IN OUT VBLK_DEV      *Dev,
+  IN OUT VRING         *Ring,
+  IN     UINT64        BufferDeviceAddress,
+  IN     UINT32        BufferSize,
+  IN     UINT16        Flags,
+  IN OUT DESC_INDICES  *Indices
+  )
+{
+  if (Dev->UseIndirect) {
+    VirtioIndirectAppendDesc (
+      &Dev->Indirect,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      Indices
+      );
+  } else {
+    VirtioAppendDesc (
+      Ring,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      Indices
+      );
   }
+}
+
+/**
+
+  Format a mapped request as up to three descriptors in the request slot's
+  own descriptor range (or indirect table), and push them to the host.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-blk device the request is targeted at.
+
+  @param[in,out] Req  The request, prepared with MapRequest().
+
+  @param[in] Token    The EFI_BLOCK_IO2_TOKEN to signal on completion, or NULL
+                      if the caller is going to wait for the request.
 
-  VirtioPrepare (&Dev->Ring, &Indices);
+  @retval EFI_SUCCESS  The request is in flight.
+
+  @return              Error codes from VirtioSubmit(). The request has not
+                       been accounted as in flight.
+
+**/
+STATIC
+EFI_STATUS
+SubmitRequest (
+  IN OUT VBLK_DEV             *Dev,
+  IN OUT VBLK_REQ             *Req,
+  IN     EFI_BLOCK_IO2_TOKEN  *Token  OPTIONAL
+  )
+{
+  DESC_INDICES  Indices;
+  DESC_INDICES  ChainIndices;
+  UINT16        Slot;
+  UINT16        QueueIdx;
+  VRING         *Ring;
+  EFI_STATUS    Status;
 
   //
-  // ensured by VirtioBlkInit() -- this predicate, in combination with the
-  // lock-step progress, ensures we don't have to track free descriptors.
+  // Each request slot is bound to a request queue (see VBLK_MAX_QUEUES), and
+  // owns a fixed range of descriptors in that queue (see VBLK_DESC_PER_REQ);
+  // build the chain there rather than at descriptor #0. This, in combination
+  // with ClaimRequest(), ensures we don't have to track free descriptors.
   //
-  ASSERT (Dev->Ring.QueueSize >= 3);
+  Slot     = (UINT16)(Req - Dev->Requests);
+  QueueIdx = Slot % Dev->NumQueues;
+  Ring     = &Dev->Queues[QueueIdx].Ring;
+
+  VirtioPrepare (Ring, &Indices);
+  Indices.HeadDescIdx = (UINT16)(Slot / Dev->NumQueues * Dev->RingDescPerReq);
+  Indices.NextDescIdx = Indices.HeadDescIdx;
+
+  if (Dev->UseIndirect) {
+    VirtioIndirectPrepare (&Dev->Indirect, Slot, &ChainIndices);
+  } else {
+    ChainIndices = Indices;
+  }
 
   //
   // virtio-blk header in first desc
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    RequestDeviceAddress,
-    sizeof Request,
+  AppendRequestDesc (
+    Dev,
+    Ring,
+    Req->RequestDeviceAddress,
+    sizeof Req->Dma->Request,
     VRING_DESC_F_NEXT,
-    &Indices
+    &ChainIndices
     );
 
   //
   // data buffer for read/write in second desc
   //
-  if (BufferSize > 0) {
+  if (Req->BufferSize > 0) {
     //
     // From virtio-0.9.5, 2.3.2 Descriptor Table:
     // "no descriptor chain may be more than 2^32 bytes long in total".
@@ -389,153 +562,625 @@ SynchronousRequest (
     // VerifyReadWriteRequest() (for read/write). It also implies that
     // converting BufferSize to UINT32 will not truncate it.
     //
-    ASSERT (BufferSize <= SIZE_1GB);
+    ASSERT (Req->BufferSize <= SIZE_1GB);
 
     //
     // VRING_DESC_F_WRITE is interpreted from the host's point of view.
     //
-    VirtioAppendDesc (
-      &Dev->Ring,
-      BufferDeviceAddress,
-      (UINT32)BufferSize,
-      VRING_DESC_F_NEXT | (RequestIsWrite ? 0 : VRING_DESC_F_WRITE),
-      &Indices
+    AppendRequestDesc (
+      Dev,
+      Ring,
+      Req->BufferDeviceAddress,
+      (UINT32)Req->BufferSize,
+      VRING_DESC_F_NEXT | (Req->RequestIsWrite ? 0 : VRING_DESC_F_WRITE),
+      &ChainIndices
       );
   }
 
   //
   // host status in last (second or third) desc
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    HostStatusDeviceAddress,
-    sizeof *HostStatus,
+  AppendRequestDesc (
+    Dev,
+    Ring,
+    Req->HostStatusDeviceAddress,
+    sizeof Req->Dma->HostStatus,
     VRING_DESC_F_WRITE,
-    &Indices
+    &ChainIndices
     );
 
+  if (Dev->UseIndirect) {
+    VirtioAppendIndirect (Ring, &Dev->Indirect, &ChainIndices, &Indices);
+  }
+
+  Req->Token    = Token;
+  Req->InFlight = TRUE;
+  Dev->NumInFlight++;
+  if ((Token != NULL) && (Dev->NumAsyncInFlight++ == 0)) {
+    gBS->SetTimer (Dev->AsyncTimer, TimerPeriodic, VBLK_ASYNC_POLL_PERIOD);
+  }
+
   //
-  // virtio-blk's only virtqueue is #0, called "requestq" (see Appendix D).
+  // Without VIRTIO_BLK_F_MQ, virtio-blk's only virtqueue is #0, called
+  // "requestq" (see Appendix D).
   //
-  if ((VirtioFlush (
-         Dev->VirtIo,
-         0,
-         &Dev->Ring,
-         &Indices,
-         NULL
-         ) == EFI_SUCCESS) &&
-      (*HostStatus == VIRTIO_BLK_S_OK))
-  {
-    Status = EFI_SUCCESS;
-  } else {
-    Status = EFI_DEVICE_ERROR;
+  Status = VirtioSubmit (Dev->VirtIo, QueueIdx, Ring, &Indices);
+  if (EFI_ERROR (Status)) {
+    Req->InFlight = FALSE;
+    Dev->NumInFlight--;
+    if ((Token != NULL) && (--Dev->NumAsyncInFlight == 0)) {
+      gBS->SetTimer (Dev->AsyncTimer, TimerCancel, 0);
+    }
   }
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, StatusMapping);
+  return Status;
+}
 
-UnmapDataBuffer:
-  if (BufferSize > 0) {
-    UnmapStatus = Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, BufferMapping);
-    if (EFI_ERROR (UnmapStatus) && !RequestIsWrite && !EFI_ERROR (Status)) {
+STATIC
+VOID
+ProcessCompletions (
+  IN OUT VBLK_DEV  *Dev
+  )
+{
+  UINT16               QueueIdx;
+  VBLK_QUEUE           *Queue;
+  UINT16               HeadDescIdx;
+  UINT16               Slot;
+  VBLK_REQ             *Req;
+  EFI_BLOCK_IO2_TOKEN  *Token;
+
+  for (QueueIdx = 0; QueueIdx < Dev->NumQueues; QueueIdx++) {
+    Queue = &Dev->Queues[QueueIdx];
+
+    while (!EFI_ERROR (
+              VirtioGetNextUsed (
+                &Queue->Ring,
+                &Queue->LastUsedIdx,
+                &HeadDescIdx,
+                NULL
+                )
+              ))
+    {
       //
-      // Data from the bus master may not reach the caller; fail the request.
+      // Invert the slot -> (queue, descriptor) mapping of SubmitRequest().
       //
-      Status = EFI_DEVICE_ERROR;
+      Slot = (UINT16)(HeadDescIdx / Dev->RingDescPerReq * Dev->NumQueues +
+                      QueueIdx);
+      if ((HeadDescIdx % Dev->RingDescPerReq != 0) ||
+          (Slot >= Dev->NumRequests) ||
+          !Dev->Requests[Slot].InFlight)
+      {
+        DEBUG ((
+          DEBUG_ERROR,
+          "%a: unexpected head descriptor %u on queue %u\n",
+          __FUNCTION__,
+          HeadDescIdx,
+          QueueIdx
+          ));
+        continue;
+      }
+
+      Req         = &Dev->Requests[Slot];
+      Req->Status = (Req->Dma->HostStatus == VIRTIO_BLK_S_OK) ?
+                    EFI_SUCCESS : EFI_DEVICE_ERROR;
+      Req->InFlight = FALSE;
+      Dev->NumInFlight--;
+
+      if (Req->Token == NULL) {
+        //
+        // The submitter is polling for this request; it will clean up.
+        //
+        continue;
+      }
+
+      //
+      // The data of a non-blocking write is not available to refresh the
+      // cache with; drop the cached copies of the blocks instead.
+      //
+      if (Req->NumBlocksWritten > 0) {
+        VirtioBlkCacheUpdate (
+          &Dev->Cache,
+          Req->Lba,
+          Req->NumBlocksWritten,
+          NULL
+          );
+      }
+
+      Token                    = Req->Token;
+      Token->TransactionStatus = UnmapRequest (Dev, Req, Req->Status);
+      Req->InUse               = FALSE;
+
+      if (--Dev->NumAsyncInFlight == 0) {
+        gBS->SetTimer (Dev->AsyncTimer, TimerCancel, 0);
+      }
+
+      gBS->SignalEvent (Token->Event);
     }
   }
+}
+
+/**
 
-UnmapRequestBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RequestMapping);
+  Wait until the host has completed all requests in flight on the device.
 
-FreeHostStatusBuffer:
-  Dev->VirtIo->FreeSharedPages (
-                 Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *HostStatus),
-                 HostStatusBuffer
-                 );
+  @param[in,out] Dev  The virtio-blk device to drain.
 
-  return Status;
+**/
+STATIC
+VOID
+DrainRequests (
+  IN OUT VBLK_DEV  *Dev
+  )
+{
+  EFI_TPL     OldTpl;
+  UINT16      Slot;
+  VBLK_QUEUE  *Queue;
+  UINT16      LastUsedIdx;
+
+  for ( ; ;) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    ProcessCompletions (Dev);
+
+    //
+    // Wait on the queue of the first request that is still in flight.
+    //
+    Queue = NULL;
+    for (Slot = 0; Slot < Dev->NumRequests; Slot++) {
+      if (Dev->Requests[Slot].InFlight) {
+        Queue       = &Dev->Queues[Slot % Dev->NumQueues];
+        LastUsedIdx = Queue->Ring.UsedCount;
+        break;
+      }
+    }
+
+    gBS->RestoreTPL (OldTpl);
+
+    if (Queue == NULL) {
+      break;
+    }
+
+    VirtioWaitUsed (&Queue->Ring, LastUsedIdx);
+  }
 }
 
 /**
 
-  ReadBlocks() operation for virtio-blk.
-
-  See
-  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
-    Protocol, EFI_BLOCK_IO_PROTOCOL.ReadBlocks().
-  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
-    ReadBlocksEx() Implementation.
+  Timer notification function that reaps the completions of non-blocking
+  requests.
 
-  Parameter checks and conformant return values are implemented in
-  VerifyReadWriteRequest() and SynchronousRequest().
+  @param[in] Event    The AsyncTimer event of the device.
 
-  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
-  successfully.
+  @param[in] Context  Pointer to the VBLK_DEV structure.
 
 **/
-EFI_STATUS
+STATIC
+VOID
 EFIAPI
-VirtioBlkReadBlocks (
-  IN  EFI_BLOCK_IO_PROTOCOL  *This,
-  IN  UINT32                 MediaId,
-  IN  EFI_LBA                Lba,
-  IN  UINTN                  BufferSize,
-  OUT VOID                   *Buffer
+VirtioBlkAsyncTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
   )
 {
-  VBLK_DEV    *Dev;
-  EFI_STATUS  Status;
+  ProcessCompletions (Context);
+}
 
-  if (BufferSize == 0) {
-    return EFI_SUCCESS;
-  }
+/**
 
-  Dev    = VIRTIO_BLK_FROM_BLOCK_IO (This);
-  Status = VerifyReadWriteRequest (
-             &Dev->BlockIoMedia,
-             Lba,
-             BufferSize,
-             FALSE               // RequestIsWrite
-             );
-  if (EFI_ERROR (Status)) {
-    return Status;
-  }
+  Execute a read / write / flush / erase request, either blocking (Token ==
+  NULL), or non-blocking.
 
-  return SynchronousRequest (
-           Dev,
-           Lba,
-           BufferSize,
-           Buffer,
-           FALSE       // RequestIsWrite
-           );
-}
+  This is the main workhorse function. Three use cases are supported,
+  read/write, flush and erase. The function may only be called after the
+  request parameters have been verified by
+  - specific checks in ReadBlocks() / WriteBlocks() / FlushBlocks() /
+    EraseBlocks(), and
+  - VerifyReadWriteRequest() (for read/write/erase only).
 
-/**
+  See MapRequest() for the description of Dev, RequestType, Lba, BufferSize and
+  Buffer. BufferSize must not exceed the limit of the device for RequestType;
+  see SubmitSplit().
 
-  WriteBlocks() operation for virtio-blk.
+  @param[in] Token  If NULL, the function polls the host until it completes the
+                    request. Otherwise the function returns as soon as the
+                    request is in flight; Token->TransactionStatus is set and
+                    Token->Event is signaled when the host completes it.
 
-  See
-  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
-    Protocol, EFI_BLOCK_IO_PROTOCOL.WriteBlocks().
-  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.3 WriteBlocks() and
-    WriteBlockEx() Implementation.
+  Return values are common to both use cases, and are appropriate to be
+  forwarded by the EFI_BLOCK_IO_PROTOCOL and EFI_BLOCK_IO2_PROTOCOL functions.
 
-  Parameter checks and conformant return values are implemented in
-  VerifyReadWriteRequest() and SynchronousRequest().
 
-  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
-  successfully.
+  @retval EFI_SUCCESS           Transfer complete, or (if Token is not NULL)
+                                queued.
+
+  @retval EFI_DEVICE_ERROR      Failed to notify host side via VirtIo write, or
+                                unable to parse host response, or host response
+                                is not VIRTIO_BLK_S_OK or failed to map Buffer
+                                for a bus master operation.
+
+  @retval EFI_OUT_OF_RESOURCES  All request slots are held by callers that the
+                                current thread of execution has interrupted.
 
 **/
+STATIC
 EFI_STATUS
 EFIAPI
-VirtioBlkWriteBlocks (
-  IN EFI_BLOCK_IO_PROTOCOL  *This,
-  IN UINT32                 MediaId,
-  IN EFI_LBA                Lba,
-  IN UINTN                  BufferSize,
-  IN VOID                   *Buffer
+SubmitAndPoll (
+  IN              VBLK_DEV             *Dev,
+  IN              UINT32               RequestType,
+  IN              EFI_LBA              Lba,
+  IN              UINTN                BufferSize,
+  IN OUT volatile VOID                 *Buffer,
+  IN              EFI_BLOCK_IO2_TOKEN  *Token          OPTIONAL
+  )
+{
+  VBLK_REQ    *Req;
+  VBLK_QUEUE  *Queue;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+  BOOLEAN     InFlight;
+  UINT16      LastUsedIdx;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Req    = ClaimRequest (Dev);
+  gBS->RestoreTPL (OldTpl);
+  if (Req == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = MapRequest (Dev, Req, RequestType, Lba, BufferSize, Buffer);
+  if (EFI_ERROR (Status)) {
+    goto ReleaseSlot;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Status = SubmitRequest (Dev, Req, Token);
+  gBS->RestoreTPL (OldTpl);
+  if (EFI_ERROR (Status)) {
+    UnmapRequest (Dev, Req, Status);
+    Status = EFI_DEVICE_ERROR;
+    goto ReleaseSlot;
+  }
+
+  if (Token != NULL) {
+    //
+    // ProcessCompletions() owns the request from now on.
+    //
+    return EFI_SUCCESS;
+  }
+
+  //
+  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
+  // Wait until the host processes and acknowledges our descriptor chain.
+  //
+  Queue = &Dev->Queues[(Req - Dev->Requests) % Dev->NumQueues];
+  for ( ; ;) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    ProcessCompletions (Dev);
+    InFlight    = Req->InFlight;
+    LastUsedIdx = Queue->Ring.UsedCount;
+    gBS->RestoreTPL (OldTpl);
+
+    if (!InFlight) {
+      break;
+    }
+
+    VirtioWaitUsed (&Queue->Ring, LastUsedIdx);
+  }
+
+  Status = UnmapRequest (Dev, Req, Req->Status);
+
+  //
+  // Write through to the block cache; if the write failed, the contents of
+  // the blocks are unknown.
+  //
+  if (Req->NumBlocksWritten > 0) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    VirtioBlkCacheUpdate (
+      &Dev->Cache,
+      Req->Lba,
+      Req->NumBlocksWritten,
+      (EFI_ERROR (Status) || (Buffer == NULL)) ? NULL : (CONST VOID *)Buffer
+      );
+    gBS->RestoreTPL (OldTpl);
+  }
+
+ReleaseSlot:
+  OldTpl     = gBS->RaiseTPL (TPL_NOTIFY);
+  Req->InUse = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+
+  Execute a read / write / flush / erase request of any size, splitting it into
+  requests that the host accepts.
+
+  With VIRTIO_BLK_F_SIZE_MAX, the host limits the size of the data buffer of
+  read and write requests; with VIRTIO_BLK_F_DISCARD and
+  VIRTIO_BLK_F_WRITE_ZEROES, it limits the number of sectors that a single
+  request may erase. A split erase request is cut first at the alignment
+  boundary that follows Lba, then in chunks of the (aligned) maximum erase size,
+  so all but its last part end on a boundary of the discard sector alignment.
+  All but the last part of a split request are executed blocking; the last one
+  is executed as requested by Token.
+
+  See SubmitAndPoll() for the parameters and return values.
+
+**/
+STATIC
+EFI_STATUS
+SubmitSplit (
+  IN              VBLK_DEV             *Dev,
+  IN              UINT32               RequestType,
+  IN              EFI_LBA              Lba,
+  IN              UINTN                BufferSize,
+  IN OUT volatile VOID                 *Buffer,
+  IN              EFI_BLOCK_IO2_TOKEN  *Token          OPTIONAL
+  )
+{
+  UINTN       MaxSize;
+  UINTN       PartSize;
+  BOOLEAN     IsErase;
+  UINT32      Misalignment;
+  EFI_STATUS  Status;
+
+  IsErase = (BOOLEAN)((RequestType == VIRTIO_BLK_T_DISCARD) ||
+                      (RequestType == VIRTIO_BLK_T_WRITE_ZEROES));
+  MaxSize = IsErase ? Dev->MaxEraseSize : Dev->MaxTransferSize;
+
+  //
+  // ensured by VirtioBlkInit()
+  //
+  ASSERT (MaxSize > 0);
+  ASSERT (MaxSize % Dev->BlockIoMedia.BlockSize == 0);
+  ASSERT (
+    !IsErase ||
+    (MaxSize / Dev->BlockIoMedia.BlockSize % Dev->EraseAlignment == 0)
+    );
+
+  while (BufferSize > MaxSize) {
+    //
+    // Cut the unaligned head of an erase request at the next alignment
+    // boundary, so that the host doesn't reject or partially ignore
+    // misaligned parts. The head is shorter than MaxSize, and from there on
+    // every MaxSize part ends on a boundary too.
+    //
+    PartSize = MaxSize;
+    if (IsErase) {
+      Misalignment = ModU64x32 (Lba, Dev->EraseAlignment);
+      if (Misalignment != 0) {
+        PartSize = (UINTN)(Dev->EraseAlignment - Misalignment) *
+                   Dev->BlockIoMedia.BlockSize;
+      }
+
+      ASSERT (
+        ModU64x32 (
+          Lba + PartSize / Dev->BlockIoMedia.BlockSize,
+          Dev->EraseAlignment
+          ) == 0
+        );
+    }
+
+    Status = SubmitAndPoll (Dev, RequestType, Lba, PartSize, Buffer, NULL);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Lba        += PartSize / Dev->BlockIoMedia.BlockSize;
+    BufferSize -= PartSize;
+    if (Buffer != NULL) {
+      Buffer = (volatile UINT8 *)Buffer + PartSize;
+    }
+  }
+
+  return SubmitAndPoll (Dev, RequestType, Lba, BufferSize, Buffer, Token);
+}
+
+/**
+
+  Format a read / write / flush request as three consecutive virtio
+  descriptors, push them to the host, and poll for the response.
+
+  See MapRequest() for the description of Dev, Lba, BufferSize and Buffer, and
+  SubmitAndPoll() for the return values.
+
+  @param[in] RequestIsWrite  TRUE iff data transfer goes from guest to
+                             device. A write request with zero BufferSize is a
+                             flush request.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+SynchronousRequest (
+  IN              VBLK_DEV  *Dev,
+  IN              EFI_LBA   Lba,
+  IN              UINTN     BufferSize,
+  IN OUT volatile VOID      *Buffer,
+  IN              BOOLEAN   RequestIsWrite
+  )
+{
+  return SubmitSplit (
+           Dev,
+           (RequestIsWrite ?
+            (BufferSize == 0 ? VIRTIO_BLK_T_FLUSH : VIRTIO_BLK_T_OUT) :
+            VIRTIO_BLK_T_IN),
+           Lba,
+           BufferSize,
+           Buffer,
+           NULL
+           );
+}
+
+/**
+
+  Execute a blocking read request through the block cache.
+
+  Small requests are served from the cache if possible. Otherwise they are
+  read from the device -- with read-ahead if they continue the previous
+  request -- and the blocks are added to the cache. Large requests bypass the
+  cache.
+
+  See SynchronousRequest() for the parameters and return values.
+
+**/
+STATIC
+EFI_STATUS
+CachedRead (
+  IN  VBLK_DEV  *Dev,
+  IN  EFI_LBA   Lba,
+  IN  UINTN     BufferSize,
+  OUT VOID      *Buffer
+  )
+{
+  VBLK_CACHE  *Cache;
+  UINTN       NumBlocks;
+  UINTN       ReadBlocks;
+  BOOLEAN     Sequential;
+  UINT32      Generation;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+
+  Cache     = &Dev->Cache;
+  NumBlocks = BufferSize / Dev->BlockIoMedia.BlockSize;
+  if ((Cache->NumEntries == 0) || (NumBlocks > Cache->MaxRequestBlocks)) {
+    return SynchronousRequest (Dev, Lba, BufferSize, Buffer, FALSE);
+  }
+
+  OldTpl         = gBS->RaiseTPL (TPL_NOTIFY);
+  Sequential     = (BOOLEAN)(Lba == Cache->NextLba);
+  Cache->NextLba = Lba + NumBlocks;
+  if (VirtioBlkCacheLookup (Cache, Lba, NumBlocks, Buffer)) {
+    gBS->RestoreTPL (OldTpl);
+    return EFI_SUCCESS;
+  }
+
+  if (Cache->BounceInUse) {
+    //
+    // We've interrupted another reader that is using the bounce buffer.
+    //
+    gBS->RestoreTPL (OldTpl);
+    return SynchronousRequest (Dev, Lba, BufferSize, Buffer, FALSE);
+  }
+
+  Cache->BounceInUse = TRUE;
+  Generation         = Cache->Generation;
+  gBS->RestoreTPL (OldTpl);
+
+  //
+  // Read ahead, up to the end of the device, in the same request.
+  //
+  ReadBlocks = NumBlocks;
+  if (Sequential) {
+    ReadBlocks += (UINTN)MIN (
+                           Cache->ReadAheadBlocks,
+                           Dev->BlockIoMedia.LastBlock - (Lba + NumBlocks - 1)
+                           );
+  }
+
+  Status = SynchronousRequest (
+             Dev,
+             Lba,
+             ReadBlocks * Dev->BlockIoMedia.BlockSize,
+             Cache->Bounce,
+             FALSE
+             );
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (!EFI_ERROR (Status)) {
+    CopyMem (Buffer, Cache->Bounce, BufferSize);
+
+    //
+    // Don't insert the blocks if some blocks have been written in the
+    // meantime; the data read may predate the write.
+    //
+    if (Generation == Cache->Generation) {
+      VirtioBlkCacheInsert (Cache, Lba, ReadBlocks, Cache->Bounce);
+      Cache->ReadAhead += ReadBlocks - NumBlocks;
+    }
+  }
+
+  Cache->BounceInUse = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+
+  ReadBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
+    Protocol, EFI_BLOCK_IO_PROTOCOL.ReadBlocks().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
+    ReadBlocksEx() Implementation.
+
+  Parameter checks and conformant return values are implemented in
+  VerifyReadWriteRequest() and SynchronousRequest().
+
+  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
+  successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocks (
+  IN  EFI_BLOCK_IO_PROTOCOL  *This,
+  IN  UINT32                 MediaId,
+  IN  EFI_LBA                Lba,
+  IN  UINTN                  BufferSize,
+  OUT VOID                   *Buffer
+  )
+{
+  VBLK_DEV    *Dev;
+  EFI_STATUS  Status;
+
+  if (BufferSize == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO (This);
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             BufferSize,
+             FALSE               // RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return CachedRead (Dev, Lba, BufferSize, Buffer);
+}
+
+/**
+
+  WriteBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
+    Protocol, EFI_BLOCK_IO_PROTOCOL.WriteBlocks().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.3 WriteBlocks() and
+    WriteBlockEx() Implementation.
+
+  Parameter checks and conformant return values are implemented in
+  VerifyReadWriteRequest() and SynchronousRequest().
+
+  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
+  successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkWriteBlocks (
+  IN EFI_BLOCK_IO_PROTOCOL  *This,
+  IN UINT32                 MediaId,
+  IN EFI_LBA                Lba,
+  IN UINTN                  BufferSize,
+  IN VOID                   *Buffer
   )
 {
   VBLK_DEV    *Dev;
@@ -596,9 +1241,293 @@ VirtioBlkFlushBlocks (
            0,      // Lba
            0,      // BufferSize
            NULL,   // Buffer
-           TRUE    // RequestIsWrite
-           ) :
-         EFI_SUCCESS;
+           TRUE    // RequestIsWrite
+           ) :
+         EFI_SUCCESS;
+}
+
+//
+// UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol
+//
+EFI_STATUS
+EFIAPI
+VirtioBlkResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  )
+{
+  VBLK_DEV  *Dev;
+  EFI_TPL   OldTpl;
+
+  //
+  // Pending non-blocking requests cannot be withdrawn from the host; let them
+  // complete (and signal their tokens) instead.
+  //
+  Dev = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  DrainRequests (Dev);
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioBlkCacheInvalidate (&Dev->Cache);
+  gBS->RestoreTPL (OldTpl);
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Complete a successful request that needs no interaction with the host.
+
+  @param[in,out] Token  The token of the request; may be NULL, or have a NULL
+                        Event, for blocking requests.
+
+  @retval EFI_SUCCESS  The request has been completed.
+
+**/
+STATIC
+EFI_STATUS
+CompleteTokenImmediately (
+  IN OUT EFI_BLOCK_IO2_TOKEN  *Token   OPTIONAL
+  )
+{
+  if ((Token != NULL) && (Token->Event != NULL)) {
+    Token->TransactionStatus = EFI_SUCCESS;
+    gBS->SignalEvent (Token->Event);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Common implementation of ReadBlocksEx() and WriteBlocksEx().
+
+  @param[in] Dev             The virtio-blk device the request is targeted at.
+
+  @param[in] Lba             Logical Block Address: number of logical blocks
+                             to skip from the beginning of the device.
+
+  @param[in,out] Token       The token of the request; see ReadBlocksEx() and
+                             WriteBlocksEx().
+
+  @param[in] BufferSize      Size of buffer to transfer, in bytes.
+
+  @param[in,out] Buffer      The guest side area to read data from the device
+                             into, or write data to the device from.
+
+  @param[in] RequestIsWrite  TRUE iff data transfer goes from guest to device.
+
+**/
+STATIC
+EFI_STATUS
+ReadWriteBlocksEx (
+  IN     VBLK_DEV             *Dev,
+  IN     EFI_LBA              Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN  *Token,
+  IN     UINTN                BufferSize,
+  IN OUT VOID                 *Buffer,
+  IN     BOOLEAN              RequestIsWrite
+  )
+{
+  EFI_STATUS  Status;
+
+  if (BufferSize == 0) {
+    return CompleteTokenImmediately (Token);
+  }
+
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             BufferSize,
+             RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (!RequestIsWrite && ((Token == NULL) || (Token->Event == NULL))) {
+    return CachedRead (Dev, Lba, BufferSize, Buffer);
+  }
+
+  return SubmitSplit (
+           Dev,
+           RequestIsWrite ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+           Lba,
+           BufferSize,
+           Buffer,
+           ((Token != NULL) && (Token->Event != NULL)) ? Token : NULL
+           );
+}
+
+/**
+
+  ReadBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx().
+
+  If Token is NULL, or Token->Event is NULL, the request is blocking, and
+  behaves identically to ReadBlocks(). Otherwise the request is queued to the
+  device, and Token->Event is signaled when the host completes it.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  )
+{
+  return ReadWriteBlocksEx (
+           VIRTIO_BLK_FROM_BLOCK_IO2 (This),
+           Lba,
+           Token,
+           BufferSize,
+           Buffer,
+           FALSE       // RequestIsWrite
+           );
+}
+
+/**
+
+  WriteBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.WriteBlocksEx().
+
+  If Token is NULL, or Token->Event is NULL, the request is blocking, and
+  behaves identically to WriteBlocks(). Otherwise the request is queued to the
+  device, and Token->Event is signaled when the host completes it.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  )
+{
+  return ReadWriteBlocksEx (
+           VIRTIO_BLK_FROM_BLOCK_IO2 (This),
+           Lba,
+           Token,
+           BufferSize,
+           Buffer,
+           TRUE        // RequestIsWrite
+           );
+}
+
+/**
+
+  FlushBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.FlushBlocksEx().
+
+  Requests that are in flight when this function is called are completed
+  first, so that the flush covers them.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  )
+{
+  VBLK_DEV  *Dev;
+
+  Dev = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  if (!Dev->BlockIoMedia.WriteCaching) {
+    return CompleteTokenImmediately (Token);
+  }
+
+  DrainRequests (Dev);
+  return SubmitAndPoll (
+           Dev,
+           VIRTIO_BLK_T_FLUSH,
+           0,      // Lba
+           0,      // BufferSize
+           NULL,   // Buffer
+           ((Token != NULL) && (Token->Event != NULL)) ? Token : NULL
+           );
+}
+
+/**
+
+  EraseBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.6, 13.15 Erase Block Protocol,
+    EFI_ERASE_BLOCK_PROTOCOL.EraseBlocks().
+
+  The protocol is only installed if the host offers VIRTIO_BLK_F_WRITE_ZEROES
+  or VIRTIO_BLK_F_DISCARD; VirtioBlkInit() selects the request type in
+  Dev->EraseType.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkEraseBlocks (
+  IN     EFI_BLOCK_IO_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN  *Token,
+  IN     UINTN                  Size
+  )
+{
+  VBLK_DEV             *Dev;
+  EFI_BLOCK_IO2_TOKEN  *BlockIo2Token;
+  UINTN                BlockCount;
+
+  //
+  // The prototype in the spec says "EFI_BLOCK_IO_PROTOCOL", but callers pass
+  // the EFI_ERASE_BLOCK_PROTOCOL instance.
+  //
+  Dev = VIRTIO_BLK_FROM_ERASE_BLOCK ((EFI_ERASE_BLOCK_PROTOCOL *)This);
+
+  //
+  // EFI_ERASE_BLOCK_TOKEN and EFI_BLOCK_IO2_TOKEN have identical layouts.
+  //
+  BlockIo2Token = (EFI_BLOCK_IO2_TOKEN *)Token;
+
+  if (Size == 0) {
+    return CompleteTokenImmediately (BlockIo2Token);
+  }
+
+  if (Size % Dev->BlockIoMedia.BlockSize != 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  BlockCount = Size / Dev->BlockIoMedia.BlockSize;
+  if ((Lba > Dev->BlockIoMedia.LastBlock) ||
+      (BlockCount - 1 > Dev->BlockIoMedia.LastBlock - Lba))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Dev->BlockIoMedia.ReadOnly) {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  return SubmitSplit (
+           Dev,
+           Dev->EraseType,
+           Lba,
+           Size,
+           NULL,   // Buffer
+           ((BlockIo2Token != NULL) && (BlockIo2Token->Event != NULL)) ?
+           BlockIo2Token : NULL
+           );
 }
 
 /**
@@ -684,6 +1613,136 @@ VirtioBlkDriverBindingSupported (
   return Status;
 }
 
+/**
+
+  Allocate, map and report one virtqueue of the device.
+
+  @param[in,out] Dev        The driver instance being set up.
+
+  @param[in] QueueIdx       The index of the virtqueue; Dev->Queues[QueueIdx]
+                            is initialized.
+
+  @param[in] Features       The features negotiated so far.
+
+  @param[out] QueueSize     The number of descriptors in the virtqueue.
+
+  @retval EFI_SUCCESS      The virtqueue is ready for use.
+
+  @retval EFI_UNSUPPORTED  The virtqueue cannot accommodate a single request.
+
+  @return                  Error codes from VirtioRingInit(), VirtioRingMap()
+                           or the VirtIo protocol.
+
+**/
+STATIC
+EFI_STATUS
+VirtioBlkInitQueue (
+  IN OUT VBLK_DEV  *Dev,
+  IN     UINT16    QueueIdx,
+  IN     UINT64    Features,
+  OUT    UINT16    *QueueSize
+  )
+{
+  VBLK_QUEUE  *Queue;
+  EFI_STATUS  Status;
+  UINT64      RingBaseShift;
+
+  Queue  = &Dev->Queues[QueueIdx];
+  Status = Dev->VirtIo->SetQueueSel (Dev->VirtIo, QueueIdx);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, QueueSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (*QueueSize < Dev->RingDescPerReq) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = VirtioRingInitForFeatures (
+             Dev->VirtIo,
+             *QueueSize,
+             Features,
+             &Queue->Ring
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // If anything fails from here on, we must release the ring resources
+  //
+  Status = VirtioRingMap (
+             Dev->VirtIo,
+             &Queue->Ring,
+             &RingBaseShift,
+             &Queue->RingMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto ReleaseRing;
+  }
+
+  //
+  // Additional steps for MMIO: align the queue appropriately, and set the
+  // size. If anything fails from here on, we must unmap the ring resources.
+  //
+  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, *QueueSize);
+  if (EFI_ERROR (Status)) {
+    goto UnmapRing;
+  }
+
+  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
+  if (EFI_ERROR (Status)) {
+    goto UnmapRing;
+  }
+
+  //
+  // step 4c -- Report GPFN (guest-physical frame number) of queue.
+  //
+  Status = Dev->VirtIo->SetQueueAddress (
+                          Dev->VirtIo,
+                          &Queue->Ring,
+                          RingBaseShift
+                          );
+  if (EFI_ERROR (Status)) {
+    goto UnmapRing;
+  }
+
+  Queue->LastUsedIdx = 0;
+  return EFI_SUCCESS;
+
+UnmapRing:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Queue->RingMap);
+
+ReleaseRing:
+  VirtioRingUninit (Dev->VirtIo, &Queue->Ring);
+
+  return Status;
+}
+
+/**
+
+  Release the resources of a virtqueue set up with VirtioBlkInitQueue().
+
+  @param[in,out] Dev   The driver instance.
+
+  @param[in] QueueIdx  The index of the virtqueue.
+
+**/
+STATIC
+VOID
+VirtioBlkUninitQueue (
+  IN OUT VBLK_DEV  *Dev,
+  IN     UINT16    QueueIdx
+  )
+{
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->Queues[QueueIdx].RingMap);
+  VirtioRingUninit (Dev->VirtIo, &Dev->Queues[QueueIdx].Ring);
+}
+
 /**
 
   Set up all BlockIo and virtio-blk aspects of this driver for the specified
@@ -719,12 +1778,22 @@ VirtioBlkInit (
   UINT8   PhysicalBlockExp;
   UINT8   AlignmentOffset;
   UINT32  OptIoSize;
+  UINT32  SizeMax;
+  UINT32  SegMax;
+  UINT16  NumQueues;
+  UINT32  MaxEraseSectors;
+  UINT32  MaxEraseSeg;
+  UINT32  EraseAlignment;
   UINT16  QueueSize;
-  UINT64  RingBaseShift;
+  UINT16  SlotsPerQueue;
+  UINT16  Slot;
+
+  EFI_PHYSICAL_ADDRESS  RequestPoolDeviceAddress;
 
   PhysicalBlockExp = 0;
   AlignmentOffset  = 0;
   OptIoSize        = 0;
+  Dev->EraseType   = 0;
 
   //
   // Execute virtio-0.9.5, 2.2.1 Device Initialization Sequence.
@@ -819,9 +1888,98 @@ VirtioBlkInit (
     }
   }
 
+  if (Features & VIRTIO_BLK_F_SIZE_MAX) {
+    Status = VIRTIO_CFG_READ (Dev, SizeMax, &SizeMax);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+
+    //
+    // SubmitSplit() cuts transfers to whole blocks; if a single block exceeds
+    // the limit, don't accept the limit at all.
+    //
+    if (SizeMax < BlockSize) {
+      Features &= ~(UINT64)VIRTIO_BLK_F_SIZE_MAX;
+    }
+  }
+
+  if (Features & VIRTIO_BLK_F_SEG_MAX) {
+    Status = VIRTIO_CFG_READ (Dev, SegMax, &SegMax);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+
+    //
+    // Every request has a single data segment.
+    //
+    if (SegMax == 0) {
+      Features &= ~(UINT64)VIRTIO_BLK_F_SEG_MAX;
+    }
+  }
+
+  NumQueues = 1;
+  if (Features & VIRTIO_BLK_F_MQ) {
+    Status = VIRTIO_CFG_READ (Dev, NumQueues, &NumQueues);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+
+    NumQueues = MAX (NumQueues, 1);
+    NumQueues = MIN (NumQueues, VBLK_MAX_QUEUES);
+  }
+
+  //
+  // Prefer VIRTIO_BLK_T_WRITE_ZEROES for EraseBlocks(), so that erased blocks
+  // read back as zeros.
+  //
+  MaxEraseSectors = 0;
+  EraseAlignment  = 0;
+  if (Features & VIRTIO_BLK_F_WRITE_ZEROES) {
+    Status = VIRTIO_CFG_READ (Dev, MaxWriteZeroesSectors, &MaxEraseSectors);
+    if (!EFI_ERROR (Status)) {
+      Status = VIRTIO_CFG_READ (Dev, MaxWriteZeroesSeg, &MaxEraseSeg);
+    }
+
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+
+    if ((MaxEraseSectors >= BlockSize / 512) && (MaxEraseSeg > 0)) {
+      Dev->EraseType = VIRTIO_BLK_T_WRITE_ZEROES;
+      Features      &= ~(UINT64)VIRTIO_BLK_F_DISCARD;
+    } else {
+      Features &= ~(UINT64)VIRTIO_BLK_F_WRITE_ZEROES;
+    }
+  }
+
+  if (Features & VIRTIO_BLK_F_DISCARD) {
+    Status = VIRTIO_CFG_READ (Dev, MaxDiscardSectors, &MaxEraseSectors);
+    if (!EFI_ERROR (Status)) {
+      Status = VIRTIO_CFG_READ (Dev, MaxDiscardSeg, &MaxEraseSeg);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = VIRTIO_CFG_READ (Dev, DiscardSectorAlignment, &EraseAlignment);
+    }
+
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+
+    if ((MaxEraseSectors >= BlockSize / 512) && (MaxEraseSeg > 0)) {
+      Dev->EraseType = VIRTIO_BLK_T_DISCARD;
+    } else {
+      Features &= ~(UINT64)VIRTIO_BLK_F_DISCARD;
+    }
+  }
+
   Features &= VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_RO |
-              VIRTIO_BLK_F_FLUSH | VIRTIO_F_VERSION_1 |
-              VIRTIO_F_IOMMU_PLATFORM;
+              VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_SIZE_MAX |
+              VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_MQ |
+              VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES |
+              VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM |
+              VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_RING_INDIRECT_DESC |
+              VIRTIO_F_RING_PACKED;
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
@@ -835,68 +1993,113 @@ VirtioBlkInit (
   }
 
   //
-  // step 4b -- allocate virtqueue
+  // step 4b, 4c -- allocate and report the virtqueues. SubmitRequest() uses at
+  // most three descriptors per request, or one descriptor that refers to an
+  // indirect table. Every queue gets the same number of request slots. The
+  // indirect tables of all slots must fit in the range that VirtioLib can
+  // address.
   //
-  Status = Dev->VirtIo->SetQueueSel (Dev->VirtIo, 0);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
-  }
+  Dev->UseIndirect    = (BOOLEAN)((Features & VIRTIO_F_RING_INDIRECT_DESC) != 0);
+  Dev->RingDescPerReq = Dev->UseIndirect ? 1 : VBLK_DESC_PER_REQ;
+  SlotsPerQueue       = (UINT16)((Dev->UseIndirect ?
+                                  ((UINTN)MAX_UINT16 + 1) / VBLK_DESC_PER_REQ :
+                                  MAX_UINT16) / NumQueues);
 
-  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, &QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
-  }
+  for (Dev->NumQueues = 0; Dev->NumQueues < NumQueues; Dev->NumQueues++) {
+    Status = VirtioBlkInitQueue (Dev, Dev->NumQueues, Features, &QueueSize);
+    if (EFI_ERROR (Status)) {
+      goto ReleaseQueues;
+    }
 
-  if (QueueSize < 3) {
-    // SynchronousRequest() uses at most three descriptors
-    Status = EFI_UNSUPPORTED;
-    goto Failed;
+    SlotsPerQueue = MIN (SlotsPerQueue, QueueSize / Dev->RingDescPerReq);
   }
 
-  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Dev->Ring);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
+  //
+  // Set up the request slots, and the timer that reaps non-blocking requests.
+  // If anything fails from here on, we must release the queues.
+  //
+  Dev->NumRequests = (UINT16)(NumQueues * SlotsPerQueue);
+  Dev->Requests    = AllocateZeroPool (Dev->NumRequests * sizeof *Dev->Requests);
+  if (Dev->Requests == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ReleaseQueues;
   }
 
   //
-  // If anything fails from here on, we must release the ring resources
+  // Allocate and map the request headers and host status bytes of all slots
+  // once, rather than for each request; under SEV, every such mapping is a
+  // round trip through the IOMMU protocol.
   //
-  Status = VirtioRingMap (
+  Dev->RequestPoolPages = EFI_SIZE_TO_PAGES (
+                            Dev->NumRequests * sizeof *Dev->RequestPool
+                            );
+  Status = Dev->VirtIo->AllocateSharedPages (
+                          Dev->VirtIo,
+                          Dev->RequestPoolPages,
+                          (VOID **)&Dev->RequestPool
+                          );
+  if (EFI_ERROR (Status)) {
+    goto FreeRequests;
+  }
+
+  SetMem (
+    Dev->RequestPool,
+    EFI_PAGES_TO_SIZE (Dev->RequestPoolPages),
+    0x00
+    );
+
+  Status = VirtioMapAllBytesInSharedBuffer (
              Dev->VirtIo,
-             &Dev->Ring,
-             &RingBaseShift,
-             &Dev->RingMap
+             VirtioOperationBusMasterCommonBuffer,
+             Dev->RequestPool,
+             EFI_PAGES_TO_SIZE (Dev->RequestPoolPages),
+             &RequestPoolDeviceAddress,
+             &Dev->RequestPoolMap
              );
   if (EFI_ERROR (Status)) {
-    goto ReleaseQueue;
+    goto FreeRequestPool;
   }
 
-  //
-  // Additional steps for MMIO: align the queue appropriately, and set the
-  // size. If anything fails from here on, we must unmap the ring resources.
-  //
-  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  for (Slot = 0; Slot < Dev->NumRequests; Slot++) {
+    Dev->Requests[Slot].Dma                     = &Dev->RequestPool[Slot];
+    Dev->Requests[Slot].RequestDeviceAddress    = RequestPoolDeviceAddress +
+                                                  Slot * sizeof *Dev->RequestPool +
+                                                  OFFSET_OF (VBLK_REQ_DMA, Request);
+    Dev->Requests[Slot].HostStatusDeviceAddress = RequestPoolDeviceAddress +
+                                                  Slot * sizeof *Dev->RequestPool +
+                                                  OFFSET_OF (VBLK_REQ_DMA, HostStatus);
+    Dev->Requests[Slot].SegmentDeviceAddress = RequestPoolDeviceAddress +
+                                               Slot * sizeof *Dev->RequestPool +
+                                               OFFSET_OF (VBLK_REQ_DMA, Segment);
   }
 
-  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  if (Dev->UseIndirect) {
+    Status = VirtioIndirectInit (
+               Dev->VirtIo,
+               &Dev->Queues[0].Ring,
+               Dev->NumRequests,
+               VBLK_DESC_PER_REQ,
+               &Dev->Indirect
+               );
+    if (EFI_ERROR (Status)) {
+      goto UnmapRequestPool;
+    }
   }
 
-  //
-  // step 4c -- Report GPFN (guest-physical frame number) of queue.
-  //
-  Status = Dev->VirtIo->SetQueueAddress (
-                          Dev->VirtIo,
-                          &Dev->Ring,
-                          RingBaseShift
-                          );
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  &VirtioBlkAsyncTimer,
+                  Dev,
+                  &Dev->AsyncTimer
+                  );
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto ReleaseIndirect;
   }
 
+  Dev->NumInFlight      = 0;
+  Dev->NumAsyncInFlight = 0;
+
   //
   // step 5 -- Report understood features.
   //
@@ -904,7 +2107,7 @@ VirtioBlkInit (
     Features &= ~(UINT64)(VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM);
     Status    = Dev->VirtIo->SetGuestFeatures (Dev->VirtIo, Features);
     if (EFI_ERROR (Status)) {
-      goto UnmapQueue;
+      goto CloseAsyncTimer;
     }
   }
 
@@ -914,7 +2117,7 @@ VirtioBlkInit (
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto CloseAsyncTimer;
   }
 
   //
@@ -927,6 +2130,11 @@ VirtioBlkInit (
   Dev->BlockIo.ReadBlocks            = &VirtioBlkReadBlocks;
   Dev->BlockIo.WriteBlocks           = &VirtioBlkWriteBlocks;
   Dev->BlockIo.FlushBlocks           = &VirtioBlkFlushBlocks;
+  Dev->BlockIo2.Media                = &Dev->BlockIoMedia;
+  Dev->BlockIo2.Reset                = &VirtioBlkResetEx;
+  Dev->BlockIo2.ReadBlocksEx         = &VirtioBlkReadBlocksEx;
+  Dev->BlockIo2.WriteBlocksEx        = &VirtioBlkWriteBlocksEx;
+  Dev->BlockIo2.FlushBlocksEx        = &VirtioBlkFlushBlocksEx;
   Dev->BlockIoMedia.MediaId          = 0;
   Dev->BlockIoMedia.RemovableMedia   = FALSE;
   Dev->BlockIoMedia.MediaPresent     = TRUE;
@@ -940,6 +2148,70 @@ VirtioBlkInit (
                                          BlockSize / 512
                                          ) - 1;
 
+  //
+  // Limits for SubmitSplit(), rounded down to whole blocks.
+  //
+  Dev->MaxTransferSize = SIZE_1GB;
+  if (Features & VIRTIO_BLK_F_SIZE_MAX) {
+    Dev->MaxTransferSize = MIN (SizeMax, SIZE_1GB);
+  }
+
+  Dev->MaxTransferSize -= Dev->MaxTransferSize % BlockSize;
+
+  if (Dev->EraseType != 0) {
+    Dev->MaxEraseSize  = (UINTN)MIN ((UINT64)MaxEraseSectors * 512, SIZE_1GB);
+    Dev->MaxEraseSize -= Dev->MaxEraseSize % BlockSize;
+
+    //
+    // discard_sector_alignment is in 512-byte sectors; keep it in blocks.
+    //
+    Dev->EraseAlignment = MAX (1, EraseAlignment / (BlockSize / 512));
+
+    //
+    // SubmitSplit() relies on the maximum erase size being a whole number of
+    // alignment units. If the host can't erase even one unit per request, the
+    // alignment can't be honored; treat it as the hint it is and ignore it.
+    //
+    if (Dev->MaxEraseSize / BlockSize < Dev->EraseAlignment) {
+      DEBUG ((
+        DEBUG_WARN,
+        "%a: ignoring erase alignment 0x%x[Lba] above MaxEraseSize 0x%Lx[B]\n",
+        __FUNCTION__,
+        Dev->EraseAlignment,
+        (UINT64)Dev->MaxEraseSize
+        ));
+      Dev->EraseAlignment = 1;
+    }
+
+    Dev->MaxEraseSize -= Dev->MaxEraseSize %
+                         ((UINTN)Dev->EraseAlignment * BlockSize);
+
+    //
+    // UEFI Spec 2.6, 13.15 Erase Block Protocol
+    //
+    Dev->EraseBlock.Revision               = EFI_ERASE_BLOCK_PROTOCOL_REVISION;
+    Dev->EraseBlock.EraseLengthGranularity = Dev->EraseAlignment;
+    Dev->EraseBlock.EraseBlocks = &VirtioBlkEraseBlocks;
+
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: Erase=%a MaxEraseSize=0x%Lx[B] EraseLengthGranularity=0x%x[Lba]\n",
+      __FUNCTION__,
+      (Dev->EraseType == VIRTIO_BLK_T_WRITE_ZEROES) ? "WriteZeroes" : "Discard",
+      (UINT64)Dev->MaxEraseSize,
+      Dev->EraseBlock.EraseLengthGranularity
+      ));
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: NumQueues=%u NumRequests=%u MaxTransferSize=0x%Lx[B]\n",
+    __FUNCTION__,
+    Dev->NumQueues,
+    Dev->NumRequests,
+    (UINT64)Dev->MaxTransferSize
+    ));
+
   DEBUG ((
     DEBUG_INFO,
     "%a: LbaSize=0x%x[B] NumBlocks=0x%Lx[Lba]\n",
@@ -970,13 +2242,52 @@ VirtioBlkInit (
       ));
   }
 
+  //
+  // The block cache is an optimization only; run without it if it cannot be
+  // set up.
+  //
+  Status = VirtioBlkCacheInit (
+             &Dev->Cache,
+             BlockSize,
+             PcdGet32 (PcdVirtioBlkCacheBlocks),
+             PcdGet32 (PcdVirtioBlkReadAheadBlocks)
+             );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((
+      DEBUG_WARN,
+      "%a: block cache disabled: %r\n",
+      __FUNCTION__,
+      Status
+      ));
+  }
+
   return EFI_SUCCESS;
 
-UnmapQueue:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
+CloseAsyncTimer:
+  gBS->CloseEvent (Dev->AsyncTimer);
+
+ReleaseIndirect:
+  if (Dev->UseIndirect) {
+    VirtioIndirectUninit (Dev->VirtIo, &Dev->Indirect);
+  }
+
+UnmapRequestPool:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RequestPoolMap);
 
-ReleaseQueue:
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+FreeRequestPool:
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 Dev->RequestPoolPages,
+                 Dev->RequestPool
+                 );
+
+FreeRequests:
+  FreePool (Dev->Requests);
+
+ReleaseQueues:
+  while (Dev->NumQueues > 0) {
+    VirtioBlkUninitQueue (Dev, --Dev->NumQueues);
+  }
 
 Failed:
   //
@@ -1011,10 +2322,26 @@ VirtioBlkUninit (
   //
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+  VirtioBlkCacheUninit (&Dev->Cache);
+  gBS->CloseEvent (Dev->AsyncTimer);
+  if (Dev->UseIndirect) {
+    VirtioIndirectUninit (Dev->VirtIo, &Dev->Indirect);
+  }
+
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RequestPoolMap);
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 Dev->RequestPoolPages,
+                 Dev->RequestPool
+                 );
+  FreePool (Dev->Requests);
+
+  while (Dev->NumQueues > 0) {
+    VirtioBlkUninitQueue (Dev, --Dev->NumQueues);
+  }
 
   SetMem (&Dev->BlockIo, sizeof Dev->BlockIo, 0x00);
+  SetMem (&Dev->BlockIo2, sizeof Dev->BlockIo2, 0x00);
   SetMem (&Dev->BlockIoMedia, sizeof Dev->BlockIoMedia, 0x00);
 }
 
@@ -1047,6 +2374,8 @@ VirtioBlkExitBoot (
   //
   Dev = Context;
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
+
+  VirtioBlkCacheLogStats (&Dev->Cache);
 }
 
 /**
@@ -1125,21 +2454,46 @@ VirtioBlkDriverBindingStart (
   }
 
   //
-  // Setup complete, attempt to export the driver instance's BlockIo interface.
+  // Setup complete, attempt to export the driver instance's BlockIo and
+  // BlockIo2 interfaces.
   //
   Dev->Signature = VBLK_SIG;
-  Status         = gBS->InstallProtocolInterface (
+  Status         = gBS->InstallMultipleProtocolInterfaces (
                           &DeviceHandle,
                           &gEfiBlockIoProtocolGuid,
-                          EFI_NATIVE_INTERFACE,
-                          &Dev->BlockIo
+                          &Dev->BlockIo,
+                          &gEfiBlockIo2ProtocolGuid,
+                          &Dev->BlockIo2,
+                          NULL
                           );
   if (EFI_ERROR (Status)) {
     goto CloseExitBoot;
   }
 
+  if (Dev->EraseType != 0) {
+    Status = gBS->InstallProtocolInterface (
+                    &DeviceHandle,
+                    &gEfiEraseBlockProtocolGuid,
+                    EFI_NATIVE_INTERFACE,
+                    &Dev->EraseBlock
+                    );
+    if (EFI_ERROR (Status)) {
+      goto UninstallBlockIo;
+    }
+  }
+
   return EFI_SUCCESS;
 
+UninstallBlockIo:
+  gBS->UninstallMultipleProtocolInterfaces (
+         DeviceHandle,
+         &gEfiBlockIoProtocolGuid,
+         &Dev->BlockIo,
+         &gEfiBlockIo2ProtocolGuid,
+         &Dev->BlockIo2,
+         NULL
+         );
+
 CloseExitBoot:
   gBS->CloseEvent (Dev->ExitBoot);
 
@@ -1212,15 +2566,44 @@ VirtioBlkDriverBindingStop (
   //
   // Handle Stop() requests for in-use driver instances gracefully.
   //
-  Status = gBS->UninstallProtocolInterface (
+  if (Dev->EraseType != 0) {
+    Status = gBS->UninstallProtocolInterface (
+                    DeviceHandle,
+                    &gEfiEraseBlockProtocolGuid,
+                    &Dev->EraseBlock
+                    );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Status = gBS->UninstallMultipleProtocolInterfaces (
                   DeviceHandle,
                   &gEfiBlockIoProtocolGuid,
-                  &Dev->BlockIo
+                  &Dev->BlockIo,
+                  &gEfiBlockIo2ProtocolGuid,
+                  &Dev->BlockIo2,
+                  NULL
                   );
   if (EFI_ERROR (Status)) {
+    if (Dev->EraseType != 0) {
+      gBS->InstallProtocolInterface (
+             &DeviceHandle,
+             &gEfiEraseBlockProtocolGuid,
+             EFI_NATIVE_INTERFACE,
+             &Dev->EraseBlock
+             );
+    }
+
     return Status;
   }
 
+  //
+  // Non-blocking requests may still be in flight; their tokens must be
+  // signaled before the request slots go away.
+  //
+  DrainRequests (Dev);
+
   gBS->CloseEvent (Dev->ExitBoot);
 
   VirtioBlkUninit (Dev);
@@ -13,13 +13,82 @@
 #define _VIRTIO_BLK_DXE_H_
 
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 #include <Protocol/ComponentName.h>
 #include <Protocol/DriverBinding.h>
+#include <Protocol/EraseBlock.h>
 
-#include <IndustryStandard/Virtio.h>
+#include <IndustryStandard/VirtioBlk.h>
+
+#include "BlockCache.h"
 
 #define VBLK_SIG  SIGNATURE_32 ('V', 'B', 'L', 'K')
 
+//
+// Every request occupies at most three descriptors: request header, data
+// buffer, host status. Request slot N owns descriptors [N * 3, N * 3 + 2], so
+// that in-flight requests never compete for descriptors.
+//
+// With VIRTIO_F_RING_INDIRECT_DESC, the three descriptors live in the indirect
+// table #N instead, and request slot N owns only ring descriptor N.
+//
+#define VBLK_DESC_PER_REQ  3
+
+//
+// With VIRTIO_BLK_F_MQ, we use at most this many request queues. Request slot
+// N is bound to queue (N % NumQueues), so that consecutive slots -- and thereby
+// concurrently outstanding requests -- are spread across the queues.
+//
+#define VBLK_MAX_QUEUES  8
+
+//
+// State of a single request queue (virtio-1.1, 5.2.2 Virtqueues).
+//
+typedef struct {
+  VRING     Ring;
+  VOID      *RingMap;
+  UINT16    LastUsedIdx;   // next used element to consume
+} VBLK_QUEUE;
+
+//
+// Period of the timer that reaps the completions of non-blocking
+// EFI_BLOCK_IO2_PROTOCOL requests, in 100ns units.
+//
+#define VBLK_ASYNC_POLL_PERIOD  EFI_TIMER_PERIOD_MILLISECONDS (1)
+
+//
+// The parts of a request that the host accesses, apart from the data buffer.
+// The request pool of a device is an array of these, one per request slot,
+// that is allocated and mapped as a bus master common buffer only once, in
+// VirtioBlkInit().
+//
+typedef struct {
+  VIRTIO_BLK_REQ                     Request;
+  VIRTIO_BLK_DISCARD_WRITE_ZEROES    Segment; // data of discard / write zeroes
+  UINT8                              HostStatus;
+} VBLK_REQ_DMA;
+
+//
+// Tracks a single request between submission and completion.
+//
+typedef struct {
+  BOOLEAN                  InUse;      // slot claimed by a caller
+  BOOLEAN                  InFlight;   // submitted, not yet completed
+  BOOLEAN                  RequestIsWrite;
+  EFI_LBA                  Lba;
+  UINTN                    NumBlocksWritten; // for the block cache
+  UINTN                    BufferSize;
+  EFI_BLOCK_IO2_TOKEN      *Token;     // NULL for blocking requests
+  EFI_STATUS               Status;     // valid once InFlight is cleared
+  volatile VBLK_REQ_DMA    *Dma;       // this slot's part of the pool
+  BOOLEAN                  BufferInPool; // data buffer is Dma->Segment
+  VOID                     *BufferMapping;
+  EFI_PHYSICAL_ADDRESS     RequestDeviceAddress;
+  EFI_PHYSICAL_ADDRESS     SegmentDeviceAddress;
+  EFI_PHYSICAL_ADDRESS     HostStatusDeviceAddress;
+  EFI_PHYSICAL_ADDRESS     BufferDeviceAddress;
+} VBLK_REQ;
+
 typedef struct {
   //
   // Parts of this structure are initialized / torn down in various functions
@@ -31,15 +100,39 @@ typedef struct {
   UINT32                    Signature;         // DriverBindingStart  0
   VIRTIO_DEVICE_PROTOCOL    *VirtIo;           // DriverBindingStart  0
   EFI_EVENT                 ExitBoot;          // DriverBindingStart  0
-  VRING                     Ring;              // VirtioRingInit      2
+  VBLK_QUEUE                Queues[VBLK_MAX_QUEUES]; // VirtioRingInit 2
+  UINT16                    NumQueues;         // VirtioBlkInit       1
   EFI_BLOCK_IO_PROTOCOL     BlockIo;           // VirtioBlkInit       1
   EFI_BLOCK_IO_MEDIA        BlockIoMedia;      // VirtioBlkInit       1
-  VOID                      *RingMap;          // VirtioRingMap       2
+  EFI_BLOCK_IO2_PROTOCOL    BlockIo2;          // VirtioBlkInit       1
+  VBLK_REQ                  *Requests;         // VirtioBlkInit       1
+  VBLK_REQ_DMA              *RequestPool;      // VirtioBlkInit       1
+  UINTN                     RequestPoolPages;  // VirtioBlkInit       1
+  VOID                      *RequestPoolMap;   // VirtioBlkInit       1
+  UINT16                    NumRequests;       // VirtioBlkInit       1
+  UINT16                    NumInFlight;       // VirtioBlkInit       1
+  UINT16                    NumAsyncInFlight;  // VirtioBlkInit       1
+  EFI_EVENT                 AsyncTimer;        // VirtioBlkInit       1
+  BOOLEAN                   UseIndirect;       // VirtioBlkInit       1
+  UINT16                    RingDescPerReq;    // VirtioBlkInit       1
+  VRING_INDIRECT            Indirect;          // VirtioIndirectInit  2
+  UINTN                     MaxTransferSize;   // VirtioBlkInit       1
+  EFI_ERASE_BLOCK_PROTOCOL  EraseBlock;        // VirtioBlkInit       1
+  UINT32                    EraseType;         // VirtioBlkInit       1
+  UINTN                     MaxEraseSize;      // VirtioBlkInit       1
+  UINT32                    EraseAlignment;    // VirtioBlkInit       1
+  VBLK_CACHE                Cache;             // VirtioBlkCacheInit  2
 } VBLK_DEV;
 
 #define VIRTIO_BLK_FROM_BLOCK_IO(BlockIoPointer) \
         CR (BlockIoPointer, VBLK_DEV, BlockIo, VBLK_SIG)
 
+#define VIRTIO_BLK_FROM_BLOCK_IO2(BlockIo2Pointer) \
+        CR (BlockIo2Pointer, VBLK_DEV, BlockIo2, VBLK_SIG)
+
+#define VIRTIO_BLK_FROM_ERASE_BLOCK(EraseBlockPointer) \
+        CR (EraseBlockPointer, VBLK_DEV, EraseBlock, VBLK_SIG)
+
 /**
 
   Device probe function for this driver.
@@ -244,6 +337,113 @@ VirtioBlkFlushBlocks (
   IN EFI_BLOCK_IO_PROTOCOL  *This
   );
 
+//
+// UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol
+//
+EFI_STATUS
+EFIAPI
+VirtioBlkResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  );
+
+/**
+
+  ReadBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx().
+
+  If Token is NULL, or Token->Event is NULL, the request is blocking, and
+  behaves identically to ReadBlocks(). Otherwise the request is queued to the
+  device, and Token->Event is signaled when the host completes it.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  );
+
+/**
+
+  WriteBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.WriteBlocksEx().
+
+  If Token is NULL, or Token->Event is NULL, the request is blocking, and
+  behaves identically to WriteBlocks(). Otherwise the request is queued to the
+  device, and Token->Event is signaled when the host completes it.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  );
+
+/**
+
+  FlushBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.FlushBlocksEx().
+
+  Requests that are in flight when this function is called are completed
+  first, so that the flush covers them.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  );
+
+//
+// UEFI Spec 2.6, 13.15 Erase Block Protocol
+//
+
+/**
+
+  EraseBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.6, 13.15 Erase Block Protocol,
+    EFI_ERASE_BLOCK_PROTOCOL.EraseBlocks().
+
+  The blocks are erased with VIRTIO_BLK_T_WRITE_ZEROES if the host supports
+  it, so that they read back as zeros; with VIRTIO_BLK_T_DISCARD otherwise.
+
+  @param[in] This  The EFI_ERASE_BLOCK_PROTOCOL instance; the type of the
+                   parameter follows the function pointer type in the
+                   protocol header.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkEraseBlocks (
+  IN     EFI_BLOCK_IO_PROTOCOL  *This,
+  IN     UINT32                 MediaId,
+  IN     EFI_LBA                Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN  *Token,
+  IN     UINTN                  Size
+  );
+
 //
 // The purpose of the following scaffolding (EFI_COMPONENT_NAME_PROTOCOL and
 // EFI_COMPONENT_NAME2_PROTOCOL implementation) is to format the driver's name
@@ -0,0 +1,842 @@
+/** @file
+  Wrapper functions for the FUSE commands (primitives) that VirtioFsDxe sends
+  to the Virtio Filesystem device.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+#include "VirtioFsDxe.h"
+
+//
+// The NUL byte that terminates names in FUSE requests, when the name itself
+// is not NUL-terminated in guest memory.
+//
+STATIC CONST CHAR8  mNul = '\0';
+
+/**
+  Negotiate the FUSE protocol version and the request size limits with the
+  Virtio Filesystem device.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device. On success,
+                           RequestId, MaxIoSize and MaxWrite are set.
+
+  @retval EFI_SUCCESS         The FUSE session has been initialized.
+
+  @retval EFI_UNSUPPORTED     The server speaks an incompatible major version.
+
+  @retval EFI_PROTOCOL_ERROR  The response was malformed.
+
+  @return                     Error codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseInitSession (
+  IN OUT VIRTIO_FS  *VirtioFs
+  )
+{
+  VIRTIO_FS_FUSE_INIT_IN   InitIn;
+  VIRTIO_FS_FUSE_INIT_OUT  InitOut;
+  VIRTIO_FS_IO_VECTOR      Request;
+  VIRTIO_FS_IO_VECTOR      Response;
+  UINT32                   ResponseSize;
+  EFI_STATUS               Status;
+
+  VirtioFs->RequestId = 1;
+
+  InitIn.Major        = VIRTIO_FS_FUSE_MAJOR;
+  InitIn.Minor        = VIRTIO_FS_FUSE_MINOR;
+  InitIn.MaxReadahead = 0;
+  InitIn.Flags        = VIRTIO_FS_FUSE_INIT_MAX_PAGES;
+
+  Request.Buffer  = &InitIn;
+  Request.Size    = sizeof InitIn;
+  Response.Buffer = &InitOut;
+  Response.Size   = sizeof InitOut;
+
+  ZeroMem (&InitOut, sizeof InitOut);
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             VirtioFsFuseOpInit,
+             0,
+             &Request,
+             1,
+             &Response,
+             1,
+             &ResponseSize
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (ResponseSize < VIRTIO_FS_FUSE_INIT_OUT_COMPAT_SIZE) {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  if (InitOut.Major != VIRTIO_FS_FUSE_MAJOR) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: Label=\"%s\": unsupported FUSE version %u.%u\n",
+      __FUNCTION__,
+      VirtioFs->Label,
+      InitOut.Major,
+      InitOut.Minor
+      ));
+    return EFI_UNSUPPORTED;
+  }
+
+  //
+  // A single FUSE_READ / FUSE_WRITE may transfer as many pages as the server
+  // grants; larger requests mean fewer round trips for big files.
+  //
+  if (((InitOut.Flags & VIRTIO_FS_FUSE_INIT_MAX_PAGES) != 0) &&
+      (ResponseSize >= OFFSET_OF (VIRTIO_FS_FUSE_INIT_OUT, MapAlignment)) &&
+      (InitOut.MaxPages > 0))
+  {
+    VirtioFs->MaxIoSize = (UINT32)InitOut.MaxPages * EFI_PAGE_SIZE;
+  } else {
+    VirtioFs->MaxIoSize = VIRTIO_FS_DEFAULT_MAX_PAGES * EFI_PAGE_SIZE;
+  }
+
+  if (InitOut.MaxWrite == 0) {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  VirtioFs->MaxWrite = MIN (InitOut.MaxWrite, VirtioFs->MaxIoSize);
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: Label=\"%s\" FUSE %u.%u MaxIoSize=%u MaxWrite=%u\n",
+    __FUNCTION__,
+    VirtioFs->Label,
+    InitOut.Major,
+    InitOut.Minor,
+    VirtioFs->MaxIoSize,
+    VirtioFs->MaxWrite
+    ));
+  return EFI_SUCCESS;
+}
+
+/**
+  Look up a name in a directory. On success, the lookup count of the node
+  found is incremented; it must be released with VirtioFsForgetNode().
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] DirNodeId     The directory to look up Name in.
+
+  @param[in] Name          The name to look up, not necessarily NUL-terminated.
+
+  @param[in] NameLen       The length of Name in bytes.
+
+  @param[out] Entry        The node ID and the attributes of the node found.
+
+  @retval EFI_SUCCESS    Entry has been filled in.
+
+  @retval EFI_NOT_FOUND  Name does not exist in the directory.
+
+  @return                Error codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseLookup (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    DirNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINTN                     NameLen,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry
+  )
+{
+  VIRTIO_FS_IO_VECTOR  Request[2];
+  VIRTIO_FS_IO_VECTOR  Response;
+  EFI_STATUS           Status;
+
+  if ((NameLen == 0) || (NameLen > VIRTIO_FS_MAX_NAME_LEN)) {
+    return EFI_NOT_FOUND;
+  }
+
+  Request[0].Buffer = Name;
+  Request[0].Size   = (UINT32)NameLen;
+  Request[1].Buffer = (VOID *)&mNul;
+  Request[1].Size   = sizeof mNul;
+  Response.Buffer   = Entry;
+  Response.Size     = sizeof *Entry;
+
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             VirtioFsFuseOpLookup,
+             DirNodeId,
+             Request,
+             ARRAY_SIZE (Request),
+             &Response,
+             1,
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // A zero node ID is a cacheable negative entry.
+  //
+  if (Entry->NodeId == 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Release lookup references to several nodes with a single request.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] Nodes         The nodes to release, and the number of references
+                           to release from each.
+
+  @param[in] Count         The number of elements in Nodes.
+
+  @return  Status codes from VirtioFsFuseRequest(). The server does not
+           respond to FUSE_BATCH_FORGET.
+**/
+EFI_STATUS
+VirtioFsFuseBatchForget (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     VIRTIO_FS_FUSE_FORGET_ONE  *Nodes,
+  IN     UINT32                     Count
+  )
+{
+  VIRTIO_FS_FUSE_BATCH_FORGET_IN  BatchForget;
+  VIRTIO_FS_IO_VECTOR             Request[2];
+
+  if (Count == 0) {
+    return EFI_SUCCESS;
+  }
+
+  BatchForget.Count = Count;
+  BatchForget.Dummy = 0;
+
+  Request[0].Buffer = &BatchForget;
+  Request[0].Size   = sizeof BatchForget;
+  Request[1].Buffer = Nodes;
+  Request[1].Size   = Count * sizeof *Nodes;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpBatchForget,
+           0,
+           Request,
+           ARRAY_SIZE (Request),
+           NULL,
+           0,
+           NULL
+           );
+}
+
+/**
+  Fetch the attributes of a node.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to query.
+
+  @param[out] Attr         The attributes of the node.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseGetAttr (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     UINT64               NodeId,
+  OUT    VIRTIO_FS_FUSE_ATTR  *Attr
+  )
+{
+  VIRTIO_FS_FUSE_GETATTR_IN  GetAttrIn;
+  VIRTIO_FS_FUSE_ATTR_OUT    AttrOut;
+  VIRTIO_FS_IO_VECTOR        Request;
+  VIRTIO_FS_IO_VECTOR        Response;
+  EFI_STATUS                 Status;
+
+  ZeroMem (&GetAttrIn, sizeof GetAttrIn);
+  Request.Buffer  = &GetAttrIn;
+  Request.Size    = sizeof GetAttrIn;
+  Response.Buffer = &AttrOut;
+  Response.Size   = sizeof AttrOut;
+
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             VirtioFsFuseOpGetAttr,
+             NodeId,
+             &Request,
+             1,
+             &Response,
+             1,
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  CopyMem (Attr, &AttrOut.Attr, sizeof *Attr);
+  return EFI_SUCCESS;
+}
+
+/**
+  Change the attributes of a node.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to change.
+
+  @param[in] SetAttr       The attributes to set; SetAttr->Valid selects them.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseSetAttr (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     UINT64                     NodeId,
+  IN     VIRTIO_FS_FUSE_SETATTR_IN  *SetAttr
+  )
+{
+  VIRTIO_FS_FUSE_ATTR_OUT  AttrOut;
+  VIRTIO_FS_IO_VECTOR      Request;
+  VIRTIO_FS_IO_VECTOR      Response;
+
+  Request.Buffer  = SetAttr;
+  Request.Size    = sizeof *SetAttr;
+  Response.Buffer = &AttrOut;
+  Response.Size   = sizeof AttrOut;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpSetAttr,
+           NodeId,
+           &Request,
+           1,
+           &Response,
+           1,
+           NULL
+           );
+}
+
+/**
+  Create a directory. On success, the new directory has been looked up once.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] ParentNodeId  The directory to create the new directory in.
+
+  @param[in] Name          The NUL-terminated name of the new directory.
+
+  @param[in] Mode          The permission bits of the new directory.
+
+  @param[out] Entry        The node ID and the attributes of the new
+                           directory.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseMkDir (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    ParentNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINT32                    Mode,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry
+  )
+{
+  VIRTIO_FS_FUSE_MKDIR_IN  MkDirIn;
+  VIRTIO_FS_IO_VECTOR      Request[2];
+  VIRTIO_FS_IO_VECTOR      Response;
+
+  MkDirIn.Mode  = Mode;
+  MkDirIn.Umask = 0;
+
+  Request[0].Buffer = &MkDirIn;
+  Request[0].Size   = sizeof MkDirIn;
+  Request[1].Buffer = Name;
+  Request[1].Size   = (UINT32)AsciiStrSize (Name);
+  Response.Buffer   = Entry;
+  Response.Size     = sizeof *Entry;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpMkDir,
+           ParentNodeId,
+           Request,
+           ARRAY_SIZE (Request),
+           &Response,
+           1,
+           NULL
+           );
+}
+
+/**
+  Remove a regular file or an empty directory.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] ParentNodeId  The directory containing Name.
+
+  @param[in] Name          The NUL-terminated name to remove.
+
+  @param[in] IsDir         Whether Name is a directory.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseRemove (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     ParentNodeId,
+  IN     CHAR8      *Name,
+  IN     BOOLEAN    IsDir
+  )
+{
+  VIRTIO_FS_IO_VECTOR  Request;
+
+  Request.Buffer = Name;
+  Request.Size   = (UINT32)AsciiStrSize (Name);
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           IsDir ? VirtioFsFuseOpRmDir : VirtioFsFuseOpUnlink,
+           ParentNodeId,
+           &Request,
+           1,
+           NULL,
+           0,
+           NULL
+           );
+}
+
+/**
+  Open a regular file or a directory.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to open.
+
+  @param[in] IsDir         Whether NodeId is a directory.
+
+  @param[in] ReadWrite     Whether to open a regular file for writing too.
+
+  @param[out] FuseHandle   The FUSE file handle of the opened node.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseOpen (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     BOOLEAN    IsDir,
+  IN     BOOLEAN    ReadWrite,
+  OUT    UINT64     *FuseHandle
+  )
+{
+  VIRTIO_FS_FUSE_OPEN_IN   OpenIn;
+  VIRTIO_FS_FUSE_OPEN_OUT  OpenOut;
+  VIRTIO_FS_IO_VECTOR      Request;
+  VIRTIO_FS_IO_VECTOR      Response;
+  EFI_STATUS               Status;
+
+  OpenIn.Flags  = ReadWrite ? VIRTIO_FS_LINUX_O_RDWR : VIRTIO_FS_LINUX_O_RDONLY;
+  OpenIn.Unused = 0;
+
+  Request.Buffer  = &OpenIn;
+  Request.Size    = sizeof OpenIn;
+  Response.Buffer = &OpenOut;
+  Response.Size   = sizeof OpenOut;
+
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             IsDir ? VirtioFsFuseOpOpenDir : VirtioFsFuseOpOpen,
+             NodeId,
+             &Request,
+             1,
+             &Response,
+             1,
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *FuseHandle = OpenOut.FileHandle;
+  return EFI_SUCCESS;
+}
+
+/**
+  Create and open a regular file for reading and writing. On success, the new
+  file has been looked up once.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] ParentNodeId  The directory to create the file in.
+
+  @param[in] Name          The NUL-terminated name of the new file.
+
+  @param[in] Mode          The permission bits of the new file.
+
+  @param[out] Entry        The node ID and the attributes of the new file.
+
+  @param[out] FuseHandle   The FUSE file handle of the new file.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseCreate (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    ParentNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINT32                    Mode,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry,
+  OUT    UINT64                    *FuseHandle
+  )
+{
+  VIRTIO_FS_FUSE_CREATE_IN  CreateIn;
+  VIRTIO_FS_FUSE_OPEN_OUT   OpenOut;
+  VIRTIO_FS_IO_VECTOR       Request[2];
+  VIRTIO_FS_IO_VECTOR       Response[2];
+  EFI_STATUS                Status;
+
+  CreateIn.Flags   = VIRTIO_FS_LINUX_O_RDWR;
+  CreateIn.Mode    = Mode;
+  CreateIn.Umask   = 0;
+  CreateIn.Padding = 0;
+
+  Request[0].Buffer  = &CreateIn;
+  Request[0].Size    = sizeof CreateIn;
+  Request[1].Buffer  = Name;
+  Request[1].Size    = (UINT32)AsciiStrSize (Name);
+  Response[0].Buffer = Entry;
+  Response[0].Size   = sizeof *Entry;
+  Response[1].Buffer = &OpenOut;
+  Response[1].Size   = sizeof OpenOut;
+
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             VirtioFsFuseOpCreate,
+             ParentNodeId,
+             Request,
+             ARRAY_SIZE (Request),
+             Response,
+             ARRAY_SIZE (Response),
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  *FuseHandle = OpenOut.FileHandle;
+  return EFI_SUCCESS;
+}
+
+/**
+  Read data from a regular file, or directory entries from a directory.
+
+  The data is transferred by the device directly into Data.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to read.
+
+  @param[in] FuseHandle    The FUSE file handle of the open node.
+
+  @param[in] IsDir         If TRUE, read VIRTIO_FS_FUSE_DIRENTPLUS entries
+                           with FUSE_READDIRPLUS; otherwise, read file data
+                           with FUSE_READ.
+
+  @param[in] Offset        The file offset, or the directory offset that a
+                           previous VIRTIO_FS_FUSE_DIRENTPLUS.Offset returned.
+
+  @param[in,out] Size      On input, the size of Data; at most
+                           VirtioFs->MaxIoSize. On output, the number of
+                           bytes read; zero at the end of the file or
+                           directory.
+
+  @param[out] Data         The buffer to read into.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseRead (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     BOOLEAN    IsDir,
+  IN     UINT64     Offset,
+  IN OUT UINT32     *Size,
+  OUT    VOID       *Data
+  )
+{
+  VIRTIO_FS_FUSE_READ_IN  ReadIn;
+  VIRTIO_FS_IO_VECTOR     Request;
+  VIRTIO_FS_IO_VECTOR     Response;
+
+  ASSERT (*Size > 0 && *Size <= VirtioFs->MaxIoSize);
+
+  ZeroMem (&ReadIn, sizeof ReadIn);
+  ReadIn.FileHandle = FuseHandle;
+  ReadIn.Offset     = Offset;
+  ReadIn.Size       = *Size;
+
+  Request.Buffer  = &ReadIn;
+  Request.Size    = sizeof ReadIn;
+  Response.Buffer = Data;
+  Response.Size   = *Size;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           IsDir ? VirtioFsFuseOpReadDirPlus : VirtioFsFuseOpRead,
+           NodeId,
+           &Request,
+           1,
+           &Response,
+           1,
+           Size
+           );
+}
+
+/**
+  Write data to a regular file.
+
+  The data is transferred by the device directly from Data.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to write.
+
+  @param[in] FuseHandle    The FUSE file handle of the node, open for writing.
+
+  @param[in] Offset        The file offset to write at.
+
+  @param[in,out] Size      On input, the size of Data; at most
+                           VirtioFs->MaxWrite. On output, the number of bytes
+                           written.
+
+  @param[in] Data          The data to write.
+
+  @retval EFI_PROTOCOL_ERROR  The server reported writing more than requested.
+
+  @return                     Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseWrite (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     UINT64     Offset,
+  IN OUT UINT32     *Size,
+  IN     VOID       *Data
+  )
+{
+  VIRTIO_FS_FUSE_WRITE_IN   WriteIn;
+  VIRTIO_FS_FUSE_WRITE_OUT  WriteOut;
+  VIRTIO_FS_IO_VECTOR       Request[2];
+  VIRTIO_FS_IO_VECTOR       Response;
+  EFI_STATUS                Status;
+
+  ASSERT (*Size > 0 && *Size <= VirtioFs->MaxWrite);
+
+  ZeroMem (&WriteIn, sizeof WriteIn);
+  WriteIn.FileHandle = FuseHandle;
+  WriteIn.Offset     = Offset;
+  WriteIn.Size       = *Size;
+
+  Request[0].Buffer = &WriteIn;
+  Request[0].Size   = sizeof WriteIn;
+  Request[1].Buffer = Data;
+  Request[1].Size   = *Size;
+  Response.Buffer   = &WriteOut;
+  Response.Size     = sizeof WriteOut;
+
+  Status = VirtioFsFuseRequest (
+             VirtioFs,
+             VirtioFsFuseOpWrite,
+             NodeId,
+             Request,
+             ARRAY_SIZE (Request),
+             &Response,
+             1,
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (WriteOut.Size > *Size) {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  *Size = WriteOut.Size;
+  return EFI_SUCCESS;
+}
+
+/**
+  Fetch file system statistics.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        Any node on the file system.
+
+  @param[out] StatFs       The file system statistics.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseStatFs (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     UINT64                     NodeId,
+  OUT    VIRTIO_FS_FUSE_STATFS_OUT  *StatFs
+  )
+{
+  VIRTIO_FS_IO_VECTOR  Response;
+
+  Response.Buffer = StatFs;
+  Response.Size   = sizeof *StatFs;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpStatFs,
+           NodeId,
+           NULL,
+           0,
+           &Response,
+           1,
+           NULL
+           );
+}
+
+/**
+  Close a FUSE file handle.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node that FuseHandle belongs to.
+
+  @param[in] FuseHandle    The FUSE file handle to close.
+
+  @param[in] IsDir         Whether NodeId is a directory.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseRelease (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     BOOLEAN    IsDir
+  )
+{
+  VIRTIO_FS_FUSE_RELEASE_IN  ReleaseIn;
+  VIRTIO_FS_IO_VECTOR        Request;
+
+  ZeroMem (&ReleaseIn, sizeof ReleaseIn);
+  ReleaseIn.FileHandle = FuseHandle;
+
+  Request.Buffer = &ReleaseIn;
+  Request.Size   = sizeof ReleaseIn;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           IsDir ? VirtioFsFuseOpReleaseDir : VirtioFsFuseOpRelease,
+           NodeId,
+           &Request,
+           1,
+           NULL,
+           0,
+           NULL
+           );
+}
+
+/**
+  Flush the data and the metadata of a regular file to the host's storage.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device.
+
+  @param[in] NodeId        The node to flush.
+
+  @param[in] FuseHandle    The FUSE file handle of the node.
+
+  @return  Status codes from VirtioFsFuseRequest().
+**/
+EFI_STATUS
+VirtioFsFuseFsync (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle
+  )
+{
+  VIRTIO_FS_FUSE_FSYNC_IN  FsyncIn;
+  VIRTIO_FS_IO_VECTOR      Request;
+
+  ZeroMem (&FsyncIn, sizeof FsyncIn);
+  FsyncIn.FileHandle = FuseHandle;
+
+  Request.Buffer = &FsyncIn;
+  Request.Size   = sizeof FsyncIn;
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpFsync,
+           NodeId,
+           &Request,
+           1,
+           NULL,
+           0,
+           NULL
+           );
+}
+
+/**
+  Rename a file or a directory, without replacing an existing target.
+
+  @param[in,out] VirtioFs     The Virtio Filesystem device.
+
+  @param[in] OldParentNodeId  The directory containing OldName.
+
+  @param[in] OldName          The NUL-terminated name to rename.
+
+  @param[in] NewParentNodeId  The directory to move the node to.
+
+  @param[in] NewName          The NUL-terminated new name.
+
+  @return  Status codes from VirtioFsFuseRequest(); EFI_ACCESS_DENIED if
+           NewName exists.
+**/
+EFI_STATUS
+VirtioFsFuseRename (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     OldParentNodeId,
+  IN     CHAR8      *OldName,
+  IN     UINT64     NewParentNodeId,
+  IN     CHAR8      *NewName
+  )
+{
+  VIRTIO_FS_FUSE_RENAME2_IN  Rename2In;
+  VIRTIO_FS_IO_VECTOR        Request[3];
+
+  Rename2In.NewDir  = NewParentNodeId;
+  Rename2In.Flags   = VIRTIO_FS_FUSE_RENAME2_NOREPLACE;
+  Rename2In.Padding = 0;
+
+  Request[0].Buffer = &Rename2In;
+  Request[0].Size   = sizeof Rename2In;
+  Request[1].Buffer = OldName;
+  Request[1].Size   = (UINT32)AsciiStrSize (OldName);
+  Request[2].Buffer = NewName;
+  Request[2].Size   = (UINT32)AsciiStrSize (NewName);
+
+  return VirtioFsFuseRequest (
+           VirtioFs,
+           VirtioFsFuseOpRename2,
+           OldParentNodeId,
+           Request,
+           ARRAY_SIZE (Request),
+           NULL,
+           0,
+           NULL
+           );
+}
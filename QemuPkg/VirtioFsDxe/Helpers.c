@@ -0,0 +1,1286 @@
+/** @file
+  Initialization and helper routines for the Virtio Filesystem device.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/VirtioLib.h>
+
+#include "VirtioFsDxe.h"
+
+/**
+  Read the Virtio Filesystem device configuration structure in full.
+
+  @param[in]  Virtio  The Virtio protocol underlying the VIRTIO_FS object.
+
+  @param[out] Config  The fully populated VIRTIO_FS_CONFIG structure.
+
+  @retval EFI_SUCCESS  Config has been filled in.
+
+  @return              Error codes propagated from Virtio->ReadDevice(). The
+                       contents of Config are indeterminate.
+**/
+STATIC
+EFI_STATUS
+VirtioFsReadConfig (
+  IN  VIRTIO_DEVICE_PROTOCOL  *Virtio,
+  OUT VIRTIO_FS_CONFIG        *Config
+  )
+{
+  UINTN       Idx;
+  EFI_STATUS  Status;
+
+  //
+  // The tag is a byte array; the Virtio 1.0 transport only supports naturally
+  // sized and aligned config space accesses.
+  //
+  for (Idx = 0; Idx < VIRTIO_FS_TAG_BYTES; Idx++) {
+    Status = Virtio->ReadDevice (
+                       Virtio,
+                       OFFSET_OF_VFS (Tag[Idx]),
+                       sizeof Config->Tag[Idx],
+                       sizeof Config->Tag[Idx],
+                       &Config->Tag[Idx]
+                       );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Status = Virtio->ReadDevice (
+                     Virtio,
+                     OFFSET_OF_VFS (NumReqQueues),
+                     SIZE_OF_VFS (NumReqQueues),
+                     sizeof Config->NumReqQueues,
+                     &Config->NumReqQueues
+                     );
+  return Status;
+}
+
+/**
+  Configure the Virtio Filesystem device underlying VirtioFs.
+
+  Only the first request queue is set up; every FUSE request is submitted
+  and completed synchronously on it.
+
+  @param[in,out] VirtioFs  The VIRTIO_FS object for which Virtio communication
+                           should be set up. On input, the caller is
+                           responsible for VirtioFs->Virtio having been
+                           initialized. On output, synchronous FUSE requests
+                           can be submitted to the device.
+
+  @retval EFI_SUCCESS      Initialization successful.
+
+  @retval EFI_UNSUPPORTED  The device is not a Virtio 1.0 device, its tag is
+                           not printable ASCII, or its request queue is too
+                           small.
+
+  @return                  Error codes from underlying functions.
+**/
+EFI_STATUS
+VirtioFsInit (
+  IN OUT VIRTIO_FS  *VirtioFs
+  )
+{
+  UINT8             NextDevStat;
+  EFI_STATUS        Status;
+  UINT64            Features;
+  VIRTIO_FS_CONFIG  Config;
+  UINTN             Idx;
+  UINT64            RingBaseShift;
+
+  //
+  // Execute virtio-v1.1-cs01-87fa6b5d8155, 3.1.1 Driver Requirements: Device
+  // Initialization.
+  //
+  // 1. Reset the device.
+  //
+  NextDevStat = 0;
+  Status      = VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, NextDevStat);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // 2. Set the ACKNOWLEDGE status bit [...]
+  //
+  NextDevStat |= VSTAT_ACK;
+  Status       = VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, NextDevStat);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // 3. Set the DRIVER status bit [...]
+  //
+  NextDevStat |= VSTAT_DRIVER;
+  Status       = VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, NextDevStat);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // 4. Read device feature bits [...]
+  //
+  Status = VirtioFs->Virtio->GetDeviceFeatures (VirtioFs->Virtio, &Features);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // virtio-fs is a Virtio 1.0+ device only.
+  //
+  if ((VirtioFs->Virtio->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) ||
+      ((Features & VIRTIO_F_VERSION_1) == 0))
+  {
+    Status = EFI_UNSUPPORTED;
+    goto Failed;
+  }
+
+  //
+  // No device-specific feature bits have been defined in file "virtio-fs.tex"
+  // of the virtio spec at <https://github.com/oasis-tcs/virtio-spec.git>, as
+  // of commit 87fa6b5d8155.
+  //
+  Features &= VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM |
+              VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_RING_PACKED;
+
+  //
+  // ... and write the subset of feature bits understood by the [...] driver to
+  // the device. [...]
+  // 5. Set the FEATURES_OK status bit.
+  // 6. Re-read device status to ensure the FEATURES_OK bit is still set [...]
+  //
+  Status = Virtio10WriteFeatures (VirtioFs->Virtio, Features, &NextDevStat);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // 7. Perform device-specific setup, including discovery of virtqueues for
+  // the device, [...] reading [...] the device's virtio configuration space.
+  //
+  Status = VirtioFsReadConfig (VirtioFs->Virtio, &Config);
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  if (Config.NumReqQueues < 1) {
+    Status = EFI_UNSUPPORTED;
+    goto Failed;
+  }
+
+  //
+  // The tag is a UTF-8 string, padded with NUL bytes if shorter than the
+  // array. Only printable ASCII is accepted, so that it can be used as the
+  // volume label verbatim.
+  //
+  for (Idx = 0; Idx < VIRTIO_FS_TAG_BYTES && Config.Tag[Idx] != '\0'; Idx++) {
+    if ((Config.Tag[Idx] < 0x20) || (Config.Tag[Idx] > 0x7E)) {
+      Status = EFI_UNSUPPORTED;
+      goto Failed;
+    }
+
+    VirtioFs->Label[Idx] = Config.Tag[Idx];
+  }
+
+  if (Idx == 0) {
+    Status = EFI_UNSUPPORTED;
+    goto Failed;
+  }
+
+  VirtioFs->Label[Idx] = L'\0';
+
+  Status = VirtioFs->Virtio->SetQueueSel (
+                               VirtioFs->Virtio,
+                               VIRTIO_FS_REQUEST_QUEUE
+                               );
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  Status = VirtioFs->Virtio->GetQueueNumMax (
+                               VirtioFs->Virtio,
+                               &VirtioFs->QueueSize
+                               );
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  //
+  // VirtioFsFuseRequest() submits one request at a time, with up to
+  // VIRTIO_FS_MAX_DESC descriptors.
+  //
+  if (VirtioFs->QueueSize < VIRTIO_FS_MAX_DESC) {
+    Status = EFI_UNSUPPORTED;
+    goto Failed;
+  }
+
+  Status = VirtioRingInitForFeatures (
+             VirtioFs->Virtio,
+             VirtioFs->QueueSize,
+             Features,
+             &VirtioFs->Ring
+             );
+  if (EFI_ERROR (Status)) {
+    goto Failed;
+  }
+
+  Status = VirtioRingMap (
+             VirtioFs->Virtio,
+             &VirtioFs->Ring,
+             &RingBaseShift,
+             &VirtioFs->RingMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto ReleaseQueue;
+  }
+
+  Status = VirtioFs->Virtio->SetQueueNum (
+                               VirtioFs->Virtio,
+                               VirtioFs->QueueSize
+                               );
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  Status = VirtioFs->Virtio->SetQueueAddress (
+                               VirtioFs->Virtio,
+                               &VirtioFs->Ring,
+                               RingBaseShift
+                               );
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  //
+  // 8. Set the DRIVER_OK status bit.
+  //
+  NextDevStat |= VSTAT_DRIVER_OK;
+  Status       = VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, NextDevStat);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  return EFI_SUCCESS;
+
+UnmapQueue:
+  VirtioFs->Virtio->UnmapSharedBuffer (VirtioFs->Virtio, VirtioFs->RingMap);
+
+ReleaseQueue:
+  VirtioRingUninit (VirtioFs->Virtio, &VirtioFs->Ring);
+
+Failed:
+  //
+  // If any of these steps go irrecoverably wrong, the driver SHOULD set the
+  // FAILED status bit to indicate that it has given up on the device (it can
+  // reset the device later to restart if desired). [...]
+  //
+  // Virtio access failure here should not mask the original error.
+  //
+  NextDevStat |= VSTAT_FAILED;
+  VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, NextDevStat);
+
+  return Status;
+}
+
+/**
+  De-configure the Virtio Filesystem device underlying VirtioFs.
+
+  @param[in] VirtioFs  The VIRTIO_FS object for which Virtio communication
+                       should be torn down. On input, the caller is responsible
+                       for having called VirtioFsInit(). On output, Virtio
+                       Filesystem commands (primitives) must no longer be
+                       submitted to the device.
+**/
+VOID
+VirtioFsUninit (
+  IN OUT VIRTIO_FS  *VirtioFs
+  )
+{
+  //
+  // Resetting the Virtio device makes it release its resources and forget its
+  // configuration.
+  //
+  VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, 0);
+  VirtioFs->Virtio->UnmapSharedBuffer (VirtioFs->Virtio, VirtioFs->RingMap);
+  VirtioRingUninit (VirtioFs->Virtio, &VirtioFs->Ring);
+}
+
+/**
+  ExitBootServices event notification function for a Virtio Filesystem
+  device.
+
+  This function resets the VIRTIO_FS.Virtio device, causing it to release all
+  references to guest-side resources. The function may only be called after
+  VirtioFsInit() returns successfully and before VirtioFsUninit() is called.
+
+  @param[in] ExitBootEvent   The VIRTIO_FS.ExitBoot event that has been
+                             signaled.
+
+  @param[in] VirtioFsAsVoid  Pointer to the VIRTIO_FS object, passed in as
+                             (VOID*).
+**/
+VOID
+EFIAPI
+VirtioFsExitBoot (
+  IN EFI_EVENT  ExitBootEvent,
+  IN VOID       *VirtioFsAsVoid
+  )
+{
+  VIRTIO_FS  *VirtioFs;
+
+  VirtioFs = VirtioFsAsVoid;
+  DEBUG ((
+    DEBUG_VERBOSE,
+    "%a: VirtioFs=0x%p Label=\"%s\"\n",
+    __FUNCTION__,
+    VirtioFsAsVoid,
+    VirtioFs->Label
+    ));
+  VirtioFs->Virtio->SetDeviceStatus (VirtioFs->Virtio, 0);
+}
+
+/**
+  Submit a FUSE request to the Virtio Filesystem device, and wait for the
+  response.
+
+  The FUSE request header and response header are provided by this function.
+  The request and response buffers of the caller are mapped for bus master
+  DMA directly, so data is not copied between guest buffers.
+
+  @param[in,out] VirtioFs      The Virtio Filesystem device to send the
+                               request to.
+
+  @param[in] Opcode            The FUSE opcode of the request.
+
+  @param[in] NodeId            The FUSE node ID that the request refers to.
+
+  @param[in] Request           The buffers that follow the request header.
+                               Each buffer must have nonzero size.
+
+  @param[in] NumRequest        The number of elements in Request.
+
+  @param[in] Response          The buffers that the response body should be
+                               written to. FUSE_BATCH_FORGET receives no
+                               response; for it, Response must be NULL, and
+                               NumResponse must be zero.
+
+  @param[in] NumResponse       The number of elements in Response.
+
+  @param[out] ResponseSize     On success, the size of the response body that
+                               the device wrote to Response, which may be
+                               shorter than the buffers. If ResponseSize is
+                               NULL, the response body must fill Response
+                               exactly.
+
+  @retval EFI_SUCCESS           The request completed successfully.
+
+  @retval EFI_DEVICE_ERROR      Mapping a buffer, or communicating with the
+                                device, failed.
+
+  @retval EFI_PROTOCOL_ERROR    The response from the device was malformed.
+
+  @return                       The FUSE error carried in the response header,
+                                mapped to EFI_STATUS with
+                                VirtioFsErrnoToEfiStatus().
+**/
+EFI_STATUS
+VirtioFsFuseRequest (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     UINT32               Opcode,
+  IN     UINT64               NodeId,
+  IN     VIRTIO_FS_IO_VECTOR  *Request,
+  IN     UINTN                NumRequest,
+  IN     VIRTIO_FS_IO_VECTOR  *Response       OPTIONAL,
+  IN     UINTN                NumResponse,
+  OUT    UINT32               *ResponseSize   OPTIONAL
+  )
+{
+  VIRTIO_FS_FUSE_IN_HEADER   InHdr;
+  VIRTIO_FS_FUSE_OUT_HEADER  OutHdr;
+  BOOLEAN                    NoReply;
+  VIRTIO_FS_IO_VECTOR        Buffers[VIRTIO_FS_MAX_DESC];
+  EFI_PHYSICAL_ADDRESS       DeviceAddress[VIRTIO_FS_MAX_DESC];
+  VOID                       *Mapping[VIRTIO_FS_MAX_DESC];
+  UINTN                      NumBuffers;
+  UINTN                      NumDeviceReadable;
+  UINTN                      NumMapped;
+  UINTN                      Idx;
+  UINT32                     ResponseTotal;
+  DESC_INDICES               Indices;
+  UINT16                     Flags;
+  UINT32                     UsedLen;
+  EFI_STATUS                 Status;
+  EFI_STATUS                 UnmapStatus;
+
+  NoReply = (BOOLEAN)(Opcode == VirtioFsFuseOpBatchForget);
+  ASSERT (!NoReply || (NumResponse == 0));
+  ASSERT (1 + NumRequest + (NoReply ? 0 : 1 + NumResponse) <= VIRTIO_FS_MAX_DESC);
+
+  //
+  // Collect the buffers in the order they are placed on the ring: the
+  // device-readable request first, the device-writable response second.
+  //
+  NumBuffers                  = 0;
+  Buffers[NumBuffers].Buffer  = &InHdr;
+  Buffers[NumBuffers++].Size  = sizeof InHdr;
+  InHdr.Len                   = sizeof InHdr;
+  for (Idx = 0; Idx < NumRequest; Idx++) {
+    ASSERT (Request[Idx].Size > 0);
+    Buffers[NumBuffers++] = Request[Idx];
+    InHdr.Len            += Request[Idx].Size;
+  }
+
+  NumDeviceReadable = NumBuffers;
+
+  ResponseTotal = 0;
+  if (!NoReply) {
+    Buffers[NumBuffers].Buffer = &OutHdr;
+    Buffers[NumBuffers++].Size = sizeof OutHdr;
+    for (Idx = 0; Idx < NumResponse; Idx++) {
+      ASSERT (Response[Idx].Size > 0);
+      Buffers[NumBuffers++] = Response[Idx];
+      ResponseTotal        += Response[Idx].Size;
+    }
+  }
+
+  InHdr.Opcode  = Opcode;
+  InHdr.Unique  = VirtioFs->RequestId++;
+  InHdr.NodeId  = NodeId;
+  InHdr.Uid     = 0;
+  InHdr.Gid     = 0;
+  InHdr.Pid     = 0;
+  InHdr.Padding = 0;
+
+  //
+  // Map every buffer for bus master DMA.
+  //
+  for (NumMapped = 0; NumMapped < NumBuffers; NumMapped++) {
+    Status = VirtioMapAllBytesInSharedBuffer (
+               VirtioFs->Virtio,
+               (NumMapped < NumDeviceReadable ?
+                VirtioOperationBusMasterRead :
+                VirtioOperationBusMasterWrite),
+               Buffers[NumMapped].Buffer,
+               Buffers[NumMapped].Size,
+               &DeviceAddress[NumMapped],
+               &Mapping[NumMapped]
+               );
+    if (EFI_ERROR (Status)) {
+      Status = EFI_DEVICE_ERROR;
+      goto Unmap;
+    }
+  }
+
+  VirtioPrepare (&VirtioFs->Ring, &Indices);
+  for (Idx = 0; Idx < NumBuffers; Idx++) {
+    Flags = 0;
+    if (Idx >= NumDeviceReadable) {
+      Flags |= VRING_DESC_F_WRITE;
+    }
+
+    if (Idx + 1 < NumBuffers) {
+      Flags |= VRING_DESC_F_NEXT;
+    }
+
+    VirtioAppendDesc (
+      &VirtioFs->Ring,
+      DeviceAddress[Idx],
+      Buffers[Idx].Size,
+      Flags,
+      &Indices
+      );
+  }
+
+  Status = VirtioFlush (
+             VirtioFs->Virtio,
+             VIRTIO_FS_REQUEST_QUEUE,
+             &VirtioFs->Ring,
+             &Indices,
+             &UsedLen
+             );
+  if (EFI_ERROR (Status)) {
+    Status = EFI_DEVICE_ERROR;
+  }
+
+Unmap:
+  //
+  // Unmapping completes the DMA, and copies the response from any bounce
+  // buffers; only then can the response be inspected.
+  //
+  while (NumMapped > 0) {
+    NumMapped--;
+    UnmapStatus = VirtioFs->Virtio->UnmapSharedBuffer (
+                                      VirtioFs->Virtio,
+                                      Mapping[NumMapped]
+                                      );
+    if (EFI_ERROR (UnmapStatus) && !EFI_ERROR (Status)) {
+      Status = EFI_DEVICE_ERROR;
+    }
+  }
+
+  if (EFI_ERROR (Status) || NoReply) {
+    return Status;
+  }
+
+  if ((UsedLen < sizeof OutHdr) ||
+      (OutHdr.Len != UsedLen) ||
+      (OutHdr.Unique != InHdr.Unique))
+  {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: Label=\"%s\" Opcode=%u: malformed response (UsedLen=%u)\n",
+      __FUNCTION__,
+      VirtioFs->Label,
+      Opcode,
+      UsedLen
+      ));
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  if (OutHdr.Error != 0) {
+    if ((OutHdr.Error > 0) || (UsedLen != sizeof OutHdr)) {
+      return EFI_PROTOCOL_ERROR;
+    }
+
+    return VirtioFsErrnoToEfiStatus (-OutHdr.Error);
+  }
+
+  if (UsedLen - sizeof OutHdr > ResponseTotal) {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  if (ResponseSize == NULL) {
+    if (UsedLen - sizeof OutHdr != ResponseTotal) {
+      return EFI_PROTOCOL_ERROR;
+    }
+  } else {
+    *ResponseSize = UsedLen - sizeof OutHdr;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Map a Linux errno value, carried in a FUSE response, to an EFI_STATUS.
+
+  @param[in] Errno  The positive "raw" errno value.
+
+  @return  The EFI_STATUS that the errno value maps to, EFI_DEVICE_ERROR for
+           unknown errno values.
+**/
+EFI_STATUS
+VirtioFsErrnoToEfiStatus (
+  IN INT32  Errno
+  )
+{
+  switch (Errno) {
+    case VIRTIO_FS_LINUX_EPERM:
+    case VIRTIO_FS_LINUX_EACCES:
+    case VIRTIO_FS_LINUX_EBUSY:
+    case VIRTIO_FS_LINUX_EEXIST:
+    case VIRTIO_FS_LINUX_EXDEV:
+    case VIRTIO_FS_LINUX_ENOTEMPTY:
+      return EFI_ACCESS_DENIED;
+
+    case VIRTIO_FS_LINUX_ENOENT:
+      return EFI_NOT_FOUND;
+
+    case VIRTIO_FS_LINUX_EBADF:
+    case VIRTIO_FS_LINUX_EFAULT:
+    case VIRTIO_FS_LINUX_ENOTDIR:
+    case VIRTIO_FS_LINUX_EISDIR:
+    case VIRTIO_FS_LINUX_EINVAL:
+    case VIRTIO_FS_LINUX_ENAMETOOLONG:
+    case VIRTIO_FS_LINUX_ELOOP:
+      return EFI_INVALID_PARAMETER;
+
+    case VIRTIO_FS_LINUX_ENOMEM:
+    case VIRTIO_FS_LINUX_ENFILE:
+    case VIRTIO_FS_LINUX_EMFILE:
+      return EFI_OUT_OF_RESOURCES;
+
+    case VIRTIO_FS_LINUX_EFBIG:
+    case VIRTIO_FS_LINUX_ENOSPC:
+    case VIRTIO_FS_LINUX_EDQUOT:
+      return EFI_VOLUME_FULL;
+
+    case VIRTIO_FS_LINUX_EROFS:
+      return EFI_WRITE_PROTECTED;
+
+    case VIRTIO_FS_LINUX_ENOSYS:
+      return EFI_UNSUPPORTED;
+
+    default:
+      return EFI_DEVICE_ERROR;
+  }
+}
+
+/**
+  Append a path component to a canonical path, or remove the last component
+  for "..".
+
+  @param[in,out] Path     The canonical path, in a buffer that is large enough
+                          for the result.
+
+  @param[in] Component    The component to append, not NUL-terminated.
+
+  @param[in] ComponentLen The length of Component in bytes.
+**/
+STATIC
+VOID
+VirtioFsAppendComponent (
+  IN OUT CHAR8        *Path,
+  IN     CONST CHAR8  *Component,
+  IN     UINTN        ComponentLen
+  )
+{
+  UINTN  PathLen;
+
+  if ((ComponentLen == 0) ||
+      ((ComponentLen == 1) && (Component[0] == '.')))
+  {
+    return;
+  }
+
+  PathLen = AsciiStrLen (Path);
+  if ((ComponentLen == 2) && (Component[0] == '.') && (Component[1] == '.')) {
+    //
+    // The parent of the root directory is the root directory.
+    //
+    while (PathLen > 1 && Path[PathLen - 1] != '/') {
+      PathLen--;
+    }
+
+    if (PathLen > 1) {
+      PathLen--;
+    }
+
+    Path[PathLen] = '\0';
+    return;
+  }
+
+  if (PathLen > 1) {
+    Path[PathLen++] = '/';
+  }
+
+  CopyMem (Path + PathLen, Component, ComponentLen);
+  Path[PathLen + ComponentLen] = '\0';
+}
+
+/**
+  Compose the canonical pathname of a file from the canonical pathname of a
+  directory and a (relative or absolute) UEFI pathname.
+
+  @param[in] LhsPath8      The canonical pathname (see VIRTIO_FS_FILE) of the
+                           directory that RhsPath16 is relative to.
+
+  @param[in] RhsPath16     The UEFI pathname, with "\" as separator. If it
+                           starts with "\", LhsPath8 is ignored.
+
+  @param[out] ResultPath8  The canonical pathname of the result, allocated
+                           from pool. The caller is responsible for freeing it.
+
+  @retval EFI_SUCCESS            ResultPath8 has been output.
+
+  @retval EFI_INVALID_PARAMETER  RhsPath16 contains a character that cannot
+                                 appear in a host path, or a component that is
+                                 too long.
+
+  @retval EFI_OUT_OF_RESOURCES   Memory allocation failed.
+**/
+EFI_STATUS
+VirtioFsComposePath (
+  IN     CHAR8   *LhsPath8,
+  IN     CHAR16  *RhsPath16,
+  OUT    CHAR8   **ResultPath8
+  )
+{
+  UINTN   RhsLen;
+  UINTN   BufferSize;
+  CHAR8   *Result;
+  CHAR8   Component[VIRTIO_FS_MAX_NAME_LEN + 1];
+  UINTN   ComponentLen;
+  CHAR16  *Rhs;
+  CHAR16  Char;
+
+  RhsLen = StrLen (RhsPath16);
+
+  //
+  // Every UCS-2 character takes at most 3 bytes in UTF-8.
+  //
+  BufferSize = AsciiStrSize (LhsPath8) + 1 + 3 * RhsLen;
+  Result     = AllocatePool (BufferSize);
+  if (Result == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (RhsPath16[0] == L'\\') {
+    AsciiStrCpyS (Result, BufferSize, "/");
+  } else {
+    AsciiStrCpyS (Result, BufferSize, LhsPath8);
+  }
+
+  ComponentLen = 0;
+  for (Rhs = RhsPath16; ; Rhs++) {
+    Char = *Rhs;
+    if ((Char == L'\\') || (Char == L'\0')) {
+      VirtioFsAppendComponent (Result, Component, ComponentLen);
+      ComponentLen = 0;
+      if (Char == L'\0') {
+        break;
+      }
+
+      continue;
+    }
+
+    if ((Char < 0x20) || (Char == L'/') ||
+        ((Char >= 0xD800) && (Char <= 0xDFFF)))
+    {
+      goto InvalidPath;
+    }
+
+    if (Char < 0x80) {
+      if (ComponentLen + 1 > VIRTIO_FS_MAX_NAME_LEN) {
+        goto InvalidPath;
+      }
+
+      Component[ComponentLen++] = (CHAR8)Char;
+    } else if (Char < 0x800) {
+      if (ComponentLen + 2 > VIRTIO_FS_MAX_NAME_LEN) {
+        goto InvalidPath;
+      }
+
+      Component[ComponentLen++] = (CHAR8)(0xC0 | (Char >> 6));
+      Component[ComponentLen++] = (CHAR8)(0x80 | (Char & 0x3F));
+    } else {
+      if (ComponentLen + 3 > VIRTIO_FS_MAX_NAME_LEN) {
+        goto InvalidPath;
+      }
+
+      Component[ComponentLen++] = (CHAR8)(0xE0 | (Char >> 12));
+      Component[ComponentLen++] = (CHAR8)(0x80 | ((Char >> 6) & 0x3F));
+      Component[ComponentLen++] = (CHAR8)(0x80 | (Char & 0x3F));
+    }
+  }
+
+  *ResultPath8 = Result;
+  return EFI_SUCCESS;
+
+InvalidPath:
+  FreePool (Result);
+  return EFI_INVALID_PARAMETER;
+}
+
+/**
+  Split a canonical pathname into the canonical pathname of the parent
+  directory and the last component.
+
+  @param[in] Path            The canonical pathname to split; must not be the
+                             root directory.
+
+  @param[out] ParentPath     The canonical pathname of the parent directory,
+                             allocated from pool.
+
+  @param[out] LastComponent  The last component, allocated from pool.
+
+  @retval EFI_SUCCESS            Both outputs have been allocated. The caller
+                                 is responsible for freeing them.
+
+  @retval EFI_INVALID_PARAMETER  Path is the root directory.
+
+  @retval EFI_OUT_OF_RESOURCES   Memory allocation failed.
+**/
+EFI_STATUS
+VirtioFsSplitPath (
+  IN     CHAR8  *Path,
+  OUT    CHAR8  **ParentPath,
+  OUT    CHAR8  **LastComponent
+  )
+{
+  UINTN  PathLen;
+  UINTN  LastSlash;
+
+  PathLen = AsciiStrLen (Path);
+  ASSERT (PathLen > 0 && Path[0] == '/');
+  if (PathLen == 1) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  LastSlash = PathLen - 1;
+  while (Path[LastSlash] != '/') {
+    LastSlash--;
+  }
+
+  *LastComponent = AllocateCopyPool (PathLen - LastSlash, Path + LastSlash + 1);
+  if (*LastComponent == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // The parent of "/name" is "/", which retains its slash.
+  //
+  *ParentPath = AllocateZeroPool (MAX (LastSlash, 1) + 1);
+  if (*ParentPath == NULL) {
+    FreePool (*LastComponent);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyMem (*ParentPath, Path, MAX (LastSlash, 1));
+  return EFI_SUCCESS;
+}
+
+/**
+  Look up a canonical pathname, component by component.
+
+  If StartPath is a proper prefix of Path (in whole components), the walk
+  starts at StartNodeId rather than at the root directory, which saves a
+  FUSE_LOOKUP for every component of StartPath.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device to send the requests
+                           to.
+
+  @param[in] Path          The canonical pathname to look up.
+
+  @param[in] StartNodeId   The node ID of the directory at StartPath.
+
+  @param[in] StartPath     The canonical pathname of a directory whose node ID
+                           is known.
+
+  @param[out] NodeId       The node ID of Path. Unless it is the root
+                           directory, the node has been looked up once more,
+                           and the caller is responsible for releasing it with
+                           VirtioFsForgetNode().
+
+  @param[out] Attr         The attributes of the node.
+
+  @retval EFI_SUCCESS  The outputs have been set.
+
+  @return              Error codes from the FUSE_LOOKUP and FUSE_GETATTR
+                       requests.
+**/
+EFI_STATUS
+VirtioFsLookupPath (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     CHAR8                *Path,
+  IN     UINT64               StartNodeId,
+  IN     CHAR8                *StartPath,
+  OUT    UINT64               *NodeId,
+  OUT    VIRTIO_FS_FUSE_ATTR  *Attr
+  )
+{
+  UINTN                     StartLen;
+  CHAR8                     *Component;
+  UINTN                     ComponentLen;
+  UINT64                    DirNodeId;
+  BOOLEAN                   DirLookedUp;
+  VIRTIO_FS_FUSE_ENTRY_OUT  Entry;
+  EFI_STATUS                Status;
+
+  if (AsciiStrCmp (Path, "/") == 0) {
+    *NodeId = VIRTIO_FS_FUSE_ROOT_NODE_ID;
+    return VirtioFsFuseGetAttr (VirtioFs, VIRTIO_FS_FUSE_ROOT_NODE_ID, Attr);
+  }
+
+  StartLen = AsciiStrLen (StartPath);
+  if ((StartLen > 1) &&
+      (AsciiStrnCmp (Path, StartPath, StartLen) == 0) &&
+      (Path[StartLen] == '/'))
+  {
+    DirNodeId = StartNodeId;
+    Component = Path + StartLen + 1;
+  } else {
+    DirNodeId = VIRTIO_FS_FUSE_ROOT_NODE_ID;
+    Component = Path + 1;
+  }
+
+  DirLookedUp = FALSE;
+  for ( ; ;) {
+    ComponentLen = 0;
+    while (Component[ComponentLen] != '\0' && Component[ComponentLen] != '/') {
+      ComponentLen++;
+    }
+
+    Status = VirtioFsFuseLookup (
+               VirtioFs,
+               DirNodeId,
+               Component,
+               ComponentLen,
+               &Entry
+               );
+
+    //
+    // Intermediate directories are only needed for the next lookup.
+    //
+    if (DirLookedUp) {
+      VirtioFsForgetNode (VirtioFs, DirNodeId);
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    if (Component[ComponentLen] == '\0') {
+      break;
+    }
+
+    if ((Entry.Attr.Mode & VIRTIO_FS_LINUX_S_IFMT) != VIRTIO_FS_LINUX_S_IFDIR) {
+      VirtioFsForgetNode (VirtioFs, Entry.NodeId);
+      return EFI_NOT_FOUND;
+    }
+
+    DirNodeId   = Entry.NodeId;
+    DirLookedUp = TRUE;
+    Component  += ComponentLen + 1;
+  }
+
+  *NodeId = Entry.NodeId;
+  CopyMem (Attr, &Entry.Attr, sizeof *Attr);
+  return EFI_SUCCESS;
+}
+
+/**
+  Release one lookup reference to a node. The root directory is never looked
+  up, so it is never forgotten either.
+
+  @param[in,out] VirtioFs  The Virtio Filesystem device to send the request
+                           to.
+
+  @param[in] NodeId        The node to release.
+**/
+VOID
+VirtioFsForgetNode (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId
+  )
+{
+  VIRTIO_FS_FUSE_FORGET_ONE  Forget;
+  EFI_STATUS                 Status;
+
+  if ((NodeId == VIRTIO_FS_FUSE_ROOT_NODE_ID) || (NodeId == 0)) {
+    return;
+  }
+
+  Forget.NodeId          = NodeId;
+  Forget.NumberOfLookups = 1;
+  Status                 = VirtioFsFuseBatchForget (VirtioFs, &Forget, 1);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((
+      DEBUG_VERBOSE,
+      "%a: Label=\"%s\" NodeId=%Lu: %r\n",
+      __FUNCTION__,
+      VirtioFs->Label,
+      NodeId,
+      Status
+      ));
+  }
+}
+
+/**
+  Convert a UTF-8 string to UCS-2.
+
+  @param[in] Utf8          The UTF-8 string, not necessarily NUL-terminated.
+
+  @param[in] Utf8Len       The length of Utf8 in bytes.
+
+  @param[out] Ucs2         The NUL-terminated UCS-2 result.
+
+  @param[in,out] Ucs2Size  On input, the size of Ucs2 in bytes. On output, the
+                           size of the result in bytes, including the
+                           terminating NUL.
+
+  @retval EFI_SUCCESS           Ucs2 has been filled in.
+
+  @retval EFI_BUFFER_TOO_SMALL  Ucs2 is NULL or too small; *Ucs2Size has been
+                                set.
+
+  @retval EFI_UNSUPPORTED       Utf8 is malformed, or encodes a character
+                                outside of the Basic Multilingual Plane.
+**/
+EFI_STATUS
+VirtioFsUtf8ToUcs2 (
+  IN     CONST CHAR8  *Utf8,
+  IN     UINTN        Utf8Len,
+  OUT    CHAR16       *Ucs2       OPTIONAL,
+  IN OUT UINTN        *Ucs2Size
+  )
+{
+  UINTN   Pass;
+  UINTN   Idx;
+  UINTN   Count;
+  UINT8   Byte;
+  UINT32  CodePoint;
+  UINTN   Extra;
+
+  //
+  // The first pass validates and counts, the second one converts.
+  //
+  for (Pass = 0; Pass < 2; Pass++) {
+    Count = 0;
+    Idx   = 0;
+    while (Idx < Utf8Len) {
+      Byte = (UINT8)Utf8[Idx++];
+      if (Byte < 0x80) {
+        CodePoint = Byte;
+        Extra     = 0;
+      } else if ((Byte & 0xE0) == 0xC0) {
+        CodePoint = Byte & 0x1F;
+        Extra     = 1;
+      } else if ((Byte & 0xF0) == 0xE0) {
+        CodePoint = Byte & 0x0F;
+        Extra     = 2;
+      } else {
+        return EFI_UNSUPPORTED;
+      }
+
+      if (Utf8Len - Idx < Extra) {
+        return EFI_UNSUPPORTED;
+      }
+
+      while (Extra > 0) {
+        Byte = (UINT8)Utf8[Idx++];
+        if ((Byte & 0xC0) != 0x80) {
+          return EFI_UNSUPPORTED;
+        }
+
+        CodePoint = (CodePoint << 6) | (Byte & 0x3F);
+        Extra--;
+      }
+
+      if ((CodePoint == 0) || ((CodePoint >= 0xD800) && (CodePoint <= 0xDFFF))) {
+        return EFI_UNSUPPORTED;
+      }
+
+      if (Pass == 1) {
+        Ucs2[Count] = (CHAR16)CodePoint;
+      }
+
+      Count++;
+    }
+
+    if (Pass == 0) {
+      if ((Ucs2 == NULL) || (*Ucs2Size < (Count + 1) * sizeof (CHAR16))) {
+        *Ucs2Size = (Count + 1) * sizeof (CHAR16);
+        return EFI_BUFFER_TOO_SMALL;
+      }
+    }
+  }
+
+  Ucs2[Count] = L'\0';
+  *Ucs2Size   = (Count + 1) * sizeof (CHAR16);
+  return EFI_SUCCESS;
+}
+
+/**
+  Convert a number of seconds since the Unix epoch to EFI_TIME, in UTC.
+
+  @param[in] Epoch  Seconds since 1970-01-01 00:00:00 UTC.
+
+  @param[out] Time  The converted time. Years beyond 9999 are clamped.
+**/
+STATIC
+VOID
+VirtioFsEpochToEfiTime (
+  IN  UINT64    Epoch,
+  OUT EFI_TIME  *Time
+  )
+{
+  UINT64  Days;
+  UINT32  Seconds;
+  UINT32  DayOfEra;
+  UINT32  Era;
+  UINT32  YearOfEra;
+  UINT32  DayOfYear;
+  UINT32  MonthShifted;
+  UINT32  Year;
+  UINT32  Month;
+
+  ZeroMem (Time, sizeof *Time);
+
+  //
+  // 2932896 is the number of days from 1970-01-01 to 9999-12-31.
+  //
+  Days = DivU64x32Remainder (Epoch, 86400, &Seconds);
+  if (Days > 2932896) {
+    Days    = 2932896;
+    Seconds = 86399;
+  }
+
+  //
+  // Shift the epoch to 0000-03-01, so that leap days end each 400-year era.
+  //
+  Days        += 719468;
+  Era          = (UINT32)Days / 146097;
+  DayOfEra     = (UINT32)Days - Era * 146097;
+  YearOfEra    = (DayOfEra - DayOfEra / 1460 + DayOfEra / 36524 -
+                  DayOfEra / 146096) / 365;
+  DayOfYear    = DayOfEra - (365 * YearOfEra + YearOfEra / 4 - YearOfEra / 100);
+  MonthShifted = (5 * DayOfYear + 2) / 153;
+  Month        = MonthShifted < 10 ? MonthShifted + 3 : MonthShifted - 9;
+  Year         = YearOfEra + Era * 400 + (Month <= 2 ? 1 : 0);
+
+  Time->Year     = (UINT16)Year;
+  Time->Month    = (UINT8)Month;
+  Time->Day      = (UINT8)(DayOfYear - (153 * MonthShifted + 2) / 5 + 1);
+  Time->Hour     = (UINT8)(Seconds / 3600);
+  Time->Minute   = (UINT8)(Seconds % 3600 / 60);
+  Time->Second   = (UINT8)(Seconds % 60);
+  Time->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+}
+
+/**
+  Convert EFI_TIME to a number of seconds since the Unix epoch.
+
+  @param[in] Time  The time to convert. If Time->TimeZone is specified, it is
+                   taken into account; otherwise Time is considered UTC.
+
+  @return  Seconds since 1970-01-01 00:00:00 UTC; zero for earlier times.
+**/
+UINT64
+VirtioFsEfiTimeToEpoch (
+  IN EFI_TIME  *Time
+  )
+{
+  UINT32  Year;
+  UINT32  Month;
+  UINT32  Era;
+  UINT32  YearOfEra;
+  UINT32  DayOfYear;
+  UINT32  DayOfEra;
+  INT64   Epoch;
+
+  if ((Time->Year < 1970) || (Time->Month < 1) || (Time->Month > 12)) {
+    return 0;
+  }
+
+  Year  = Time->Year;
+  Month = Time->Month;
+  if (Month <= 2) {
+    Year--;
+  }
+
+  Era       = Year / 400;
+  YearOfEra = Year - Era * 400;
+  DayOfYear = (153 * (Month > 2 ? Month - 3 : Month + 9) + 2) / 5 +
+              Time->Day - 1;
+  DayOfEra = YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 + DayOfYear;
+
+  Epoch = (INT64)MultU64x32 (Era * 146097 + DayOfEra - 719468, 86400) +
+          Time->Hour * 3600 + Time->Minute * 60 + Time->Second;
+
+  //
+  // Localtime = UTC - TimeZone.
+  //
+  if (Time->TimeZone != EFI_UNSPECIFIED_TIMEZONE) {
+    Epoch += (INT64)Time->TimeZone * 60;
+  }
+
+  return (Epoch < 0) ? 0 : (UINT64)Epoch;
+}
+
+/**
+  Check whether an EFI_TIME in EFI_FILE_INFO asks for a time stamp to be
+  changed; an all-zero EFI_TIME means "leave unchanged".
+
+  @param[in] Time  The time to check.
+
+  @retval TRUE   Time is set.
+
+  @retval FALSE  Time is all zeros.
+**/
+BOOLEAN
+VirtioFsIsEfiTimeSet (
+  IN EFI_TIME  *Time
+  )
+{
+  return (BOOLEAN)!IsZeroBuffer (Time, sizeof *Time);
+}
+
+/**
+  Convert FUSE node attributes and a file name to EFI_FILE_INFO.
+
+  @param[in] FuseAttr          The attributes to convert.
+
+  @param[in] Name              The name of the file, in UTF-8, not necessarily
+                               NUL-terminated.
+
+  @param[in] NameLen           The length of Name in bytes.
+
+  @param[out] FileInfo         The converted EFI_FILE_INFO.
+
+  @param[in,out] FileInfoSize  On input, the size of FileInfo in bytes. On
+                               output, the size of the result in bytes.
+
+  @retval EFI_SUCCESS           FileInfo has been filled in.
+
+  @retval EFI_BUFFER_TOO_SMALL  FileInfo is NULL or too small; *FileInfoSize
+                                has been set.
+
+  @retval EFI_UNSUPPORTED       The node is neither a regular file nor a
+                                directory, or Name cannot be converted.
+**/
+EFI_STATUS
+VirtioFsFuseAttrToEfiFileInfo (
+  IN     VIRTIO_FS_FUSE_ATTR  *FuseAttr,
+  IN     CONST CHAR8          *Name,
+  IN     UINTN                NameLen,
+  OUT    EFI_FILE_INFO        *FileInfo   OPTIONAL,
+  IN OUT UINTN                *FileInfoSize
+  )
+{
+  UINT32      Type;
+  UINTN       NameSize;
+  EFI_STATUS  Status;
+
+  Type = FuseAttr->Mode & VIRTIO_FS_LINUX_S_IFMT;
+  if ((Type != VIRTIO_FS_LINUX_S_IFDIR) && (Type != VIRTIO_FS_LINUX_S_IFREG)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  NameSize = 0;
+  Status   = VirtioFsUtf8ToUcs2 (Name, NameLen, NULL, &NameSize);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return Status;
+  }
+
+  if ((FileInfo == NULL) || (*FileInfoSize < SIZE_OF_EFI_FILE_INFO + NameSize)) {
+    *FileInfoSize = SIZE_OF_EFI_FILE_INFO + NameSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  FileInfo->Size         = SIZE_OF_EFI_FILE_INFO + NameSize;
+  FileInfo->FileSize     = FuseAttr->Size;
+  FileInfo->PhysicalSize = MultU64x32 (FuseAttr->Blocks, 512);
+  //
+  // Linux does not report the creation time through FUSE; the inode change
+  // time is the closest match.
+  //
+  VirtioFsEpochToEfiTime (FuseAttr->Ctime, &FileInfo->CreateTime);
+  VirtioFsEpochToEfiTime (FuseAttr->Atime, &FileInfo->LastAccessTime);
+  VirtioFsEpochToEfiTime (FuseAttr->Mtime, &FileInfo->ModificationTime);
+
+  FileInfo->Attribute = 0;
+  if (Type == VIRTIO_FS_LINUX_S_IFDIR) {
+    FileInfo->Attribute |= EFI_FILE_DIRECTORY;
+  } else {
+    FileInfo->Attribute |= EFI_FILE_ARCHIVE;
+  }
+
+  if ((FuseAttr->Mode & (VIRTIO_FS_LINUX_S_IWUSR | VIRTIO_FS_LINUX_S_IWGRP |
+                         VIRTIO_FS_LINUX_S_IWOTH)) == 0)
+  {
+    FileInfo->Attribute |= EFI_FILE_READ_ONLY;
+  }
+
+  Status = VirtioFsUtf8ToUcs2 (Name, NameLen, FileInfo->FileName, &NameSize);
+  ASSERT_EFI_ERROR (Status);
+
+  *FileInfoSize = (UINTN)FileInfo->Size;
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,611 @@
+/** @file
+  EFI_FILE_PROTOCOL member functions for the Virtio Filesystem driver, except
+  Open(), GetInfo() and SetInfo().
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioFsDxe.h"
+
+/**
+  Wrap an open FUSE file handle into a new VIRTIO_FS_FILE object.
+
+  @param[in,out] VirtioFs       The Virtio Filesystem device that the file
+                                lives on.
+
+  @param[in] CanonicalPathname  The canonical pathname of the file, allocated
+                                from pool. On success, ownership passes to the
+                                new object.
+
+  @param[in] NodeId             The node ID of the file. On success, the new
+                                object takes over the lookup reference.
+
+  @param[in] FuseHandle         The open FUSE file handle. On success,
+                                ownership passes to the new object.
+
+  @param[in] IsDirectory        Whether the file is a directory.
+
+  @param[in] IsOpenForWriting   Whether the file has been opened with
+                                EFI_FILE_MODE_WRITE.
+
+  @param[out] NewHandle         The EFI_FILE_PROTOCOL interface of the new
+                                object.
+
+  @retval EFI_SUCCESS           The object has been created and linked into
+                                VirtioFs->OpenFiles.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+**/
+EFI_STATUS
+VirtioFsNewFile (
+  IN OUT VIRTIO_FS          *VirtioFs,
+  IN     CHAR8              *CanonicalPathname,
+  IN     UINT64             NodeId,
+  IN     UINT64             FuseHandle,
+  IN     BOOLEAN            IsDirectory,
+  IN     BOOLEAN            IsOpenForWriting,
+  OUT    EFI_FILE_PROTOCOL  **NewHandle
+  )
+{
+  VIRTIO_FS_FILE  *NewVirtioFsFile;
+
+  NewVirtioFsFile = AllocateZeroPool (sizeof *NewVirtioFsFile);
+  if (NewVirtioFsFile == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewVirtioFsFile->Signature              = VIRTIO_FS_FILE_SIG;
+  NewVirtioFsFile->SimpleFile.Revision    = EFI_FILE_PROTOCOL_REVISION;
+  NewVirtioFsFile->SimpleFile.Open        = VirtioFsSimpleFileOpen;
+  NewVirtioFsFile->SimpleFile.Close       = VirtioFsSimpleFileClose;
+  NewVirtioFsFile->SimpleFile.Delete      = VirtioFsSimpleFileDelete;
+  NewVirtioFsFile->SimpleFile.Read        = VirtioFsSimpleFileRead;
+  NewVirtioFsFile->SimpleFile.Write       = VirtioFsSimpleFileWrite;
+  NewVirtioFsFile->SimpleFile.GetPosition = VirtioFsSimpleFileGetPosition;
+  NewVirtioFsFile->SimpleFile.SetPosition = VirtioFsSimpleFileSetPosition;
+  NewVirtioFsFile->SimpleFile.GetInfo     = VirtioFsSimpleFileGetInfo;
+  NewVirtioFsFile->SimpleFile.SetInfo     = VirtioFsSimpleFileSetInfo;
+  NewVirtioFsFile->SimpleFile.Flush       = VirtioFsSimpleFileFlush;
+  NewVirtioFsFile->IsDirectory            = IsDirectory;
+  NewVirtioFsFile->IsOpenForWriting       = IsOpenForWriting;
+  NewVirtioFsFile->OwnerFs                = VirtioFs;
+  NewVirtioFsFile->CanonicalPathname      = CanonicalPathname;
+  NewVirtioFsFile->FilePosition           = 0;
+  NewVirtioFsFile->NodeId                 = NodeId;
+  NewVirtioFsFile->FuseHandle             = FuseHandle;
+
+  InsertTailList (&VirtioFs->OpenFiles, &NewVirtioFsFile->OpenFilesEntry);
+
+  *NewHandle = &NewVirtioFsFile->SimpleFile;
+  return EFI_SUCCESS;
+}
+
+/**
+  Drop the buffered FUSE_READDIRPLUS response of a directory, releasing the
+  lookup references that the server took for the nodes in it, with a single
+  FUSE_BATCH_FORGET.
+
+  @param[in,out] VirtioFsFile  The directory.
+**/
+VOID
+VirtioFsDropDirents (
+  IN OUT VIRTIO_FS_FILE  *VirtioFsFile
+  )
+{
+  VIRTIO_FS_FUSE_FORGET_ONE  *Forget;
+  VIRTIO_FS_FUSE_DIRENTPLUS  *Dirent;
+  UINT32                     Pos;
+  UINT32                     Count;
+  UINT32                     EntrySize;
+
+  if (VirtioFsFile->DirentBuf == NULL) {
+    return;
+  }
+
+  //
+  // Every entry is larger than a VIRTIO_FS_FUSE_FORGET_ONE.
+  //
+  Forget = AllocatePool (VirtioFsFile->DirentBufSize);
+  Count  = 0;
+  for (Pos = 0;
+       VirtioFsFile->DirentBufSize - Pos >= sizeof *Dirent;
+       Pos += EntrySize)
+  {
+    Dirent    = (VIRTIO_FS_FUSE_DIRENTPLUS *)(VirtioFsFile->DirentBuf + Pos);
+    EntrySize = (UINT32)VIRTIO_FS_FUSE_DIRENTPLUS_SIZE (Dirent->NameLen);
+    if ((Dirent->NameLen > VIRTIO_FS_MAX_NAME_LEN) ||
+        (EntrySize > VirtioFsFile->DirentBufSize - Pos))
+    {
+      break;
+    }
+
+    if ((Forget != NULL) && (Dirent->Entry.NodeId != 0)) {
+      Forget[Count].NodeId          = Dirent->Entry.NodeId;
+      Forget[Count].NumberOfLookups = 1;
+      Count++;
+    }
+  }
+
+  if (Forget != NULL) {
+    VirtioFsFuseBatchForget (VirtioFsFile->OwnerFs, Forget, Count);
+    FreePool (Forget);
+  }
+
+  FreePool (VirtioFsFile->DirentBuf);
+  VirtioFsFile->DirentBuf     = NULL;
+  VirtioFsFile->DirentBufSize = 0;
+  VirtioFsFile->DirentBufPos  = 0;
+}
+
+/**
+  Return the next directory entry as EFI_FILE_INFO.
+
+  Directory entries are fetched with FUSE_READDIRPLUS, which carries the
+  attributes of each entry, so no FUSE_LOOKUP is needed per entry.
+
+  @param[in,out] VirtioFsFile  The directory to read.
+
+  @param[in,out] BufferSize    See EFI_FILE_READ.
+
+  @param[out] Buffer           See EFI_FILE_READ.
+
+  @return  See EFI_FILE_READ.
+**/
+STATIC
+EFI_STATUS
+VirtioFsReadDirectory (
+  IN OUT VIRTIO_FS_FILE  *VirtioFsFile,
+  IN OUT UINTN           *BufferSize,
+  OUT    VOID            *Buffer
+  )
+{
+  VIRTIO_FS                  *VirtioFs;
+  VIRTIO_FS_FUSE_DIRENTPLUS  *Dirent;
+  UINT32                     EntrySize;
+  UINT32                     ReadSize;
+  CHAR8                      *Name;
+  VIRTIO_FS_FUSE_ATTR        Attr;
+  EFI_STATUS                 Status;
+
+  VirtioFs = VirtioFsFile->OwnerFs;
+
+  for ( ; ;) {
+    if ((VirtioFsFile->DirentBuf == NULL) ||
+        (VirtioFsFile->DirentBufSize - VirtioFsFile->DirentBufPos <
+         sizeof *Dirent))
+    {
+      VirtioFsDropDirents (VirtioFsFile);
+      if (VirtioFsFile->DirentEof) {
+        *BufferSize = 0;
+        return EFI_SUCCESS;
+      }
+
+      VirtioFsFile->DirentBuf = AllocatePool (VIRTIO_FS_DIRENT_BUF_SIZE);
+      if (VirtioFsFile->DirentBuf == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+      }
+
+      ReadSize = MIN (VIRTIO_FS_DIRENT_BUF_SIZE, VirtioFs->MaxIoSize);
+      Status   = VirtioFsFuseRead (
+                   VirtioFs,
+                   VirtioFsFile->NodeId,
+                   VirtioFsFile->FuseHandle,
+                   TRUE,
+                   VirtioFsFile->DirentNextOffset,
+                   &ReadSize,
+                   VirtioFsFile->DirentBuf
+                   );
+      if (EFI_ERROR (Status)) {
+        FreePool (VirtioFsFile->DirentBuf);
+        VirtioFsFile->DirentBuf = NULL;
+        return Status;
+      }
+
+      VirtioFsFile->DirentBufSize = ReadSize;
+      if (ReadSize == 0) {
+        VirtioFsFile->DirentEof = TRUE;
+      }
+
+      continue;
+    }
+
+    Dirent = (VIRTIO_FS_FUSE_DIRENTPLUS *)(VirtioFsFile->DirentBuf +
+                                           VirtioFsFile->DirentBufPos);
+    EntrySize = (UINT32)VIRTIO_FS_FUSE_DIRENTPLUS_SIZE (Dirent->NameLen);
+    if ((Dirent->NameLen == 0) ||
+        (Dirent->NameLen > VIRTIO_FS_MAX_NAME_LEN) ||
+        (EntrySize > VirtioFsFile->DirentBufSize - VirtioFsFile->DirentBufPos))
+    {
+      return EFI_PROTOCOL_ERROR;
+    }
+
+    Name = (CHAR8 *)(Dirent + 1);
+    CopyMem (&Attr, &Dirent->Entry.Attr, sizeof Attr);
+
+    //
+    // The server does not look up "." and ".."; their attributes carry only
+    // the type, taken from the directory entry.
+    //
+    if (Dirent->Entry.NodeId == 0) {
+      if (!(((Dirent->NameLen == 1) && (Name[0] == '.')) ||
+            ((Dirent->NameLen == 2) && (Name[0] == '.') && (Name[1] == '.'))))
+      {
+        goto NextEntry;
+      }
+
+      if ((Attr.Mode & VIRTIO_FS_LINUX_S_IFMT) == 0) {
+        Attr.Mode |= Dirent->Type << 12;
+      }
+    }
+
+    Status = VirtioFsFuseAttrToEfiFileInfo (
+               &Attr,
+               Name,
+               Dirent->NameLen,
+               Buffer,
+               BufferSize
+               );
+    if (Status == EFI_UNSUPPORTED) {
+      //
+      // Neither a regular file nor a directory, or a name that UCS-2 cannot
+      // represent.
+      //
+      goto NextEntry;
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    VirtioFsFile->DirentBufPos    += EntrySize;
+    VirtioFsFile->DirentNextOffset = Dirent->Offset;
+    return EFI_SUCCESS;
+
+NextEntry:
+    VirtioFsFile->DirentBufPos    += EntrySize;
+    VirtioFsFile->DirentNextOffset = Dirent->Offset;
+  }
+}
+
+/**
+  Close an open file.
+
+  Refer to EFI_FILE_CLOSE for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileClose (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+  VIRTIO_FS       *VirtioFs;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  VirtioFs     = VirtioFsFile->OwnerFs;
+
+  //
+  // Errors cannot be reported from here; the handle is gone either way.
+  //
+  if (VirtioFsFile->IsDirectory) {
+    VirtioFsDropDirents (VirtioFsFile);
+  }
+
+  VirtioFsFuseRelease (
+    VirtioFs,
+    VirtioFsFile->NodeId,
+    VirtioFsFile->FuseHandle,
+    VirtioFsFile->IsDirectory
+    );
+  VirtioFsForgetNode (VirtioFs, VirtioFsFile->NodeId);
+
+  RemoveEntryList (&VirtioFsFile->OpenFilesEntry);
+  FreePool (VirtioFsFile->CanonicalPathname);
+  FreePool (VirtioFsFile);
+  return EFI_SUCCESS;
+}
+
+/**
+  Close and delete a file.
+
+  Refer to EFI_FILE_DELETE for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileDelete (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  VIRTIO_FS_FILE       *VirtioFsFile;
+  VIRTIO_FS            *VirtioFs;
+  CHAR8                *ParentPath;
+  CHAR8                *Name;
+  UINT64               ParentNodeId;
+  VIRTIO_FS_FUSE_ATTR  ParentAttr;
+  EFI_STATUS           Status;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  VirtioFs     = VirtioFsFile->OwnerFs;
+
+  Status = EFI_WARN_DELETE_FAILURE;
+  if (!VirtioFsFile->IsOpenForWriting ||
+      EFI_ERROR (
+        VirtioFsSplitPath (VirtioFsFile->CanonicalPathname, &ParentPath, &Name)
+        ))
+  {
+    goto Close;
+  }
+
+  if (!EFI_ERROR (
+         VirtioFsLookupPath (
+           VirtioFs,
+           ParentPath,
+           VIRTIO_FS_FUSE_ROOT_NODE_ID,
+           "/",
+           &ParentNodeId,
+           &ParentAttr
+           )
+         ))
+  {
+    if (!EFI_ERROR (
+           VirtioFsFuseRemove (
+             VirtioFs,
+             ParentNodeId,
+             Name,
+             VirtioFsFile->IsDirectory
+             )
+           ))
+    {
+      Status = EFI_SUCCESS;
+    }
+
+    VirtioFsForgetNode (VirtioFs, ParentNodeId);
+  }
+
+  FreePool (Name);
+  FreePool (ParentPath);
+
+Close:
+  VirtioFsSimpleFileClose (This);
+  return Status;
+}
+
+/**
+  Flush the data written to a file to the host's storage.
+
+  Refer to EFI_FILE_FLUSH for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileFlush (
+  IN EFI_FILE_PROTOCOL  *This
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+
+  if (!VirtioFsFile->IsOpenForWriting) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  //
+  // Directory changes are synchronous on the host.
+  //
+  if (VirtioFsFile->IsDirectory) {
+    return EFI_SUCCESS;
+  }
+
+  return VirtioFsFuseFsync (
+           VirtioFsFile->OwnerFs,
+           VirtioFsFile->NodeId,
+           VirtioFsFile->FuseHandle
+           );
+}
+
+/**
+  Return the current position in a regular file.
+
+  Refer to EFI_FILE_GET_POSITION for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileGetPosition (
+  IN     EFI_FILE_PROTOCOL  *This,
+  OUT    UINT64             *Position
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  if (VirtioFsFile->IsDirectory) {
+    return EFI_UNSUPPORTED;
+  }
+
+  *Position = VirtioFsFile->FilePosition;
+  return EFI_SUCCESS;
+}
+
+/**
+  Set the position in a regular file, or restart reading a directory.
+
+  Refer to EFI_FILE_SET_POSITION for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileSetPosition (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN UINT64             Position
+  )
+{
+  VIRTIO_FS_FILE       *VirtioFsFile;
+  VIRTIO_FS_FUSE_ATTR  Attr;
+  EFI_STATUS           Status;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+
+  if (VirtioFsFile->IsDirectory) {
+    if (Position != 0) {
+      return EFI_UNSUPPORTED;
+    }
+
+    VirtioFsDropDirents (VirtioFsFile);
+    VirtioFsFile->DirentNextOffset = 0;
+    VirtioFsFile->DirentEof        = FALSE;
+    return EFI_SUCCESS;
+  }
+
+  //
+  // MAX_UINT64 means the end of the file.
+  //
+  if (Position == MAX_UINT64) {
+    Status = VirtioFsFuseGetAttr (
+               VirtioFsFile->OwnerFs,
+               VirtioFsFile->NodeId,
+               &Attr
+               );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Position = Attr.Size;
+  }
+
+  VirtioFsFile->FilePosition = Position;
+  return EFI_SUCCESS;
+}
+
+/**
+  Read data from a regular file, or the next entry from a directory.
+
+  File data is read in requests of up to VIRTIO_FS.MaxIoSize bytes, directly
+  into the caller's buffer.
+
+  Refer to EFI_FILE_READ for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileRead (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+  VIRTIO_FS       *VirtioFs;
+  UINTN           Transferred;
+  UINT32          ChunkSize;
+  UINT32          ReadSize;
+  EFI_STATUS      Status;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  VirtioFs     = VirtioFsFile->OwnerFs;
+
+  if (VirtioFsFile->IsDirectory) {
+    return VirtioFsReadDirectory (VirtioFsFile, BufferSize, Buffer);
+  }
+
+  Status = EFI_SUCCESS;
+  for (Transferred = 0; Transferred < *BufferSize; Transferred += ReadSize) {
+    ChunkSize = (UINT32)MIN (*BufferSize - Transferred, VirtioFs->MaxIoSize);
+    ReadSize  = ChunkSize;
+    Status    = VirtioFsFuseRead (
+                  VirtioFs,
+                  VirtioFsFile->NodeId,
+                  VirtioFsFile->FuseHandle,
+                  FALSE,
+                  VirtioFsFile->FilePosition + Transferred,
+                  &ReadSize,
+                  (UINT8 *)Buffer + Transferred
+                  );
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+
+    //
+    // A short read means the end of the file.
+    //
+    if (ReadSize < ChunkSize) {
+      Transferred += ReadSize;
+      break;
+    }
+  }
+
+  //
+  // Report whatever was read before an error, unless nothing was.
+  //
+  if (EFI_ERROR (Status) && (Transferred == 0)) {
+    return Status;
+  }
+
+  VirtioFsFile->FilePosition += Transferred;
+  *BufferSize                 = Transferred;
+  return EFI_SUCCESS;
+}
+
+/**
+  Write data to a regular file.
+
+  File data is written in requests of up to VIRTIO_FS.MaxWrite bytes,
+  directly from the caller's buffer.
+
+  Refer to EFI_FILE_WRITE for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileWrite (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  IN     VOID               *Buffer
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+  VIRTIO_FS       *VirtioFs;
+  UINTN           Transferred;
+  UINT32          ChunkSize;
+  UINT32          WriteSize;
+  EFI_STATUS      Status;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  VirtioFs     = VirtioFsFile->OwnerFs;
+
+  if (VirtioFsFile->IsDirectory) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (!VirtioFsFile->IsOpenForWriting) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  Status = EFI_SUCCESS;
+  for (Transferred = 0; Transferred < *BufferSize; Transferred += WriteSize) {
+    ChunkSize = (UINT32)MIN (*BufferSize - Transferred, VirtioFs->MaxWrite);
+    WriteSize = ChunkSize;
+    Status    = VirtioFsFuseWrite (
+                  VirtioFs,
+                  VirtioFsFile->NodeId,
+                  VirtioFsFile->FuseHandle,
+                  VirtioFsFile->FilePosition + Transferred,
+                  &WriteSize,
+                  (UINT8 *)Buffer + Transferred
+                  );
+    if (!EFI_ERROR (Status) && (WriteSize < ChunkSize)) {
+      Transferred += WriteSize;
+      Status       = EFI_VOLUME_FULL;
+    }
+
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+  }
+
+  VirtioFsFile->FilePosition += Transferred;
+  *BufferSize                 = Transferred;
+  return Status;
+}
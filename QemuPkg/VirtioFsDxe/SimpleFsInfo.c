@@ -0,0 +1,429 @@
+/** @file
+  EFI_FILE_PROTOCOL.GetInfo() and EFI_FILE_PROTOCOL.SetInfo() member functions
+  for the Virtio Filesystem driver.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioFsDxe.h"
+
+/**
+  Return the last component of a canonical pathname; the empty string for the
+  root directory.
+
+  @param[in] Path  The canonical pathname.
+
+  @return  A pointer into Path.
+**/
+STATIC
+CHAR8 *
+VirtioFsLastComponent (
+  IN CHAR8  *Path
+  )
+{
+  CHAR8  *Last;
+
+  Last = Path;
+  while (*Path != '\0') {
+    if (*Path == '/') {
+      Last = Path + 1;
+    }
+
+    Path++;
+  }
+
+  return Last;
+}
+
+/**
+  Produce EFI_FILE_INFO for an open file.
+**/
+STATIC
+EFI_STATUS
+VirtioFsGetFileInfo (
+  IN     VIRTIO_FS_FILE  *VirtioFsFile,
+  IN OUT UINTN           *BufferSize,
+  OUT    VOID            *Buffer
+  )
+{
+  VIRTIO_FS_FUSE_ATTR  Attr;
+  CHAR8                *Name;
+  EFI_STATUS           Status;
+
+  Status = VirtioFsFuseGetAttr (
+             VirtioFsFile->OwnerFs,
+             VirtioFsFile->NodeId,
+             &Attr
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Name = VirtioFsLastComponent (VirtioFsFile->CanonicalPathname);
+  return VirtioFsFuseAttrToEfiFileInfo (
+           &Attr,
+           Name,
+           AsciiStrLen (Name),
+           Buffer,
+           BufferSize
+           );
+}
+
+/**
+  Produce EFI_FILE_SYSTEM_INFO for the file system of an open file.
+**/
+STATIC
+EFI_STATUS
+VirtioFsGetFileSystemInfo (
+  IN     VIRTIO_FS_FILE  *VirtioFsFile,
+  IN OUT UINTN           *BufferSize,
+  OUT    VOID            *Buffer
+  )
+{
+  VIRTIO_FS                  *VirtioFs;
+  UINTN                      LabelSize;
+  UINTN                      InfoSize;
+  EFI_FILE_SYSTEM_INFO       *FsInfo;
+  VIRTIO_FS_FUSE_STATFS_OUT  StatFs;
+  EFI_STATUS                 Status;
+
+  VirtioFs  = VirtioFsFile->OwnerFs;
+  LabelSize = StrSize (VirtioFs->Label);
+  InfoSize  = SIZE_OF_EFI_FILE_SYSTEM_INFO + LabelSize;
+  if ((Buffer == NULL) || (*BufferSize < InfoSize)) {
+    *BufferSize = InfoSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  Status = VirtioFsFuseStatFs (VirtioFs, VirtioFsFile->NodeId, &StatFs);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  FsInfo             = Buffer;
+  FsInfo->Size       = InfoSize;
+  FsInfo->ReadOnly   = FALSE;
+  FsInfo->VolumeSize = MultU64x32 (StatFs.Blocks, StatFs.Frsize);
+  FsInfo->FreeSpace  = MultU64x32 (StatFs.Bavail, StatFs.Frsize);
+  FsInfo->BlockSize  = StatFs.Frsize;
+  CopyMem (FsInfo->VolumeLabel, VirtioFs->Label, LabelSize);
+
+  *BufferSize = InfoSize;
+  return EFI_SUCCESS;
+}
+
+/**
+  Produce EFI_FILE_SYSTEM_VOLUME_LABEL for the file system of an open file.
+**/
+STATIC
+EFI_STATUS
+VirtioFsGetVolumeLabel (
+  IN     VIRTIO_FS_FILE  *VirtioFsFile,
+  IN OUT UINTN           *BufferSize,
+  OUT    VOID            *Buffer
+  )
+{
+  VIRTIO_FS  *VirtioFs;
+  UINTN      LabelSize;
+
+  VirtioFs  = VirtioFsFile->OwnerFs;
+  LabelSize = StrSize (VirtioFs->Label);
+  if ((Buffer == NULL) || (*BufferSize < LabelSize)) {
+    *BufferSize = LabelSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  CopyMem (Buffer, VirtioFs->Label, LabelSize);
+  *BufferSize = LabelSize;
+  return EFI_SUCCESS;
+}
+
+/**
+  Return information about a file or the file system.
+
+  Refer to EFI_FILE_GET_INFO for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileGetInfo (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN     EFI_GUID           *InformationType,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+
+  if (CompareGuid (InformationType, &gEfiFileInfoGuid)) {
+    return VirtioFsGetFileInfo (VirtioFsFile, BufferSize, Buffer);
+  }
+
+  if (CompareGuid (InformationType, &gEfiFileSystemInfoGuid)) {
+    return VirtioFsGetFileSystemInfo (VirtioFsFile, BufferSize, Buffer);
+  }
+
+  if (CompareGuid (InformationType, &gEfiFileSystemVolumeLabelInfoIdGuid)) {
+    return VirtioFsGetVolumeLabel (VirtioFsFile, BufferSize, Buffer);
+  }
+
+  return EFI_UNSUPPORTED;
+}
+
+/**
+  Rename an open file, as requested by EFI_FILE_INFO.FileName.
+
+  The new name is relative to the parent directory of the file, unless it
+  starts with "\".
+
+  @param[in,out] VirtioFsFile  The file to rename. On success, its canonical
+                               pathname is updated.
+
+  @param[in] NewFileName       The new name from EFI_FILE_INFO.
+
+  @return  Status codes from the FUSE requests.
+**/
+STATIC
+EFI_STATUS
+VirtioFsRenameFile (
+  IN OUT VIRTIO_FS_FILE  *VirtioFsFile,
+  IN     CHAR16          *NewFileName
+  )
+{
+  VIRTIO_FS            *VirtioFs;
+  CHAR8                *OldParentPath;
+  CHAR8                *OldName;
+  CHAR8                *NewPath;
+  CHAR8                *NewParentPath;
+  CHAR8                *NewName;
+  UINT64               OldParentNodeId;
+  UINT64               NewParentNodeId;
+  VIRTIO_FS_FUSE_ATTR  Attr;
+  EFI_STATUS           Status;
+
+  VirtioFs = VirtioFsFile->OwnerFs;
+
+  Status = VirtioFsSplitPath (
+             VirtioFsFile->CanonicalPathname,
+             &OldParentPath,
+             &OldName
+             );
+  if (EFI_ERROR (Status)) {
+    //
+    // The root directory cannot be renamed.
+    //
+    return (Status == EFI_INVALID_PARAMETER) ? EFI_ACCESS_DENIED : Status;
+  }
+
+  Status = VirtioFsComposePath (OldParentPath, NewFileName, &NewPath);
+  if (EFI_ERROR (Status)) {
+    goto FreeOldPaths;
+  }
+
+  if (AsciiStrCmp (NewPath, VirtioFsFile->CanonicalPathname) == 0) {
+    FreePool (NewPath);
+    Status = EFI_SUCCESS;
+    goto FreeOldPaths;
+  }
+
+  Status = VirtioFsSplitPath (NewPath, &NewParentPath, &NewName);
+  if (EFI_ERROR (Status)) {
+    Status = (Status == EFI_INVALID_PARAMETER) ? EFI_ACCESS_DENIED : Status;
+    goto FreeNewPath;
+  }
+
+  Status = VirtioFsLookupPath (
+             VirtioFs,
+             OldParentPath,
+             VIRTIO_FS_FUSE_ROOT_NODE_ID,
+             "/",
+             &OldParentNodeId,
+             &Attr
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeNewPaths;
+  }
+
+  Status = VirtioFsLookupPath (
+             VirtioFs,
+             NewParentPath,
+             VIRTIO_FS_FUSE_ROOT_NODE_ID,
+             "/",
+             &NewParentNodeId,
+             &Attr
+             );
+  if (EFI_ERROR (Status)) {
+    goto ForgetOldParent;
+  }
+
+  Status = VirtioFsFuseRename (
+             VirtioFs,
+             OldParentNodeId,
+             OldName,
+             NewParentNodeId,
+             NewName
+             );
+  if (!EFI_ERROR (Status)) {
+    FreePool (VirtioFsFile->CanonicalPathname);
+    VirtioFsFile->CanonicalPathname = NewPath;
+    NewPath                         = NULL;
+  }
+
+  VirtioFsForgetNode (VirtioFs, NewParentNodeId);
+
+ForgetOldParent:
+  VirtioFsForgetNode (VirtioFs, OldParentNodeId);
+
+FreeNewPaths:
+  FreePool (NewName);
+  FreePool (NewParentPath);
+
+FreeNewPath:
+  if (NewPath != NULL) {
+    FreePool (NewPath);
+  }
+
+FreeOldPaths:
+  FreePool (OldName);
+  FreePool (OldParentPath);
+  return Status;
+}
+
+/**
+  Apply EFI_FILE_INFO to an open file: rename it, resize it, and change its
+  time stamps and read-only attribute.
+**/
+STATIC
+EFI_STATUS
+VirtioFsSetFileInfo (
+  IN OUT VIRTIO_FS_FILE  *VirtioFsFile,
+  IN     UINTN           BufferSize,
+  IN     EFI_FILE_INFO   *FileInfo
+  )
+{
+  VIRTIO_FS                  *VirtioFs;
+  VIRTIO_FS_FUSE_ATTR        Attr;
+  VIRTIO_FS_FUSE_SETATTR_IN  SetAttr;
+  UINT32                     Mode;
+  EFI_STATUS                 Status;
+
+  VirtioFs = VirtioFsFile->OwnerFs;
+
+  if ((BufferSize < SIZE_OF_EFI_FILE_INFO + sizeof (CHAR16)) ||
+      (FileInfo->Size > BufferSize) ||
+      ((FileInfo->Attribute & ~(UINT64)EFI_FILE_VALID_ATTR) != 0) ||
+      (StrnSizeS (
+         FileInfo->FileName,
+         (BufferSize - SIZE_OF_EFI_FILE_INFO) / sizeof (CHAR16)
+         ) > BufferSize - SIZE_OF_EFI_FILE_INFO))
+  {
+    return EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (!VirtioFsFile->IsOpenForWriting) {
+    return EFI_ACCESS_DENIED;
+  }
+
+  Status = VirtioFsFuseGetAttr (VirtioFs, VirtioFsFile->NodeId, &Attr);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // The type of a file cannot change.
+  //
+  if (((FileInfo->Attribute & EFI_FILE_DIRECTORY) != 0) !=
+      VirtioFsFile->IsDirectory)
+  {
+    return EFI_ACCESS_DENIED;
+  }
+
+  ZeroMem (&SetAttr, sizeof SetAttr);
+
+  if (FileInfo->FileSize != Attr.Size) {
+    if (VirtioFsFile->IsDirectory || !VirtioFsFile->IsOpenForWriting) {
+      return EFI_ACCESS_DENIED;
+    }
+
+    SetAttr.Valid     |= VIRTIO_FS_FUSE_SETATTR_SIZE | VIRTIO_FS_FUSE_SETATTR_FH;
+    SetAttr.Size       = FileInfo->FileSize;
+    SetAttr.FileHandle = VirtioFsFile->FuseHandle;
+  }
+
+  if (VirtioFsIsEfiTimeSet (&FileInfo->LastAccessTime)) {
+    SetAttr.Valid |= VIRTIO_FS_FUSE_SETATTR_ATIME;
+    SetAttr.Atime  = VirtioFsEfiTimeToEpoch (&FileInfo->LastAccessTime);
+  }
+
+  if (VirtioFsIsEfiTimeSet (&FileInfo->ModificationTime)) {
+    SetAttr.Valid |= VIRTIO_FS_FUSE_SETATTR_MTIME;
+    SetAttr.Mtime  = VirtioFsEfiTimeToEpoch (&FileInfo->ModificationTime);
+  }
+
+  Mode = Attr.Mode & ~(UINT32)VIRTIO_FS_LINUX_S_IFMT;
+  if ((FileInfo->Attribute & EFI_FILE_READ_ONLY) != 0) {
+    Mode &= ~(UINT32)(VIRTIO_FS_LINUX_S_IWUSR | VIRTIO_FS_LINUX_S_IWGRP |
+                      VIRTIO_FS_LINUX_S_IWOTH);
+  } else if ((Mode & (VIRTIO_FS_LINUX_S_IWUSR | VIRTIO_FS_LINUX_S_IWGRP |
+                      VIRTIO_FS_LINUX_S_IWOTH)) == 0)
+  {
+    Mode |= VIRTIO_FS_LINUX_S_IWUSR;
+  }
+
+  if (Mode != (Attr.Mode & ~(UINT32)VIRTIO_FS_LINUX_S_IFMT)) {
+    SetAttr.Valid |= VIRTIO_FS_FUSE_SETATTR_MODE;
+    SetAttr.Mode   = Mode;
+  }
+
+  Status = VirtioFsRenameFile (VirtioFsFile, FileInfo->FileName);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (SetAttr.Valid == 0) {
+    return EFI_SUCCESS;
+  }
+
+  return VirtioFsFuseSetAttr (VirtioFs, VirtioFsFile->NodeId, &SetAttr);
+}
+
+/**
+  Change information about a file.
+
+  The file system information, including the volume label, is the device's
+  tag and cannot be changed.
+
+  Refer to EFI_FILE_SET_INFO for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileSetInfo (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN EFI_GUID           *InformationType,
+  IN UINTN              BufferSize,
+  IN VOID               *Buffer
+  )
+{
+  VIRTIO_FS_FILE  *VirtioFsFile;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+
+  if (CompareGuid (InformationType, &gEfiFileInfoGuid)) {
+    return VirtioFsSetFileInfo (VirtioFsFile, BufferSize, Buffer);
+  }
+
+  if (CompareGuid (InformationType, &gEfiFileSystemInfoGuid) ||
+      CompareGuid (InformationType, &gEfiFileSystemVolumeLabelInfoIdGuid))
+  {
+    return EFI_WRITE_PROTECTED;
+  }
+
+  return EFI_UNSUPPORTED;
+}
@@ -0,0 +1,259 @@
+/** @file
+  EFI_FILE_PROTOCOL.Open() member function for the Virtio Filesystem driver.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioFsDxe.h"
+
+/**
+  Create a regular file or a directory that VirtioFsLookupPath() did not find.
+
+  @param[in,out] VirtioFs    The Virtio Filesystem device.
+
+  @param[in] Parent          The open file that the pathname was relative to.
+
+  @param[in] NewPath         The canonical pathname of the file to create.
+
+  @param[in] Attributes      The EFI_FILE_* attributes of the new file.
+
+  @param[out] NodeId         The node ID of the new file, looked up once.
+
+  @param[out] FuseHandle     The FUSE file handle of the new file, open for
+                             reading and writing.
+
+  @param[out] IsDir          Whether a directory has been created.
+
+  @return  Status codes from the FUSE requests.
+**/
+STATIC
+EFI_STATUS
+VirtioFsCreateFile (
+  IN OUT VIRTIO_FS       *VirtioFs,
+  IN     VIRTIO_FS_FILE  *Parent,
+  IN     CHAR8           *NewPath,
+  IN     UINT64          Attributes,
+  OUT    UINT64          *NodeId,
+  OUT    UINT64          *FuseHandle,
+  OUT    BOOLEAN         *IsDir
+  )
+{
+  CHAR8                     *ParentPath;
+  CHAR8                     *Name;
+  UINT64                    ParentNodeId;
+  VIRTIO_FS_FUSE_ATTR       ParentAttr;
+  VIRTIO_FS_FUSE_ENTRY_OUT  Entry;
+  UINT32                    Mode;
+  EFI_STATUS                Status;
+
+  Status = VirtioFsSplitPath (NewPath, &ParentPath, &Name);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = VirtioFsLookupPath (
+             VirtioFs,
+             ParentPath,
+             Parent->NodeId,
+             Parent->CanonicalPathname,
+             &ParentNodeId,
+             &ParentAttr
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreePaths;
+  }
+
+  if ((ParentAttr.Mode & VIRTIO_FS_LINUX_S_IFMT) != VIRTIO_FS_LINUX_S_IFDIR) {
+    Status = EFI_NOT_FOUND;
+    goto ForgetParent;
+  }
+
+  //
+  // rwxr-xr-x / rw-r--r--, minus the write permissions for read-only files.
+  //
+  *IsDir = (BOOLEAN)((Attributes & EFI_FILE_DIRECTORY) != 0);
+  Mode   = *IsDir ? 0755 : 0644;
+  if ((Attributes & EFI_FILE_READ_ONLY) != 0) {
+    Mode &= ~(UINT32)(VIRTIO_FS_LINUX_S_IWUSR | VIRTIO_FS_LINUX_S_IWGRP |
+                      VIRTIO_FS_LINUX_S_IWOTH);
+  }
+
+  if (*IsDir) {
+    Status = VirtioFsFuseMkDir (VirtioFs, ParentNodeId, Name, Mode, &Entry);
+    if (EFI_ERROR (Status)) {
+      goto ForgetParent;
+    }
+
+    Status = VirtioFsFuseOpen (VirtioFs, Entry.NodeId, TRUE, FALSE, FuseHandle);
+    if (EFI_ERROR (Status)) {
+      VirtioFsForgetNode (VirtioFs, Entry.NodeId);
+      goto ForgetParent;
+    }
+  } else {
+    Status = VirtioFsFuseCreate (
+               VirtioFs,
+               ParentNodeId,
+               Name,
+               Mode,
+               &Entry,
+               FuseHandle
+               );
+    if (EFI_ERROR (Status)) {
+      goto ForgetParent;
+    }
+  }
+
+  *NodeId = Entry.NodeId;
+
+ForgetParent:
+  VirtioFsForgetNode (VirtioFs, ParentNodeId);
+
+FreePaths:
+  FreePool (Name);
+  FreePool (ParentPath);
+  return Status;
+}
+
+/**
+  Open a file relative to an open directory, or by absolute pathname.
+
+  Refer to EFI_FILE_OPEN for the interface contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileOpen (
+  IN     EFI_FILE_PROTOCOL  *This,
+  OUT    EFI_FILE_PROTOCOL  **NewHandle,
+  IN     CHAR16             *FileName,
+  IN     UINT64             OpenMode,
+  IN     UINT64             Attributes
+  )
+{
+  VIRTIO_FS_FILE       *VirtioFsFile;
+  VIRTIO_FS            *VirtioFs;
+  BOOLEAN              OpenForWriting;
+  BOOLEAN              PermitCreation;
+  CHAR8                *NewPath;
+  UINT64               NodeId;
+  VIRTIO_FS_FUSE_ATTR  Attr;
+  UINT32               Type;
+  BOOLEAN              IsDir;
+  UINT64               FuseHandle;
+  EFI_STATUS           Status;
+
+  VirtioFsFile = VIRTIO_FS_FILE_FROM_SIMPLE_FILE (This);
+  VirtioFs     = VirtioFsFile->OwnerFs;
+
+  switch (OpenMode) {
+    case EFI_FILE_MODE_READ:
+      OpenForWriting = FALSE;
+      PermitCreation = FALSE;
+      break;
+
+    case EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE:
+      OpenForWriting = TRUE;
+      PermitCreation = FALSE;
+      break;
+
+    case EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE:
+      OpenForWriting = TRUE;
+      PermitCreation = TRUE;
+      break;
+
+    default:
+      return EFI_INVALID_PARAMETER;
+  }
+
+  if (PermitCreation &&
+      ((Attributes & ~(UINT64)EFI_FILE_VALID_ATTR) != 0))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // Only directories can be the base of a relative pathname.
+  //
+  if (!VirtioFsFile->IsDirectory && (FileName[0] != L'\\')) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Status = VirtioFsComposePath (
+             VirtioFsFile->CanonicalPathname,
+             FileName,
+             &NewPath
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = VirtioFsLookupPath (
+             VirtioFs,
+             NewPath,
+             VirtioFsFile->NodeId,
+             VirtioFsFile->CanonicalPathname,
+             &NodeId,
+             &Attr
+             );
+  if (!EFI_ERROR (Status)) {
+    Type = Attr.Mode & VIRTIO_FS_LINUX_S_IFMT;
+    if ((Type != VIRTIO_FS_LINUX_S_IFDIR) && (Type != VIRTIO_FS_LINUX_S_IFREG)) {
+      Status = EFI_UNSUPPORTED;
+      goto ForgetNode;
+    }
+
+    IsDir  = (BOOLEAN)(Type == VIRTIO_FS_LINUX_S_IFDIR);
+    Status = VirtioFsFuseOpen (
+               VirtioFs,
+               NodeId,
+               IsDir,
+               (BOOLEAN)(OpenForWriting && !IsDir),
+               &FuseHandle
+               );
+    if (EFI_ERROR (Status)) {
+      goto ForgetNode;
+    }
+  } else if ((Status == EFI_NOT_FOUND) && PermitCreation) {
+    Status = VirtioFsCreateFile (
+               VirtioFs,
+               VirtioFsFile,
+               NewPath,
+               Attributes,
+               &NodeId,
+               &FuseHandle,
+               &IsDir
+               );
+    if (EFI_ERROR (Status)) {
+      goto FreeNewPath;
+    }
+  } else {
+    goto FreeNewPath;
+  }
+
+  Status = VirtioFsNewFile (
+             VirtioFs,
+             NewPath,
+             NodeId,
+             FuseHandle,
+             IsDir,
+             OpenForWriting,
+             NewHandle
+             );
+  if (EFI_ERROR (Status)) {
+    VirtioFsFuseRelease (VirtioFs, NodeId, FuseHandle, IsDir);
+    goto ForgetNode;
+  }
+
+  return EFI_SUCCESS;
+
+ForgetNode:
+  VirtioFsForgetNode (VirtioFs, NodeId);
+
+FreeNewPath:
+  FreePool (NewPath);
+  return Status;
+}
@@ -0,0 +1,77 @@
+/** @file
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL.OpenVolume() member function for the Virtio
+  Filesystem driver.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioFsDxe.h"
+
+/**
+  Open the root directory on the Virtio Filesystem.
+
+  Refer to EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_OPEN_VOLUME for the interface
+  contract.
+**/
+EFI_STATUS
+EFIAPI
+VirtioFsOpenVolume (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
+  OUT EFI_FILE_PROTOCOL                **Root
+  )
+{
+  VIRTIO_FS   *VirtioFs;
+  CHAR8       *RootPath;
+  UINT64      RootDirHandle;
+  EFI_STATUS  Status;
+
+  VirtioFs = VIRTIO_FS_FROM_SIMPLE_FS (This);
+
+  RootPath = AllocateCopyPool (sizeof "/", "/");
+  if (RootPath == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // The root directory is never looked up, and never forgotten.
+  //
+  Status = VirtioFsFuseOpen (
+             VirtioFs,
+             VIRTIO_FS_FUSE_ROOT_NODE_ID,
+             TRUE,
+             FALSE,
+             &RootDirHandle
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeRootPath;
+  }
+
+  Status = VirtioFsNewFile (
+             VirtioFs,
+             RootPath,
+             VIRTIO_FS_FUSE_ROOT_NODE_ID,
+             RootDirHandle,
+             TRUE,
+             TRUE,
+             Root
+             );
+  if (EFI_ERROR (Status)) {
+    VirtioFsFuseRelease (
+      VirtioFs,
+      VIRTIO_FS_FUSE_ROOT_NODE_ID,
+      RootDirHandle,
+      TRUE
+      );
+    goto FreeRootPath;
+  }
+
+  return EFI_SUCCESS;
+
+FreeRootPath:
+  FreePool (RootPath);
+  return Status;
+}
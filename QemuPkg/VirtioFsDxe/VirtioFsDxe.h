@@ -0,0 +1,468 @@
+/** @file
+
+  Internal type and macro definitions for the Virtio Filesystem device driver.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _VIRTIO_FS_DXE_H_
+#define _VIRTIO_FS_DXE_H_
+
+#include <Base.h>
+
+#include <Guid/FileInfo.h>
+#include <Guid/FileSystemInfo.h>
+#include <Guid/FileSystemVolumeLabelInfo.h>
+#include <IndustryStandard/VirtioFs.h>
+#include <Library/DebugLib.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Protocol/VirtioDevice.h>
+
+#define VIRTIO_FS_SIG       SIGNATURE_64 ('V', 'I', 'R', 'T', 'I', 'O', 'F', 'S')
+#define VIRTIO_FS_FILE_SIG  SIGNATURE_64 ('V', 'I', 'O', 'F', 'S', 'F', 'I', 'L')
+
+//
+// The largest number of buffers (descriptors) that a single FUSE request and
+// its response take together: the request header plus up to three request
+// buffers (FUSE_RENAME2), and the response header plus up to two response
+// buffers (FUSE_CREATE).
+//
+#define VIRTIO_FS_MAX_DESC  8
+
+//
+// The default size limit of a single FUSE_READ or FUSE_WRITE request (32
+// pages), which applies unless the server grants a larger limit with
+// VIRTIO_FS_FUSE_INIT_MAX_PAGES.
+//
+#define VIRTIO_FS_DEFAULT_MAX_PAGES  32
+
+//
+// The size of the buffer that directory entries are read into, with
+// FUSE_READDIRPLUS.
+//
+#define VIRTIO_FS_DIRENT_BUF_SIZE  SIZE_16KB
+
+//
+// The maximum length of a single path component, in bytes of UTF-8.
+//
+#define VIRTIO_FS_MAX_NAME_LEN  255
+
+//
+// The label of the file system is the device tag, plus a terminating NUL.
+//
+typedef CHAR16 VIRTIO_FS_LABEL[VIRTIO_FS_TAG_BYTES + 1];
+
+//
+// Main context structure, expressing an EFI_SIMPLE_FILE_SYSTEM_PROTOCOL
+// interface on top of the Virtio Filesystem device.
+//
+typedef struct {
+  //
+  // Parts of this structure are initialized / torn down in various functions
+  // at various call depths. The table to the right should make it easier to
+  // track them.
+  //
+  //                              field         init function       init depth
+  //                              -----------   ------------------  ----------
+  UINT64                             Signature; // DriverBindingStart  0
+  VIRTIO_DEVICE_PROTOCOL             *Virtio;   // DriverBindingStart  0
+  VIRTIO_FS_LABEL                    Label;     // VirtioFsInit        1
+  UINT16                             QueueSize; // VirtioFsInit        1
+  VRING                              Ring;      // VirtioRingInit      2
+  VOID                               *RingMap;  // VirtioRingMap       2
+  UINT64                             RequestId; // FuseInitSession     1
+  UINT32                             MaxIoSize; // FuseInitSession     1
+  UINT32                             MaxWrite;  // FuseInitSession     1
+  EFI_EVENT                          ExitBoot;  // DriverBindingStart  0
+  LIST_ENTRY                         OpenFiles; // DriverBindingStart  0
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL    SimpleFs;  // DriverBindingStart  0
+} VIRTIO_FS;
+
+#define VIRTIO_FS_FROM_SIMPLE_FS(SimpleFsReference) \
+  CR (SimpleFsReference, VIRTIO_FS, SimpleFs, VIRTIO_FS_SIG);
+
+//
+// One buffer of a FUSE request or response.
+//
+typedef struct {
+  VOID      *Buffer;
+  UINT32    Size;
+} VIRTIO_FS_IO_VECTOR;
+
+//
+// Private context structure that exposes EFI_FILE_PROTOCOL on top of an open
+// FUSE file handle.
+//
+typedef struct {
+  UINT64               Signature;
+  EFI_FILE_PROTOCOL    SimpleFile;
+  BOOLEAN              IsDirectory;
+  BOOLEAN              IsOpenForWriting;
+  VIRTIO_FS            *OwnerFs;
+  LIST_ENTRY           OpenFilesEntry;
+  //
+  // The absolute path of the file on the host, in UTF-8, with "/" as
+  // separator, starting with "/", and without "." and ".." components.
+  //
+  CHAR8                *CanonicalPathname;
+  UINT64               FilePosition;
+  UINT64               NodeId;
+  UINT64               FuseHandle;
+  //
+  // Directories only: the last FUSE_READDIRPLUS response, the position of the
+  // next entry to return from it, and the offset to continue reading the
+  // directory at once the buffer has been consumed. The nodes in the buffer
+  // are forgotten when the buffer is refilled or dropped.
+  //
+  UINT8                *DirentBuf;
+  UINT32               DirentBufSize;
+  UINT32               DirentBufPos;
+  UINT64               DirentNextOffset;
+  BOOLEAN              DirentEof;
+} VIRTIO_FS_FILE;
+
+#define VIRTIO_FS_FILE_FROM_SIMPLE_FILE(SimpleFileReference) \
+  CR (SimpleFileReference, VIRTIO_FS_FILE, SimpleFile, VIRTIO_FS_FILE_SIG);
+
+#define VIRTIO_FS_FILE_FROM_OPEN_FILES_ENTRY(OpenFilesEntryReference) \
+  CR (OpenFilesEntryReference, VIRTIO_FS_FILE, OpenFilesEntry, \
+    VIRTIO_FS_FILE_SIG);
+
+//
+// Initialization and helper routines for the Virtio Filesystem device.
+//
+
+EFI_STATUS
+VirtioFsInit (
+  IN OUT VIRTIO_FS  *VirtioFs
+  );
+
+VOID
+VirtioFsUninit (
+  IN OUT VIRTIO_FS  *VirtioFs
+  );
+
+VOID
+EFIAPI
+VirtioFsExitBoot (
+  IN EFI_EVENT  ExitBootEvent,
+  IN VOID       *VirtioFsAsVoid
+  );
+
+EFI_STATUS
+VirtioFsFuseRequest (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     UINT32               Opcode,
+  IN     UINT64               NodeId,
+  IN     VIRTIO_FS_IO_VECTOR  *Request,
+  IN     UINTN                NumRequest,
+  IN     VIRTIO_FS_IO_VECTOR  *Response       OPTIONAL,
+  IN     UINTN                NumResponse,
+  OUT    UINT32               *ResponseSize   OPTIONAL
+  );
+
+EFI_STATUS
+VirtioFsErrnoToEfiStatus (
+  IN INT32  Errno
+  );
+
+EFI_STATUS
+VirtioFsComposePath (
+  IN     CHAR8   *LhsPath8,
+  IN     CHAR16  *RhsPath16,
+  OUT    CHAR8   **ResultPath8
+  );
+
+EFI_STATUS
+VirtioFsSplitPath (
+  IN     CHAR8  *Path,
+  OUT    CHAR8  **ParentPath,
+  OUT    CHAR8  **LastComponent
+  );
+
+EFI_STATUS
+VirtioFsLookupPath (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     CHAR8                *Path,
+  IN     UINT64               StartNodeId,
+  IN     CHAR8                *StartPath,
+  OUT    UINT64               *NodeId,
+  OUT    VIRTIO_FS_FUSE_ATTR  *Attr
+  );
+
+VOID
+VirtioFsForgetNode (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId
+  );
+
+EFI_STATUS
+VirtioFsUtf8ToUcs2 (
+  IN     CONST CHAR8  *Utf8,
+  IN     UINTN        Utf8Len,
+  OUT    CHAR16       *Ucs2       OPTIONAL,
+  IN OUT UINTN        *Ucs2Size
+  );
+
+EFI_STATUS
+VirtioFsFuseAttrToEfiFileInfo (
+  IN     VIRTIO_FS_FUSE_ATTR  *FuseAttr,
+  IN     CONST CHAR8          *Name,
+  IN     UINTN                NameLen,
+  OUT    EFI_FILE_INFO        *FileInfo   OPTIONAL,
+  IN OUT UINTN                *FileInfoSize
+  );
+
+UINT64
+VirtioFsEfiTimeToEpoch (
+  IN EFI_TIME  *Time
+  );
+
+BOOLEAN
+VirtioFsIsEfiTimeSet (
+  IN EFI_TIME  *Time
+  );
+
+//
+// Wrapper functions for FUSE commands (primitives).
+//
+
+EFI_STATUS
+VirtioFsFuseInitSession (
+  IN OUT VIRTIO_FS  *VirtioFs
+  );
+
+EFI_STATUS
+VirtioFsFuseLookup (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    DirNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINTN                     NameLen,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry
+  );
+
+EFI_STATUS
+VirtioFsFuseBatchForget (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     VIRTIO_FS_FUSE_FORGET_ONE  *Nodes,
+  IN     UINT32                     Count
+  );
+
+EFI_STATUS
+VirtioFsFuseGetAttr (
+  IN OUT VIRTIO_FS            *VirtioFs,
+  IN     UINT64               NodeId,
+  OUT    VIRTIO_FS_FUSE_ATTR  *Attr
+  );
+
+EFI_STATUS
+VirtioFsFuseSetAttr (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     UINT64                     NodeId,
+  IN     VIRTIO_FS_FUSE_SETATTR_IN  *SetAttr
+  );
+
+EFI_STATUS
+VirtioFsFuseMkDir (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    ParentNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINT32                    Mode,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry
+  );
+
+EFI_STATUS
+VirtioFsFuseRemove (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     ParentNodeId,
+  IN     CHAR8      *Name,
+  IN     BOOLEAN    IsDir
+  );
+
+EFI_STATUS
+VirtioFsFuseOpen (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     BOOLEAN    IsDir,
+  IN     BOOLEAN    ReadWrite,
+  OUT    UINT64     *FuseHandle
+  );
+
+EFI_STATUS
+VirtioFsFuseCreate (
+  IN OUT VIRTIO_FS                 *VirtioFs,
+  IN     UINT64                    ParentNodeId,
+  IN     CHAR8                     *Name,
+  IN     UINT32                    Mode,
+  OUT    VIRTIO_FS_FUSE_ENTRY_OUT  *Entry,
+  OUT    UINT64                    *FuseHandle
+  );
+
+EFI_STATUS
+VirtioFsFuseRead (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     BOOLEAN    IsDir,
+  IN     UINT64     Offset,
+  IN OUT UINT32     *Size,
+  OUT    VOID       *Data
+  );
+
+EFI_STATUS
+VirtioFsFuseWrite (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     UINT64     Offset,
+  IN OUT UINT32     *Size,
+  IN     VOID       *Data
+  );
+
+EFI_STATUS
+VirtioFsFuseStatFs (
+  IN OUT VIRTIO_FS                  *VirtioFs,
+  IN     UINT64                     NodeId,
+  OUT    VIRTIO_FS_FUSE_STATFS_OUT  *StatFs
+  );
+
+EFI_STATUS
+VirtioFsFuseRelease (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle,
+  IN     BOOLEAN    IsDir
+  );
+
+EFI_STATUS
+VirtioFsFuseFsync (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     NodeId,
+  IN     UINT64     FuseHandle
+  );
+
+EFI_STATUS
+VirtioFsFuseRename (
+  IN OUT VIRTIO_FS  *VirtioFs,
+  IN     UINT64     OldParentNodeId,
+  IN     CHAR8      *OldName,
+  IN     UINT64     NewParentNodeId,
+  IN     CHAR8      *NewName
+  );
+
+//
+// EFI_SIMPLE_FILE_SYSTEM_PROTOCOL member functions for the Virtio Filesystem
+// driver.
+//
+
+EFI_STATUS
+EFIAPI
+VirtioFsOpenVolume (
+  IN  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *This,
+  OUT EFI_FILE_PROTOCOL                **Root
+  );
+
+//
+// EFI_FILE_PROTOCOL member functions for the Virtio Filesystem driver.
+//
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileClose (
+  IN EFI_FILE_PROTOCOL  *This
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileDelete (
+  IN EFI_FILE_PROTOCOL  *This
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileFlush (
+  IN EFI_FILE_PROTOCOL  *This
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileGetInfo (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN     EFI_GUID           *InformationType,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileGetPosition (
+  IN     EFI_FILE_PROTOCOL  *This,
+  OUT    UINT64             *Position
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileOpen (
+  IN     EFI_FILE_PROTOCOL  *This,
+  OUT    EFI_FILE_PROTOCOL  **NewHandle,
+  IN     CHAR16             *FileName,
+  IN     UINT64             OpenMode,
+  IN     UINT64             Attributes
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileRead (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  OUT    VOID               *Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileSetInfo (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN EFI_GUID           *InformationType,
+  IN UINTN              BufferSize,
+  IN VOID               *Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileSetPosition (
+  IN EFI_FILE_PROTOCOL  *This,
+  IN UINT64             Position
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioFsSimpleFileWrite (
+  IN     EFI_FILE_PROTOCOL  *This,
+  IN OUT UINTN              *BufferSize,
+  IN     VOID               *Buffer
+  );
+
+//
+// Helpers shared by the EFI_FILE_PROTOCOL member functions.
+//
+
+EFI_STATUS
+VirtioFsNewFile (
+  IN OUT VIRTIO_FS          *VirtioFs,
+  IN     CHAR8              *CanonicalPathname,
+  IN     UINT64             NodeId,
+  IN     UINT64             FuseHandle,
+  IN     BOOLEAN            IsDirectory,
+  IN     BOOLEAN            IsOpenForWriting,
+  OUT    EFI_FILE_PROTOCOL  **NewHandle
+  );
+
+VOID
+VirtioFsDropDirents (
+  IN OUT VIRTIO_FS_FILE  *VirtioFsFile
+  );
+
+#endif // _VIRTIO_FS_DXE_H_
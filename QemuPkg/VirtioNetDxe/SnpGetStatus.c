@@ -136,15 +136,25 @@ VirtioNetGetStatus (
       ASSERT (DescIdx < (UINT32)(2 * Dev->TxMaxPending - 1));
 
       //
-      // get the device address that has been enqueued for the caller's
-      // transmit buffer
+      // now this descriptor can be used again to enqueue a transmit buffer
       //
-      DeviceAddress = Dev->TxRing.Desc[DescIdx + 1].Addr;
+      Dev->TxFreeStack[--Dev->TxCurPending] = (UINT16)DescIdx;
+
+      if (Dev->TxPool != NULL) {
+        //
+        // The packet was copied to the slot of the descriptor chain; the
+        // slot is free again, too.
+        //
+        *TxBuf = Dev->TxPoolOrigBuf[DescIdx / 2];
+        Status = EFI_SUCCESS;
+        goto Exit;
+      }
 
       //
-      // now this descriptor can be used again to enqueue a transmit buffer
+      // get the device address that has been enqueued for the caller's
+      // transmit buffer
       //
-      Dev->TxFreeStack[--Dev->TxCurPending] = (UINT16)DescIdx;
+      DeviceAddress = Dev->TxRing.Desc[DescIdx + 1].Addr;
 
       //
       // Unmap the device address and perform the reverse mapping to find the
@@ -14,6 +14,7 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
 #include "VirtioNet.h"
@@ -123,6 +124,104 @@ ReleaseQueue:
   return Status;
 }
 
+/**
+  Allocate and map the TX buffer pool, with one slot per possibly pending TX
+  packet, and point the tail descriptor of each TX descriptor chain at its
+  slot for good.
+
+  VirtioNetTransmit() then copies each packet into the slot of its chain, and
+  VirtioNetGetStatus() recycles the slot, without allocating, mapping or
+  tracking anything per packet. On confidential computing guests, where every
+  mapping of a caller buffer would cost a bounce copy anyway, this is strictly
+  cheaper.
+
+  This function may only be called by VirtioNetInitTx(), after the TX
+  descriptor chains have been laid out.
+
+  @param[in,out] Dev            The VNET_DEV driver instance about to enter
+                                the EfiSimpleNetworkInitialized state.
+
+  @retval EFI_OUT_OF_RESOURCES  Failed to allocate the array that tracks the
+                                caller buffers of pending packets.
+  @return                       Status codes from VIRTIO_DEVICE_PROTOCOL.
+                                AllocateSharedPages() or
+                                VirtioMapAllBytesInSharedBuffer()
+  @retval EFI_SUCCESS           TX buffer pool set up.
+*/
+STATIC
+EFI_STATUS
+VirtioNetInitTxPool (
+  IN OUT VNET_DEV  *Dev
+  )
+{
+  EFI_STATUS            Status;
+  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+  VOID                  *TxPoolBuffer;
+  UINTN                 PktIdx;
+
+  Dev->TxPoolSlotSize = ALIGN_VALUE (
+                          Dev->Snm.MediaHeaderSize + Dev->Snm.MaxPacketSize,
+                          VNET_TX_POOL_SLOT_ALIGN
+                          );
+  Dev->TxPoolNrPages = EFI_SIZE_TO_PAGES (
+                         (UINTN)Dev->TxPoolSlotSize * Dev->TxMaxPending
+                         );
+
+  Dev->TxPoolOrigBuf = AllocateZeroPool (
+                         Dev->TxMaxPending * sizeof *Dev->TxPoolOrigBuf
+                         );
+  if (Dev->TxPoolOrigBuf == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = Dev->VirtIo->AllocateSharedPages (
+                          Dev->VirtIo,
+                          Dev->TxPoolNrPages,
+                          &TxPoolBuffer
+                          );
+  if (EFI_ERROR (Status)) {
+    goto FreeTxPoolOrigBuf;
+  }
+
+  //
+  // The host only reads the slots, but we rewrite them for every packet, so
+  // map them as a common buffer once.
+  //
+  Status = VirtioMapAllBytesInSharedBuffer (
+             Dev->VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             TxPoolBuffer,
+             EFI_PAGES_TO_SIZE (Dev->TxPoolNrPages),
+             &DeviceAddress,
+             &Dev->TxPoolMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeTxPoolBuffer;
+  }
+
+  Dev->TxPool = TxPoolBuffer;
+
+  for (PktIdx = 0; PktIdx < Dev->TxMaxPending; ++PktIdx) {
+    Dev->TxRing.Desc[2 * PktIdx + 1].Addr = DeviceAddress +
+                                            PktIdx * Dev->TxPoolSlotSize;
+  }
+
+  return EFI_SUCCESS;
+
+FreeTxPoolBuffer:
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 Dev->TxPoolNrPages,
+                 TxPoolBuffer
+                 );
+
+FreeTxPoolOrigBuf:
+  FreePool (Dev->TxPoolOrigBuf);
+  Dev->TxPoolOrigBuf = NULL;
+
+  return Status;
+}
+
 /**
   Set up static scaffolding for the VirtioNetTransmit() and
   VirtioNetGetStatus() SNP methods.
@@ -135,6 +234,7 @@ ReleaseQueue:
   - tracking of heads of free descriptor chains from the above,
   - one common virtio-net request header (never modified by the host) for all
     pending TX packets,
+  - with PcdVirtioNetTxPool, a premapped buffer pool for the packets,
   - select polling over TX interrupt.
 
   @param[in,out] Dev       The VNET_DEV driver instance about to enter the
@@ -155,7 +255,6 @@ VirtioNetInitTx (
   IN OUT VNET_DEV  *Dev
   )
 {
-  UINTN                 TxSharedReqSize;
   UINTN                 PktIdx;
   EFI_STATUS            Status;
   EFI_PHYSICAL_ADDRESS  DeviceAddress;
@@ -174,13 +273,18 @@ VirtioNetInitTx (
     return EFI_OUT_OF_RESOURCES;
   }
 
-  Dev->TxBufCollection = OrderedCollectionInit (
-                           VirtioNetTxBufMapInfoCompare,
-                           VirtioNetTxBufDeviceAddressCompare
-                           );
-  if (Dev->TxBufCollection == NULL) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto FreeTxFreeStack;
+  Dev->TxPool          = NULL;
+  Dev->TxPoolOrigBuf   = NULL;
+  Dev->TxBufCollection = NULL;
+  if (!PcdGetBool (PcdVirtioNetTxPool)) {
+    Dev->TxBufCollection = OrderedCollectionInit (
+                             VirtioNetTxBufMapInfoCompare,
+                             VirtioNetTxBufDeviceAddressCompare
+                             );
+    if (Dev->TxBufCollection == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto FreeTxFreeStack;
+    }
   }
 
   //
@@ -212,14 +316,6 @@ VirtioNetInitTx (
 
   Dev->TxSharedReq = TxSharedReqBuffer;
 
-  //
-  // In VirtIo 1.0, the NumBuffers field is mandatory. In 0.9.5, it depends on
-  // VIRTIO_NET_F_MRG_RXBUF, which we never negotiate.
-  //
-  TxSharedReqSize = (Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) ?
-                    sizeof (Dev->TxSharedReq->V0_9_5) :
-                    sizeof *Dev->TxSharedReq;
-
   for (PktIdx = 0; PktIdx < Dev->TxMaxPending; ++PktIdx) {
     UINT16  DescIdx;
 
@@ -231,7 +327,7 @@ VirtioNetInitTx (
     // (unmodified by the host) virtio-net request header.
     //
     Dev->TxRing.Desc[DescIdx].Addr  = DeviceAddress;
-    Dev->TxRing.Desc[DescIdx].Len   = (UINT32)TxSharedReqSize;
+    Dev->TxRing.Desc[DescIdx].Len   = Dev->NetReqSize;
     Dev->TxRing.Desc[DescIdx].Flags = VRING_DESC_F_NEXT;
     Dev->TxRing.Desc[DescIdx].Next  = (UINT16)(DescIdx + 1);
 
@@ -249,10 +345,18 @@ VirtioNetInitTx (
   Dev->TxSharedReq->V0_9_5.GsoType = VIRTIO_NET_HDR_GSO_NONE;
 
   //
-  // For VirtIo 1.0 only -- the field exists, but it is unused
+  // For VirtIo 1.0 and VIRTIO_NET_F_MRG_RXBUF only -- the field exists, but it
+  // is unused
   //
   Dev->TxSharedReq->NumBuffers = 0;
 
+  if (PcdGetBool (PcdVirtioNetTxPool)) {
+    Status = VirtioNetInitTxPool (Dev);
+    if (EFI_ERROR (Status)) {
+      goto UnmapTxSharedReq;
+    }
+  }
+
   //
   // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
   //
@@ -267,6 +371,9 @@ VirtioNetInitTx (
 
   return EFI_SUCCESS;
 
+UnmapTxSharedReq:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxSharedReqMap);
+
 FreeTxSharedReqBuffer:
   Dev->VirtIo->FreeSharedPages (
                  Dev->VirtIo,
@@ -275,7 +382,9 @@ FreeTxSharedReqBuffer:
                  );
 
 UninitTxBufCollection:
-  OrderedCollectionUninit (Dev->TxBufCollection);
+  if (Dev->TxBufCollection != NULL) {
+    OrderedCollectionUninit (Dev->TxBufCollection);
+  }
 
 FreeTxFreeStack:
   FreePool (Dev->TxFreeStack);
@@ -294,7 +403,8 @@ FreeTxFreeStack:
     packet data into,
   - select polling over RX interrupt,
   - fully populate the RX queue with a static pattern of virtio descriptor
-    chains.
+    chains; with VIRTIO_NET_F_MRG_RXBUF, each chain is a single descriptor,
+    so the queue holds twice as many buffers.
 
   @param[in,out] Dev       The VNET_DEV driver instance about to enter the
                            EfiSimpleNetworkInitialized state.
@@ -313,8 +423,7 @@ VirtioNetInitRx (
   )
 {
   EFI_STATUS            Status;
-  UINTN                 VirtioNetReqSize;
-  UINTN                 RxBufSize;
+  UINT32                RxTailLen;
   UINT16                RxAlwaysPending;
   UINTN                 PktIdx;
   UINT16                DescIdx;
@@ -323,27 +432,33 @@ VirtioNetInitRx (
   VOID                  *RxBuffer;
 
   //
-  // In VirtIo 1.0, the NumBuffers field is mandatory. In 0.9.5, it depends on
-  // VIRTIO_NET_F_MRG_RXBUF, which we never negotiate.
+  // Each RX buffer receives the virtio-net request header, plus the network
+  // data (which consists of Ethernet header and Ethernet payload).
   //
-  VirtioNetReqSize = (Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) ?
-                     sizeof (VIRTIO_NET_REQ) :
-                     sizeof (VIRTIO_1_0_NET_REQ);
+  Dev->RxBufSize = Dev->NetReqSize +
+                   (Dev->Snm.MediaHeaderSize + Dev->Snm.MaxPacketSize);
 
   //
-  // For each incoming packet we must supply two descriptors:
-  // - the recipient for the virtio-net request header, plus
-  // - the recipient for the network data (which consists of Ethernet header
-  //   and Ethernet payload).
+  // Without VIRTIO_NET_F_MRG_RXBUF, the device expects the header and the data
+  // in separate descriptors, so we must supply two descriptors per buffer.
+  // With it, the header is simply at the start of the first buffer of each
+  // packet, and one descriptor per buffer suffices.
   //
-  RxBufSize = VirtioNetReqSize +
-              (Dev->Snm.MediaHeaderSize + Dev->Snm.MaxPacketSize);
+  if ((Dev->Features & VIRTIO_NET_F_MRG_RXBUF) != 0) {
+    Dev->RxDescPerBuf = 1;
+    RxTailLen         = Dev->RxBufSize;
+  } else {
+    Dev->RxDescPerBuf = 2;
+    RxTailLen         = Dev->RxBufSize - Dev->NetReqSize;
+  }
 
   //
-  // Limit the number of pending RX packets if the queue is big. The division
-  // by two is due to the above "two descriptors per packet" trait.
+  // Post as many RX buffers as the queue can take, unless it is really big.
   //
-  RxAlwaysPending = (UINT16)MIN (Dev->RxRing.QueueSize / 2, VNET_MAX_PENDING);
+  RxAlwaysPending = (UINT16)MIN (
+                              Dev->RxRing.QueueSize / Dev->RxDescPerBuf,
+                              VNET_MAX_PENDING
+                              );
 
   //
   // The RxBuf is shared between guest and hypervisor, use
@@ -351,7 +466,7 @@ VirtioNetInitRx (
   // BusMasterCommonBuffer so that it can be accessed by both guest and
   // hypervisor.
   //
-  NumBytes          = RxAlwaysPending * RxBufSize;
+  NumBytes          = RxAlwaysPending * Dev->RxBufSize;
   Dev->RxBufNrPages = EFI_SIZE_TO_PAGES (NumBytes);
   Status            = Dev->VirtIo->AllocateSharedPages (
                                      Dev->VirtIo,
@@ -393,8 +508,8 @@ VirtioNetInitRx (
   *Dev->RxRing.Avail.Flags = (UINT16)VRING_AVAIL_F_NO_INTERRUPT;
 
   //
-  // now set up a separate, two-part descriptor chain for each RX packet, and
-  // link each chain into (from) the available ring as well
+  // now set up a separate, one- or two-part descriptor chain for each RX
+  // buffer, and link each chain into (from) the available ring as well
   //
   DescIdx            = 0;
   RxBufDeviceAddress = Dev->RxBufDeviceBase;
@@ -408,14 +523,16 @@ VirtioNetInitRx (
     //
     // virtio-0.9.5, 2.4.1.1 Placing Buffers into the Descriptor Table
     //
-    Dev->RxRing.Desc[DescIdx].Addr  = RxBufDeviceAddress;
-    Dev->RxRing.Desc[DescIdx].Len   = (UINT32)VirtioNetReqSize;
-    Dev->RxRing.Desc[DescIdx].Flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
-    Dev->RxRing.Desc[DescIdx].Next  = (UINT16)(DescIdx + 1);
-    RxBufDeviceAddress             += Dev->RxRing.Desc[DescIdx++].Len;
+    if (Dev->RxDescPerBuf == 2) {
+      Dev->RxRing.Desc[DescIdx].Addr  = RxBufDeviceAddress;
+      Dev->RxRing.Desc[DescIdx].Len   = Dev->NetReqSize;
+      Dev->RxRing.Desc[DescIdx].Flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
+      Dev->RxRing.Desc[DescIdx].Next  = (UINT16)(DescIdx + 1);
+      RxBufDeviceAddress             += Dev->RxRing.Desc[DescIdx++].Len;
+    }
 
     Dev->RxRing.Desc[DescIdx].Addr  = RxBufDeviceAddress;
-    Dev->RxRing.Desc[DescIdx].Len   = (UINT32)(RxBufSize - VirtioNetReqSize);
+    Dev->RxRing.Desc[DescIdx].Len   = RxTailLen;
     Dev->RxRing.Desc[DescIdx].Flags = VRING_DESC_F_WRITE;
     RxBufDeviceAddress             += Dev->RxRing.Desc[DescIdx++].Len;
   }
@@ -557,8 +674,19 @@ VirtioNetInitialize (
     !!(Features & VIRTIO_NET_F_STATUS)
     );
 
+  //
+  // VIRTIO_NET_F_MRG_RXBUF lets us post single-descriptor RX buffers, and
+  // VIRTIO_NET_F_GUEST_CSUM spares the host from checksumming packets that it
+  // forwards from a local source; VirtioNetReceive() completes them instead.
+  // We never offload TX checksums: SNP has no interface for that, so the
+  // packets handed to VirtioNetTransmit() are always complete.
+  //
+  // VIRTIO_F_RING_PACKED is deliberately not negotiated; this driver drives
+  // the split ring by hand (see "Split ring only" in TechNotes.txt).
+  //
   Features &= VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_F_VERSION_1 |
-              VIRTIO_F_IOMMU_PLATFORM;
+              VIRTIO_F_IOMMU_PLATFORM | VIRTIO_NET_F_MRG_RXBUF |
+              VIRTIO_NET_F_GUEST_CSUM;
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
@@ -605,6 +733,16 @@ VirtioNetInitialize (
     }
   }
 
+  //
+  // In VirtIo 1.0, the NumBuffers field is mandatory. In 0.9.5, it depends on
+  // VIRTIO_NET_F_MRG_RXBUF.
+  //
+  Dev->Features   = Features;
+  Dev->NetReqSize = ((Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) &&
+                     ((Features & VIRTIO_NET_F_MRG_RXBUF) == 0)) ?
+                    sizeof (VIRTIO_NET_REQ) :
+                    sizeof (VIRTIO_1_0_NET_REQ);
+
   //
   // step 6 -- virtio-net initialization complete
   //
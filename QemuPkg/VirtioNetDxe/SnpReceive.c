@@ -15,6 +15,65 @@
 
 #include "VirtioNet.h"
 
+/**
+  Complete the partial checksum of a received packet, as requested by the
+  VIRTIO_NET_HDR_F_NEEDS_CSUM flag in its virtio-net request header.
+
+  The host has stored the checksum of the pseudo-header at CsumOffset bytes
+  after CsumStart; the checksum needs to be computed over the bytes from
+  CsumStart to the end of the packet, and stored at the same location.
+
+  @param[in] NetReq     The virtio-net request header of the packet.
+  @param[in,out] Packet The packet data, starting with the Ethernet header.
+  @param[in] PacketLen  The length of Packet in bytes.
+
+  @retval EFI_SUCCESS       The checksum has been completed.
+  @retval EFI_DEVICE_ERROR  The checksum location is out of the packet.
+**/
+STATIC
+EFI_STATUS
+VirtioNetCompleteChecksum (
+  IN     CONST VIRTIO_NET_REQ  *NetReq,
+  IN OUT UINT8                 *Packet,
+  IN     UINT32                PacketLen
+  )
+{
+  UINT32  CsumStart;
+  UINT32  CsumOffset;
+  UINT32  Sum;
+  UINT32  Idx;
+  UINT16  Csum;
+
+  CsumStart  = NetReq->CsumStart;
+  CsumOffset = NetReq->CsumOffset;
+  if ((CsumStart > PacketLen) ||
+      (CsumOffset + sizeof Csum > PacketLen - CsumStart))
+  {
+    return EFI_DEVICE_ERROR;
+  }
+
+  //
+  // RFC 1071 one's complement sum, in network byte order, of 16-bit words
+  //
+  Sum = 0;
+  for (Idx = CsumStart; Idx + 1 < PacketLen; Idx += 2) {
+    Sum += (UINT32)((Packet[Idx] << 8) | Packet[Idx + 1]);
+  }
+
+  if (Idx < PacketLen) {
+    Sum += (UINT32)(Packet[Idx] << 8);
+  }
+
+  while ((Sum >> 16) != 0) {
+    Sum = (Sum & 0xFFFF) + (Sum >> 16);
+  }
+
+  Csum                                = (UINT16)~Sum;
+  Packet[CsumStart + CsumOffset]     = (UINT8)(Csum >> 8);
+  Packet[CsumStart + CsumOffset + 1] = (UINT8)Csum;
+  return EFI_SUCCESS;
+}
+
 /**
   Receives a packet from a network interface.
 
@@ -64,18 +123,22 @@ VirtioNetReceive (
   OUT UINT16                      *Protocol   OPTIONAL
   )
 {
-  VNET_DEV    *Dev;
-  EFI_TPL     OldTpl;
-  EFI_STATUS  Status;
-  UINT16      RxCurUsed;
-  UINT16      UsedElemIdx;
-  UINT32      DescIdx;
-  UINT32      RxLen;
-  UINTN       OrigBufferSize;
-  UINT8       *RxPtr;
-  UINT16      AvailIdx;
-  EFI_STATUS  NotifyStatus;
-  UINTN       RxBufOffset;
+  VNET_DEV            *Dev;
+  EFI_TPL             OldTpl;
+  EFI_STATUS          Status;
+  UINT16              RxCurUsed;
+  UINT16              UsedElemIdx;
+  UINT32              DescIdx;
+  UINT32              RxLen;
+  UINTN               OrigBufferSize;
+  UINT8               *RxPtr;
+  UINT16              AvailIdx;
+  EFI_STATUS          NotifyStatus;
+  VIRTIO_1_0_NET_REQ  NetReq;
+  UINT16              NumBuffers;
+  UINT16              BufIdx;
+  UINT32              BufLen;
+  UINT8               *Dest;
 
   if ((This == NULL) || (BufferSize == NULL) || (Buffer == NULL)) {
     return EFI_INVALID_PARAMETER;
@@ -110,15 +173,51 @@ VirtioNetReceive (
   DescIdx     = Dev->RxRing.Used.UsedElem[UsedElemIdx].Id;
   RxLen       = Dev->RxRing.Used.UsedElem[UsedElemIdx].Len;
 
+  //
+  // The buffers are laid out contiguously in RxBuf, each one starting with
+  // room for the virtio-net request header; see VirtioNetInitRx().
+  //
+  RxPtr = Dev->RxBuf + (UINTN)(DescIdx / Dev->RxDescPerBuf) * Dev->RxBufSize;
+
   //
   // the virtio-net request header must be complete; we skip it
   //
-  ASSERT (RxLen >= Dev->RxRing.Desc[DescIdx].Len);
-  RxLen -= Dev->RxRing.Desc[DescIdx].Len;
+  ASSERT (RxLen >= Dev->NetReqSize);
+  RxLen -= Dev->NetReqSize;
   //
   // the host must not have filled in more data than requested
   //
-  ASSERT (RxLen <= Dev->RxRing.Desc[DescIdx + 1].Len);
+  ASSERT (RxLen <= Dev->RxBufSize - Dev->NetReqSize);
+
+  CopyMem (&NetReq, RxPtr, Dev->NetReqSize);
+  RxPtr += Dev->NetReqSize;
+  BufLen = RxLen;
+
+  //
+  // With VIRTIO_NET_F_MRG_RXBUF, the packet may continue in further buffers,
+  // which the host has placed on the Used Ring along with the first one. They
+  // carry no request header.
+  //
+  NumBuffers = 1;
+  if ((Dev->Features & VIRTIO_NET_F_MRG_RXBUF) != 0) {
+    NumBuffers = NetReq.NumBuffers;
+    if (NumBuffers == 0) {
+      NumBuffers = 1;
+      Status     = EFI_DEVICE_ERROR;
+      goto RecycleDesc; // drop malformed packet
+    }
+
+    if (NumBuffers > (UINT16)(RxCurUsed - Dev->RxLastUsed)) {
+      Status = EFI_NOT_READY;
+      goto Exit; // keep the partially used buffers
+    }
+
+    for (BufIdx = 1; BufIdx < NumBuffers; ++BufIdx) {
+      UsedElemIdx = (UINT16)(Dev->RxLastUsed + BufIdx) % Dev->RxRing.QueueSize;
+      ASSERT (Dev->RxRing.Used.UsedElem[UsedElemIdx].Len <= Dev->RxBufSize);
+      RxLen += Dev->RxRing.Used.UsedElem[UsedElemIdx].Len;
+    }
+  }
 
   OrigBufferSize = *BufferSize;
   *BufferSize    = RxLen;
@@ -137,10 +236,30 @@ VirtioNetReceive (
     *HeaderSize = Dev->Snm.MediaHeaderSize;
   }
 
-  RxBufOffset = (UINTN)(Dev->RxRing.Desc[DescIdx + 1].Addr -
-                        Dev->RxBufDeviceBase);
-  RxPtr = Dev->RxBuf + RxBufOffset;
-  CopyMem (Buffer, RxPtr, RxLen);
+  CopyMem (Buffer, RxPtr, BufLen);
+  Dest = (UINT8 *)Buffer + BufLen;
+  for (BufIdx = 1; BufIdx < NumBuffers; ++BufIdx) {
+    UsedElemIdx = (UINT16)(Dev->RxLastUsed + BufIdx) % Dev->RxRing.QueueSize;
+    BufLen      = Dev->RxRing.Used.UsedElem[UsedElemIdx].Len;
+    CopyMem (
+      Dest,
+      Dev->RxBuf + (UINTN)Dev->RxRing.Used.UsedElem[UsedElemIdx].Id *
+      Dev->RxBufSize,
+      BufLen
+      );
+    Dest += BufLen;
+  }
+
+  if (((Dev->Features & VIRTIO_NET_F_GUEST_CSUM) != 0) &&
+      ((NetReq.V0_9_5.Flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0))
+  {
+    Status = VirtioNetCompleteChecksum (&NetReq.V0_9_5, Buffer, RxLen);
+    if (EFI_ERROR (Status)) {
+      goto RecycleDesc; // drop packet that we cannot make valid
+    }
+  }
+
+  RxPtr = Buffer;
 
   if (DestAddr != NULL) {
     CopyMem (DestAddr, RxPtr, SIZE_OF_VNET (Mac));
@@ -163,14 +282,16 @@ VirtioNetReceive (
   Status = EFI_SUCCESS;
 
 RecycleDesc:
-  ++Dev->RxLastUsed;
-
   //
   // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
   //
-  AvailIdx                                                   = *Dev->RxRing.Avail.Idx;
-  Dev->RxRing.Avail.Ring[AvailIdx++ % Dev->RxRing.QueueSize] =
-    (UINT16)DescIdx;
+  AvailIdx = *Dev->RxRing.Avail.Idx;
+  for (BufIdx = 0; BufIdx < NumBuffers; ++BufIdx) {
+    UsedElemIdx = Dev->RxLastUsed++ % Dev->RxRing.QueueSize;
+    DescIdx     = Dev->RxRing.Used.UsedElem[UsedElemIdx].Id;
+    Dev->RxRing.Avail.Ring[AvailIdx++ % Dev->RxRing.QueueSize] =
+      (UINT16)DescIdx;
+  }
 
   MemoryFence ();
   *Dev->RxRing.Avail.Idx = AvailIdx;
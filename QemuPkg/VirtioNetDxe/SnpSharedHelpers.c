@@ -67,19 +67,31 @@ VirtioNetShutdownTx (
                  Dev->TxSharedReq
                  );
 
-  for (Entry = OrderedCollectionMin (Dev->TxBufCollection);
-       Entry != NULL;
-       Entry = Entry2)
-  {
-    Entry2 = OrderedCollectionNext (Entry);
-    OrderedCollectionDelete (Dev->TxBufCollection, Entry, &UserStruct);
-    TxBufMapInfo = UserStruct;
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, TxBufMapInfo->BufMap);
-    FreePool (TxBufMapInfo);
+  if (Dev->TxPool != NULL) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxPoolMap);
+    Dev->VirtIo->FreeSharedPages (
+                   Dev->VirtIo,
+                   Dev->TxPoolNrPages,
+                   Dev->TxPool
+                   );
+    FreePool (Dev->TxPoolOrigBuf);
+    Dev->TxPool        = NULL;
+    Dev->TxPoolOrigBuf = NULL;
+  } else {
+    for (Entry = OrderedCollectionMin (Dev->TxBufCollection);
+         Entry != NULL;
+         Entry = Entry2)
+    {
+      Entry2 = OrderedCollectionNext (Entry);
+      OrderedCollectionDelete (Dev->TxBufCollection, Entry, &UserStruct);
+      TxBufMapInfo = UserStruct;
+      Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, TxBufMapInfo->BufMap);
+      FreePool (TxBufMapInfo);
+    }
+
+    OrderedCollectionUninit (Dev->TxBufCollection);
   }
 
-  OrderedCollectionUninit (Dev->TxBufCollection);
-
   FreePool (Dev->TxFreeStack);
 }
 
@@ -142,26 +142,43 @@ VirtioNetTransmit (
     ASSERT ((UINTN)(Ptr - (UINT8 *)Buffer) == Dev->Snm.MediaHeaderSize);
   }
 
-  //
-  // Map the transmit buffer system physical address to device address.
-  //
-  Status = VirtioNetMapTxBuf (
-             Dev,
-             Buffer,
-             BufferSize,
-             &DeviceAddress
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto Exit;
+  DescIdx = Dev->TxFreeStack[Dev->TxCurPending];
+
+  if (Dev->TxPool != NULL) {
+    //
+    // Copy the packet to the premapped slot that the tail descriptor points
+    // to, and remember the caller's buffer for VirtioNetGetStatus().
+    //
+    ASSERT (BufferSize <= Dev->TxPoolSlotSize);
+    CopyMem (
+      Dev->TxPool + (DescIdx / 2) * Dev->TxPoolSlotSize,
+      Buffer,
+      BufferSize
+      );
+    Dev->TxPoolOrigBuf[DescIdx / 2] = Buffer;
+  } else {
+    //
+    // Map the transmit buffer system physical address to device address.
+    //
+    Status = VirtioNetMapTxBuf (
+               Dev,
+               Buffer,
+               BufferSize,
+               &DeviceAddress
+               );
+    if (EFI_ERROR (Status)) {
+      Status = EFI_DEVICE_ERROR;
+      goto Exit;
+    }
+
+    Dev->TxRing.Desc[DescIdx + 1].Addr = DeviceAddress;
   }
 
   //
   // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
   //
-  DescIdx                            = Dev->TxFreeStack[Dev->TxCurPending++];
-  Dev->TxRing.Desc[DescIdx + 1].Addr = DeviceAddress;
-  Dev->TxRing.Desc[DescIdx + 1].Len  = (UINT32)BufferSize;
+  Dev->TxCurPending++;
+  Dev->TxRing.Desc[DescIdx + 1].Len = (UINT32)BufferSize;
 
   //
   // the available index is never written by the host, we can read it back
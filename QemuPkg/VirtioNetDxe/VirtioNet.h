@@ -25,9 +25,16 @@
 #define VNET_SIG  SIGNATURE_32 ('V', 'N', 'E', 'T')
 
 //
-// maximum number of pending packets, separately for each direction
+// Maximum number of pending packets, separately for each direction. The
+// actual limits follow the queue sizes of the device; this only caps the
+// memory spent on them. (QEMU offers queues of up to 1024 descriptors.)
 //
-#define VNET_MAX_PENDING  64
+#define VNET_MAX_PENDING  1024
+
+//
+// alignment of the slots in the TX buffer pool (see PcdVirtioNetTxPool)
+//
+#define VNET_TX_POOL_SLOT_ALIGN  64
 
 //
 // State diagram:
@@ -76,11 +83,15 @@ typedef struct {
   EFI_EVENT                      ExitBoot;       // VirtioNetSnpPopulate
   EFI_DEVICE_PATH_PROTOCOL       *MacDevicePath; // VirtioNetDriverBindingStart
   EFI_HANDLE                     MacHandle;      // VirtioNetDriverBindingStart
+  UINT64                         Features;       // VirtioNetInitialize
+  UINT32                         NetReqSize;     // VirtioNetInitialize
 
   VRING                          RxRing;          // VirtioNetInitRing
   VOID                           *RxRingMap;      // VirtioRingMap and
                                                   // VirtioNetInitRing
   UINT8                          *RxBuf;          // VirtioNetInitRx
+  UINT32                         RxBufSize;       // VirtioNetInitRx
+  UINT16                         RxDescPerBuf;    // VirtioNetInitRx
   UINT16                         RxLastUsed;      // VirtioNetInitRx
   UINTN                          RxBufNrPages;    // VirtioNetInitRx
   EFI_PHYSICAL_ADDRESS           RxBufDeviceBase; // VirtioNetInitRx
@@ -96,6 +107,15 @@ typedef struct {
   VOID                           *TxSharedReqMap;  // VirtioNetInitTx
   UINT16                         TxLastUsed;       // VirtioNetInitTx
   ORDERED_COLLECTION             *TxBufCollection; // VirtioNetInitTx
+  //
+  // With PcdVirtioNetTxPool, each pending TX packet is copied to its own slot
+  // of TxPool, rather than mapped for the device. TxPool is NULL otherwise.
+  //
+  UINT8                          *TxPool;          // VirtioNetInitTxPool
+  UINTN                          TxPoolNrPages;    // VirtioNetInitTxPool
+  VOID                           *TxPoolMap;       // VirtioNetInitTxPool
+  UINT32                         TxPoolSlotSize;   // VirtioNetInitTxPool
+  VOID                           **TxPoolOrigBuf;  // VirtioNetInitTxPool
 } VNET_DEV;
 
 //
@@ -19,6 +19,7 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 #include <Library/VirtioLib.h>
@@ -89,45 +90,218 @@ VirtioRngGetInfo (
 }
 
 /**
-  Produces and returns an RNG value using either the default or specified RNG
-  algorithm.
+  Ask the host to fill the free part of the entropy pool, without waiting for
+  the request to complete.
 
-  @param[in]  This                    A pointer to the EFI_RNG_PROTOCOL
-                                      instance.
-  @param[in]  RNGAlgorithm            A pointer to the EFI_RNG_ALGORITHM that
-                                      identifies the RNG algorithm to use. May
-                                      be NULL in which case the function will
-                                      use its default RNG algorithm.
-  @param[in]  RNGValueLength          The length in bytes of the memory buffer
-                                      pointed to by RNGValue. The driver shall
-                                      return exactly this numbers of bytes.
-  @param[out] RNGValue                A caller-allocated memory buffer filled
-                                      by the driver with the resulting RNG
-                                      value.
+  Only one request may be in flight on the virtqueue at any time; the caller
+  must have reaped the previous refill with VirtioRngReap().
 
-  @retval EFI_SUCCESS                 The RNG value was returned successfully.
-  @retval EFI_UNSUPPORTED             The algorithm specified by RNGAlgorithm
-                                      is not supported by this driver.
-  @retval EFI_DEVICE_ERROR            An RNG value could not be retrieved due
-                                      to a hardware or firmware error.
-  @retval EFI_NOT_READY               There is not enough random data available
-                                      to satisfy the length requested by
-                                      RNGValueLength.
-  @retval EFI_INVALID_PARAMETER       RNGValue is NULL or RNGValueLength is
-                                      zero.
+  @param[in,out] Dev  The device whose entropy pool should be refilled.
 
+  @return              Error codes from VirtioSubmit().
+  @retval EFI_SUCCESS  The refill request is in flight.
 **/
 STATIC
 EFI_STATUS
-EFIAPI
-VirtioRngGetRNG (
-  IN EFI_RNG_PROTOCOL   *This,
-  IN EFI_RNG_ALGORITHM  *RNGAlgorithm  OPTIONAL,
-  IN UINTN              RNGValueLength,
-  OUT UINT8             *RNGValue
+VirtioRngPrefetch (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  DESC_INDICES  Indices;
+  EFI_STATUS    Status;
+
+  ASSERT (!Dev->RefillInFlight);
+  ASSERT (Dev->PoolAvail < Dev->PoolSize);
+
+  //
+  // The device writes the new bytes after the ones still in the pool. Until
+  // the request completes, VirtioRngGetFromPool() only consumes bytes below
+  // RefillOffset.
+  //
+  Dev->RefillOffset = Dev->PoolAvail;
+
+  //
+  // Due to our lock-step progress, this is where the host will produce the
+  // used element; see VirtioFlush().
+  //
+  Dev->LastUsedIdx = Dev->Ring.Packed ? Dev->Ring.UsedCount : *Dev->Ring.Avail.Idx;
+
+  VirtioPrepare (&Dev->Ring, &Indices);
+  VirtioAppendDesc (
+    &Dev->Ring,
+    Dev->PoolDevAddr + Dev->RefillOffset,
+    Dev->PoolSize - Dev->RefillOffset,
+    VRING_DESC_F_WRITE,
+    &Indices
+    );
+
+  Status = VirtioSubmit (Dev->VirtIo, 0, &Dev->Ring, &Indices);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Dev->RefillInFlight = TRUE;
+  return EFI_SUCCESS;
+}
+
+/**
+  Collect the completion of the entropy pool refill that is in flight, if any,
+  and add the bytes that the host produced to the pool.
+
+  @param[in,out] Dev   The device whose refill should be collected.
+
+  @param[in] Wait      Whether to wait until the host completes the refill.
+
+  @retval EFI_SUCCESS       No refill is in flight (any longer).
+  @retval EFI_NOT_READY     Wait is FALSE, and the host has not completed the
+                            refill yet.
+  @retval EFI_DEVICE_ERROR  The host completed the refill without producing
+                            any bytes.
+**/
+STATIC
+EFI_STATUS
+VirtioRngReap (
+  IN OUT VIRTIO_RNG_DEV  *Dev,
+  IN     BOOLEAN         Wait
+  )
+{
+  UINT16  HeadDescIdx;
+  UINT32  Len;
+
+  if (!Dev->RefillInFlight) {
+    return EFI_SUCCESS;
+  }
+
+  if (Wait) {
+    VirtioWaitUsed (&Dev->Ring, Dev->LastUsedIdx);
+  }
+
+  if (EFI_ERROR (
+        VirtioGetNextUsed (
+          &Dev->Ring,
+          &Dev->LastUsedIdx,
+          &HeadDescIdx,
+          &Len
+          )
+        ))
+  {
+    ASSERT (!Wait);
+    return EFI_NOT_READY;
+  }
+
+  ASSERT (HeadDescIdx == 0);
+  Dev->RefillInFlight = FALSE;
+
+  Len = MIN (Len, Dev->PoolSize - Dev->RefillOffset);
+  if (Len == 0) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  //
+  // If bytes have been consumed while the refill was in flight, close the gap
+  // between the remaining bytes and the new ones, and scrub the stale copy.
+  //
+  if (Dev->PoolAvail < Dev->RefillOffset) {
+    CopyMem (
+      Dev->Pool + Dev->PoolAvail,
+      Dev->Pool + Dev->RefillOffset,
+      Len
+      );
+    ZeroMem (
+      Dev->Pool + Dev->PoolAvail + Len,
+      Dev->RefillOffset - Dev->PoolAvail
+      );
+  }
+
+  Dev->PoolAvail += Len;
+  return EFI_SUCCESS;
+}
+
+/**
+  Serve a small RNG request from the entropy pool of the device, and prefetch
+  more entropy in the background if the pool drops to its low-water mark.
+
+  @param[in,out] Dev             The device to take the entropy from.
+
+  @param[in] RNGValueLength      The number of bytes to return. Must not
+                                 exceed Dev->PoolSize.
+
+  @param[out] RNGValue           The buffer to fill with entropy.
+
+  @retval EFI_SUCCESS       RNGValue has been filled.
+  @retval EFI_DEVICE_ERROR  The pool could not be refilled.
+**/
+STATIC
+EFI_STATUS
+VirtioRngGetFromPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev,
+  IN     UINTN           RNGValueLength,
+  OUT    UINT8           *RNGValue
+  )
+{
+  EFI_STATUS  Status;
+
+  ASSERT (RNGValueLength <= Dev->PoolSize);
+
+  Status = VirtioRngReap (Dev, FALSE);
+  if (Status == EFI_DEVICE_ERROR) {
+    return Status;
+  }
+
+  while (Dev->PoolAvail < RNGValueLength) {
+    if (!Dev->RefillInFlight && EFI_ERROR (VirtioRngPrefetch (Dev))) {
+      return EFI_DEVICE_ERROR;
+    }
+
+    Status = VirtioRngReap (Dev, TRUE);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  //
+  // Hand out the most recently produced bytes, and don't keep a copy.
+  //
+  Dev->PoolAvail -= (UINT32)RNGValueLength;
+  CopyMem (RNGValue, Dev->Pool + Dev->PoolAvail, RNGValueLength);
+  ZeroMem (Dev->Pool + Dev->PoolAvail, RNGValueLength);
+
+  if ((Dev->PoolAvail <= Dev->PoolLowWater) && !Dev->RefillInFlight) {
+    //
+    // The request has been satisfied; a failure to prefetch is retried on the
+    // next call.
+    //
+    Status = VirtioRngPrefetch (Dev);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_WARN, "%a: prefetch: %r\n", __FUNCTION__, Status));
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Fetch entropy from the device synchronously, into a buffer that is allocated
+  and mapped for this request only.
+
+  @param[in,out] Dev             The device to take the entropy from. No
+                                 request may be in flight on its virtqueue.
+
+  @param[in] RNGValueLength      The number of bytes to return.
+
+  @param[out] RNGValue           The buffer to fill with entropy.
+
+  @retval EFI_SUCCESS       RNGValue has been filled.
+  @retval EFI_DEVICE_ERROR  The entropy could not be retrieved.
+**/
+STATIC
+EFI_STATUS
+VirtioRngGetDirect (
+  IN OUT VIRTIO_RNG_DEV  *Dev,
+  IN     UINTN           RNGValueLength,
+  OUT    UINT8           *RNGValue
   )
 {
-  VIRTIO_RNG_DEV        *Dev;
   DESC_INDICES          Indices;
   volatile UINT8        *Buffer;
   UINTN                 Index;
@@ -137,25 +311,11 @@ VirtioRngGetRNG (
   EFI_PHYSICAL_ADDRESS  DeviceAddress;
   VOID                  *Mapping;
 
-  if ((This == NULL) || (RNGValueLength == 0) || (RNGValue == NULL)) {
-    return EFI_INVALID_PARAMETER;
-  }
-
-  //
-  // We only support the raw algorithm, so reject requests for anything else
-  //
-  if ((RNGAlgorithm != NULL) &&
-      !CompareGuid (RNGAlgorithm, &gEfiRngAlgorithmRaw))
-  {
-    return EFI_UNSUPPORTED;
-  }
-
   Buffer = (volatile UINT8 *)AllocatePool (RNGValueLength);
   if (Buffer == NULL) {
     return EFI_DEVICE_ERROR;
   }
 
-  Dev = VIRTIO_ENTROPY_SOURCE_FROM_RNG (This);
   //
   // Map Buffer's system physical address to device address
   //
@@ -229,6 +389,176 @@ FreeBuffer:
   return Status;
 }
 
+/**
+  Produces and returns an RNG value using either the default or specified RNG
+  algorithm.
+
+  @param[in]  This                    A pointer to the EFI_RNG_PROTOCOL
+                                      instance.
+  @param[in]  RNGAlgorithm            A pointer to the EFI_RNG_ALGORITHM that
+                                      identifies the RNG algorithm to use. May
+                                      be NULL in which case the function will
+                                      use its default RNG algorithm.
+  @param[in]  RNGValueLength          The length in bytes of the memory buffer
+                                      pointed to by RNGValue. The driver shall
+                                      return exactly this numbers of bytes.
+  @param[out] RNGValue                A caller-allocated memory buffer filled
+                                      by the driver with the resulting RNG
+                                      value.
+
+  @retval EFI_SUCCESS                 The RNG value was returned successfully.
+  @retval EFI_UNSUPPORTED             The algorithm specified by RNGAlgorithm
+                                      is not supported by this driver.
+  @retval EFI_DEVICE_ERROR            An RNG value could not be retrieved due
+                                      to a hardware or firmware error.
+  @retval EFI_NOT_READY               There is not enough random data available
+                                      to satisfy the length requested by
+                                      RNGValueLength.
+  @retval EFI_INVALID_PARAMETER       RNGValue is NULL or RNGValueLength is
+                                      zero.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+VirtioRngGetRNG (
+  IN EFI_RNG_PROTOCOL   *This,
+  IN EFI_RNG_ALGORITHM  *RNGAlgorithm  OPTIONAL,
+  IN UINTN              RNGValueLength,
+  OUT UINT8             *RNGValue
+  )
+{
+  VIRTIO_RNG_DEV  *Dev;
+  EFI_TPL         OldTpl;
+  EFI_STATUS      Status;
+
+  if ((This == NULL) || (RNGValueLength == 0) || (RNGValue == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // We only support the raw algorithm, so reject requests for anything else
+  //
+  if ((RNGAlgorithm != NULL) &&
+      !CompareGuid (RNGAlgorithm, &gEfiRngAlgorithmRaw))
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  Dev = VIRTIO_ENTROPY_SOURCE_FROM_RNG (This);
+
+  //
+  // The entropy pool and the virtqueue are shared by all callers.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  if ((Dev->Pool != NULL) &&
+      (RNGValueLength <= Dev->PoolSize / VIRTIO_RNG_POOL_MAX_REQUEST_DIV))
+  {
+    Status = VirtioRngGetFromPool (Dev, RNGValueLength, RNGValue);
+  } else {
+    //
+    // Large requests bypass the pool. VirtioFlush() relies on lock-step
+    // progress on the virtqueue, so let the background refill complete first.
+    //
+    Status = VirtioRngReap (Dev, TRUE);
+    if (!EFI_ERROR (Status)) {
+      Status = VirtioRngGetDirect (Dev, RNGValueLength, RNGValue);
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
+/**
+  Allocate the entropy pool of the device and map it for the device once, if
+  PcdVirtioRngPoolSize enables the pool.
+
+  @param[in,out] Dev  The device being initialized.
+
+  @retval EFI_SUCCESS  The pool has been set up, or it is disabled.
+  @return              Status codes from VIRTIO_DEVICE_PROTOCOL.
+                       AllocateSharedPages() or
+                       VirtioMapAllBytesInSharedBuffer().
+**/
+STATIC
+EFI_STATUS
+VirtioRngInitPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  EFI_STATUS  Status;
+  VOID        *PoolBuffer;
+
+  Dev->Pool           = NULL;
+  Dev->PoolAvail      = 0;
+  Dev->RefillInFlight = FALSE;
+
+  Dev->PoolSize = PcdGet32 (PcdVirtioRngPoolSize);
+  if (Dev->PoolSize == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Dev->PoolSize     = MIN (Dev->PoolSize, SIZE_1MB);
+  Dev->PoolLowWater = MIN (
+                        PcdGet32 (PcdVirtioRngPoolLowWater),
+                        Dev->PoolSize - 1
+                        );
+  Dev->PoolNrPages  = EFI_SIZE_TO_PAGES (Dev->PoolSize);
+
+  Status = Dev->VirtIo->AllocateSharedPages (
+                          Dev->VirtIo,
+                          Dev->PoolNrPages,
+                          &PoolBuffer
+                          );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // The host writes the pool over and over, and we read it in between, so map
+  // it as a common buffer once.
+  //
+  Status = VirtioMapAllBytesInSharedBuffer (
+             Dev->VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             PoolBuffer,
+             EFI_PAGES_TO_SIZE (Dev->PoolNrPages),
+             &Dev->PoolDevAddr,
+             &Dev->PoolMap
+             );
+  if (EFI_ERROR (Status)) {
+    Dev->VirtIo->FreeSharedPages (Dev->VirtIo, Dev->PoolNrPages, PoolBuffer);
+    return Status;
+  }
+
+  Dev->Pool = PoolBuffer;
+  return EFI_SUCCESS;
+}
+
+/**
+  Scrub, unmap and free the entropy pool of the device, if it has one. The
+  device must have been reset.
+
+  @param[in,out] Dev  The device being torn down.
+**/
+STATIC
+VOID
+VirtioRngUninitPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  if (Dev->Pool == NULL) {
+    return;
+  }
+
+  ZeroMem (Dev->Pool, Dev->PoolSize);
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->PoolMap);
+  Dev->VirtIo->FreeSharedPages (Dev->VirtIo, Dev->PoolNrPages, Dev->Pool);
+  Dev->Pool = NULL;
+}
+
 STATIC
 EFI_STATUS
 EFIAPI
@@ -279,7 +609,8 @@ VirtioRngInit (
     goto Failed;
   }
 
-  Features &= VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM;
+  Features &= VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM |
+              VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_RING_PACKED;
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
@@ -313,7 +644,12 @@ VirtioRngInit (
     goto Failed;
   }
 
-  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Dev->Ring);
+  Status = VirtioRingInitForFeatures (
+             Dev->VirtIo,
+             QueueSize,
+             Features,
+             &Dev->Ring
+             );
   if (EFI_ERROR (Status)) {
     goto Failed;
   }
@@ -368,13 +704,26 @@ VirtioRngInit (
     }
   }
 
+  Status = VirtioRngInitPool (Dev);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
   //
   // step 6 -- initialization complete
   //
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitPool;
+  }
+
+  //
+  // Let the host fill the entropy pool while the boot continues. Should this
+  // fail, the first VirtioRngGetRNG() call will retry.
+  //
+  if (Dev->Pool != NULL) {
+    VirtioRngPrefetch (Dev);
   }
 
   //
@@ -385,6 +734,9 @@ VirtioRngInit (
 
   return EFI_SUCCESS;
 
+UninitPool:
+  VirtioRngUninitPool (Dev);
+
 UnmapQueue:
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
 
@@ -416,6 +768,8 @@ VirtioRngUninit (
   //
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
 
+  VirtioRngUninitPool (Dev);
+
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
 
   VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
@@ -445,6 +799,13 @@ VirtioRngExitBoot (
   //
   Dev = Context;
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
+
+  //
+  // Don't leave unused entropy behind for the OS to find.
+  //
+  if (Dev->Pool != NULL) {
+    ZeroMem (Dev->Pool, Dev->PoolSize);
+  }
 }
 
 //
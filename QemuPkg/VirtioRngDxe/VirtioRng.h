@@ -19,6 +19,11 @@
 
 #define VIRTIO_RNG_SIG  SIGNATURE_32 ('V', 'R', 'N', 'G')
 
+//
+// Requests for more than this fraction of the entropy pool bypass the pool.
+//
+#define VIRTIO_RNG_POOL_MAX_REQUEST_DIV  4
+
 typedef struct {
   //
   // Parts of this structure are initialized / torn down in various functions
@@ -33,6 +38,16 @@ typedef struct {
   VRING                     Ring;           // VirtioRingInit       2
   EFI_RNG_PROTOCOL          Rng;            // VirtioRngInit        1
   VOID                      *RingMap;       // VirtioRingMap        2
+  UINT8                     *Pool;          // VirtioRngInitPool    2
+  UINTN                     PoolNrPages;    // VirtioRngInitPool    2
+  EFI_PHYSICAL_ADDRESS      PoolDevAddr;    // VirtioRngInitPool    2
+  VOID                      *PoolMap;       // VirtioRngInitPool    2
+  UINT32                    PoolSize;       // VirtioRngInitPool    2
+  UINT32                    PoolLowWater;   // VirtioRngInitPool    2
+  UINT32                    PoolAvail;      // VirtioRngInitPool    2
+  BOOLEAN                   RefillInFlight; // VirtioRngInitPool    2
+  UINT32                    RefillOffset;   // VirtioRngPrefetch    2
+  UINT16                    LastUsedIdx;    // VirtioRngPrefetch    2
 } VIRTIO_RNG_DEV;
 
 #define VIRTIO_ENTROPY_SOURCE_FROM_RNG(RngPointer) \
@@ -7,16 +7,20 @@
 
   - No hotplug / hot-unplug.
 
-  - Although EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru() could be a good match
-    for multiple in-flight virtio-scsi requests, we stick to synchronous
-    requests for now.
+  - EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru() is non-blocking when called
+    with an Event. Each request slot owns a fixed range of descriptors (or an
+    indirect descriptor table), so that many tagged requests can be in flight.
 
   - Timeouts are not supported for EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru().
 
   - Only one channel is supported. (At the time of this writing, host-side
     virtio-scsi supports a single channel too.)
 
-  - Only one request queue is used (for the one synchronous request).
+  - Only one request queue is used.
+
+  - GetNextTargetLun() discovers the LUNs of all targets with concurrent
+    REPORT LUNS commands when a scan starts, and skips the target / LUN pairs
+    that don't exist.
 
   - The ResetChannel() and ResetTargetLun() functions of
     EFI_EXT_SCSI_PASS_THRU_PROTOCOL are not supported (which is allowed by the
@@ -34,6 +38,7 @@
 **/
 
 #include <IndustryStandard/VirtioScsi.h>
+#include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
@@ -410,83 +415,129 @@ ReportHostAdapterError (
   return EFI_DEVICE_ERROR;
 }
 
-//
-// The next seven functions implement EFI_EXT_SCSI_PASS_THRU_PROTOCOL
-// for the virtio-scsi HBA. Refer to UEFI Spec 2.3.1 + Errata C, sections
-// - 14.1 SCSI Driver Model Overview,
-// - 14.7 Extended SCSI Pass Thru Protocol.
-//
+/**
 
-EFI_STATUS
-EFIAPI
-VirtioScsiPassThru (
-  IN     EFI_EXT_SCSI_PASS_THRU_PROTOCOL             *This,
-  IN     UINT8                                       *Target,
-  IN     UINT64                                      Lun,
-  IN OUT EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet,
-  IN     EFI_EVENT                                   Event   OPTIONAL
+  Reap the requests that the host has completed since the last call.
+
+  Blocking requests are only marked as completed; the thread of execution that
+  waits for them is responsible for completing their packets. Non-blocking
+  requests are completed here, and their events are signaled.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-scsi device whose request queue to process.
+
+**/
+STATIC
+VOID
+ProcessCompletions (
+  IN OUT VSCSI_DEV  *Dev
+  );
+
+/**
+
+  Claim a free request slot.
+
+  If all slots are taken, completed requests are reaped until a slot becomes
+  free.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-scsi device to claim a request slot on.
+
+  @return  The claimed request slot, or NULL if all slots are held by callers
+           that the current thread of execution has interrupted.
+
+**/
+STATIC
+VSCSI_REQ *
+ClaimRequest (
+  IN OUT VSCSI_DEV  *Dev
   )
 {
-  VSCSI_DEV                  *Dev;
-  UINT16                     TargetValue;
-  EFI_STATUS                 Status;
-  volatile VIRTIO_SCSI_REQ   Request;
-  volatile VIRTIO_SCSI_RESP  *Response;
-  VOID                       *ResponseBuffer;
-  DESC_INDICES               Indices;
-  VOID                       *RequestMapping;
-  VOID                       *ResponseMapping;
-  VOID                       *InDataMapping;
-  VOID                       *OutDataMapping;
-  EFI_PHYSICAL_ADDRESS       RequestDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       ResponseDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       InDataDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       OutDataDeviceAddress;
-  VOID                       *InDataBuffer;
-  UINTN                      InDataNumPages;
-  BOOLEAN                    OutDataBufferIsMapped;
-
-  //
-  // Set InDataMapping,OutDataMapping,InDataDeviceAddress and OutDataDeviceAddress to
-  // suppress incorrect compiler/analyzer warnings.
-  //
-  InDataMapping        = NULL;
-  OutDataMapping       = NULL;
-  InDataDeviceAddress  = 0;
-  OutDataDeviceAddress = 0;
-
-  ZeroMem ((VOID *)&Request, sizeof (Request));
+  UINT16  Slot;
+
+  for ( ; ;) {
+    for (Slot = 0; Slot < Dev->NumRequests; Slot++) {
+      if (!Dev->Requests[Slot].InUse) {
+        Dev->Requests[Slot].InUse    = TRUE;
+        Dev->Requests[Slot].InFlight = FALSE;
+        return &Dev->Requests[Slot];
+      }
+    }
 
-  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
-  CopyMem (&TargetValue, Target, sizeof TargetValue);
+    if (Dev->NumInFlight == 0) {
+      //
+      // No slot can be freed at our TPL.
+      //
+      return NULL;
+    }
+
+    gBS->Stall (1);
+    ProcessCompletions (Dev);
+  }
+}
 
-  InDataBuffer          = NULL;
-  OutDataBufferIsMapped = FALSE;
-  InDataNumPages        = 0;
+/**
 
-  Status = PopulateRequest (Dev, TargetValue, Lun, Packet, &Request);
-  if (EFI_ERROR (Status)) {
-    return Status;
+  Release the data buffers that MapRequest() set up for a request.
+
+  @param[in] Dev      The virtio-scsi device the request was targeted at.
+
+  @param[in,out] Req  The request to clean up.
+
+**/
+STATIC
+VOID
+UnmapRequest (
+  IN     VSCSI_DEV  *Dev,
+  IN OUT VSCSI_REQ  *Req
+  )
+{
+  if (Req->OutDataMapping != NULL) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Req->OutDataMapping);
   }
 
-  //
-  // Map the virtio-scsi Request header buffer
-  //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterRead,
-             (VOID *)&Request,
-             sizeof Request,
-             &RequestDeviceAddress,
-             &RequestMapping
-             );
-  if (EFI_ERROR (Status)) {
-    return ReportHostAdapterError (Packet);
+  if (Req->InDataBuffer != NULL) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Req->InDataMapping);
+    Dev->VirtIo->FreeSharedPages (
+                   Dev->VirtIo,
+                   Req->InDataNumPages,
+                   Req->InDataBuffer
+                   );
   }
+}
+
+/**
+
+  Map the data buffers of a request for bus master access.
+
+  @param[in] Dev      The virtio-scsi device the request is targeted at.
+
+  @param[in,out] Req  The claimed request slot; Req->Packet has been validated
+                      by PopulateRequest().
+
+  @retval EFI_SUCCESS  The data buffers are ready for the host.
+
+  @return              Error codes from the VirtIo protocol. Nothing is left
+                       mapped.
+
+**/
+STATIC
+EFI_STATUS
+MapRequest (
+  IN     VSCSI_DEV  *Dev,
+  IN OUT VSCSI_REQ  *Req
+  )
+{
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet;
+  EFI_STATUS                                  Status;
+
+  Packet              = Req->Packet;
+  Req->InDataBuffer   = NULL;
+  Req->InDataNumPages = 0;
+  Req->OutDataMapping = NULL;
 
-  //
-  // Map the input buffer
-  //
   if (Packet->InTransferLength > 0) {
     //
     // Allocate a intermediate input buffer. This is mainly to handle the
@@ -503,206 +554,785 @@ VirtioScsiPassThru (
     // the Virtio request is successful then we copy the data from temporary
     // buffer into Packet->InDataBuffer.
     //
-    InDataNumPages = EFI_SIZE_TO_PAGES ((UINTN)Packet->InTransferLength);
-    Status         = Dev->VirtIo->AllocateSharedPages (
-                                    Dev->VirtIo,
-                                    InDataNumPages,
-                                    &InDataBuffer
-                                    );
+    Req->InDataNumPages = EFI_SIZE_TO_PAGES ((UINTN)Packet->InTransferLength);
+    Status              = Dev->VirtIo->AllocateSharedPages (
+                                         Dev->VirtIo,
+                                         Req->InDataNumPages,
+                                         &Req->InDataBuffer
+                                         );
     if (EFI_ERROR (Status)) {
-      Status = ReportHostAdapterError (Packet);
-      goto UnmapRequestBuffer;
+      Req->InDataBuffer = NULL;
+      return Status;
     }
 
-    ZeroMem (InDataBuffer, Packet->InTransferLength);
+    ZeroMem (Req->InDataBuffer, Packet->InTransferLength);
 
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
                VirtioOperationBusMasterCommonBuffer,
-               InDataBuffer,
+               Req->InDataBuffer,
                Packet->InTransferLength,
-               &InDataDeviceAddress,
-               &InDataMapping
+               &Req->InDataDeviceAddress,
+               &Req->InDataMapping
                );
     if (EFI_ERROR (Status)) {
-      Status = ReportHostAdapterError (Packet);
       goto FreeInDataBuffer;
     }
   }
 
-  //
-  // Map the output buffer
-  //
   if (Packet->OutTransferLength > 0) {
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
                VirtioOperationBusMasterRead,
                Packet->OutDataBuffer,
                Packet->OutTransferLength,
-               &OutDataDeviceAddress,
-               &OutDataMapping
+               &Req->OutDataDeviceAddress,
+               &Req->OutDataMapping
                );
     if (EFI_ERROR (Status)) {
-      Status = ReportHostAdapterError (Packet);
+      Req->OutDataMapping = NULL;
       goto UnmapInDataBuffer;
     }
+  }
+
+  return EFI_SUCCESS;
 
-    OutDataBufferIsMapped = TRUE;
+UnmapInDataBuffer:
+  if (Req->InDataBuffer != NULL) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Req->InDataMapping);
   }
 
-  //
-  // Response header is bi-direction (we preset with host status and expect
-  // the device to update it). Allocate a response buffer which can be mapped
-  // to access equally by both processor and device.
-  //
-  Status = Dev->VirtIo->AllocateSharedPages (
-                          Dev->VirtIo,
-                          EFI_SIZE_TO_PAGES (sizeof *Response),
-                          &ResponseBuffer
-                          );
-  if (EFI_ERROR (Status)) {
-    Status = ReportHostAdapterError (Packet);
-    goto UnmapOutDataBuffer;
+FreeInDataBuffer:
+  if (Req->InDataBuffer != NULL) {
+    Dev->VirtIo->FreeSharedPages (
+                   Dev->VirtIo,
+                   Req->InDataNumPages,
+                   Req->InDataBuffer
+                   );
+    Req->InDataBuffer = NULL;
   }
 
-  Response = ResponseBuffer;
+  return Status;
+}
 
-  ZeroMem ((VOID *)Response, sizeof (*Response));
+/**
 
-  //
-  // preset a host status for ourselves that we do not accept as success
-  //
-  Response->Response = VIRTIO_SCSI_S_FAILURE;
+  Translate the host's response to a completed request into the packet of the
+  request, and release the data buffers of the request.
+
+  @param[in] Dev      The virtio-scsi device the request was targeted at.
+
+  @param[in,out] Req  The completed request.
+
+  @return  See ParseResponse().
+
+**/
+STATIC
+EFI_STATUS
+CompleteRequest (
+  IN     VSCSI_DEV  *Dev,
+  IN OUT VSCSI_REQ  *Req
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = ParseResponse (Req->Packet, &Req->Dma->Response);
 
   //
-  // Map the response buffer with BusMasterCommonBuffer so that response
-  // buffer can be accessed by both host and device.
+  // If virtio request was successful and it was a CPU read request then we
+  // have used an intermediate buffer. Copy the data from intermediate buffer
+  // to the final buffer.
   //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterCommonBuffer,
-             ResponseBuffer,
-             sizeof (*Response),
-             &ResponseDeviceAddress,
-             &ResponseMapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = ReportHostAdapterError (Packet);
-    goto FreeResponseBuffer;
+  if (Req->InDataBuffer != NULL) {
+    CopyMem (
+      Req->Packet->InDataBuffer,
+      Req->InDataBuffer,
+      Req->Packet->InTransferLength
+      );
   }
 
-  VirtioPrepare (&Dev->Ring, &Indices);
+  UnmapRequest (Dev, Req);
+  return Status;
+}
+
+/**
+
+  Append a buffer of a request either to the virtio ring, or to the request
+  slot's indirect descriptor table.
+
+  @param[in,out] Dev  The virtio-scsi device the request is targeted at.
+
+  See VirtioAppendDesc() for the rest of the parameters.
+
+**/
+STATIC
+VOID
+AppendRequestDesc (
+  IN OUT VSCSI_DEV     *Dev,
+  IN     UINT64        BufferDeviceAddress,
+  IN     UINT32        BufferSize,
+  IN     UINT16        Flags,
+  IN OUT DESC_INDICES  *Indices
+  )
+{
+  if (Dev->UseIndirect) {
+    VirtioIndirectAppendDesc (
+      &Dev->Indirect,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      Indices
+      );
+  } else {
+    VirtioAppendDesc (
+      &Dev->Ring,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      Indices
+      );
+  }
+}
+
+/**
+
+  Format a mapped request as up to four descriptors in the request slot's own
+  descriptor range, and push them to the host.
+
+  Must be called at TPL_NOTIFY.
+
+  @param[in,out] Dev  The virtio-scsi device the request is targeted at.
+
+  @param[in,out] Req  The request, prepared with PopulateRequest() and
+                      MapRequest().
+
+  @retval EFI_SUCCESS  The request is in flight.
+
+  @return              Error codes from VirtioSubmit(). The request has not
+                       been accounted as in flight.
+
+**/
+STATIC
+EFI_STATUS
+SubmitRequest (
+  IN OUT VSCSI_DEV  *Dev,
+  IN OUT VSCSI_REQ  *Req
+  )
+{
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet;
+  DESC_INDICES                                Indices;
+  DESC_INDICES                                ChainIndices;
+  UINT16                                      Slot;
+  EFI_STATUS                                  Status;
+
+  Packet = Req->Packet;
+  Slot   = (UINT16)(Req - Dev->Requests);
 
   //
-  // ensured by VirtioScsiInit() -- this predicate, in combination with the
-  // lock-step progress, ensures we don't have to track free descriptors.
+  // Each request slot owns a fixed range of descriptors (see
+  // VSCSI_DESC_PER_REQ); build the chain there rather than at descriptor #0.
+  // This, in combination with ClaimRequest(), ensures we don't have to track
+  // free descriptors.
   //
-  ASSERT (Dev->Ring.QueueSize >= 4);
+  VirtioPrepare (&Dev->Ring, &Indices);
+  Indices.HeadDescIdx = (UINT16)(Slot * Dev->RingDescPerReq);
+  Indices.NextDescIdx = Indices.HeadDescIdx;
+
+  if (Dev->UseIndirect) {
+    VirtioIndirectPrepare (&Dev->Indirect, Slot, &ChainIndices);
+  } else {
+    ChainIndices = Indices;
+  }
 
   //
   // enqueue Request
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    RequestDeviceAddress,
-    sizeof Request,
+  AppendRequestDesc (
+    Dev,
+    Req->RequestDeviceAddress,
+    sizeof Req->Dma->Request,
     VRING_DESC_F_NEXT,
-    &Indices
+    &ChainIndices
     );
 
   //
   // enqueue "dataout" if any
   //
   if (Packet->OutTransferLength > 0) {
-    VirtioAppendDesc (
-      &Dev->Ring,
-      OutDataDeviceAddress,
+    AppendRequestDesc (
+      Dev,
+      Req->OutDataDeviceAddress,
       Packet->OutTransferLength,
       VRING_DESC_F_NEXT,
-      &Indices
+      &ChainIndices
       );
   }
 
   //
   // enqueue Response, to be written by the host
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    ResponseDeviceAddress,
-    sizeof *Response,
+  AppendRequestDesc (
+    Dev,
+    Req->ResponseDeviceAddress,
+    sizeof Req->Dma->Response,
     VRING_DESC_F_WRITE | (Packet->InTransferLength > 0 ? VRING_DESC_F_NEXT : 0),
-    &Indices
+    &ChainIndices
     );
 
   //
   // enqueue "datain" if any, to be written by the host
   //
   if (Packet->InTransferLength > 0) {
-    VirtioAppendDesc (
-      &Dev->Ring,
-      InDataDeviceAddress,
+    AppendRequestDesc (
+      Dev,
+      Req->InDataDeviceAddress,
       Packet->InTransferLength,
       VRING_DESC_F_WRITE,
-      &Indices
+      &ChainIndices
       );
   }
 
+  if (Dev->UseIndirect) {
+    VirtioAppendIndirect (&Dev->Ring, &Dev->Indirect, &ChainIndices, &Indices);
+  }
+
+  Req->InFlight = TRUE;
+  Dev->NumInFlight++;
+  if ((Req->Event != NULL) && (Dev->NumAsyncInFlight++ == 0)) {
+    gBS->SetTimer (Dev->AsyncTimer, TimerPeriodic, VSCSI_ASYNC_POLL_PERIOD);
+  }
+
+  Status = VirtioSubmit (
+             Dev->VirtIo,
+             VIRTIO_SCSI_REQUEST_QUEUE,
+             &Dev->Ring,
+             &Indices
+             );
+  if (EFI_ERROR (Status)) {
+    Req->InFlight = FALSE;
+    Dev->NumInFlight--;
+    if ((Req->Event != NULL) && (--Dev->NumAsyncInFlight == 0)) {
+      gBS->SetTimer (Dev->AsyncTimer, TimerCancel, 0);
+    }
+  }
+
+  return Status;
+}
+
+STATIC
+VOID
+ProcessCompletions (
+  IN OUT VSCSI_DEV  *Dev
+  )
+{
+  UINT16     HeadDescIdx;
+  UINT16     Slot;
+  VSCSI_REQ  *Req;
+  EFI_EVENT  Event;
+
+  while (!EFI_ERROR (
+            VirtioGetNextUsed (
+              &Dev->Ring,
+              &Dev->LastUsedIdx,
+              &HeadDescIdx,
+              NULL
+              )
+            ))
+  {
+    Slot = HeadDescIdx / Dev->RingDescPerReq;
+    if ((HeadDescIdx % Dev->RingDescPerReq != 0) ||
+        (Slot >= Dev->NumRequests) ||
+        !Dev->Requests[Slot].InFlight)
+    {
+      DEBUG ((
+        DEBUG_ERROR,
+        "%a: unexpected head descriptor %u\n",
+        __FUNCTION__,
+        HeadDescIdx
+        ));
+      continue;
+    }
+
+    Req           = &Dev->Requests[Slot];
+    Req->InFlight = FALSE;
+    Dev->NumInFlight--;
+
+    if (Req->Event == NULL) {
+      //
+      // The submitter is polling for this request; it will clean up.
+      //
+      continue;
+    }
+
+    //
+    // The outcome of a non-blocking request is reported in the packet only.
+    //
+    CompleteRequest (Dev, Req);
+    Event      = Req->Event;
+    Req->InUse = FALSE;
+
+    if (--Dev->NumAsyncInFlight == 0) {
+      gBS->SetTimer (Dev->AsyncTimer, TimerCancel, 0);
+    }
+
+    gBS->SignalEvent (Event);
+  }
+}
+
+/**
+
+  Wait until the host has completed all requests in flight on the device.
+
+  @param[in,out] Dev  The virtio-scsi device to drain.
+
+**/
+STATIC
+VOID
+DrainRequests (
+  IN OUT VSCSI_DEV  *Dev
+  )
+{
+  EFI_TPL  OldTpl;
+  UINT16   NumInFlight;
+  UINT16   LastUsedIdx;
+
+  for ( ; ;) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    ProcessCompletions (Dev);
+    NumInFlight = Dev->NumInFlight;
+    LastUsedIdx = Dev->Ring.UsedCount;
+    gBS->RestoreTPL (OldTpl);
+
+    if (NumInFlight == 0) {
+      break;
+    }
+
+    VirtioWaitUsed (&Dev->Ring, LastUsedIdx);
+  }
+}
+
+/**
+
+  Timer notification function that reaps the completions of non-blocking
+  requests.
+
+  @param[in] Event    The AsyncTimer event of the device.
+
+  @param[in] Context  Pointer to the VSCSI_DEV structure.
+
+**/
+STATIC
+VOID
+EFIAPI
+VirtioScsiAsyncTimer (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  ProcessCompletions (Context);
+}
+
+/**
+
+  Validate a packet, and submit it to the host as a new request.
+
+  @param[in] Dev         The virtio-scsi device the packet targets.
+
+  @param[in] Target      The SCSI target controlled by the virtio-scsi host
+                         device.
+
+  @param[in] Lun         The Logical Unit Number under the SCSI target.
+
+  @param[in,out] Packet  The Extended SCSI Pass Thru Protocol packet to submit.
+                         On failure this parameter relays error contents.
+
+  @param[in] Event       If not NULL, the request is non-blocking:
+                         ProcessCompletions() completes Packet and signals
+                         Event. If NULL, the caller must pass *Request to
+                         FinishRequest().
+
+  @param[out] Request    On success, the request in flight.
+
+  @retval EFI_SUCCESS    The request is in flight.
+
+  @retval EFI_NOT_READY  All request slots are held by callers that the current
+                         thread of execution has interrupted.
+
+  @return                PassThru() status codes from PopulateRequest() and
+                         ReportHostAdapterError().
+
+**/
+STATIC
+EFI_STATUS
+StartRequest (
+  IN OUT VSCSI_DEV                                   *Dev,
+  IN     UINT16                                      Target,
+  IN     UINT64                                      Lun,
+  IN OUT EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet,
+  IN     EFI_EVENT                                   Event    OPTIONAL,
+  OUT    VSCSI_REQ                                   **Request
+  )
+{
+  VSCSI_REQ   *Req;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Req    = ClaimRequest (Dev);
+  gBS->RestoreTPL (OldTpl);
+  if (Req == NULL) {
+    return EFI_NOT_READY;
+  }
+
+  ZeroMem ((VOID *)&Req->Dma->Request, sizeof Req->Dma->Request);
+  Status = PopulateRequest (Dev, Target, Lun, Packet, &Req->Dma->Request);
+  if (EFI_ERROR (Status)) {
+    goto ReleaseSlot;
+  }
+
+  //
+  // Tag the request with its slot; the task attribute is left at SIMPLE
+  // (zero), so that the host may process requests in any order.
+  //
+  Req->Dma->Request.Id = (UINT64)(Req - Dev->Requests);
+
+  //
+  // preset a host status for ourselves that we do not accept as success
+  //
+  ZeroMem ((VOID *)&Req->Dma->Response, sizeof Req->Dma->Response);
+  Req->Dma->Response.Response = VIRTIO_SCSI_S_FAILURE;
+
+  Req->Packet = Packet;
+  Req->Event  = Event;
+  Status      = MapRequest (Dev, Req);
+  if (EFI_ERROR (Status)) {
+    Status = ReportHostAdapterError (Packet);
+    goto ReleaseSlot;
+  }
+
+  //
   // If kicking the host fails, we must fake a host adapter error.
   // EFI_NOT_READY would save us the effort, but it would also suggest that the
   // caller retry.
   //
-  if (VirtioFlush (
-        Dev->VirtIo,
-        VIRTIO_SCSI_REQUEST_QUEUE,
-        &Dev->Ring,
-        &Indices,
-        NULL
-        ) != EFI_SUCCESS)
-  {
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Status = SubmitRequest (Dev, Req);
+  gBS->RestoreTPL (OldTpl);
+  if (EFI_ERROR (Status)) {
+    UnmapRequest (Dev, Req);
     Status = ReportHostAdapterError (Packet);
-    goto UnmapResponseBuffer;
+    goto ReleaseSlot;
   }
 
-  Status = ParseResponse (Packet, Response);
+  *Request = Req;
+  return EFI_SUCCESS;
 
-  //
-  // If virtio request was successful and it was a CPU read request then we
-  // have used an intermediate buffer. Copy the data from intermediate buffer
-  // to the final buffer.
-  //
-  if (InDataBuffer != NULL) {
-    CopyMem (Packet->InDataBuffer, InDataBuffer, Packet->InTransferLength);
+ReleaseSlot:
+  OldTpl     = gBS->RaiseTPL (TPL_NOTIFY);
+  Req->InUse = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+
+  Wait for a blocking request started with StartRequest() to complete,
+  complete its packet, and release its slot.
+
+  @param[in,out] Dev  The virtio-scsi device the request is targeted at.
+
+  @param[in,out] Req  The request in flight.
+
+  @return  See ParseResponse().
+
+**/
+STATIC
+EFI_STATUS
+FinishRequest (
+  IN OUT VSCSI_DEV  *Dev,
+  IN OUT VSCSI_REQ  *Req
+  )
+{
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+  BOOLEAN     InFlight;
+  UINT16      LastUsedIdx;
+
+  for ( ; ;) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    ProcessCompletions (Dev);
+    InFlight    = Req->InFlight;
+    LastUsedIdx = Dev->Ring.UsedCount;
+    gBS->RestoreTPL (OldTpl);
+
+    if (!InFlight) {
+      break;
+    }
+
+    VirtioWaitUsed (&Dev->Ring, LastUsedIdx);
   }
 
-UnmapResponseBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, ResponseMapping);
+  Status = CompleteRequest (Dev, Req);
 
-FreeResponseBuffer:
-  Dev->VirtIo->FreeSharedPages (
-                 Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *Response),
-                 ResponseBuffer
-                 );
+  OldTpl     = gBS->RaiseTPL (TPL_NOTIFY);
+  Req->InUse = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+
+  Look up a target / LUN pair in the LUN map built by ScanLuns().
+
+  @param[in] Dev     The virtio-scsi device.
+
+  @param[in] Target  The target; at most Dev->MaxTarget.
+
+  @param[in] Lun     The LUN; at most Dev->MaxLun.
+
+  @retval TRUE   The LUN may exist, or no LUN map is available.
+
+  @retval FALSE  The LUN is known not to exist.
 
-UnmapOutDataBuffer:
-  if (OutDataBufferIsMapped) {
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, OutDataMapping);
+**/
+STATIC
+BOOLEAN
+IsLunPresent (
+  IN CONST VSCSI_DEV  *Dev,
+  IN UINT16           Target,
+  IN UINT32           Lun
+  )
+{
+  UINTN  Bit;
+
+  if (Dev->LunMap == NULL) {
+    return TRUE;
   }
 
-UnmapInDataBuffer:
-  if (InDataBuffer != NULL) {
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, InDataMapping);
+  Bit = (UINTN)Target * (Dev->MaxLun + 1) + Lun;
+  return (BOOLEAN)((Dev->LunMap[Bit / 8] & (1 << (Bit % 8))) != 0);
+}
+
+/**
+
+  Record a target / LUN pair as present in the LUN map.
+
+  @param[in,out] Dev  The virtio-scsi device; Dev->LunMap must not be NULL.
+
+  @param[in] Target   The target; at most Dev->MaxTarget.
+
+  @param[in] Lun      The LUN; at most Dev->MaxLun.
+
+**/
+STATIC
+VOID
+MarkLunPresent (
+  IN OUT VSCSI_DEV  *Dev,
+  IN     UINT16     Target,
+  IN     UINT32     Lun
+  )
+{
+  UINTN  Bit;
+
+  Bit                  = (UINTN)Target * (Dev->MaxLun + 1) + Lun;
+  Dev->LunMap[Bit / 8] = (UINT8)(Dev->LunMap[Bit / 8] | (1 << (Bit % 8)));
+}
+
+/**
+
+  Record the LUNs of a target in the LUN map, from the outcome of the REPORT
+  LUNS command that ScanLuns() sent to the target.
+
+  @param[in,out] Dev  The virtio-scsi device; Dev->LunMap must not be NULL.
+
+  @param[in] Target   The target that the command was sent to.
+
+  @param[in] Scan     The completed command.
+
+**/
+STATIC
+VOID
+RecordLuns (
+  IN OUT VSCSI_DEV        *Dev,
+  IN     UINT16           Target,
+  IN     CONST VSCSI_SCAN *Scan
+  )
+{
+  UINT32       ListLength;
+  UINT32       Offset;
+  CONST UINT8  *Entry;
+  UINT32       Lun;
+
+  if ((Scan->Status == EFI_TIMEOUT) &&
+      (Scan->Packet.HostAdapterStatus ==
+       EFI_EXT_SCSI_STATUS_HOST_ADAPTER_TIMEOUT_COMMAND))
+  {
+    //
+    // VIRTIO_SCSI_S_BAD_TARGET: the target has no LUNs at all.
+    //
+    return;
   }
 
-FreeInDataBuffer:
-  if (InDataBuffer != NULL) {
-    Dev->VirtIo->FreeSharedPages (Dev->VirtIo, InDataNumPages, InDataBuffer);
+  if (!EFI_ERROR (Scan->Status) &&
+      (Scan->Packet.TargetStatus == EFI_EXT_SCSI_STATUS_TARGET_GOOD) &&
+      (Scan->Packet.InTransferLength >= 8))
+  {
+    ListLength = SwapBytes32 (ReadUnaligned32 ((CONST UINT32 *)Scan->Data));
+    if ((ListLength % 8 == 0) &&
+        (ListLength <= Scan->Packet.InTransferLength - 8))
+    {
+      for (Offset = 8; Offset < 8 + ListLength; Offset += 8) {
+        //
+        // Only peripheral (00b) and flat (01b) single level LUNs are
+        // supported, as in PopulateRequest().
+        //
+        Entry = &Scan->Data[Offset];
+        if ((Entry[0] >> 6 > 1) ||
+            (ReadUnaligned32 ((CONST UINT32 *)&Entry[2]) != 0) ||
+            (ReadUnaligned16 ((CONST UINT16 *)&Entry[6]) != 0))
+        {
+          break;
+        }
+
+        Lun = ((UINT32)(Entry[0] & 0x3F) << 8) | Entry[1];
+        if (Lun <= Dev->MaxLun) {
+          MarkLunPresent (Dev, Target, Lun);
+        }
+      }
+
+      if (Offset == 8 + ListLength) {
+        return;
+      }
+    }
   }
 
-UnmapRequestBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RequestMapping);
+  //
+  // The answer is inconclusive; let ScsiBusDxe probe every LUN of the target.
+  //
+  for (Lun = 0; Lun <= Dev->MaxLun; Lun++) {
+    MarkLunPresent (Dev, Target, Lun);
+  }
+}
 
-  return Status;
+/**
+
+  Discover the LUNs of all targets, by sending REPORT LUNS to LUN 0 of every
+  target, with up to VSCSI_SCAN_BATCH requests in flight.
+
+  VirtioScsiGetNextTargetLun() then skips the target / LUN pairs that don't
+  exist, so that ScsiBusDxe doesn't probe them one by one. If a target doesn't
+  answer REPORT LUNS conclusively, all its LUNs are reported. If the scan
+  cannot be performed, Dev->LunMap is left NULL, and all target / LUN pairs
+  are reported.
+
+  @param[in,out] Dev  The virtio-scsi device to scan.
+
+**/
+STATIC
+VOID
+ScanLuns (
+  IN OUT VSCSI_DEV  *Dev
+  )
+{
+  UINTN       LunMapSize;
+  VSCSI_SCAN  *Scans;
+  VSCSI_SCAN  *Scan;
+  UINTN       BatchSize;
+  UINTN       Count;
+  UINTN       Idx;
+  UINT32      First;
+
+  if (Dev->LunMap != NULL) {
+    FreePool (Dev->LunMap);
+    Dev->LunMap = NULL;
+  }
+
+  BatchSize = MIN (VSCSI_SCAN_BATCH, Dev->NumRequests);
+  Scans     = AllocatePool (BatchSize * sizeof *Scans);
+  if (Scans == NULL) {
+    return;
+  }
+
+  LunMapSize = ((UINTN)(Dev->MaxTarget + 1) * (Dev->MaxLun + 1) + 7) / 8;
+  Dev->LunMap = AllocateZeroPool (LunMapSize);
+  if (Dev->LunMap == NULL) {
+    goto FreeScans;
+  }
+
+  for (First = 0; First <= Dev->MaxTarget; First += (UINT32)BatchSize) {
+    Count = MIN (BatchSize, (UINTN)Dev->MaxTarget + 1 - First);
+
+    for (Idx = 0; Idx < Count; Idx++) {
+      Scan = &Scans[Idx];
+      ZeroMem (Scan, sizeof *Scan);
+      Scan->Cdb[0] = VSCSI_OP_REPORT_LUNS;
+      WriteUnaligned32 (
+        (UINT32 *)&Scan->Cdb[6],
+        SwapBytes32 (sizeof Scan->Data)
+        );
+      Scan->Packet.InDataBuffer     = Scan->Data;
+      Scan->Packet.Cdb              = Scan->Cdb;
+      Scan->Packet.InTransferLength = sizeof Scan->Data;
+      Scan->Packet.CdbLength        = sizeof Scan->Cdb;
+      Scan->Packet.DataDirection    = EFI_EXT_SCSI_DATA_DIRECTION_READ;
+
+      Scan->Status = StartRequest (
+                       Dev,
+                       (UINT16)(First + Idx),
+                       0,
+                       &Scan->Packet,
+                       NULL,
+                       &Scan->Req
+                       );
+    }
+
+    for (Idx = 0; Idx < Count; Idx++) {
+      Scan = &Scans[Idx];
+      if (!EFI_ERROR (Scan->Status)) {
+        Scan->Status = FinishRequest (Dev, Scan->Req);
+      }
+
+      RecordLuns (Dev, (UINT16)(First + Idx), Scan);
+    }
+  }
+
+FreeScans:
+  FreePool (Scans);
+}
+
+//
+// The next seven functions implement EFI_EXT_SCSI_PASS_THRU_PROTOCOL
+// for the virtio-scsi HBA. Refer to UEFI Spec 2.3.1 + Errata C, sections
+// - 14.1 SCSI Driver Model Overview,
+// - 14.7 Extended SCSI Pass Thru Protocol.
+//
+
+EFI_STATUS
+EFIAPI
+VirtioScsiPassThru (
+  IN     EFI_EXT_SCSI_PASS_THRU_PROTOCOL             *This,
+  IN     UINT8                                       *Target,
+  IN     UINT64                                      Lun,
+  IN OUT EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet,
+  IN     EFI_EVENT                                   Event   OPTIONAL
+  )
+{
+  VSCSI_DEV   *Dev;
+  UINT16      TargetValue;
+  VSCSI_REQ   *Req;
+  EFI_STATUS  Status;
+
+  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
+  CopyMem (&TargetValue, Target, sizeof TargetValue);
+
+  Status = StartRequest (Dev, TargetValue, Lun, Packet, Event, &Req);
+  if (EFI_ERROR (Status) || (Event != NULL)) {
+    return Status;
+  }
+
+  return FinishRequest (Dev, Req);
 }
 
 EFI_STATUS
@@ -722,45 +1352,50 @@ VirtioScsiGetNextTargetLun (
   // the TargetPointer input parameter is unnecessarily a pointer-to-pointer
   //
   Target = *TargetPointer;
+  Dev    = VIRTIO_SCSI_FROM_PASS_THRU (This);
 
   //
-  // Search for first non-0xFF byte. If not found, return first target & LUN.
+  // Search for first non-0xFF byte. If not found, (re)discover the LUNs, and
+  // return the first target & LUN that may exist.
   //
   for (Idx = 0; Idx < TARGET_MAX_BYTES && Target[Idx] == 0xFF; ++Idx) {
   }
 
   if (Idx == TARGET_MAX_BYTES) {
-    SetMem (Target, TARGET_MAX_BYTES, 0x00);
-    *Lun = 0;
-    return EFI_SUCCESS;
+    ScanLuns (Dev);
+    LastTarget = 0;
+    *Lun       = 0;
+    if (IsLunPresent (Dev, LastTarget, 0)) {
+      SetMem (Target, TARGET_MAX_BYTES, 0x00);
+      return EFI_SUCCESS;
+    }
+  } else {
+    //
+    // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+    //
+    CopyMem (&LastTarget, Target, sizeof LastTarget);
+    if ((LastTarget > Dev->MaxTarget) || (*Lun > Dev->MaxLun)) {
+      return EFI_INVALID_PARAMETER;
+    }
   }
 
   //
-  // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+  // increment (target, LUN) pair until it identifies a LUN that may exist
   //
-  CopyMem (&LastTarget, Target, sizeof LastTarget);
-
-  //
-  // increment (target, LUN) pair if valid on input
-  //
-  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
-  if ((LastTarget > Dev->MaxTarget) || (*Lun > Dev->MaxLun)) {
-    return EFI_INVALID_PARAMETER;
-  }
-
-  if (*Lun < Dev->MaxLun) {
-    ++*Lun;
-    return EFI_SUCCESS;
-  }
-
-  if (LastTarget < Dev->MaxTarget) {
-    *Lun = 0;
-    ++LastTarget;
-    CopyMem (Target, &LastTarget, sizeof LastTarget);
-    return EFI_SUCCESS;
-  }
+  do {
+    if (*Lun < Dev->MaxLun) {
+      ++*Lun;
+    } else if (LastTarget < Dev->MaxTarget) {
+      *Lun = 0;
+      ++LastTarget;
+    } else {
+      return EFI_NOT_FOUND;
+    }
+  } while (!IsLunPresent (Dev, LastTarget, (UINT32)*Lun));
 
-  return EFI_NOT_FOUND;
+  SetMem (Target, TARGET_MAX_BYTES, 0x00);
+  CopyMem (Target, &LastTarget, sizeof LastTarget);
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS
@@ -932,6 +1567,9 @@ VirtioScsiInit (
   UINT16      MaxChannel; // for validation only
   UINT32      NumQueues;  // for validation only
   UINT16      QueueSize;
+  UINT16      Slot;
+
+  EFI_PHYSICAL_ADDRESS  RequestPoolDeviceAddress;
 
   //
   // Execute virtio-0.9.5, 2.2.1 Device Initialization Sequence.
@@ -1028,7 +1666,8 @@ VirtioScsiInit (
   }
 
   Features &= VIRTIO_SCSI_F_INOUT | VIRTIO_F_VERSION_1 |
-              VIRTIO_F_IOMMU_PLATFORM;
+              VIRTIO_F_IOMMU_PLATFORM | VIRTIO_F_RING_EVENT_IDX |
+              VIRTIO_F_RING_INDIRECT_DESC | VIRTIO_F_RING_PACKED;
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
@@ -1055,14 +1694,22 @@ VirtioScsiInit (
   }
 
   //
-  // VirtioScsiPassThru() uses at most four descriptors
+  // SubmitRequest() uses at most four descriptors per request, or one
+  // descriptor that refers to an indirect table.
   //
-  if (QueueSize < 4) {
+  Dev->UseIndirect    = (BOOLEAN)((Features & VIRTIO_F_RING_INDIRECT_DESC) != 0);
+  Dev->RingDescPerReq = Dev->UseIndirect ? 1 : VSCSI_DESC_PER_REQ;
+  if (QueueSize < Dev->RingDescPerReq) {
     Status = EFI_UNSUPPORTED;
     goto Failed;
   }
 
-  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Dev->Ring);
+  Status = VirtioRingInitForFeatures (
+             Dev->VirtIo,
+             QueueSize,
+             Features,
+             &Dev->Ring
+             );
   if (EFI_ERROR (Status)) {
     goto Failed;
   }
@@ -1106,6 +1753,97 @@ VirtioScsiInit (
     goto UnmapQueue;
   }
 
+  //
+  // Set up the request slots, and the timer that reaps non-blocking requests.
+  // If anything fails from here on, we must unmap the ring resources.
+  //
+  Dev->NumRequests = QueueSize / Dev->RingDescPerReq;
+  if (Dev->UseIndirect) {
+    Dev->NumRequests = (UINT16)MIN (
+                                 Dev->NumRequests,
+                                 ((UINTN)MAX_UINT16 + 1) / VSCSI_DESC_PER_REQ
+                                 );
+  }
+
+  Dev->Requests    = AllocateZeroPool (Dev->NumRequests * sizeof *Dev->Requests);
+  if (Dev->Requests == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto UnmapQueue;
+  }
+
+  //
+  // Allocate and map the request headers and responses of all slots once,
+  // rather than for each request.
+  //
+  Dev->RequestPoolPages = EFI_SIZE_TO_PAGES (
+                            Dev->NumRequests * sizeof *Dev->RequestPool
+                            );
+  Status = Dev->VirtIo->AllocateSharedPages (
+                          Dev->VirtIo,
+                          Dev->RequestPoolPages,
+                          (VOID **)&Dev->RequestPool
+                          );
+  if (EFI_ERROR (Status)) {
+    goto FreeRequests;
+  }
+
+  SetMem (
+    Dev->RequestPool,
+    EFI_PAGES_TO_SIZE (Dev->RequestPoolPages),
+    0x00
+    );
+
+  Status = VirtioMapAllBytesInSharedBuffer (
+             Dev->VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             Dev->RequestPool,
+             EFI_PAGES_TO_SIZE (Dev->RequestPoolPages),
+             &RequestPoolDeviceAddress,
+             &Dev->RequestPoolMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeRequestPool;
+  }
+
+  for (Slot = 0; Slot < Dev->NumRequests; Slot++) {
+    Dev->Requests[Slot].Dma                   = &Dev->RequestPool[Slot];
+    Dev->Requests[Slot].RequestDeviceAddress  = RequestPoolDeviceAddress +
+                                                Slot * sizeof *Dev->RequestPool +
+                                                OFFSET_OF (VSCSI_REQ_DMA, Request);
+    Dev->Requests[Slot].ResponseDeviceAddress = RequestPoolDeviceAddress +
+                                                Slot * sizeof *Dev->RequestPool +
+                                                OFFSET_OF (VSCSI_REQ_DMA, Response);
+  }
+
+  if (Dev->UseIndirect) {
+    Status = VirtioIndirectInit (
+               Dev->VirtIo,
+               &Dev->Ring,
+               Dev->NumRequests,
+               VSCSI_DESC_PER_REQ,
+               &Dev->Indirect
+               );
+    if (EFI_ERROR (Status)) {
+      goto UnmapRequestPool;
+    }
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  &VirtioScsiAsyncTimer,
+                  Dev,
+                  &Dev->AsyncTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto ReleaseIndirect;
+  }
+
+  Dev->LastUsedIdx      = 0;
+  Dev->NumInFlight      = 0;
+  Dev->NumAsyncInFlight = 0;
+  Dev->LunMap           = NULL;
+
   //
   // step 5 -- Report understood features and guest-tuneables.
   //
@@ -1113,7 +1851,7 @@ VirtioScsiInit (
     Features &= ~(UINT64)(VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM);
     Status    = Dev->VirtIo->SetGuestFeatures (Dev->VirtIo, Features);
     if (EFI_ERROR (Status)) {
-      goto UnmapQueue;
+      goto CloseAsyncTimer;
     }
   }
 
@@ -1123,12 +1861,12 @@ VirtioScsiInit (
   //
   Status = VIRTIO_CFG_WRITE (Dev, CdbSize, VIRTIO_SCSI_CDB_SIZE);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto CloseAsyncTimer;
   }
 
   Status = VIRTIO_CFG_WRITE (Dev, SenseSize, VIRTIO_SCSI_SENSE_SIZE);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto CloseAsyncTimer;
   }
 
   //
@@ -1137,7 +1875,7 @@ VirtioScsiInit (
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto CloseAsyncTimer;
   }
 
   //
@@ -1163,8 +1901,12 @@ VirtioScsiInit (
   // Driver Writer's Guide for UEFI 2.3.1 v1.01, 20.1.5 Implementing Extended
   // SCSI Pass Thru Protocol.
   //
+  // PassThru() requests with an Event are queued to the host, and completed
+  // by VirtioScsiAsyncTimer().
+  //
   Dev->PassThruMode.Attributes = EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_PHYSICAL |
-                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_LOGICAL;
+                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_LOGICAL |
+                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_NONBLOCKIO;
 
   //
   // no restriction on transfer buffer alignment
@@ -1173,6 +1915,27 @@ VirtioScsiInit (
 
   return EFI_SUCCESS;
 
+CloseAsyncTimer:
+  gBS->CloseEvent (Dev->AsyncTimer);
+
+ReleaseIndirect:
+  if (Dev->UseIndirect) {
+    VirtioIndirectUninit (Dev->VirtIo, &Dev->Indirect);
+  }
+
+UnmapRequestPool:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RequestPoolMap);
+
+FreeRequestPool:
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 Dev->RequestPoolPages,
+                 Dev->RequestPool
+                 );
+
+FreeRequests:
+  FreePool (Dev->Requests);
+
 UnmapQueue:
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
 
@@ -1214,6 +1977,24 @@ VirtioScsiUninit (
   Dev->MaxLun         = 0;
   Dev->MaxSectors     = 0;
 
+  if (Dev->LunMap != NULL) {
+    FreePool (Dev->LunMap);
+    Dev->LunMap = NULL;
+  }
+
+  gBS->CloseEvent (Dev->AsyncTimer);
+  if (Dev->UseIndirect) {
+    VirtioIndirectUninit (Dev->VirtIo, &Dev->Indirect);
+  }
+
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RequestPoolMap);
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 Dev->RequestPoolPages,
+                 Dev->RequestPool
+                 );
+  FreePool (Dev->Requests);
+
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
   VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
 
@@ -1432,6 +2213,12 @@ VirtioScsiDriverBindingStop (
     return Status;
   }
 
+  //
+  // Non-blocking requests may still be in flight; their events must be
+  // signaled before the request slots go away.
+  //
+  DrainRequests (Dev);
+
   gBS->CloseEvent (Dev->ExitBoot);
 
   VirtioScsiUninit (Dev);
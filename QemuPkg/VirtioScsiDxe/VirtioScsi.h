@@ -16,7 +16,7 @@
 #include <Protocol/DriverBinding.h>
 #include <Protocol/ScsiPassThruExt.h>
 
-#include <IndustryStandard/Virtio.h>
+#include <IndustryStandard/VirtioScsi.h>
 
 //
 // This driver supports 2-byte target identifiers and 4-byte LUN identifiers.
@@ -34,6 +34,77 @@
 
 #define VSCSI_SIG  SIGNATURE_32 ('V', 'S', 'C', 'S')
 
+//
+// Every request occupies at most four descriptors: request header, "dataout",
+// response, "datain". Request slot N owns descriptors [N * 4, N * 4 + 3], so
+// that in-flight requests never compete for descriptors.
+//
+// With VIRTIO_F_RING_INDIRECT_DESC, the four descriptors live in the indirect
+// table #N instead, and request slot N owns only ring descriptor N.
+//
+#define VSCSI_DESC_PER_REQ  4
+
+//
+// Period of the timer that reaps the completions of non-blocking
+// EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru() requests, in 100ns units.
+//
+#define VSCSI_ASYNC_POLL_PERIOD  EFI_TIMER_PERIOD_MILLISECONDS (1)
+
+//
+// REPORT LUNS (SPC-4, 6.33), sent by VirtioScsiGetNextTargetLun() to discover
+// the LUNs of all targets at once. The response buffer of each target holds
+// the 8-byte list header and up to VSCSI_REPORT_LUNS_MAX LUN entries.
+//
+#define VSCSI_OP_REPORT_LUNS   0xA0
+#define VSCSI_REPORT_LUNS_MAX  255
+
+//
+// At most this many REPORT LUNS commands are in flight during the scan.
+//
+#define VSCSI_SCAN_BATCH  32
+
+//
+// The parts of a request that the host accesses, apart from the data buffers.
+// The request pool of a device is an array of these, one per request slot,
+// that is allocated and mapped as a bus master common buffer only once, in
+// VirtioScsiInit().
+//
+typedef struct {
+  VIRTIO_SCSI_REQ     Request;
+  VIRTIO_SCSI_RESP    Response;
+} VSCSI_REQ_DMA;
+
+//
+// Tracks a single request between submission and completion. The Id (tag) of
+// the virtio-scsi request is the index of the request slot.
+//
+typedef struct {
+  BOOLEAN                                       InUse;    // slot claimed
+  BOOLEAN                                       InFlight; // not completed
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET    *Packet;
+  EFI_EVENT                                     Event;    // NULL if blocking
+  volatile VSCSI_REQ_DMA                        *Dma;     // slot's pool part
+  EFI_PHYSICAL_ADDRESS                          RequestDeviceAddress;
+  EFI_PHYSICAL_ADDRESS                          ResponseDeviceAddress;
+  VOID                                          *InDataBuffer;
+  UINTN                                         InDataNumPages;
+  VOID                                          *InDataMapping;
+  EFI_PHYSICAL_ADDRESS                          InDataDeviceAddress;
+  VOID                                          *OutDataMapping;
+  EFI_PHYSICAL_ADDRESS                          OutDataDeviceAddress;
+} VSCSI_REQ;
+
+//
+// A REPORT LUNS command sent to LUN 0 of a target by ScanLuns().
+//
+typedef struct {
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET    Packet;
+  UINT8                                         Cdb[12];
+  VSCSI_REQ                                     *Req;
+  EFI_STATUS                                    Status;
+  UINT8                                         Data[8 + 8 * VSCSI_REPORT_LUNS_MAX];
+} VSCSI_SCAN;
+
 typedef struct {
   //
   // Parts of this structure are initialized / torn down in various functions
@@ -53,6 +124,19 @@ typedef struct {
   EFI_EXT_SCSI_PASS_THRU_PROTOCOL    PassThru;       // VirtioScsiInit      1
   EFI_EXT_SCSI_PASS_THRU_MODE        PassThruMode;   // VirtioScsiInit      1
   VOID                               *RingMap;       // VirtioRingMap       2
+  UINT16                             LastUsedIdx;    // VirtioScsiInit      1
+  VSCSI_REQ                          *Requests;      // VirtioScsiInit      1
+  UINT16                             NumRequests;    // VirtioScsiInit      1
+  UINT16                             NumInFlight;    // VirtioScsiInit      1
+  UINT16                             NumAsyncInFlight; // VirtioScsiInit    1
+  VSCSI_REQ_DMA                      *RequestPool;   // VirtioScsiInit      1
+  UINTN                              RequestPoolPages; // VirtioScsiInit    1
+  VOID                               *RequestPoolMap; // VirtioScsiInit     1
+  EFI_EVENT                          AsyncTimer;     // VirtioScsiInit      1
+  BOOLEAN                            UseIndirect;    // VirtioScsiInit      1
+  UINT16                             RingDescPerReq; // VirtioScsiInit      1
+  VRING_INDIRECT                     Indirect;       // VirtioIndirectInit  2
+  UINT8                              *LunMap;        // ScanLuns            2
 } VSCSI_DEV;
 
 #define VIRTIO_SCSI_FROM_PASS_THRU(PassThruPointer) \